@@ -0,0 +1,144 @@
+"""Measures bytes saved by payload compression against CPU time spent on it.
+
+Representative payloads (single telemetry reading, batch of readings, log lines, incompressible binary) are
+compressed at several levels with and without shared dictionary, with gmqttlib and with Python zlib. Cost is
+CPU time per message on both sides and per kilobyte saved. Parallel cases compress large payloads in several
+threads to show GIL is released for them. Results are printed as JSON lines:
+
+    python -m benchmarks.bench_compression
+"""
+import argparse
+import json
+import random
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+from gmqtt import compression
+from gmqtt.compression import PayloadCompressor
+
+LEVELS = [1, 6, 9]
+# CPU time spent on one case, messages count is adjusted to it
+CASE_SECONDS = 0.5
+PARALLEL_PAYLOADS = 64
+THREADS = [1, 2, 4]
+
+
+def reading(rnd, index):
+    return {
+        'device': 'sensor-{:04d}'.format(index),
+        'ts': 1700000000 + rnd.randrange(86400),
+        'temperature': round(rnd.uniform(-10, 40), 2),
+        'humidity': round(rnd.uniform(20, 90), 1),
+        'battery': rnd.randrange(100),
+        'status': rnd.choice(['ok', 'ok', 'ok', 'degraded']),
+    }
+
+
+def payloads():
+    rnd = random.Random(7)
+    lines = []
+    while sum(map(len, lines)) < 64 * 1024:
+        lines.append('2024-01-01T00:00:{:02d}Z INFO worker-{} handled request {} in {}ms\n'.format(
+            rnd.randrange(60), rnd.randrange(8), rnd.randrange(10 ** 6), rnd.randrange(500)))
+    return {
+        'telemetry': json.dumps(reading(rnd, 1)).encode(),
+        'telemetry_batch': json.dumps([reading(rnd, i) for i in range(100)]).encode(),
+        'log_lines': ''.join(lines).encode(),
+        'telemetry_bulk': json.dumps([reading(rnd, i) for i in range(10000)]).encode(),
+        'random': bytes(rnd.randrange(256) for _ in range(4096)),
+    }
+
+
+def dictionary():
+    # shared dictionary is a sample of typical messages, the most common strings go last
+    rnd = random.Random(1)
+    return ''.join(json.dumps(reading(rnd, i)) for i in range(8)).encode()
+
+
+def implementations():
+    return ['gmqttlib', 'python'] if compression._has_gmqttlib else ['python']
+
+
+def cpu_time_per_call(func, payload):
+    count = 0
+    started = time.process_time()
+    elapsed = 0
+    while elapsed < CASE_SECONDS:
+        for _ in range(10):
+            func(payload)
+        count += 10
+        elapsed = time.process_time() - started
+    return elapsed / count
+
+
+def compression_case(impl, payload, level, zdict):
+    compressor = PayloadCompressor(level=level, dictionary=zdict)
+    saved = compression._has_gmqttlib
+    compression._has_gmqttlib = impl == 'gmqttlib'
+    try:
+        compressed = compressor.compress(payload)
+        assert compressor.decompress(compressed) == payload
+        compress_time = cpu_time_per_call(compressor.compress, payload)
+        decompress_time = cpu_time_per_call(compressor.decompress, compressed)
+    finally:
+        compression._has_gmqttlib = saved
+
+    bytes_saved = len(payload) - len(compressed)
+    return {
+        'compressed_size': len(compressed),
+        'ratio': round(len(payload) / len(compressed), 2),
+        'bytes_saved': bytes_saved,
+        'compress_us': round(compress_time * 1e6, 1),
+        'decompress_us': round(decompress_time * 1e6, 1),
+        'us_per_kb_saved': round((compress_time + decompress_time) * 1e6 / (bytes_saved / 1024), 1)
+        if bytes_saved > 0 else None,
+    }
+
+
+def parallel_case(impl, payload, threads):
+    compressor = PayloadCompressor(nogil_threshold=64 * 1024)
+    saved = compression._has_gmqttlib
+    compression._has_gmqttlib = impl == 'gmqttlib'
+    try:
+        with ThreadPoolExecutor(threads) as executor:
+            started = time.perf_counter()
+            list(executor.map(compressor.compress, [payload] * PARALLEL_PAYLOADS))
+            elapsed = time.perf_counter() - started
+    finally:
+        compression._has_gmqttlib = saved
+    return {
+        'threads': threads,
+        'mbytes_per_sec': round(PARALLEL_PAYLOADS * len(payload) / elapsed / 2 ** 20, 1),
+    }
+
+
+def main(levels):
+    zdict = dictionary()
+    cases = payloads()
+    for name, payload in cases.items():
+        for level in levels:
+            for use_dictionary in (False, True):
+                for impl in implementations():
+                    result = compression_case(impl, payload, level, zdict if use_dictionary else None)
+                    print(json.dumps(dict(benchmark='compression', implementation=impl, payload=name,
+                                          payload_size=len(payload), level=level, dictionary=use_dictionary,
+                                          **result)), flush=True)
+
+    for impl in implementations():
+        for threads in THREADS:
+            result = parallel_case(impl, cases['telemetry_bulk'], threads)
+            print(json.dumps(dict(benchmark='parallel_compression', implementation=impl,
+                                  payload_size=len(cases['telemetry_bulk']), **result)), flush=True)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--level', action='append', type=int, help='compression level, {} by default'.format(LEVELS))
+    parser.add_argument('--quick', action='store_true', help='spend 10 times less time on every case')
+    args = parser.parse_args()
+
+    if args.quick:
+        CASE_SECONDS /= 10
+        PARALLEL_PAYLOADS //= 8
+
+    main(args.level or LEVELS)
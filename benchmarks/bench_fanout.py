@@ -0,0 +1,191 @@
+"""Compares subscriber processes with broker connections of their own against one connection shared through
+FanoutHub.
+
+Publisher sends QoS 0 messages through in-process stand-in broker, every subscriber process receives all of them.
+Reported are broker connections and subscriptions, messages sent by the broker, CPU time per delivered message of
+subscriber processes and hub owner, and CPU time per published message of the broker process. Results are printed
+as JSON lines:
+
+    python -m benchmarks.bench_fanout --subscribers 8
+"""
+import argparse
+import asyncio
+import json
+import logging
+import multiprocessing
+import time
+import uuid
+
+import gmqtt
+from gmqtt.fanout import FanoutHub, FanoutSubscriber
+
+from .broker import FakeBroker
+
+TOPIC = 'bench/fanout/#'
+MESSAGES = 20000
+PAYLOAD_SIZE = 256
+SUBSCRIBERS = 4
+# subscriber reports what it has got if nothing comes for this long
+IDLE_TIMEOUT = 30
+
+
+async def count_messages(subscribe, count, results):
+    # reports CPU time spent from subscription till the last message
+    received = [0]
+    last_received = [time.monotonic()]
+    done = asyncio.get_event_loop().create_future()
+
+    def on_message(client, topic, payload, qos, properties):
+        received[0] += 1
+        last_received[0] = time.monotonic()
+        if received[0] == count and not done.done():
+            done.set_result(None)
+        return 0
+
+    await subscribe(on_message)
+    started = time.process_time()
+    results.put(('ready', None))
+    while not done.done() and time.monotonic() - last_received[0] < IDLE_TIMEOUT:
+        await asyncio.wait([done], timeout=1)
+    results.put(('done', (received[0], time.process_time() - started)))
+
+
+def direct_subscriber(port, count, results):
+    async def main():
+        client = gmqtt.Client('bench-subscriber-' + uuid.uuid4().hex)
+
+        async def subscribe(on_message):
+            client.on_message = on_message
+            await client.connect('127.0.0.1', port)
+            client.subscribe(TOPIC)
+
+        await count_messages(subscribe, count, results)
+        await client.disconnect()
+
+    asyncio.run(main())
+
+
+def fanout_subscriber(name, count, results):
+    async def main():
+        subscriber = FanoutSubscriber(name)
+
+        async def subscribe(on_message):
+            subscriber.on_message = on_message
+            await subscriber.connect()
+            subscriber.subscribe(TOPIC)
+
+        await count_messages(subscribe, count, results)
+        await subscriber.disconnect()
+
+    asyncio.run(main())
+
+
+def hub_owner(port, name, results, stop):
+    async def main():
+        client = gmqtt.Client('bench-hub-owner')
+        await client.connect('127.0.0.1', port)
+        hub = await FanoutHub(client, name, capacity=64 * 2**20).start()
+        started = time.process_time()
+        results.put(('ready', None))
+        while not stop.is_set():
+            await asyncio.sleep(0.05)
+        cpu_time = time.process_time() - started
+        await hub.stop()
+        await client.disconnect()
+        results.put(('owner', cpu_time))
+
+    asyncio.run(main())
+
+
+async def wait_results(results, kind, count):
+    loop = asyncio.get_event_loop()
+    values = []
+    while len(values) < count:
+        event, value = await loop.run_in_executor(None, results.get)
+        assert event == kind, event
+        values.append(value)
+    return values
+
+
+def broker_subscriptions(broker):
+    return sum(len(subscriptions) for subscriptions in broker._connections.values())
+
+
+async def run_case(mode, subscribers, messages):
+    context = multiprocessing.get_context('spawn')
+    results = context.Queue()
+    stop = context.Event()
+    broker = await FakeBroker().start()
+    processes = []
+    name = 'bench-' + uuid.uuid4().hex[:8]
+
+    if mode == 'fanout':
+        owner = context.Process(target=hub_owner, args=(broker.port, name, results, stop))
+        owner.start()
+        processes.append(owner)
+        await wait_results(results, 'ready', 1)
+        target, args = fanout_subscriber, (name, messages, results)
+    else:
+        target, args = direct_subscriber, (broker.port, messages, results)
+
+    for _ in range(subscribers):
+        process = context.Process(target=target, args=args)
+        process.start()
+        processes.append(process)
+    await wait_results(results, 'ready', subscribers)
+    expected_subscriptions = 1 if mode == 'fanout' else subscribers
+    while broker_subscriptions(broker) < expected_subscriptions:
+        await asyncio.sleep(0.01)
+    connections = len(broker._connections)
+
+    publisher = gmqtt.Client('bench-publisher')
+    await publisher.connect('127.0.0.1', broker.port)
+    payload = b'x' * PAYLOAD_SIZE
+    started = time.perf_counter()
+    broker_started = time.process_time()
+    for i in range(messages):
+        publisher.publish('bench/fanout/{}'.format(i % 100), payload)
+        if i % 100 == 99:
+            await asyncio.sleep(0)
+    done = await wait_results(results, 'done', subscribers)
+    elapsed = time.perf_counter() - started
+    broker_cpu = time.process_time() - broker_started
+
+    owner_cpu = 0
+    if mode == 'fanout':
+        stop.set()
+        owner_cpu, = await wait_results(results, 'owner', 1)
+    await publisher.disconnect()
+    for process in processes:
+        process.join()
+    await broker.stop()
+
+    delivered = sum(received for received, _ in done)
+    return {
+        'broker_connections': connections,
+        'broker_subscriptions': expected_subscriptions,
+        'broker_messages_sent': messages * expected_subscriptions,
+        'delivered': delivered,
+        'lost': messages * subscribers - delivered,
+        'delivered_per_sec': round(delivered / elapsed),
+        'subscriber_cpu_us_per_message': round((sum(cpu for _, cpu in done) + owner_cpu) * 1e6 / delivered, 2),
+        'broker_cpu_us_per_message': round(broker_cpu * 1e6 / messages, 2),
+    }
+
+
+async def main(subscribers, messages):
+    for mode in ('direct', 'fanout'):
+        result = await run_case(mode, subscribers, messages)
+        print(json.dumps(dict(benchmark='fanout', mode=mode, subscribers=subscribers, messages=messages,
+                              payload_size=PAYLOAD_SIZE, **result)), flush=True)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--subscribers', type=int, default=SUBSCRIBERS, help='qty of subscriber processes')
+    parser.add_argument('--messages', type=int, default=MESSAGES, help='qty of published messages')
+    parser.add_argument('--quick', action='store_true', help='publish 10 times less messages')
+    args = parser.parse_args()
+    logging.getLogger('gmqtt').setLevel(logging.ERROR)
+
+    asyncio.run(main(args.subscribers, args.messages // 10 if args.quick else args.messages))
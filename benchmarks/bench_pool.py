@@ -0,0 +1,97 @@
+"""Measures how ClientPool publish throughput scales with the number of workers.
+
+Pool publishes QoS 1 messages through stand-in broker running in its own process, so the broker does not take
+CPU time of the pool event loop. Reported are messages per second, CPU time per message of the pool process
+(sharding and sending commands to workers) and of the broker. Throughput may grow with workers only while there
+are free cores for them, `cpu_count` is printed with the results. Results are printed as JSON lines:
+
+    python -m benchmarks.bench_pool --workers 1 --workers 2 --workers 4
+"""
+import argparse
+import asyncio
+import json
+import logging
+import multiprocessing
+import time
+
+from gmqtt.pool import ClientPool
+
+from .broker import FakeBroker
+
+WORKERS = [1, 2, 4]
+MESSAGES = 200000
+PAYLOAD_SIZE = 256
+TOPICS = 1000
+
+
+def run_broker(expected, results, stop):
+    async def main():
+        broker = await FakeBroker().start()
+        results.put(('ready', broker.port))
+        started = time.process_time()
+        await broker.wait_received(expected)
+        results.put(('done', time.process_time() - started))
+        while not stop.is_set():
+            await asyncio.sleep(0.05)
+        await broker.stop()
+
+    asyncio.run(main())
+
+
+async def wait_result(results, kind):
+    event, value = await asyncio.get_event_loop().run_in_executor(None, results.get)
+    assert event == kind, event
+    return value
+
+
+async def run_case(workers, messages, use_threads):
+    context = multiprocessing.get_context('spawn')
+    results = context.Queue()
+    stop = context.Event()
+    broker = context.Process(target=run_broker, args=(messages, results, stop))
+    broker.start()
+    port = await wait_result(results, 'ready')
+
+    pool = ClientPool('bench-pool', workers=workers, use_threads=use_threads)
+    await pool.connect('127.0.0.1', port)
+    payload = b'x' * PAYLOAD_SIZE
+    started = time.perf_counter()
+    pool_started = time.process_time()
+    for i in range(messages):
+        pool.publish('bench/pool/{}'.format(i % TOPICS), payload, qos=1)
+        if i % 1000 == 999:
+            pool.flush()
+            await asyncio.sleep(0)
+    pool.flush()
+    pool_cpu = time.process_time() - pool_started
+    broker_cpu = await wait_result(results, 'done')
+    elapsed = time.perf_counter() - started
+
+    await pool.disconnect()
+    stop.set()
+    broker.join()
+    return {
+        'messages_per_sec': round(messages / elapsed),
+        'pool_cpu_us_per_message': round(pool_cpu * 1e6 / messages, 2),
+        'broker_cpu_us_per_message': round(broker_cpu * 1e6 / messages, 2),
+    }
+
+
+async def main(workers_counts, messages, use_threads):
+    for workers in workers_counts:
+        result = await run_case(workers, messages, use_threads)
+        print(json.dumps(dict(benchmark='pool', workers=workers, threads=use_threads,
+                              cpu_count=multiprocessing.cpu_count(), messages=messages,
+                              payload_size=PAYLOAD_SIZE, **result)), flush=True)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--workers', action='append', type=int, help='qty of workers, {} by default'.format(WORKERS))
+    parser.add_argument('--messages', type=int, default=MESSAGES, help='qty of published messages')
+    parser.add_argument('--threads', action='store_true', help='run workers in threads instead of processes')
+    parser.add_argument('--quick', action='store_true', help='publish 10 times less messages')
+    args = parser.parse_args()
+    logging.getLogger('gmqtt').setLevel(logging.ERROR)
+
+    asyncio.run(main(args.workers or WORKERS, args.messages // 10 if args.quick else args.messages, args.threads))
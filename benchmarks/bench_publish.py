@@ -0,0 +1,111 @@
+"""Compares per message publish with publish_many and coalesced writes over a socket pair.
+
+    python -m benchmarks.bench_publish
+"""
+import argparse
+import asyncio
+import json
+import socket
+import time
+from functools import partial
+from types import SimpleNamespace
+
+import gmqtt
+from gmqtt.mqtt.connection import MQTTConnection
+from gmqtt.mqtt.package import PublishPacket
+from gmqtt.mqtt.protocol import MQTTProtocol
+from gmqtt.mqtt.utils import IdGenerator
+
+
+class Sink(asyncio.Protocol):
+    def __init__(self):
+        self.received = 0
+        self.waiter = None
+        self.expected = 0
+
+    def data_received(self, data):
+        self.received += len(data)
+        if self.waiter and self.received >= self.expected:
+            self.waiter.set_result(None)
+            self.waiter = None
+
+    async def wait(self, expected):
+        if self.received < expected:
+            self.expected = expected
+            self.waiter = asyncio.get_running_loop().create_future()
+            await self.waiter
+
+
+async def make_client(write_delay):
+    loop = asyncio.get_running_loop()
+    rsock, wsock = socket.socketpair()
+    _, sink = await loop.connect_accepted_socket(Sink, rsock)
+    transport, proto = await loop.create_connection(partial(MQTTProtocol, write_delay=write_delay), sock=wsock)
+
+    client = gmqtt.Client('bench-client')
+    client._connection = MQTTConnection(transport, proto, clean_session=True, keepalive=0)
+    client._connection.set_handler(lambda cmd, packet: None)
+    return client, sink
+
+
+def package_size(message):
+    protocol = SimpleNamespace(proto_ver=MQTTProtocol.proto_ver, id_generator=IdGenerator())
+    return len(PublishPacket.build_package(message, protocol)[1])
+
+
+async def run_case(mode, count, payload_size, qos, repeat=3):
+    # all packages have the same size
+    messages = [gmqtt.Message('sensors/{:03}'.format(i % 1000), b'x' * payload_size, qos=qos) for i in range(count)]
+    expected_size = count * package_size(messages[0])
+
+    elapsed = None
+    for _ in range(repeat):
+        client, sink = await make_client(0 if mode == 'publish_coalesced' else None)
+        started = time.perf_counter()
+        if mode == 'publish_many':
+            client.publish_many(messages)
+        else:
+            for message in messages:
+                client.publish(message)
+        client._connection._protocol.flush_writes()
+        await sink.wait(expected_size)
+        run_elapsed = time.perf_counter() - started
+        elapsed = run_elapsed if elapsed is None else min(elapsed, run_elapsed)
+
+        await client._connection.close()
+
+    return {
+        'mode': mode,
+        'messages': count,
+        'payload_size': payload_size,
+        'qos': qos,
+        'messages_per_sec': round(count / elapsed),
+    }
+
+
+CASES = [
+    # messages count, payload size, QoS
+    (10000, 32, 0),
+    (10000, 32, 1),
+    (10000, 1024, 0),
+]
+
+
+async def main(cases):
+    results = []
+    for count, payload_size, qos in cases:
+        for mode in ('publish', 'publish_coalesced', 'publish_many'):
+            results.append(await run_case(mode, count, payload_size, qos))
+    return results
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--quick', action='store_true', help='run every case with 10 times less messages')
+    args = parser.parse_args()
+
+    cases = CASES
+    if args.quick:
+        cases = [(max(1, count // 10), size, qos) for count, size, qos in CASES]
+    for result in asyncio.run(main(cases)):
+        print(json.dumps(result))
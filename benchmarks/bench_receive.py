@@ -0,0 +1,133 @@
+"""Compares StreamReader based receive path with the buffered one.
+
+    python -m benchmarks.bench_receive
+"""
+import argparse
+import asyncio
+import json
+import time
+import tracemalloc
+
+from gmqtt.mqtt.protocol import MQTTProtocol, MQTTBufferedProtocol
+from gmqtt.mqtt.utils import pack_variable_byte_integer
+
+
+class FakeTransport:
+    def get_extra_info(self, name, default=None):
+        return default
+
+    def is_closing(self):
+        return False
+
+    def write(self, data):
+        pass
+
+    def close(self):
+        pass
+
+
+class CountingConnection:
+    def __init__(self):
+        self.packages = 0
+
+    def put_package(self, pkg):
+        self.packages += 1
+
+
+def build_stream(payload_size, count):
+    body = b'\x00\x05topic' + b'x' * payload_size
+    frame = b'\x30' + bytes(pack_variable_byte_integer(len(body))) + body
+    return frame * count
+
+
+async def feed_stream_reader(proto, chunks):
+    for chunk in chunks:
+        proto.data_received(chunk)
+        # let the read loop consume the chunk
+        await asyncio.sleep(0)
+
+
+async def feed_buffered(proto, chunks):
+    for chunk in chunks:
+        buf = proto.get_buffer(-1)
+        while len(buf) < len(chunk):
+            # the same what transport does: read as much as fits, then ask for buffer again
+            size = len(buf)
+            buf[:] = chunk[:size]
+            chunk = chunk[size:]
+            proto.buffer_updated(size)
+            buf = proto.get_buffer(-1)
+        buf[:len(chunk)] = chunk
+        proto.buffer_updated(len(chunk))
+
+
+async def consume(protocol_class, feed, chunks, count):
+    proto = protocol_class()
+    connection = CountingConnection()
+    proto.set_connection(connection)
+    proto.connection_made(FakeTransport())
+    await asyncio.sleep(0)
+
+    started = time.perf_counter()
+    await feed(proto, chunks)
+    while connection.packages < count:
+        await asyncio.sleep(0)
+    elapsed = time.perf_counter() - started
+
+    proto.connection_lost(None)
+    return elapsed
+
+
+async def run_case(protocol_class, feed, payload_size, count, chunk_size, repeat=3):
+    stream = build_stream(payload_size, count)
+    chunks = [stream[i:i + chunk_size] for i in range(0, len(stream), chunk_size)]
+
+    elapsed = None
+    for _ in range(repeat):
+        run_elapsed = await consume(protocol_class, feed, chunks, count)
+        elapsed = run_elapsed if elapsed is None else min(elapsed, run_elapsed)
+
+    # second pass is traced, tracing slows down everything too much to measure speed
+    tracemalloc.start()
+    await consume(protocol_class, feed, chunks, count)
+    _, peak = tracemalloc.get_traced_memory()
+    tracemalloc.stop()
+
+    return {
+        'protocol': protocol_class.__name__,
+        'payload_size': payload_size,
+        'chunk_size': chunk_size,
+        'messages': count,
+        'bytes_per_sec': round(len(stream) / elapsed),
+        'messages_per_sec': round(count / elapsed),
+        'peak_alloc_bytes': peak,
+    }
+
+
+CASES = [
+    # payload size, messages count, socket read size
+    (16, 200000, 65536),
+    (1024, 50000, 65536),
+    (1024 * 1024, 20, 16384),
+    (16 * 1024 * 1024, 2, 65536),
+]
+
+
+async def main(cases):
+    results = []
+    for payload_size, count, chunk_size in cases:
+        results.append(await run_case(MQTTProtocol, feed_stream_reader, payload_size, count, chunk_size))
+        results.append(await run_case(MQTTBufferedProtocol, feed_buffered, payload_size, count, chunk_size))
+    return results
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--quick', action='store_true', help='run every case with 10 times less messages')
+    args = parser.parse_args()
+
+    cases = CASES
+    if args.quick:
+        cases = [(size, max(1, count // 10), chunk) for size, count, chunk in CASES]
+    for result in asyncio.run(main(cases)):
+        print(json.dumps(result))
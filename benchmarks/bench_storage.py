@@ -0,0 +1,109 @@
+"""Measures acknowledgement cost of in-flight storages as in-flight depth grows.
+
+Every operation removes the oldest message by its id (the same what PUBACK does)
+and pushes a new one, so the depth stays the same during the run.
+Append throughput of the durable storage is compared with the in-memory one too.
+
+    python -m benchmarks.bench_storage
+"""
+import argparse
+import asyncio
+import json
+import shutil
+import tempfile
+import time
+
+from gmqtt.storage import HeapPersistentStorage, IndexedPersistentStorage, SegmentLogPersistentStorage
+
+
+async def fill(storage_class, depth):
+    storage = storage_class()
+    await storage.push_messages([(mid, b'x') for mid in range(1, depth + 1)])
+    return storage
+
+
+async def run_case(storage_class, depth, ops, repeat=3):
+    elapsed = None
+    for _ in range(repeat):
+        storage = await fill(storage_class, depth)
+        started = time.perf_counter()
+        for mid in range(1, ops + 1):
+            await storage.remove_message_by_mid(mid)
+            await storage.push_message(depth + mid, b'x')
+        run_elapsed = time.perf_counter() - started
+        elapsed = run_elapsed if elapsed is None else min(elapsed, run_elapsed)
+
+    return {
+        'storage': storage_class.__name__,
+        'depth': depth,
+        'acks': ops,
+        'ns_per_ack': round(elapsed / ops * 1e9),
+    }
+
+
+DEPTHS = [10, 100, 1000, 10000, 60000]
+STORAGES = [
+    # storage, acks per case, heap storage ack cost grows linearly so it gets less of them
+    (HeapPersistentStorage, lambda depth: min(depth, max(100, 2000000 // depth))),
+    (IndexedPersistentStorage, lambda depth: max(depth, 10000)),
+]
+
+
+async def run_append_case(name, storage_factory, payload_size, count, repeat=3):
+    package = b'x' * payload_size
+    elapsed = None
+    for _ in range(repeat):
+        storage = storage_factory()
+        started = time.perf_counter()
+        for mid in range(count):
+            await storage.push_message(mid % 65535 + 1, package)
+            await storage.remove_message_by_mid(mid % 65535 + 1)
+        run_elapsed = time.perf_counter() - started
+        elapsed = run_elapsed if elapsed is None else min(elapsed, run_elapsed)
+        if hasattr(storage, 'close'):
+            storage.close()
+
+    return {
+        'storage': name,
+        'payload_size': payload_size,
+        'messages': count,
+        'messages_per_sec': round(count / elapsed),
+        'bytes_per_sec': round(count * payload_size / elapsed),
+    }
+
+
+APPEND_CASES = [
+    # payload size, messages count
+    (64, 200000),
+    (1024, 200000),
+    (64 * 1024, 10000),
+]
+
+
+async def main(depths, scale):
+    results = []
+    for depth in depths:
+        for storage_class, ops in STORAGES:
+            results.append(await run_case(storage_class, depth, max(1, ops(depth) // scale)))
+
+    path = tempfile.mkdtemp()
+    try:
+        for payload_size, count in APPEND_CASES:
+            count = max(1, count // scale)
+            results.append(await run_append_case('IndexedPersistentStorage', IndexedPersistentStorage,
+                                                 payload_size, count))
+            results.append(await run_append_case('SegmentLogPersistentStorage',
+                                                 lambda: SegmentLogPersistentStorage(tempfile.mkdtemp(dir=path)),
+                                                 payload_size, count))
+    finally:
+        shutil.rmtree(path)
+    return results
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--quick', action='store_true', help='run every case with 10 times less operations')
+    args = parser.parse_args()
+
+    for result in asyncio.run(main(DEPTHS, 10 if args.quick else 1)):
+        print(json.dumps(result))
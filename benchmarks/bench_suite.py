@@ -0,0 +1,234 @@
+"""Runs publish throughput, end-to-end latency and allocations benchmarks against in-process stand-in broker.
+
+Every case runs with gmqttlib and with pure Python frame and properties paths. Results are printed
+as JSON lines, --output also writes them with environment description into one JSON document:
+
+    python -m benchmarks.bench_suite --output results.json
+"""
+import argparse
+import asyncio
+import datetime
+import gc
+import json
+import logging
+import platform
+import struct
+import time
+import tracemalloc
+from contextlib import contextmanager
+
+import gmqtt
+from gmqtt.mqtt import handler, package, protocol, utils
+
+from .broker import FakeBroker
+
+PAYLOAD_SIZES = [16, 256, 4096, 65536, 1024 * 1024]
+QOS_LEVELS = [0, 1, 2]
+# payload bytes sent in one throughput case, messages count is limited too
+CASE_BYTES = 64 * 1024 * 1024
+MAX_MESSAGES = 20000
+LATENCY_MESSAGES = 1000
+ALLOCATION_MESSAGES = 1000
+
+
+@contextmanager
+def implementation(name):
+    # pure Python paths are used when gmqttlib is not available
+    modules = [handler, package, protocol, utils]
+    saved = [module._has_gmqttlib for module in modules]
+    if name == 'python':
+        for module in modules:
+            module._has_gmqttlib = False
+    try:
+        yield
+    finally:
+        for module, value in zip(modules, saved):
+            module._has_gmqttlib = value
+
+
+def implementations():
+    return ['gmqttlib', 'python'] if protocol._has_gmqttlib else ['python']
+
+
+async def connect_client(client_id, broker, impl):
+    client = gmqtt.Client(client_id, extract_c_properties=impl == 'gmqttlib')
+    await client.connect('127.0.0.1', broker.port)
+    return client
+
+
+def messages_count(payload_size, limit):
+    return max(10, min(limit, CASE_BYTES // payload_size))
+
+
+async def wait_acknowledged(client):
+    while client._in_flight_mids:
+        await asyncio.sleep(0.001)
+
+
+async def publish_throughput(broker, impl, payload_size, qos):
+    count = messages_count(payload_size, MAX_MESSAGES)
+    client = await connect_client('bench-publisher', broker, impl)
+    payload = b'x' * payload_size
+    received = broker.received
+
+    started = time.perf_counter()
+    for i in range(count):
+        client.publish('bench/throughput/{}'.format(i % 100), payload, qos=qos)
+        if i % 100 == 99:
+            # let the loop write and read acknowledgements as real publisher does
+            await asyncio.sleep(0)
+    await broker.wait_received(received + count)
+    await wait_acknowledged(client)
+    elapsed = time.perf_counter() - started
+
+    await client.disconnect()
+    return {
+        'messages': count,
+        'messages_per_sec': round(count / elapsed),
+        'mbytes_per_sec': round(count * payload_size / elapsed / 2**20, 2),
+    }
+
+
+def percentile(values, fraction):
+    return values[min(len(values) - 1, int(len(values) * fraction))]
+
+
+async def end_to_end_latency(broker, impl, payload_size, qos):
+    count = messages_count(payload_size, LATENCY_MESSAGES)
+    subscriber = await connect_client('bench-subscriber', broker, impl)
+    publisher = await connect_client('bench-publisher', broker, impl)
+
+    latencies = []
+    waiter = None
+
+    def on_message(client, topic, payload, qos, properties):
+        sent, = struct.unpack('!d', payload[:8])
+        latencies.append(time.perf_counter() - sent)
+        waiter.set_result(None)
+        return 0
+
+    subscriber.on_message = on_message
+    subscriber.subscribe('bench/latency/#', qos=qos)
+    while not subscriber.subscriptions[-1].acknowledged:
+        await asyncio.sleep(0.001)
+
+    padding = b'x' * max(0, payload_size - 8)
+    for i in range(count):
+        waiter = asyncio.get_event_loop().create_future()
+        publisher.publish('bench/latency/{}'.format(i % 100), struct.pack('!d', time.perf_counter()) + padding,
+                          qos=qos)
+        await waiter
+
+    await publisher.disconnect()
+    await subscriber.disconnect()
+    latencies.sort()
+    return {
+        'messages': count,
+        'latency_p50_us': round(percentile(latencies, 0.5) * 1e6, 1),
+        'latency_p90_us': round(percentile(latencies, 0.9) * 1e6, 1),
+        'latency_p99_us': round(percentile(latencies, 0.99) * 1e6, 1),
+        'latency_max_us': round(latencies[-1] * 1e6, 1),
+    }
+
+
+async def allocations(broker, impl, payload_size, qos):
+    # traced memory is measured around publishing only, received messages go nowhere. Transient bytes are taken
+    # at the peak of one publish call above what was traced before it (packet buffers, temporary objects), retained
+    # ones are still held after the loop (stored packages, transport buffer); gc is off, so it frees nothing
+    # in between
+    count = messages_count(payload_size, ALLOCATION_MESSAGES)
+    client = await connect_client('bench-publisher', broker, impl)
+    payload = b'x' * payload_size
+    topics = ['bench/allocations/{}'.format(i) for i in range(100)]
+    received = broker.received
+    own_traces = [tracemalloc.Filter(False, tracemalloc.__file__)]
+
+    gc.disable()
+    tracemalloc.start()
+    try:
+        before = tracemalloc.take_snapshot()
+        transient = 0
+        for i in range(count):
+            current, _ = tracemalloc.get_traced_memory()
+            tracemalloc.reset_peak()
+            client.publish(topics[i % 100], payload, qos=qos)
+            transient += tracemalloc.get_traced_memory()[1] - current
+        after = tracemalloc.take_snapshot()
+    finally:
+        tracemalloc.stop()
+        gc.enable()
+    retained = after.filter_traces(own_traces).compare_to(before.filter_traces(own_traces), 'filename')
+
+    await broker.wait_received(received + count)
+    await wait_acknowledged(client)
+    await client.disconnect()
+    return {
+        'messages': count,
+        'transient_bytes_per_message': round(transient / count),
+        'retained_bytes_per_message': round(sum(stat.size_diff for stat in retained) / count),
+        'retained_blocks_per_message': round(sum(stat.count_diff for stat in retained) / count, 2),
+    }
+
+
+BENCHMARKS = {
+    'publish_throughput': publish_throughput,
+    'end_to_end_latency': end_to_end_latency,
+    'allocations': allocations,
+}
+
+
+async def main(benchmarks, payload_sizes, qos_levels):
+    broker = await FakeBroker().start()
+    results = []
+    try:
+        for name in benchmarks:
+            for payload_size in payload_sizes:
+                for qos in qos_levels:
+                    for impl in implementations():
+                        with implementation(impl):
+                            result = await BENCHMARKS[name](broker, impl, payload_size, qos)
+                        result = dict(benchmark=name, implementation=impl, payload_size=payload_size, qos=qos,
+                                      **result)
+                        print(json.dumps(result), flush=True)
+                        results.append(result)
+    finally:
+        await broker.stop()
+    return results
+
+
+def environment():
+    return {
+        'gmqtt_version': gmqtt.__version__,
+        'python': platform.python_version(),
+        'implementation': platform.python_implementation(),
+        'platform': platform.platform(),
+        'machine': platform.machine(),
+        'started': datetime.datetime.utcnow().isoformat() + 'Z',
+    }
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--benchmark', action='append', choices=sorted(BENCHMARKS),
+                        help='benchmark to run, all of them by default')
+    parser.add_argument('--payload-size', action='append', type=int, help='payload size, {} by default'.format(
+        PAYLOAD_SIZES))
+    parser.add_argument('--qos', action='append', type=int, choices=QOS_LEVELS)
+    parser.add_argument('--quick', action='store_true', help='run every case with 10 times less messages')
+    parser.add_argument('--output', help='write results into JSON file')
+    args = parser.parse_args()
+    # disconnects in the middle of acknowledgement flows are expected here
+    logging.getLogger('gmqtt').setLevel(logging.ERROR)
+
+    if args.quick:
+        CASE_BYTES //= 10
+        MAX_MESSAGES //= 10
+        LATENCY_MESSAGES //= 10
+        ALLOCATION_MESSAGES //= 10
+
+    meta = environment()
+    results = asyncio.run(main(args.benchmark or list(BENCHMARKS), args.payload_size or PAYLOAD_SIZES,
+                               args.qos or QOS_LEVELS))
+    if args.output:
+        with open(args.output, 'w') as output:
+            json.dump({'environment': meta, 'results': results}, output, indent=2)
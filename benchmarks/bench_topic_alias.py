@@ -0,0 +1,77 @@
+"""Compares uplink bytes and encoding time of QoS 0 publish with and without automatic topic aliases.
+
+    python -m benchmarks.bench_topic_alias
+"""
+import argparse
+import json
+import random
+import time
+from types import SimpleNamespace
+
+import gmqtt
+from gmqtt.mqtt.constants import MQTTv50
+from gmqtt.mqtt.package import PublishPacket
+from gmqtt.mqtt.utils import IdGenerator, TopicAliases
+
+
+def device_topics(count, rnd):
+    # 60-120 bytes long device paths
+    topics = []
+    for i in range(count):
+        topic = 'tenants/{:04}/sites/site-{:05}/devices/{:08x}/telemetry'.format(rnd.randrange(10000), i,
+                                                                                rnd.getrandbits(32))
+        topics.append(topic + '/' + 'channel-' * rnd.randrange(1, 7))
+    return topics
+
+
+def encode(messages, topic_alias_maximum):
+    protocol = SimpleNamespace(proto_ver=MQTTv50, id_generator=IdGenerator(),
+                               topic_aliases=TopicAliases(topic_alias_maximum))
+    size = 0
+    started = time.perf_counter()
+    for message in messages:
+        size += len(PublishPacket.build_package(message, protocol)[1])
+    return size, time.perf_counter() - started
+
+
+def run_case(count, topics_count, topic_alias_maximum, payload_size, skew):
+    rnd = random.Random(1)
+    topics = device_topics(topics_count, rnd)
+    # hot topics are published more often when skew > 0
+    weights = [1 / (i + 1) ** skew for i in range(topics_count)]
+    messages = [gmqtt.Message(topic, b'x' * payload_size) for topic in rnd.choices(topics, weights, k=count)]
+
+    plain_size, plain_elapsed = min(encode(messages, 0) for _ in range(3))
+    aliased_size, aliased_elapsed = min(encode(messages, topic_alias_maximum) for _ in range(3))
+    return {
+        'messages': count,
+        'topics': topics_count,
+        'topic_alias_maximum': topic_alias_maximum,
+        'payload_size': payload_size,
+        'skew': skew,
+        'plain_bytes': plain_size,
+        'aliased_bytes': aliased_size,
+        'bytes_saved_percent': round(100 * (1 - aliased_size / plain_size), 1),
+        'plain_messages_per_sec': round(count / plain_elapsed),
+        'aliased_messages_per_sec': round(count / aliased_elapsed),
+    }
+
+
+CASES = [
+    # messages count, distinct topics, topic_alias_maximum, payload size, skew of topics popularity
+    (100000, 100, 100, 32, 0),
+    (100000, 1000, 100, 32, 1),
+    (100000, 1000, 100, 32, 0),
+    (100000, 100, 100, 256, 0),
+]
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--quick', action='store_true', help='run every case with 10 times less messages')
+    args = parser.parse_args()
+
+    for count, topics_count, topic_alias_maximum, payload_size, skew in CASES:
+        if args.quick:
+            count //= 10
+        print(json.dumps(run_case(count, topics_count, topic_alias_maximum, payload_size, skew)))
@@ -0,0 +1,80 @@
+"""Compares UTF-8 validation kernels of gmqttlib with Python decoder, selected kernel is gmqttlib.UTF8_IMPL.
+
+    python -m benchmarks.bench_utf8
+"""
+import argparse
+import json
+import time
+from functools import partial
+
+from gmqtt import gmqttlib
+
+
+def python_validate(data, allow_null=False):
+    try:
+        str(data, 'utf-8')
+    except UnicodeDecodeError:
+        return False
+    return allow_null or b'\x00' not in data
+
+
+def measure(func, data, number):
+    elapsed = None
+    for _ in range(3):
+        started = time.perf_counter()
+        for _ in range(number):
+            func(data)
+        run_elapsed = time.perf_counter() - started
+        elapsed = run_elapsed if elapsed is None else min(elapsed, run_elapsed)
+    return elapsed
+
+
+CASES = [
+    # name, text sample, size in bytes
+    ('ascii', 'sensors/building-1/floor-2/temperature ', 32),
+    ('ascii', 'sensors/building-1/floor-2/temperature ', 1024),
+    ('ascii', 'sensors/building-1/floor-2/temperature ', 1024 * 1024),
+    ('mostly_ascii', '{"name": "Grüße", "value": 21.5} ', 1024),
+    ('mostly_ascii', '{"name": "Grüße", "value": 21.5} ', 1024 * 1024),
+    ('cyrillic', 'привет мир ', 1024 * 1024),
+    ('cjk', '你好世界', 1024 * 1024),
+]
+
+def kernel_validate(data, kernel):
+    return gmqttlib._validate_utf8_kernel(data, False, kernel)
+
+
+VALIDATORS = [
+    ('gmqttlib_' + kernel, partial(kernel_validate, kernel=kernel))
+    for kernel in ('avx2', 'ssse3', 'scalar') if gmqttlib._validate_utf8_kernel(b'', False, kernel) is not None
+] + [('python', python_validate)]
+
+
+def main(number_scale):
+    for name, sample, size in CASES:
+        data = sample.encode() * (size // len(sample.encode()) + 1)
+        data = data[:size]
+        # do not cut multibyte character in the middle
+        while not python_validate(data):
+            data = data[:-1]
+
+        number = max(1, number_scale // len(data))
+        for validator_name, validator in VALIDATORS:
+            assert validator(data)
+            elapsed = measure(validator, data, number)
+            yield {
+                'case': name,
+                'size': len(data),
+                'validator': validator_name,
+                'bytes_per_sec': round(len(data) * number / elapsed),
+                'calls_per_sec': round(number / elapsed),
+            }
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--quick', action='store_true', help='validate 10 times less data')
+    args = parser.parse_args()
+
+    for result in main(2 ** 24 if args.quick else 2 ** 28):
+        print(json.dumps(result))
@@ -0,0 +1,177 @@
+"""In-process stand-in broker, just enough of MQTT 3.1.1 and 5.0 to run benchmarks without network.
+
+Accepts any client, grants requested QoS, routes messages to subscribers (shared subscriptions are
+treated as plain ones) and runs QoS 1 and 2 flows on both sides. Properties are not forwarded, sessions,
+retained messages and topic aliases are not supported.
+"""
+import asyncio
+import struct
+
+from gmqtt.mqtt.constants import MQTTCommands, MQTTv50
+from gmqtt.mqtt.utils import PyTopicMatcher, pack_variable_byte_integer, unpack_variable_byte_integer
+
+
+def build_frame(cmd, body):
+    return bytes([cmd]) + bytes(pack_variable_byte_integer(len(body))) + body
+
+
+class BrokerConnection(asyncio.Protocol):
+    def __init__(self, broker):
+        self._broker = broker
+        self._transport = None
+        self._buffer = bytearray()
+        self._proto_ver = MQTTv50
+        self._next_mid = 0
+
+    def connection_made(self, transport):
+        self._transport = transport
+        self._broker.add_connection(self)
+
+    def connection_lost(self, exc):
+        self._broker.remove_connection(self)
+
+    def data_received(self, data):
+        self._buffer += data
+        buf = self._buffer
+        offset = 0
+        while True:
+            frame = self._frame_size(buf, offset)
+            if frame is None:
+                break
+            header_size, payload_size = frame
+            self._handle(buf[offset], bytes(buf[offset + header_size:offset + header_size + payload_size]))
+            offset += header_size + payload_size
+        del buf[:offset]
+
+    @staticmethod
+    def _frame_size(buf, offset):
+        # returns (header size, payload size) of the frame at offset if it is received completely
+        header_size = 1
+        payload_size = 0
+        while offset + header_size < len(buf) and header_size <= 4:
+            payload_byte = buf[offset + header_size]
+            payload_size |= (payload_byte & 0x7F) << (7 * (header_size - 1))
+            header_size += 1
+            if not payload_byte & 0x80:
+                if offset + header_size + payload_size > len(buf):
+                    return None
+                return header_size, payload_size
+        return None
+
+    def _skip_properties(self, packet):
+        if self._proto_ver < MQTTv50:
+            return packet
+        properties_len, packet = unpack_variable_byte_integer(packet)
+        return packet[properties_len:]
+
+    def _handle(self, cmd, packet):
+        cmd_type = cmd & 0xF0
+        if cmd_type == MQTTCommands.CONNECT:
+            proto_name_len, = struct.unpack('!H', packet[:2])
+            self._proto_ver = packet[2 + proto_name_len]
+            self.write(build_frame(MQTTCommands.CONNACK, b'\x00\x00\x00' if self._proto_ver >= MQTTv50 else b'\x00\x00'))
+        elif cmd_type == MQTTCommands.SUBSCRIBE:
+            mid = packet[:2]
+            packet = self._skip_properties(packet[2:])
+            granted = bytearray()
+            while packet:
+                topic_len, = struct.unpack('!H', packet[:2])
+                topic = packet[2:2 + topic_len].decode('utf-8')
+                qos = packet[2 + topic_len] & 0x03
+                self._broker.subscribe(self, topic, qos)
+                granted.append(qos)
+                packet = packet[3 + topic_len:]
+            self.write(build_frame(MQTTCommands.SUBACK, mid + (b'\x00' if self._proto_ver >= MQTTv50 else b'') + granted))
+        elif cmd_type == MQTTCommands.PUBLISH:
+            qos = (cmd & 0x06) >> 1
+            topic_len, = struct.unpack('!H', packet[:2])
+            topic = packet[2:2 + topic_len]
+            packet = packet[2 + topic_len:]
+            if qos:
+                mid = packet[:2]
+                packet = packet[2:]
+                self.write(build_frame(MQTTCommands.PUBACK if qos == 1 else MQTTCommands.PUBREC, mid))
+            self._broker.route(topic, self._skip_properties(packet), qos)
+        elif cmd_type == MQTTCommands.PUBREL:
+            self.write(build_frame(MQTTCommands.PUBCOMP, packet[:2]))
+        elif cmd_type == MQTTCommands.PUBREC:
+            self.write(build_frame(MQTTCommands.PUBREL | 2, packet[:2]))
+        elif cmd_type == MQTTCommands.PINGREQ:
+            self.write(build_frame(MQTTCommands.PINGRESP, b''))
+        elif cmd_type == MQTTCommands.DISCONNECT:
+            self._transport.close()
+        # PUBACK and PUBCOMP finish outgoing flows, nothing to do
+
+    def deliver(self, topic, payload, qos):
+        body = bytearray(struct.pack('!H', len(topic)))
+        body += topic
+        if qos:
+            self._next_mid = self._next_mid % 65535 + 1
+            body += struct.pack('!H', self._next_mid)
+        if self._proto_ver >= MQTTv50:
+            body.append(0)
+        body += payload
+        self.write(build_frame(MQTTCommands.PUBLISH | qos << 1, body))
+
+    def write(self, data):
+        if not self._transport.is_closing():
+            self._transport.write(data)
+
+
+class FakeBroker:
+    def __init__(self):
+        self._server = None
+        # subscriptions by connection
+        self._connections = {}
+        self._subscriptions = PyTopicMatcher()
+        # qty of PUBLISH packets received from clients
+        self.received = 0
+        self._received_waiters = []
+
+    @property
+    def port(self):
+        return self._server.sockets[0].getsockname()[1]
+
+    async def start(self, host='127.0.0.1', port=0):
+        loop = asyncio.get_event_loop()
+        self._server = await loop.create_server(lambda: BrokerConnection(self), host, port)
+        return self
+
+    async def stop(self):
+        for connection in list(self._connections):
+            connection._transport.close()
+        self._server.close()
+        await self._server.wait_closed()
+
+    def add_connection(self, connection):
+        self._connections[connection] = []
+
+    def subscribe(self, connection, topic, qos):
+        if topic.startswith('$share/'):
+            # every member of the group gets the messages
+            topic = topic.split('/', 2)[2]
+        value = (connection, qos)
+        self._subscriptions.add(topic, value)
+        self._connections[connection].append((topic, value))
+
+    def remove_connection(self, connection):
+        for topic, value in self._connections.pop(connection, []):
+            self._subscriptions.remove(topic, value)
+
+    def route(self, topic, payload, qos):
+        self.received += 1
+        for connection, granted_qos in self._subscriptions.match(topic.decode('utf-8')):
+            connection.deliver(topic, payload, min(qos, granted_qos))
+        while self._received_waiters and self._received_waiters[0][0] <= self.received:
+            _, waiter = self._received_waiters.pop(0)
+            if not waiter.done():
+                waiter.set_result(None)
+
+    async def wait_received(self, count):
+        # waits till broker receives count PUBLISH packets in total
+        if self.received >= count:
+            return
+        waiter = asyncio.get_event_loop().create_future()
+        self._received_waiters.append((count, waiter))
+        self._received_waiters.sort(key=lambda item: item[0])
+        await waiter
@@ -0,0 +1,60 @@
+import logging
+import os
+import signal
+import time
+
+import asyncio
+
+from gmqtt.pool import ClientPool
+
+STOP = asyncio.Event()
+
+
+# called in worker processes, so it must be a module level function
+def on_message(client, topic, payload, qos, properties):
+    logging.info('[RECV MSG {}] TOPIC: {} PAYLOAD: {} QOS: {}'.format(client._client_id, topic, payload, qos))
+
+
+def on_connect(pool, index, flags, rc):
+    logging.info('[CONNECTED WORKER {}]'.format(index))
+
+
+def ask_exit(*args):
+    STOP.set()
+
+
+async def main(broker_host, broker_port, token):
+    # one client per CPU core, every one subscribes to $share/mytestgroup/TEST/SHARED/#
+    # and broker spreads messages among them
+    sub_pool = ClientPool('clientgonnasub', on_message=on_message, share_group='mytestgroup')
+    sub_pool.on_connect = on_connect
+    sub_pool.set_auth_credentials(token, None)
+    await sub_pool.connect(broker_host, broker_port)
+    sub_pool.subscribe('TEST/SHARED/#')
+
+    # publishes are sharded among the clients by topic hash
+    pub_pool = ClientPool('clientgonnapub', workers=2)
+    pub_pool.set_auth_credentials(token, None)
+    await pub_pool.connect(broker_host, broker_port)
+
+    for i in range(100):
+        pub_pool.publish('TEST/SHARED/{}'.format(i), i, user_property=('time', str(time.time())))
+
+    await STOP.wait()
+    logging.info('[HEALTH] %s', sub_pool.health())
+    await pub_pool.disconnect()
+    await sub_pool.disconnect(session_expiry_interval=0)
+
+
+if __name__ == '__main__':
+    loop = asyncio.get_event_loop()
+    logging.basicConfig(level=logging.INFO)
+
+    host = os.environ.get('HOST', 'mqtt.flespi.io')
+    port = 1883
+    token = os.environ.get('TOKEN', 'fake token')
+
+    loop.add_signal_handler(signal.SIGINT, ask_exit)
+    loop.add_signal_handler(signal.SIGTERM, ask_exit)
+
+    loop.run_until_complete(main(host, port, token))
@@ -2,16 +2,18 @@ import asyncio
 import json
 
 import logging
+import time
 import uuid
-from copy import copy
+from functools import partial
 from typing import Union, Sequence
 
-from .mqtt.protocol import MQTTProtocol
+from .mqtt.protocol import MQTTProtocol, MQTTBufferedProtocol
 from .mqtt.connection import MQTTConnection
 from .mqtt.handler import MqttPackageHandler
-from .mqtt.constants import MQTTv50, UNLIMITED_RECONNECTS
+from .mqtt.constants import MQTTv50, MQTTCommands, UNLIMITED_RECONNECTS
+from .mqtt.utils import TopicMatcher, CallbackExecutor, HISTOGRAM_NAMES, HISTOGRAM_CALLBACK
 
-from .storage import HeapPersistentStorage
+from .storage import IndexedPersistentStorage
 
 
 class Message:
@@ -42,7 +44,7 @@ class Message:
 
 class Subscription:
     def __init__(self, topic, qos=0, no_local=False, retain_as_published=False, retain_handling_options=0,
-                 subscription_identifier=None):
+                 subscription_identifier=None, callback=None, codec=None, stream_threshold=None):
         self.topic = topic
         self.qos = qos
         self.no_local = no_local
@@ -55,10 +57,51 @@ class Subscription:
         # this property can be used only in MQTT5.0
         self.subscription_identifier = subscription_identifier
 
+        # called instead of on_message for messages matching the topic, has the same signature
+        self.callback = callback
+        # decodes payloads of messages matching the topic if client has payload_decoder
+        self.codec = codec
+        # payloads of at least this size are passed to callbacks as PayloadStream (with buffered_receive only)
+        self.stream_threshold = stream_threshold
+
+
+def _topic_filter(subscription):
+    return subscription.topic.decode('utf-8') if isinstance(subscription.topic, bytes) else subscription.topic
+
 
 class SubscriptionsHandler:
     def __init__(self):
         self.subscriptions = []
+        # subscriptions are indexed to find them without scanning the list on every received packet
+        self._subscriptions_matcher = TopicMatcher()
+        self._subscriptions_by_identifier = {}
+        self._subscriptions_by_mid = {}
+        # qty of subscriptions with stream_threshold, large payloads are not offered for streaming without them
+        self._stream_subscriptions = 0
+
+    def _index_subscription(self, subscription):
+        self._subscriptions_matcher.add(_topic_filter(subscription), subscription)
+        self._index_subscription_identifier(subscription)
+        if subscription.stream_threshold is not None:
+            self._stream_subscriptions += 1
+
+    def _index_subscription_identifier(self, subscription):
+        if subscription.subscription_identifier is not None:
+            self._subscriptions_by_identifier.setdefault(subscription.subscription_identifier, []).append(subscription)
+
+    def _unindex_subscription_identifier(self, subscription):
+        subscriptions = self._subscriptions_by_identifier.get(subscription.subscription_identifier)
+        if subscriptions is None:
+            return
+        subscriptions[:] = [sub for sub in subscriptions if sub is not subscription]
+        if not subscriptions:
+            del self._subscriptions_by_identifier[subscription.subscription_identifier]
+
+    def _unindex_subscription(self, subscription):
+        if self._subscriptions_matcher.remove(_topic_filter(subscription), subscription) and \
+                subscription.stream_threshold is not None:
+            self._stream_subscriptions -= 1
+        self._unindex_subscription_identifier(subscription)
 
     def update_subscriptions_with_subscription_or_topic(
             self, subscription_or_topic, qos, no_local, retain_as_published, retain_handling_options, kwargs):
@@ -90,14 +133,23 @@ class SubscriptionsHandler:
                                           subscription_identifier=subscription_identifier)]
         else:
             raise ValueError('Bad subscription: must be string or Subscription or list of Subscriptions')
+        for sub in subscriptions:
+            self._index_subscription(sub)
         self.subscriptions.extend(subscriptions)
         return subscriptions
 
     def _remove_subscriptions(self, topic: Union[str, Sequence[str]]):
-        if isinstance(topic, str):
-            self.subscriptions = [s for s in self.subscriptions if s.topic != topic]
-        else:
-            self.subscriptions = [s for s in self.subscriptions if s.topic not in topic]
+        topics = {topic} if isinstance(topic, str) else set(topic)
+        kept = []
+        for sub in self.subscriptions:
+            if sub.topic in topics:
+                self._unindex_subscription(sub)
+            else:
+                kept.append(sub)
+        self.subscriptions = kept
+
+    def _set_subscriptions_mid(self, subscriptions, mid):
+        self._subscriptions_by_mid[mid] = list(subscriptions)
 
     def subscribe(self, subscription_or_topic: Union[str, Subscription, Sequence[Subscription]],
                   qos=0, no_local=False, retain_as_published=False, retain_handling_options=0, **kwargs):
@@ -108,15 +160,21 @@ class SubscriptionsHandler:
 
         subscriptions = self.update_subscriptions_with_subscription_or_topic(
             subscription_or_topic, qos, no_local, retain_as_published, retain_handling_options, kwargs)
-        return self._connection.subscribe(subscriptions, **kwargs)
+        mid = self._connection.subscribe(subscriptions, **kwargs)
+        self._set_subscriptions_mid(subscriptions, mid)
+        return mid
 
     def resubscribe(self, subscription: Subscription, **kwargs):
         # send subscribe packet for subscription,that's already in client's subscription list
         if 'subscription_identifier' in kwargs:
+            self._unindex_subscription_identifier(subscription)
             subscription.subscription_identifier = kwargs['subscription_identifier']
+            self._index_subscription_identifier(subscription)
         elif subscription.subscription_identifier is not None:
             kwargs['subscription_identifier'] = subscription.subscription_identifier
-        return self._connection.subscribe([subscription], **kwargs)
+        mid = self._connection.subscribe([subscription], **kwargs)
+        self._set_subscriptions_mid([subscription], mid)
+        return mid
 
     def unsubscribe(self, topic: Union[str, Sequence[str]], **kwargs):
         self._remove_subscriptions(topic)
@@ -124,6 +182,9 @@ class SubscriptionsHandler:
 
 
 class Client(MqttPackageHandler, SubscriptionsHandler):
+    # max qty of stored messages written with one call on session resume
+    resend_batch_size = 1024
+
     def __init__(self, client_id, clean_session=True, optimistic_acknowledgement=True,
                  will_message=None, logger=None, **kwargs):
         super(Client, self).__init__(optimistic_acknowledgement=optimistic_acknowledgement, logger=logger)
@@ -148,8 +209,31 @@ class Client(MqttPackageHandler, SubscriptionsHandler):
         self._will_message = will_message
 
         # TODO: this constant may be moved to config
-        self._persistent_storage = kwargs.pop('persistent_storage', HeapPersistentStorage())
+        self._persistent_storage = kwargs.pop('persistent_storage', IndexedPersistentStorage())
+        self._reserve_stored_mids()
         self._extract_c_properties = kwargs.pop('extract_c_properties', False)
+        # drop messages with payload_format_id=1 and non UTF-8 payload
+        self._validate_payload_format = kwargs.pop('validate_payload_format', False)
+        # receive data into reusable buffer instead of StreamReader
+        self._protocol_class = MQTTBufferedProtocol if kwargs.pop('buffered_receive', False) else MQTTProtocol
+        # coalesce packages written within this delay (in seconds) into one transport call
+        self._write_delay = kwargs.pop('write_delay', None)
+        # replace topics of QoS 0 messages with aliases, up to server topic_alias_maximum of them
+        self._auto_topic_alias = kwargs.pop('auto_topic_alias', False)
+        # PayloadDecoder passing decoded payloads to callbacks instead of bytes
+        self._payload_decoder = kwargs.pop('payload_decoder', None)
+        # PayloadCompressor compressing payloads of published messages (MQTT 5.0 only) and decompressing
+        # received ones with its dictionary
+        self._payload_compressor = kwargs.pop('compression', None)
+        # message callbacks run in callback_workers tasks, reading is paused while there are
+        # max_pending_callbacks of them waiting, ordered_callbacks keeps order of callbacks of one topic
+        callback_workers = kwargs.pop('callback_workers', None)
+        max_pending_callbacks = kwargs.pop('max_pending_callbacks', 1024)
+        ordered_callbacks = kwargs.pop('ordered_callbacks', False)
+        if callback_workers:
+            self._callback_executor = CallbackExecutor(
+                callback_workers, max_pending_callbacks, ordered_callbacks, on_pause=self._pause_reading,
+                on_resume=self._resume_reading, observe=partial(self._metrics.observe, HISTOGRAM_CALLBACK))
 
         # [retain, not_retain]
         self._publish_stats = [0, 0]
@@ -160,10 +244,26 @@ class Client(MqttPackageHandler, SubscriptionsHandler):
         self._logger = logger or logging.getLogger(__name__)
 
     def get_subscription_by_identifier(self, subscription_identifier):
-        return next((sub for sub in self.subscriptions if sub.subscription_identifier == subscription_identifier), None)
+        subscriptions = self._subscriptions_by_identifier.get(subscription_identifier)
+        return subscriptions[0] if subscriptions else None
 
     def get_subscriptions_by_mid(self, mid):
-        return [sub for sub in self.subscriptions if sub.mid == mid]
+        return self._subscriptions_by_mid.get(mid, [])
+
+    def get_subscriptions_by_topic(self, topic):
+        # subscriptions with topic filters matching the topic name
+        return self._subscriptions_matcher.match(topic)
+
+    def _pop_subscriptions_by_mid(self, mid):
+        return self._subscriptions_by_mid.pop(mid, [])
+
+    def _reserve_stored_mids(self):
+        # messages restored by durable storage after restart keep their ids till they are resent and
+        # acknowledged, so messages published from on_connect do not overwrite them
+        sent = time.monotonic()
+        for mid in self._persistent_storage.stored_mids():
+            self._id_generator.use_id(mid)
+            self._in_flight_mids.setdefault(mid, sent)
 
     def _remove_message_from_query(self, mid):
         self._logger.debug('[REMOVE MESSAGE] %s', mid)
@@ -185,21 +285,57 @@ class Client(MqttPackageHandler, SubscriptionsHandler):
         elif self._connection.is_closing():
             self._logger.debug('[Some msg need to resend] Transport is closing')
             return
-        else:
-            msgs = copy(await self._persistent_storage.get_all())
-            self._logger.debug('[msgs need to resend] processing %s messages', len(msgs))
-
-            await self._persistent_storage.clear()
-
-            for msg in msgs:
-                (_, mid, package) = msg
 
-                try:
-                    self._connection.send_package(package)
-                except Exception as exc:
-                    self._logger.error('[ERROR WHILE RESENDING] mid: %s', mid, exc_info=exc)
-
-                await self._persistent_storage.push_message(mid, package)
+        connection = self._connection
+        # messages stay in the storage, the ones left to resend are tracked by mid
+        msgs = await self._persistent_storage.get_all()
+        self._logger.debug('[msgs need to resend] processing %s messages', len(msgs))
+        resend_mids = self._resend_mids = {mid for _, mid, _ in msgs}
+
+        for mid in resend_mids:
+            # storage may not report its messages on start, their ids are unknown to the generator then
+            self._id_generator.use_id(mid)
+            # nothing is in flight over the new connection till it is resent
+            self._in_flight_mids.pop(mid, None)
+        self._wake_send_quota_waiters()
+
+        while resend_mids:
+            # backlog goes in batches within send quota and transport high-water mark,
+            # new messages are published in between
+            await self._acquire_send_quota()
+            await connection.drain()
+            await asyncio.sleep(0)
+            if connection is not self._connection or connection.is_closing():
+                self._logger.debug('[msgs need to resend] connection is lost, %s messages left', len(resend_mids))
+                return
+
+            batch_size = min(self.resend_batch_size, max(self._send_quota - len(self._in_flight_mids), 1))
+            packages = []
+            sent = time.monotonic()
+            # storage is changed by acknowledgements and new messages in between, so every batch is taken
+            # from its current state; messages acknowledged meanwhile are gone from resend_mids, and their
+            # ids may belong to new messages already
+            for _, mid, package in await self._persistent_storage.get_all():
+                if mid not in resend_mids:
+                    continue
+                resend_mids.discard(mid)
+                if not isinstance(package, bytearray):
+                    # packages restored by durable storage are read-only
+                    package = bytearray(package)
+                package[0] |= 0x08
+                self._in_flight_mids.setdefault(mid, sent)
+                packages.append(package)
+                if len(packages) == batch_size:
+                    break
+
+            if not packages:
+                # the rest is removed from the storage without acknowledgement
+                resend_mids.clear()
+                return
+            try:
+                connection.send_packages(packages)
+            except Exception as exc:
+                self._logger.error('[ERROR WHILE RESENDING] %s messages', len(packages), exc_info=exc)
 
     async def _clear_resend_qos_queue(self):
         await self._persistent_storage.clear()
@@ -235,7 +371,10 @@ class Client(MqttPackageHandler, SubscriptionsHandler):
 
         self._stat_task = asyncio.ensure_future(self._stat_logger())
 
-        await self._persistent_storage.wait_empty()
+        if not self._session_present:
+            # stored messages are dropped with the old session; on session resume they are resent in background
+            # and wait for acknowledgement while new messages are published
+            await self._persistent_storage.wait_empty()
 
         if raise_exc and self._error:
             raise self._error
@@ -244,10 +383,27 @@ class Client(MqttPackageHandler, SubscriptionsHandler):
         # important for reconnects, make sure u know what u are doing if wanna change :(
         self._exit_reconnecting_state()
         self._clear_topics_aliases()
-        connection = await MQTTConnection.create_connection(host, port, ssl, clean_session, keepalive, logger=self._logger)
+        connection = await MQTTConnection.create_connection(host, port, ssl, clean_session, keepalive, logger=self._logger,
+                                                            protocol_class=self._protocol_class,
+                                                            write_delay=self._write_delay,
+                                                            id_generator=self._id_generator,
+                                                            metrics=self._metrics)
         connection.set_handler(self)
+        if self._callback_executor is not None and self._callback_executor.paused:
+            # callbacks of the previous connection are still running
+            connection.pause_reading()
         return connection
 
+    def _pause_reading(self):
+        self._logger.debug('[CALLBACKS] %s pending, reading is paused', self._callback_executor.pending)
+        if self._connection is not None:
+            self._connection.pause_reading()
+
+    def _resume_reading(self):
+        self._logger.debug('[CALLBACKS] %s pending, reading is resumed', self._callback_executor.pending)
+        if self._connection is not None:
+            self._connection.resume_reading()
+
     def _allow_reconnect(self):
         if self._reconnecting_now or not self._is_active:
             return False
@@ -263,6 +419,7 @@ class Client(MqttPackageHandler, SubscriptionsHandler):
             return
         # stopping auto-reconnects during reconnect procedure is important, better do not touch :(
         self._temporatily_stop_reconnect()
+        self._reconnects += 1
         try:
             await self._disconnect()
         except:
@@ -282,7 +439,9 @@ class Client(MqttPackageHandler, SubscriptionsHandler):
 
     async def disconnect(self, reason_code=0, **properties):
         self._is_active = False
-        self._stat_task.cancel()
+        if self._stat_task is not None:
+            # not started if connect is not finished
+            self._stat_task.cancel()
         await self._disconnect(reason_code=reason_code, **properties)
 
     async def _disconnect(self, reason_code=0, **properties):
@@ -299,6 +458,31 @@ class Client(MqttPackageHandler, SubscriptionsHandler):
         else:
             message = Message(message_or_topic, payload, qos=qos, retain=retain, **kwargs)
 
+        self._publish_message(message)
+
+    async def publish_async(self, message_or_topic, payload=None, qos=0, retain=False, **kwargs):
+        """Publishes message with flow control, returns message id (None for QoS 0).
+
+        Waits while server receive_maximum QoS > 0 messages are not acknowledged and while
+        transport buffer is over its high-water mark.
+        """
+        if isinstance(message_or_topic, Message):
+            message = message_or_topic
+        else:
+            message = Message(message_or_topic, payload, qos=qos, retain=retain, **kwargs)
+
+        if message.qos > 0:
+            await self._acquire_send_quota()
+        mid = self._publish_message(message)
+        await self._connection.drain()
+        return mid
+
+    def _compress_message(self, message):
+        if self._payload_compressor is not None and self.protocol_version >= MQTTv50:
+            self._payload_compressor.compress_message(message)
+
+    def _publish_message(self, message):
+        self._compress_message(message)
         if message.retain:
             self._publish_stats[0] += 1
         else:
@@ -306,8 +490,56 @@ class Client(MqttPackageHandler, SubscriptionsHandler):
 
         mid, package = self._connection.publish(message)
 
-        if qos > 0:
+        if message.qos > 0:
+            self._in_flight_mids[mid] = time.monotonic()
             self._persistent_storage.push_message_nowait(mid, package)
+        return mid
+
+    def publish_many(self, messages: Sequence[Message]):
+        # packages are written with one transport call and QoS > 0 ones are stored with one storage call
+        messages = list(messages)
+        for message in messages:
+            self._compress_message(message)
+            if message.retain:
+                self._publish_stats[0] += 1
+            else:
+                self._publish_stats[1] += 1
+
+        packages = self._connection.publish_many(messages)
+
+        qos_packages = [(mid, package) for message, (mid, package) in zip(messages, packages) if message.qos > 0]
+        if qos_packages:
+            sent = time.monotonic()
+            self._in_flight_mids.update((mid, sent) for mid, _ in qos_packages)
+            self._persistent_storage.push_messages_nowait(qos_packages)
+
+    def get_metrics(self):
+        """Returns counters of all connections of the client.
+
+        Histograms have log2 buckets of microseconds: bucket 0 counts durations below 1us,
+        bucket i counts durations in [2^(i-1), 2^i) us, the last one the rest.
+        """
+        packets_in, bytes_in, packets_out, bytes_out, histograms = self._metrics.snapshot()
+
+        names = {command.value >> 4: command.name for command in MQTTCommands}
+
+        def by_type(values):
+            return {names.get(packet_type, str(packet_type)): value for packet_type, value in enumerate(values)
+                    if value}
+
+        oldest_sent = next(iter(self._in_flight_mids.values()), None)
+        return {
+            'connected': self._connection is not None and self.is_connected,
+            'reconnects': self._reconnects,
+            'in_flight': len(self._in_flight_mids),
+            'oldest_in_flight_age': time.monotonic() - oldest_sent if oldest_sent is not None else None,
+            'packets_in': by_type(packets_in),
+            'bytes_in': by_type(bytes_in),
+            'packets_out': by_type(packets_out),
+            'bytes_out': by_type(bytes_out),
+            'histograms': {name: {'buckets': buckets, 'count': sum(buckets), 'sum': total}
+                           for name, (buckets, total) in zip(HISTOGRAM_NAMES, histograms)},
+        }
 
     async def _stat_logger(self):
         while True:
@@ -0,0 +1,98 @@
+import zlib
+
+try:
+    from gmqtt import gmqttlib
+except:
+    _has_gmqttlib = False
+else:
+    _has_gmqttlib = hasattr(gmqttlib, 'deflate_payload')
+
+# user property marking compressed payloads, like HTTP Content-Encoding header
+CONTENT_ENCODING = 'content-encoding'
+DEFLATE = 'deflate'
+
+
+def _py_deflate_payload(data, level, dictionary, nogil_threshold):
+    compressor = zlib.compressobj(level, zdict=dictionary) if dictionary else zlib.compressobj(level)
+    return compressor.compress(data) + compressor.flush()
+
+
+def _py_inflate_payload(data, dictionary, max_size, nogil_threshold):
+    decompressor = zlib.decompressobj(zdict=dictionary) if dictionary else zlib.decompressobj()
+    try:
+        payload = decompressor.decompress(data, max_size + 1)
+    except zlib.error as exc:
+        raise ValueError(str(exc))
+    if len(payload) > max_size:
+        raise ValueError('decompressed payload is larger than {} bytes'.format(max_size))
+    if not decompressor.eof:
+        raise ValueError('compressed payload is truncated')
+    if decompressor.unused_data:
+        raise ValueError('compressed payload has trailing data')
+    return payload
+
+
+class PayloadCompressor(object):
+    """Compresses payloads of published messages and decompresses received ones with zlib (deflate).
+
+    Payloads of at least min_size bytes are compressed if it makes them smaller, such messages get
+    ('content-encoding', 'deflate') user property, so it works with MQTT 5.0 only. Both sides must use the same
+    dictionary, a sample of typical payloads helps a lot for small messages. Received payloads which would be
+    larger than max_size bytes are rejected. gmqttlib releases GIL while payloads of at least nogil_threshold
+    bytes are processed, so other threads (callback workers, decoder executor) are not stalled; client inflates
+    received payloads of that size in executor.
+    """
+
+    def __init__(self, level=6, dictionary=None, min_size=128, max_size=268435455, nogil_threshold=64 * 1024):
+        self.level = level
+        self.dictionary = bytes(dictionary) if dictionary else None
+        self.min_size = min_size
+        self.max_size = max_size
+        self.nogil_threshold = nogil_threshold
+
+    def compress(self, payload):
+        if _has_gmqttlib:
+            return gmqttlib.deflate_payload(payload, self.level, self.dictionary, self.nogil_threshold)
+        return _py_deflate_payload(payload, self.level, self.dictionary, self.nogil_threshold)
+
+    def decompress(self, payload):
+        if _has_gmqttlib:
+            return gmqttlib.inflate_payload(payload, self.dictionary, self.max_size, self.nogil_threshold)
+        return _py_inflate_payload(payload, self.dictionary, self.max_size, self.nogil_threshold)
+
+    def compress_message(self, message):
+        # message keeps its payload if it is small, already encoded or does not get smaller
+        if message.payload_size < self.min_size or is_compressed(message.properties):
+            return
+        payload = self.compress(message.payload)
+        if len(payload) >= message.payload_size:
+            return
+        message.payload = payload
+        message.payload_size = len(payload)
+        message.properties['user_property'] = _user_properties(message.properties) + [(CONTENT_ENCODING, DEFLATE)]
+
+
+def _user_properties(properties):
+    user_properties = properties.get('user_property')
+    if not user_properties:
+        return []
+    if isinstance(user_properties, tuple) and len(user_properties) == 2 and isinstance(user_properties[0], str):
+        # single pair may be passed as is
+        return [user_properties]
+    return list(user_properties)
+
+
+def is_compressed(properties):
+    user_properties = properties.get('user_property')
+    if not user_properties:
+        return False
+    return any(pair == (CONTENT_ENCODING, DEFLATE) for pair in _user_properties(properties))
+
+
+def strip_content_encoding(properties):
+    # callbacks get decompressed payload, so they should not see the marker
+    user_properties = [pair for pair in _user_properties(properties) if pair != (CONTENT_ENCODING, DEFLATE)]
+    if user_properties:
+        properties['user_property'] = user_properties
+    else:
+        properties.pop('user_property', None)
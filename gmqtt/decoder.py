@@ -0,0 +1,58 @@
+import asyncio
+import json
+
+
+def decode_utf8(payload):
+    return payload.decode('utf-8')
+
+
+DEFAULT_CODECS = {
+    'application/json': json.loads,
+    'text/plain': decode_utf8,
+}
+
+
+class PayloadDecoder(object):
+    """Decodes payloads of received messages before they are passed to callbacks.
+
+    Codec is a function of payload bytes, it is taken from the subscription matching the topic if it has one,
+    else by content_type of the message (parameters like charset are ignored). Messages with payload_format_id=1
+    and no known content_type are decoded as UTF-8 text, others are passed as is.
+
+    Payloads shorter than inline_threshold are decoded right on the event loop, larger ones in executor
+    (loop default executor if it is None). Codecs must be picklable to be run in ProcessPoolExecutor.
+    """
+
+    def __init__(self, codecs=None, executor=None, inline_threshold=64 * 1024):
+        self._codecs = dict(DEFAULT_CODECS)
+        for content_type, codec in (codecs or {}).items():
+            self.register(content_type, codec)
+        self._executor = executor
+        self._inline_threshold = inline_threshold
+
+    def register(self, content_type, codec):
+        self._codecs[self._media_type(content_type)] = codec
+
+    @staticmethod
+    def _media_type(content_type):
+        return content_type.split(';', 1)[0].strip().lower()
+
+    def codec_for(self, properties, subscriptions=()):
+        for subscription in subscriptions:
+            if subscription.codec is not None:
+                return subscription.codec
+
+        content_type = properties.get('content_type')
+        if content_type:
+            codec = self._codecs.get(self._media_type(content_type[0]))
+            if codec is not None:
+                return codec
+        if properties.get('payload_format_id') == [1]:
+            return decode_utf8
+        return None
+
+    def is_inline(self, payload):
+        return len(payload) < self._inline_threshold
+
+    def submit(self, codec, payload):
+        return asyncio.get_event_loop().run_in_executor(self._executor, codec, payload)
@@ -0,0 +1,495 @@
+import asyncio
+import logging
+import mmap
+import os
+import pickle
+import socket
+import struct
+from itertools import count
+
+from .client import Message, Subscription
+from .mqtt.utils import TopicMatcher, run_coroutine_or_function
+
+logger = logging.getLogger(__name__)
+
+# rings are files of shared memory filesystem, unlinked by the process which created them
+SHM_DIR = '/dev/shm'
+# ring header: write position, read position (bounded ring only), capacity; data starts at 64
+_POSITION = struct.Struct('<Q')
+_WRITE_POSITION_OFFSET = 0
+_READ_POSITION_OFFSET = 8
+_CAPACITY_OFFSET = 16
+_HEADER_SIZE = 64
+# record is its length followed by data, records are 8 bytes aligned, padding length marks wrap to ring start
+_LENGTH = struct.Struct('<I')
+_PADDING = 0xFFFFFFFF
+# message record header: topic length, QoS, flags (retain for publishes), properties length
+_MESSAGE = struct.Struct('<HBBI')
+_PICKLED_PAYLOAD = 0x01
+# control frames are length prefixed pickles, empty frame wakes up the other side to read its ring
+_FRAME = struct.Struct('<I')
+_WAKEUP = _FRAME.pack(0)
+
+_reverse_ring_ids = count()
+
+
+def socket_path(name):
+    # abstract unix socket, nothing to clean up if the hub dies
+    return '\0gmqtt-fanout-' + name
+
+
+def ring_name(name):
+    return 'gmqtt-fanout-' + name
+
+
+def _empty_callback(*args, **kwargs):
+    pass
+
+
+def _unlink_ring(name):
+    try:
+        os.unlink(os.path.join(SHM_DIR, name))
+    except FileNotFoundError:
+        pass
+
+
+def _map_ring(name, size=None):
+    # creates ring memory of size bytes or maps existing one
+    path = os.path.join(SHM_DIR, name)
+    if size is None:
+        fd = os.open(path, os.O_RDWR)
+    else:
+        try:
+            fd = os.open(path, os.O_RDWR | os.O_CREAT | os.O_EXCL, 0o600)
+        except FileExistsError:
+            # left by a process which crashed
+            _unlink_ring(name)
+            fd = os.open(path, os.O_RDWR | os.O_CREAT | os.O_EXCL, 0o600)
+    try:
+        if size is not None:
+            os.ftruncate(fd, size)
+        return mmap.mmap(fd, 0)
+    finally:
+        os.close(fd)
+
+
+def _check_peer(writer):
+    # abstract sockets are reachable by every user of the host, rings and frames are trusted for the same user only
+    sock = writer.get_extra_info('socket')
+    _, uid, _ = struct.unpack('3i', sock.getsockopt(socket.SOL_SOCKET, socket.SO_PEERCRED, struct.calcsize('3i')))
+    if uid != os.getuid():
+        raise PermissionError('fanout peer runs as user {}'.format(uid))
+
+
+async def _read_frame(reader):
+    # returns None for wakeup frame
+    length, = _FRAME.unpack(await reader.readexactly(_FRAME.size))
+    if not length:
+        return None
+    return pickle.loads(await reader.readexactly(length))
+
+
+def _send_frame(writer, frame):
+    data = pickle.dumps(frame, pickle.HIGHEST_PROTOCOL)
+    writer.write(_FRAME.pack(len(data)) + data)
+
+
+class SharedRing:
+    """Ring of variable size records in shared memory, written by one process.
+
+    Broadcast ring is never blocked by readers: each reader keeps its own position and jumps to the newest record
+    when the writer gets closer than half of the ring behind it, so records which may be overwritten are never
+    returned. Bounded ring has one reader, which stores its position in the ring, write fails while there is no
+    room. Positions grow monotonically and are stored after the record is written.
+    """
+
+    def __init__(self, name, memory, bounded=False, owner=False):
+        self.name = name
+        self._memory = memory
+        self._buf = memoryview(memory)
+        self._owner = owner
+        self.bounded = bounded
+        self.capacity, = _POSITION.unpack_from(self._buf, _CAPACITY_OFFSET)
+        self.max_record = self.capacity // 4
+        # reader which is further behind may read a record being overwritten
+        self._max_lag = self.capacity - 2 * self.max_record
+        self._position = self.write_position
+
+    @classmethod
+    def create(cls, name, capacity, bounded=False):
+        capacity = max(4096, (capacity + 7) & ~7)
+        memory = _map_ring(name, _HEADER_SIZE + capacity)
+        _POSITION.pack_into(memory, _CAPACITY_OFFSET, capacity)
+        return cls(name, memory, bounded, owner=True)
+
+    @classmethod
+    def attach(cls, name, bounded=False):
+        return cls(name, _map_ring(name), bounded)
+
+    @property
+    def write_position(self):
+        return _POSITION.unpack_from(self._buf, _WRITE_POSITION_OFFSET)[0]
+
+    @property
+    def read_position(self):
+        return _POSITION.unpack_from(self._buf, _READ_POSITION_OFFSET)[0]
+
+    @read_position.setter
+    def read_position(self, position):
+        _POSITION.pack_into(self._buf, _READ_POSITION_OFFSET, position)
+
+    def write(self, *parts):
+        """Writes one record of parts, returns False if bounded ring has no room for it."""
+        size = _LENGTH.size + sum(len(part) for part in parts)
+        advance = (size + 7) & ~7
+        if advance > self.max_record:
+            raise ValueError('record of {} bytes does not fit the ring'.format(size))
+
+        capacity = self.capacity
+        position = self._position
+        offset = position % capacity
+        padding = capacity - offset if capacity - offset < advance else 0
+        if self.bounded and position + padding + advance - self.read_position > capacity:
+            return False
+
+        buf = self._buf
+        if padding:
+            _LENGTH.pack_into(buf, _HEADER_SIZE + offset, _PADDING)
+            position += padding
+            offset = 0
+        start = _HEADER_SIZE + offset
+        _LENGTH.pack_into(buf, start, size - _LENGTH.size)
+        start += _LENGTH.size
+        for part in parts:
+            end = start + len(part)
+            buf[start:end] = part
+            start = end
+
+        self._position = position + advance
+        _POSITION.pack_into(buf, _WRITE_POSITION_OFFSET, self._position)
+        return True
+
+    def read(self, position, limit=1024):
+        """Returns up to limit records written since position and position after them.
+
+        Records are None if broadcast ring writer has overtaken the reader, position is the newest one then.
+        """
+        buf = self._buf
+        capacity = self.capacity
+        write_position = self.write_position
+        records = []
+        while position < write_position and len(records) < limit:
+            if not self.bounded and write_position - position > self._max_lag:
+                return None, write_position
+            offset = position % capacity
+            length, = _LENGTH.unpack_from(buf, _HEADER_SIZE + offset)
+            if length == _PADDING:
+                record = None
+            else:
+                start = _HEADER_SIZE + offset + _LENGTH.size
+                record = bytes(buf[start:start + length])
+            if not self.bounded:
+                # the record is valid only if writer has not reached it while it was copied
+                write_position = self.write_position
+                if write_position - position > self._max_lag:
+                    return None, write_position
+
+            if record is None:
+                position += capacity - offset
+            else:
+                records.append(record)
+                position += (_LENGTH.size + length + 7) & ~7
+        return records, position
+
+    def close(self, unlink=None):
+        self._buf.release()
+        self._memory.close()
+        if self._owner if unlink is None else unlink:
+            _unlink_ring(self.name)
+
+
+def _pack_message(topic, payload, qos, flags, properties):
+    if isinstance(topic, str):
+        topic = topic.encode('utf-8')
+    properties = pickle.dumps(properties, pickle.HIGHEST_PROTOCOL) if properties else b''
+    return _MESSAGE.pack(len(topic), qos, flags, len(properties)), topic, properties, payload
+
+
+def _unpack_message(record):
+    topic_len, qos, flags, properties_len = _MESSAGE.unpack_from(record)
+    start = _MESSAGE.size + topic_len
+    topic = record[_MESSAGE.size:start]
+    properties = pickle.loads(record[start:start + properties_len]) if properties_len else {}
+    return topic, record[start + properties_len:], qos, flags, properties
+
+
+class _Peer:
+    def __init__(self, writer, reverse):
+        self.writer = writer
+        self.reverse = reverse
+        self.topics = set()
+
+
+class FanoutHub:
+    """Shares messages received by one client with FanoutSubscriber objects of other processes on the host,
+    so they need no broker connections of their own.
+
+    Messages are written into shared memory ring which every subscriber reads and filters by its topic filters.
+    The client is subscribed to the union of the filters with the highest requested QoS, QoS > 0 messages are
+    acknowledged when they are written into the ring, and subscribers which are behind by more than half of the ring
+    lose messages. Publishes of subscribers come through their own bounded rings. Linux only, peers must run
+    as the same user. Start the hub when the client is connected.
+    """
+
+    def __init__(self, client, name, capacity=16 * 2**20):
+        self._client = client
+        self._name = name
+        self._capacity = capacity
+        self._ring = None
+        self._server = None
+        self._peers = set()
+        # qos requested by every peer by topic filter and the client subscription made for it
+        self._filters = {}
+        self._subscriptions = {}
+        self._wakeup_handle = None
+
+        self.written = 0
+        self.dropped = 0
+
+    async def start(self):
+        # socket is bound first, so ring of a running hub with the same name is not replaced
+        self._server = await asyncio.start_unix_server(self._serve_peer, path=socket_path(self._name))
+        self._ring = SharedRing.create(ring_name(self._name), self._capacity)
+        return self
+
+    async def stop(self):
+        self._server.close()
+        for peer in list(self._peers):
+            peer.writer.close()
+        await self._server.wait_closed()
+        for topic in list(self._subscriptions):
+            self._client.unsubscribe(topic)
+        self._subscriptions.clear()
+        self._filters.clear()
+        self._ring.close()
+
+    async def _serve_peer(self, reader, writer):
+        peer = None
+        try:
+            _check_peer(writer)
+            command, reverse_name = await _read_frame(reader)
+            if '/' in reverse_name or not reverse_name.startswith(ring_name(self._name) + '-'):
+                raise ValueError('unexpected ring name {}'.format(reverse_name))
+            peer = _Peer(writer, SharedRing.attach(reverse_name, bounded=True))
+            _send_frame(writer, ('welcome', self._ring.name))
+            self._peers.add(peer)
+            while True:
+                frame = await _read_frame(reader)
+                if frame is None:
+                    self._read_publishes(peer)
+                else:
+                    command, *args = frame
+                    getattr(self, '_command_' + command)(peer, *args)
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        except Exception as exc:
+            logger.error('[FANOUT] peer failed', exc_info=exc)
+        finally:
+            writer.close()
+            if peer is not None:
+                self._remove_peer(peer)
+
+    def _remove_peer(self, peer):
+        self._peers.discard(peer)
+        for topic in peer.topics:
+            requested = self._filters.get(topic)
+            if requested:
+                requested.pop(peer, None)
+                self._update_subscription(topic)
+        # peer may be dead, so its ring is removed here
+        peer.reverse.close(unlink=True)
+
+    def _command_subscribe(self, peer, topic, qos):
+        self._filters.setdefault(topic, {})[peer] = qos
+        peer.topics.add(topic)
+        self._update_subscription(topic)
+
+    def _command_unsubscribe(self, peer, topic):
+        if topic in peer.topics:
+            peer.topics.remove(topic)
+            self._filters[topic].pop(peer, None)
+            self._update_subscription(topic)
+
+    def _update_subscription(self, topic):
+        requested = self._filters.get(topic)
+        subscription = self._subscriptions.get(topic)
+        if not requested:
+            self._filters.pop(topic, None)
+            if subscription is not None:
+                del self._subscriptions[topic]
+                self._client.unsubscribe(topic)
+            return
+
+        qos = max(requested.values())
+        if subscription is None:
+            subscription = self._subscriptions[topic] = Subscription(topic, qos=qos, callback=self._on_message)
+            self._client.subscribe(subscription)
+        elif subscription.qos < qos:
+            subscription.qos = qos
+            self._client.resubscribe(subscription)
+
+    def _on_message(self, client, topic, payload, qos, properties):
+        flags = 0
+        if not isinstance(payload, (bytes, bytearray, memoryview)):
+            # client has payload_decoder
+            payload = pickle.dumps(payload, pickle.HIGHEST_PROTOCOL)
+            flags = _PICKLED_PAYLOAD
+        try:
+            self._ring.write(*_pack_message(topic, payload, qos, flags, dict(properties)))
+        except ValueError as exc:
+            self.dropped += 1
+            logger.warning('[FANOUT] message of %s is dropped: %s', topic, exc)
+            return 0
+
+        self.written += 1
+        if self._wakeup_handle is None:
+            self._wakeup_handle = asyncio.get_event_loop().call_soon(self._wake_peers)
+        return 0
+
+    def _wake_peers(self):
+        self._wakeup_handle = None
+        for peer in self._peers:
+            # peer reads everything written so far on any wakeup, so one pending wakeup is enough
+            if not peer.writer.transport.get_write_buffer_size():
+                peer.writer.write(_WAKEUP)
+
+    def _read_publishes(self, peer):
+        while True:
+            records, position = peer.reverse.read(peer.reverse.read_position)
+            if not records:
+                return
+            messages = []
+            for record in records:
+                topic, payload, qos, retain, properties = _unpack_message(record)
+                messages.append(Message(topic, payload, qos=qos, retain=bool(retain), **properties))
+            peer.reverse.read_position = position
+            self._client.publish_many(messages)
+
+
+class FanoutSubscriber:
+    """Receives messages of FanoutHub `name` running in another process of the host and publishes through it.
+
+    `on_message` has the signature of Client one, its result is ignored: messages are acknowledged by the hub.
+    Shared subscriptions are not supported, messages are filtered locally. `overruns` counts times the subscriber
+    was too slow and lost messages.
+    """
+
+    def __init__(self, name, reverse_capacity=2**20):
+        self._name = name
+        self._reverse_capacity = reverse_capacity
+        self._reader = None
+        self._writer = None
+        self._ring = None
+        self._reverse = None
+        self._position = 0
+        self._read_task = None
+        self._wakeup_handle = None
+
+        # qos by topic filter, matcher values are the filters
+        self._filters = {}
+        self._matcher = TopicMatcher()
+
+        self.on_message = _empty_callback
+        self.overruns = 0
+
+    async def connect(self):
+        self._reader, self._writer = await asyncio.open_unix_connection(socket_path(self._name))
+        _check_peer(self._writer)
+        self._reverse = SharedRing.create('{}-{}-{}'.format(ring_name(self._name), os.getpid(),
+                                                            next(_reverse_ring_ids)),
+                                          self._reverse_capacity, bounded=True)
+        _send_frame(self._writer, ('hello', self._reverse.name))
+        _, name = await _read_frame(self._reader)
+        self._ring = SharedRing.attach(name)
+        self._position = self._ring.write_position
+        self._read_task = asyncio.ensure_future(self._read_wakeups())
+
+    async def disconnect(self):
+        self._read_task.cancel()
+        self._writer.close()
+        self._ring.close()
+        self._reverse.close()
+
+    @property
+    def is_connected(self):
+        return self._read_task is not None and not self._read_task.done()
+
+    async def _read_wakeups(self):
+        try:
+            while True:
+                await _read_frame(self._reader)
+                self._receive()
+        except (asyncio.IncompleteReadError, ConnectionError):
+            logger.warning('[FANOUT] hub %s is gone', self._name)
+
+    def _receive(self):
+        while True:
+            records, self._position = self._ring.read(self._position)
+            if records is None:
+                self.overruns += 1
+                logger.warning('[FANOUT] subscriber is behind the hub, messages are lost')
+                continue
+            if not records:
+                return
+            for record in records:
+                self._dispatch(record)
+
+    def _dispatch(self, record):
+        topic, payload, qos, flags, properties = _unpack_message(record)
+        topic = topic.decode('utf-8')
+        topic_filters = self._matcher.match(topic)
+        if not topic_filters:
+            return
+        if flags & _PICKLED_PAYLOAD:
+            payload = pickle.loads(payload)
+        qos = min(qos, max(self._filters[topic_filter] for topic_filter in topic_filters))
+        run_coroutine_or_function(self.on_message, self, topic, payload, qos, properties)
+
+    def subscribe(self, topic, qos=0):
+        if topic.startswith('$share/'):
+            raise ValueError('shared subscriptions are not supported by fanout')
+        if topic not in self._filters:
+            self._matcher.add(topic, topic)
+        self._filters[topic] = qos
+        _send_frame(self._writer, ('subscribe', topic, qos))
+
+    def unsubscribe(self, topic):
+        if self._filters.pop(topic, None) is not None:
+            self._matcher.remove(topic, topic)
+        _send_frame(self._writer, ('unsubscribe', topic))
+
+    def publish(self, message_or_topic, payload=None, qos=0, retain=False, **kwargs):
+        """Passes message to the hub, raises BufferError if hub is behind and the ring is full."""
+        if isinstance(message_or_topic, Message):
+            message = message_or_topic
+        else:
+            message = Message(message_or_topic, payload, qos=qos, retain=retain, **kwargs)
+
+        if not self._reverse.write(*_pack_message(message.topic, message.payload, message.qos, int(message.retain),
+                                                  message.properties)):
+            raise BufferError('fanout publish ring is full')
+        if self._wakeup_handle is None:
+            self._wakeup_handle = asyncio.get_event_loop().call_soon(self._wake_hub)
+
+    async def publish_async(self, message_or_topic, payload=None, qos=0, retain=False, **kwargs):
+        # waits while the hub is behind
+        while True:
+            try:
+                return self.publish(message_or_topic, payload, qos, retain, **kwargs)
+            except BufferError:
+                await asyncio.sleep(0.001)
+
+    def _wake_hub(self):
+        self._wakeup_handle = None
+        if not self._writer.is_closing() and not self._writer.transport.get_write_buffer_size():
+            self._writer.write(_WAKEUP)
@@ -2,7 +2,10 @@ import asyncio
 import logging
 import time
 
+from functools import partial
+
 from .protocol import MQTTProtocol
+from .utils import TimerWheel
 
 class MQTTConnection(object):
     def __init__(self, transport: asyncio.Transport, protocol: MQTTProtocol, clean_session: bool, keepalive: int, logger=None):
@@ -16,18 +19,42 @@ class MQTTConnection(object):
 
         self._last_data_in = time.monotonic()
         self._last_data_out = time.monotonic()
+        self._last_ping = float('-inf')
 
-        self._keep_connection_callback = asyncio.get_event_loop().call_later(self._keepalive / 2, self._keep_connection)
+        # keepalive checks of all connections of the loop share one wheel, data in and out only updates
+        # timestamps above and the check reschedules itself for the time they are due
+        self._timer_wheel = TimerWheel.for_loop()
+        self._keep_connection_callback = None
+        self._schedule_keep_connection()
 
         self._logger = logger or logging.getLogger(__name__)
 
     @classmethod
-    async def create_connection(cls, host, port, ssl, clean_session, keepalive, loop=None, logger=None):
+    async def create_connection(cls, host, port, ssl, clean_session, keepalive, loop=None, logger=None,
+                                protocol_class=MQTTProtocol, write_delay=None, id_generator=None, metrics=None):
         loop = loop or asyncio.get_event_loop()
-        transport, protocol = await loop.create_connection(MQTTProtocol, host, port, ssl=ssl)
+        protocol_factory = partial(protocol_class, write_delay=write_delay, id_generator=id_generator,
+                                   metrics=metrics)
+        transport, protocol = await loop.create_connection(protocol_factory, host, port, ssl=ssl)
         return MQTTConnection(transport, protocol, clean_session, keepalive, logger=logger)
 
+    def _next_ping_time(self):
+        # ping when nothing is received or sent for 0.8 of keepalive, but not more often than twice per keepalive
+        return max(min(self._last_data_in, self._last_data_out) + 0.8 * self._keepalive,
+                   self._last_ping + self._keepalive / 2)
+
+    def _schedule_keep_connection(self):
+        if self._keep_connection_callback:
+            self._timer_wheel.cancel(self._keep_connection_callback)
+            self._keep_connection_callback = None
+        if not self._keepalive:
+            return
+        next_check = min(self._next_ping_time(), self._last_data_in + 2 * self._keepalive)
+        self._keep_connection_callback = self._timer_wheel.call_later(next_check - time.monotonic(),
+                                                                      self._keep_connection)
+
     def _keep_connection(self):
+        self._keep_connection_callback = None
         if self.is_closing() or not self._keepalive:
             return
 
@@ -37,25 +64,37 @@ class MQTTConnection(object):
             asyncio.ensure_future(self.close())
             return
 
-        if time_ - self._last_data_out >= 0.8 * self._keepalive or \
-                time_ - self._last_data_in >= 0.8 * self._keepalive:
+        if time_ >= self._next_ping_time():
+            self._last_ping = time_
             self._send_ping_request()
-        self._keep_connection_callback = asyncio.get_event_loop().call_later(self._keepalive / 2, self._keep_connection)
+        self._schedule_keep_connection()
 
     def put_package(self, pkg):
         self._last_data_in = time.monotonic()
         self._handler(*pkg)
 
+    @property
+    def streams_enabled(self):
+        return bool(self._handler._stream_subscriptions)
+
+    def open_stream(self, cmd, raw_header, payload_size):
+        # returns PayloadStream if the PUBLISH payload is to be streamed, None to receive it whole
+        self._last_data_in = time.monotonic()
+        return self._handler._open_publish_stream(cmd, raw_header, payload_size)
+
     def send_package(self, package):
         # This is not blocking operation, because transport place the data
         # to the buffer, and this buffer flushing async
-        self._last_data_out = time.monotonic()
         if isinstance(package, (bytes, bytearray)):
             package = package
         else:
             package = package.encode()
 
-        self._transport.write(package)
+        # goes through the protocol to keep order with coalesced writes
+        self._protocol.write_data(package)
+
+    def send_packages(self, packages):
+        self._protocol.write_many(packages)
 
     async def auth(self, client_id, username, password, will_message=None, **kwargs):
         await self._protocol.send_auth_package(client_id, username, password, self._clean_session,
@@ -64,6 +103,25 @@ class MQTTConnection(object):
     def publish(self, message):
         return self._protocol.send_publish(message)
 
+    def publish_many(self, messages):
+        return self._protocol.send_publish_many(messages)
+
+    def pause_reading(self):
+        self._protocol.pause_reading()
+
+    def resume_reading(self):
+        self._protocol.resume_reading()
+
+    async def drain(self):
+        await self._protocol.drain()
+
+    @property
+    def metrics(self):
+        return self._protocol.metrics
+
+    def set_topic_alias_maximum(self, maximum):
+        self._protocol.topic_aliases.reset(maximum)
+
     def send_disconnect(self, reason_code=0, **properties):
         self._protocol.send_disconnect(reason_code=reason_code, **properties)
 
@@ -87,7 +145,9 @@ class MQTTConnection(object):
 
     async def close(self):
         if self._keep_connection_callback:
-            self._keep_connection_callback.cancel()
+            self._timer_wheel.cancel(self._keep_connection_callback)
+            self._keep_connection_callback = None
+        self._protocol.flush_writes()
         self._transport.close()
         await self._protocol.closed
 
@@ -103,6 +163,5 @@ class MQTTConnection(object):
         if self._keepalive == value:
             return
         self._keepalive = value
-        if self._keep_connection_callback:
-            self._keep_connection_callback.cancel()
-        self._keep_connection_callback = asyncio.get_event_loop().call_later(self._keepalive / 2, self._keep_connection)
+        # server_keep_alive takes effect at once, the check is due already if keepalive got shorter
+        self._schedule_keep_connection()
@@ -120,6 +120,9 @@ class SubAckReasonCode(enum.IntEnum):
 
 UNLIMITED_RECONNECTS = -1
 
+# server accepts this many QoS > 0 messages in flight if CONNACK has no receive_maximum property
+DEFAULT_RECEIVE_MAXIMUM = 65535
+
 DEFAULT_CONFIG = {
     'reconnect_delay': 6,
     'reconnect_retries': UNLIMITED_RECONNECTS,
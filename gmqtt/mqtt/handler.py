@@ -4,15 +4,18 @@ import struct
 import time
 import re
 
-from collections import defaultdict
+from collections import defaultdict, deque
 from copy import deepcopy
 from functools import partial
 
-from .utils import unpack_variable_byte_integer, IdGenerator, run_coroutine_or_function
+from .utils import unpack_variable_byte_integer, IdGenerator, run_coroutine_or_function, validate_utf8, Metrics
+from .utils import iscoroutinefunction_or_partial
+from .utils import HISTOGRAM_PUBACK_LATENCY, HISTOGRAM_PUBCOMP_LATENCY, HISTOGRAM_CALLBACK
 from .property import Property
-from .protocol import MQTTProtocol
-from .constants import MQTTCommands, PubRecReasonCode, DEFAULT_CONFIG
+from .protocol import MQTTProtocol, PayloadStream
+from .constants import MQTTCommands, PubRecReasonCode, PubAckReasonCode, DEFAULT_CONFIG, DEFAULT_RECEIVE_MAXIMUM
 from .constants import MQTTv311, MQTTv50
+from ..compression import PayloadCompressor, is_compressed, strip_content_encoding
 
 try:
     from gmqtt import gmqttlib
@@ -24,6 +27,16 @@ else:
 logger = logging.getLogger(__name__)
 
 
+_default_compressor = PayloadCompressor()
+
+
+def _inflate_payload(compressor, payload, validate_utf8_payload, codec):
+    payload = compressor.decompress(payload)
+    if validate_utf8_payload and not validate_utf8(payload, allow_null=True):
+        raise ValueError('payload is not UTF-8')
+    return codec(payload) if codec is not None else payload
+
+
 def _empty_callback(*args, **kwargs):
     pass
 
@@ -180,9 +193,35 @@ class MqttPackageHandler(EventCallback):
         self._error = None
         self._connection = None
         self._extract_c_properties = False
+        self._validate_payload_format = False
         self._server_topics_aliases = {}
-
-        self._id_generator = IdGenerator(max=kwargs.get('receive_maximum', 65535))
+        self._auto_topic_alias = False
+        # decodes payloads before callbacks if set, messages waiting for decoding (or decompression) by topic
+        self._payload_decoder = None
+        self._decode_queues = {}
+        # decompresses payloads marked with content-encoding user property, default one has no dictionary
+        self._payload_compressor = None
+        # runs message callbacks with bounded concurrency if set
+        self._callback_executor = None
+
+        # identifiers of outgoing packets, freed on acknowledgement only
+        self._id_generator = IdGenerator()
+        # counters of all connections of the client
+        self._metrics = Metrics()
+        self._reconnects = 0
+
+        # outgoing QoS > 0 messages which are not acknowledged yet (monotonic send time by mid, in send order),
+        # publish_async waits while there are receive_maximum of them
+        self._send_quota = DEFAULT_RECEIVE_MAXIMUM
+        self._in_flight_mids = {}
+        self._send_quota_waiters = deque()
+        # QoS 2 messages received by the broker (PUBREC is got), they are not in the storage any more
+        # and wait for PUBCOMP, PUBREL is sent again on session resume
+        self._pubrel_mids = {}
+        # mids of the stored messages left to resend on session resume, acknowledged ones are dropped as their
+        # ids may be taken by new messages before the resend gets to them
+        self._resend_mids = set()
+        self._session_present = False
 
         if self.protocol_version == MQTTv50:
             self._optimistic_acknowledgement = kwargs.get('optimistic_acknowledgement', True)
@@ -200,6 +239,43 @@ class MqttPackageHandler(EventCallback):
     def _remove_message_from_query(self, mid):
         raise NotImplementedError
 
+    async def _acquire_send_quota(self):
+        while len(self._in_flight_mids) >= self._send_quota:
+            waiter = asyncio.get_event_loop().create_future()
+            self._send_quota_waiters.append(waiter)
+            try:
+                await waiter
+            except asyncio.CancelledError:
+                # quota may be released to this waiter already, pass it to the next one
+                if waiter.done() and not waiter.cancelled():
+                    self._wake_send_quota_waiters()
+                raise
+
+    def _wake_send_quota_waiters(self):
+        free = self._send_quota - len(self._in_flight_mids)
+        while free > 0 and self._send_quota_waiters:
+            waiter = self._send_quota_waiters.popleft()
+            if not waiter.done():
+                waiter.set_result(None)
+                free -= 1
+
+    def _release_send_quota(self, mid, histogram=None):
+        sent = self._in_flight_mids.pop(mid, None)
+        if sent is not None and histogram is not None:
+            self._metrics.observe(histogram, time.monotonic() - sent)
+        self._wake_send_quota_waiters()
+
+    def _update_send_quota(self):
+        receive_maximum = (self._connack_properties or {}).get('receive_maximum')
+        self._send_quota = max(receive_maximum[0], 1) if receive_maximum else DEFAULT_RECEIVE_MAXIMUM
+        self._wake_send_quota_waiters()
+
+    def _update_topic_alias_maximum(self):
+        if not self._auto_topic_alias:
+            return
+        topic_alias_maximum = (self._connack_properties or {}).get('topic_alias_maximum')
+        self._connection.set_topic_alias_maximum(topic_alias_maximum[0] if topic_alias_maximum else 0)
+
     def _send_puback(self, mid, reason_code=0):
         self._send_command_with_mid(MQTTCommands.PUBACK, mid, False, reason_code=reason_code)
 
@@ -209,6 +285,12 @@ class MqttPackageHandler(EventCallback):
     def _send_pubrel(self, mid, dup, reason_code=0):
         self._send_command_with_mid(MQTTCommands.PUBREL | 2, mid, dup, reason_code=reason_code)
 
+    def _resend_pubrels(self):
+        # DUP flag is reserved in PUBREL fixed header, so it is sent as is
+        for mid in self._pubrel_mids:
+            self._logger.debug('[RESEND PUBREL] %s', mid)
+            self._send_pubrel(mid, 0)
+
     def _send_pubcomp(self, mid, dup, reason_code=0):
         self._send_command_with_mid(MQTTCommands.PUBCOMP, mid, dup, reason_code=reason_code)
 
@@ -239,7 +321,7 @@ class MqttPackageHandler(EventCallback):
 
         future = asyncio.ensure_future(self.reconnect(delay=True))
         future.add_done_callback(self._handle_exception_in_future)
-        self.on_disconnect(self, packet)
+        self.on_disconnect(self, bytes(packet))
 
     def _parse_properties(self, packet):
         if self.protocol_version < MQTTv50:
@@ -253,19 +335,27 @@ class MqttPackageHandler(EventCallback):
         else:
             packet = left_packet[:properties_len]
             left_packet = left_packet[properties_len:]
-            properties_dict = defaultdict(list)
-            while packet:
-                property_identifier, = struct.unpack("!B", packet[:1])
-                property_obj = Property.factory(id_=property_identifier)
-                if property_obj is None:
-                    self._logger.critical('[PROPERTIES] received invalid property id {}, disconnecting'.format(property_identifier))
-                    return None, None
-                result, packet = property_obj.loads(packet[1:])
-                for k, v in result.items():
-                    properties_dict[k].append(v)
-            properties_dict = dict(properties_dict)
+            properties_dict = self._load_properties(packet)
+            if properties_dict is None:
+                return None, None
             return properties_dict, left_packet
 
+    def _load_properties(self, packet):
+        # parses properties block without its size
+        if not packet:
+            return {}
+        properties_dict = defaultdict(list)
+        while packet:
+            property_identifier, = struct.unpack("!B", packet[:1])
+            property_obj = Property.factory(id_=property_identifier)
+            if property_obj is None:
+                self._logger.critical('[PROPERTIES] received invalid property id {}, disconnecting'.format(property_identifier))
+                return None
+            result, packet = property_obj.loads(packet[1:])
+            for k, v in result.items():
+                properties_dict[k].append(v)
+        return dict(properties_dict)
+
     def _update_keepalive_if_needed(self):
         if not self._connack_properties.get('server_keep_alive'):
             return
@@ -276,9 +366,15 @@ class MqttPackageHandler(EventCallback):
         self._connected.set()
 
         (session_present, result) = struct.unpack("!BB", packet[:2])
+        self._session_present = bool(session_present)
         if session_present:
+            self._resend_pubrels()
             asyncio.ensure_future(self._resend_qos_messages())
         else:
+            # there is no session on the server, so nothing is in flight
+            self._id_generator.reset()
+            self._in_flight_mids.clear()
+            self._pubrel_mids.clear()
             asyncio.ensure_future(self._clear_resend_qos_queue())
 
         if result != 0:
@@ -310,6 +406,8 @@ class MqttPackageHandler(EventCallback):
                 asyncio.ensure_future(self.disconnect())
             self._connack_properties = properties
             self._update_keepalive_if_needed()
+        self._update_send_quota()
+        self._update_topic_alias_maximum()
 
         # TODO: Implement checking for the flags and results
         # see 3.2.2.3 Connect Return code of the http://docs.oasis-open.org/mqtt/mqtt/v3.1.1/os/mqtt-v3.1.1-os.pdf
@@ -324,15 +422,288 @@ class MqttPackageHandler(EventCallback):
         qos = (header & 0x06) >> 1
         retain = header & 0x01
 
+        if _has_gmqttlib:
+            decoded = self._decode_publish_packet_c(qos, raw_packet)
+        else:
+            decoded = self._decode_publish_packet(qos, raw_packet)
+
+        if decoded is None:
+            self._logger.critical('[INVALID MESSAGE] skipping: {}'.format(raw_packet))
+            return
+        topic, mid, properties, packet = decoded
+        properties['dup'] = dup
+        properties['retain'] = retain
+        # payload might be a view of the receive buffer
+        packet = bytes(packet)
+
+        if not topic:
+            self._logger.warning('[MQTT ERR PROTO] topic name is empty (or server has send invalid topic alias)')
+            return
+
+        if validate_utf8(topic):
+            print_topic = topic.decode('utf-8')
+        else:
+            self._logger.warning('[INVALID CHARACTER IN TOPIC] %s', topic)
+            print_topic = topic
+
+        if is_compressed(properties):
+            compressor = self._payload_compressor or _default_compressor
+            strip_content_encoding(properties)
+            if len(packet) >= compressor.nogil_threshold and isinstance(print_topic, str):
+                self._inflate_in_executor(compressor, print_topic, packet, qos, mid, properties)
+                return
+            try:
+                packet = compressor.decompress(packet)
+            except ValueError as exc:
+                self._logger.warning('[PAYLOAD DECOMPRESS FAILED] %s: %s', print_topic, exc)
+                self._reject_invalid_payload(qos, mid)
+                return
+
+        if self._validate_payload_format and properties.get('payload_format_id') == [1] \
+                and not validate_utf8(packet, allow_null=True):
+            self._logger.warning('[INVALID PAYLOAD FORMAT] %s: payload is not UTF-8', print_topic)
+            self._reject_invalid_payload(qos, mid)
+            return
+
+        self._logger.debug('[RECV %s with QoS: %s] %s', print_topic, qos, packet)
+
+        if qos == 0:
+            self._deliver_message(print_topic, packet, qos, properties)
+        elif qos == 1:
+            self._handle_qos_1_publish_packet(mid, packet, print_topic, properties)
+        elif qos == 2:
+            self._handle_qos_2_publish_packet(mid, packet, print_topic, properties)
+
+    def _inflate_in_executor(self, compressor, print_topic, packet, qos, mid, properties):
+        # large payload is decompressed (and decoded) in executor, then validated and acknowledged; messages
+        # of the topic received after it wait in its decode queue
+        subscriptions = self.get_subscriptions_by_topic(print_topic)
+        codec = self._payload_decoder.codec_for(properties, subscriptions) if self._payload_decoder else None
+        self._logger.debug('[RECV %s with QoS: %s] inflating %s bytes', print_topic, qos, len(packet))
+        future = asyncio.get_event_loop().run_in_executor(
+            None, _inflate_payload, compressor, packet, self._validate_payload_format and
+            properties.get('payload_format_id') == [1], codec)
+        queue = self._decode_queues.get(print_topic)
+        if queue is None:
+            queue = self._decode_queues[print_topic] = deque()
+        future.add_done_callback(partial(self._flush_decode_queue, print_topic))
+        queue.append((future, partial(self._deliver_inflated, future, print_topic, qos, mid, properties,
+                                      subscriptions)))
+
+    def _deliver_inflated(self, future, print_topic, qos, mid, properties, subscriptions):
+        try:
+            payload = future.result()
+        except Exception as exc:
+            self._logger.warning('[PAYLOAD DECOMPRESS FAILED] %s: %r', print_topic, exc)
+            self._reject_invalid_payload(qos, mid)
+            return
+
+        callback = None
+        if qos and self._optimistic_acknowledgement:
+            if qos == 2:
+                self._send_pubrec(mid)
+            else:
+                self._send_puback(mid)
+        elif qos:
+            callback = partial(self.__handle_publish_callback, qos=qos, mid=mid)
+        self._dispatch_message(print_topic, payload, qos, properties, subscriptions, callback)
+
+    def _reject_invalid_payload(self, qos, mid):
+        if qos == 1:
+            self._send_puback(mid, reason_code=PubAckReasonCode.PAYLOAD_FORMAT_INVALID)
+        elif qos == 2:
+            self._send_pubrec(mid, reason_code=PubRecReasonCode.PAYLOAD_FORMAT_INVALID)
+
+    def _open_publish_stream(self, cmd, raw_header, payload_size):
+        # payload is streamed if a subscription matching the topic asks for it, the message is acknowledged
+        # when the stream is consumed
+        try:
+            qos = (cmd & 0x06) >> 1
+            if _has_gmqttlib:
+                decoded = self._decode_publish_packet_c(qos, raw_header)
+            else:
+                decoded = self._decode_publish_packet(qos, raw_header)
+            if decoded is None or not decoded[0] or not validate_utf8(decoded[0]):
+                return None
+            topic, mid, properties, _ = decoded
+            if is_compressed(properties):
+                # compressed payload is inflated as a whole
+                return None
+            print_topic = topic.decode('utf-8')
+            subscriptions = self.get_subscriptions_by_topic(print_topic)
+            streaming = [sub for sub in subscriptions
+                         if sub.stream_threshold is not None and payload_size >= sub.stream_threshold]
+            if not streaming:
+                return None
+        except Exception as exc:
+            self._logger.error('[ERROR HANDLE PKG]', exc_info=exc)
+            return None
+
+        properties['dup'] = (cmd & 0x08) >> 3
+        properties['retain'] = cmd & 0x01
+        self._logger.debug('[RECV STREAM %s with QoS: %s] %s bytes', print_topic, qos, payload_size)
+
+        stream = PayloadStream(payload_size)
+        # only the callback of the streaming subscription reads the stream, callbacks of other matching
+        # subscriptions get the whole payload when it is received
+        stream_callback = streaming[0].callback or self.on_message
+        others = [sub for sub in subscriptions if sub.callback is not None and sub.callback is not stream_callback]
+        if others:
+            stream._tee(lambda payload: self._deliver_message(print_topic, payload, qos, dict(properties),
+                                                              subscriptions=others))
+
+        callback = None
+        if qos and self._optimistic_acknowledgement:
+            stream.consumed.add_done_callback(partial(self._acknowledge_stream, None, qos, mid))
+        elif qos:
+            callback = lambda f: stream.consumed.add_done_callback(partial(self._acknowledge_stream, f, qos, mid))
+        self._run_callbacks(print_topic, stream, qos, properties, [self._releasing_stream(stream, stream_callback)],
+                            callback)
+        return stream
+
+    def _releasing_stream(self, stream, message_callback):
+        # stream which is not read when the callback returns is discarded, otherwise reading stays paused
+        # and the message is never acknowledged
+        if iscoroutinefunction_or_partial(message_callback):
+            async def run(*args):
+                try:
+                    return await message_callback(*args)
+                finally:
+                    stream._release()
+        else:
+            def run(*args):
+                try:
+                    return message_callback(*args)
+                finally:
+                    stream._release()
+        return run
+
+    def _acknowledge_stream(self, result, qos, mid, consumed):
+        if consumed.cancelled():
+            # connection is lost, server sends the message again
+            return
+        if result is not None:
+            self.__handle_publish_callback(result, qos=qos, mid=mid)
+        elif qos == 2:
+            self._send_pubrec(mid)
+        else:
+            self._send_puback(mid)
+
+    def _deliver_message(self, print_topic, packet, qos, properties, callback=None, subscriptions=None):
+        if subscriptions is None:
+            subscriptions = self.get_subscriptions_by_topic(print_topic) if isinstance(print_topic, str) else []
+        decoder = self._payload_decoder
+        queue = self._decode_queues.get(print_topic)
+        if decoder is None and queue is None:
+            self._dispatch_message(print_topic, packet, qos, properties, subscriptions, callback)
+            return
+
+        codec = decoder.codec_for(properties, subscriptions) if decoder is not None else None
+        if queue is None and (codec is None or decoder.is_inline(packet)):
+            # nothing of the topic is being decoded in executor, so message goes right away
+            self._deliver_decoded(None, codec, packet, print_topic, qos, properties, subscriptions, callback)
+            return
+
+        # messages of the topic wait for the ones received before them, acknowledgements wait for delivery
+        if queue is None:
+            queue = self._decode_queues[print_topic] = deque()
+        future = None
+        if codec is not None and not decoder.is_inline(packet):
+            future = decoder.submit(codec, packet)
+            future.add_done_callback(partial(self._flush_decode_queue, print_topic))
+        queue.append((future, partial(self._deliver_decoded, future, codec, packet, print_topic, qos, properties,
+                                      subscriptions, callback)))
+
+    def _flush_decode_queue(self, print_topic, _=None):
+        queue = self._decode_queues.get(print_topic)
+        if queue is None:
+            # flushed already by done callback of a later future
+            return
+        while queue and (queue[0][0] is None or queue[0][0].done()):
+            _, deliver = queue.popleft()
+            deliver()
+        if not queue:
+            del self._decode_queues[print_topic]
+
+    def _deliver_decoded(self, future, codec, packet, print_topic, qos, properties, subscriptions, callback):
+        try:
+            if future is not None:
+                payload = future.result()
+            elif codec is not None:
+                payload = codec(packet)
+            else:
+                payload = packet
+        except Exception as exc:
+            self._logger.warning('[PAYLOAD DECODE FAILED] %s: %r', print_topic, exc)
+            if callback is not None:
+                # message is not delivered, so it is acknowledged as one with invalid payload
+                result = asyncio.get_event_loop().create_future()
+                result.set_result(PubRecReasonCode.PAYLOAD_FORMAT_INVALID)
+                callback(result)
+            return
+        self._dispatch_message(print_topic, payload, qos, properties, subscriptions, callback)
+
+    def _dispatch_message(self, print_topic, packet, qos, properties, subscriptions, callback=None):
+        # message goes to callbacks of matching subscriptions, on_message gets it if there is none of them;
+        # acknowledgement depends on the result of the first callback only
+        callbacks = []
+        for sub in subscriptions:
+            if sub.callback is not None and sub.callback not in callbacks:
+                callbacks.append(sub.callback)
+        if not callbacks:
+            callbacks.append(self.on_message)
+        self._run_callbacks(print_topic, packet, qos, properties, callbacks, callback)
+
+    def _run_callbacks(self, print_topic, packet, qos, properties, callbacks, callback=None):
+        if self._callback_executor is not None:
+            self._callback_executor.submit(print_topic, callbacks[0], self, print_topic, packet, qos, properties,
+                                           callback=callback)
+            for message_callback in callbacks[1:]:
+                self._callback_executor.submit(print_topic, message_callback, self, print_topic, packet, qos,
+                                               properties)
+            return
+
+        started = time.monotonic()
+        futures = [run_coroutine_or_function(callbacks[0], self, print_topic, packet, qos, properties, callback=callback)]
+        for message_callback in callbacks[1:]:
+            futures.append(run_coroutine_or_function(message_callback, self, print_topic, packet, qos, properties))
+        self._observe_callback_duration(started, futures)
+
+    def _observe_callback_duration(self, started, futures):
+        # coroutine callbacks are measured till the last of them is done
+        futures = [f for f in futures if f is not None]
+        if not futures:
+            self._metrics.observe(HISTOGRAM_CALLBACK, time.monotonic() - started)
+            return
+        pending = [len(futures)]
+
+        def done(f):
+            pending[0] -= 1
+            if not pending[0]:
+                self._metrics.observe(HISTOGRAM_CALLBACK, time.monotonic() - started)
+
+        for f in futures:
+            f.add_done_callback(done)
+
+    def _decode_publish_packet_c(self, qos, raw_packet):
+        decoded = gmqttlib.publish_loads(raw_packet, qos, self.protocol_version, self._extract_c_properties,
+                                         self._server_topics_aliases)
+        if decoded is None or self.protocol_version < MQTTv50 or self._extract_c_properties:
+            return decoded
+
+        topic, mid, properties, packet = decoded
+        properties = self._load_properties(properties)
+        if properties is None:
+            return None
+        return topic, mid, properties, packet
+
+    def _decode_publish_packet(self, qos, raw_packet):
         pack_format = "!H" + str(len(raw_packet) - 2) + 's'
         (slen, packet) = struct.unpack(pack_format, raw_packet)
 
         pack_format = '!' + str(slen) + 's' + str(len(packet) - slen) + 's'
         (topic, packet) = struct.unpack(pack_format, packet)
 
-        # we will change the packet ref, let's save origin
-        payload = packet
-
         if qos > 0:
             pack_format = "!H" + str(len(packet) - 2) + 's'
             (mid, packet) = struct.unpack(pack_format, packet)
@@ -340,12 +711,9 @@ class MqttPackageHandler(EventCallback):
             mid = None
 
         properties, packet = self._parse_properties(packet)
-        properties['dup'] = dup
-        properties['retain'] = retain
 
         if packet is None:
-            self._logger.critical('[INVALID MESSAGE] skipping: {}'.format(raw_packet))
-            return
+            return None
 
         if 'topic_alias' in properties:
             # TODO: need to add validation (topic alias must be greater than 0 and less than topic_alias_maximum)
@@ -355,33 +723,15 @@ class MqttPackageHandler(EventCallback):
             else:
                 topic = self._server_topics_aliases.get(topic_alias, None)
 
-        if not topic:
-            self._logger.warning('[MQTT ERR PROTO] topic name is empty (or server has send invalid topic alias)')
-            return
-
-        try:
-            print_topic = topic.decode('utf-8')
-        except UnicodeDecodeError as exc:
-            self._logger.warning('[INVALID CHARACTER IN TOPIC] %s', topic, exc_info=exc)
-            print_topic = topic
-
-        self._logger.debug('[RECV %s with QoS: %s] %s', print_topic, qos, payload)
-
-        if qos == 0:
-            run_coroutine_or_function(self.on_message, self, print_topic, packet, qos, properties)
-        elif qos == 1:
-            self._handle_qos_1_publish_packet(mid, packet, print_topic, properties)
-        elif qos == 2:
-            self._handle_qos_2_publish_packet(mid, packet, print_topic, properties)
-        self._id_generator.free_id(mid)
+        return topic, mid, properties, packet
 
     def _handle_qos_2_publish_packet(self, mid, packet, print_topic, properties):
         if self._optimistic_acknowledgement:
             self._send_pubrec(mid)
-            run_coroutine_or_function(self.on_message, self, print_topic, packet, 2, properties)
+            self._deliver_message(print_topic, packet, 2, properties)
         else:
-            run_coroutine_or_function(self.on_message, self, print_topic, packet, 2, properties,
-                                      callback=partial(self.__handle_publish_callback, qos=2, mid=mid))
+            self._deliver_message(print_topic, packet, 2, properties,
+                                  callback=partial(self.__handle_publish_callback, qos=2, mid=mid))
 
     def __handle_publish_callback(self, f, qos=None, mid=None):
         reason_code = f.result()
@@ -391,15 +741,14 @@ class MqttPackageHandler(EventCallback):
             self._send_pubrec(mid, reason_code=reason_code)
         else:
             self._send_puback(mid, reason_code=reason_code)
-        self._id_generator.free_id(mid)
 
     def _handle_qos_1_publish_packet(self, mid, packet, print_topic, properties):
         if self._optimistic_acknowledgement:
             self._send_puback(mid)
-            run_coroutine_or_function(self.on_message, self, print_topic, packet, 1, properties)
+            self._deliver_message(print_topic, packet, 1, properties)
         else:
-            run_coroutine_or_function(self.on_message, self, print_topic, packet, 1, properties,
-                                      callback=partial(self.__handle_publish_callback, qos=1, mid=mid))
+            self._deliver_message(print_topic, packet, 1, properties,
+                                  callback=partial(self.__handle_publish_callback, qos=1, mid=mid))
 
     def __call__(self, cmd, packet):
         try:
@@ -417,7 +766,7 @@ class MqttPackageHandler(EventCallback):
         pack_format = "!" + "B" * len(packet)
         granted_qoses = struct.unpack(pack_format, packet)
 
-        subs = self.get_subscriptions_by_mid(mid)
+        subs = self._pop_subscriptions_by_mid(mid)
         for granted_qos, sub in zip(granted_qoses, subs):
             if granted_qos >= 128:
                 # subscription was not acknowledged
@@ -429,7 +778,7 @@ class MqttPackageHandler(EventCallback):
         self._logger.info('[SUBACK] %s %s', mid, granted_qoses)
         self.on_subscribe(self, mid, granted_qoses, properties)
 
-        for sub in self.subscriptions:
+        for sub in subs:
             if sub.mid == mid:
                 sub.mid = None
         self._id_generator.free_id(mid)
@@ -459,22 +808,33 @@ class MqttPackageHandler(EventCallback):
 
         self._logger.debug('[RECEIVED PUBACK FOR] %s', mid)
 
+        self._resend_mids.discard(mid)
         self._id_generator.free_id(mid)
+        self._release_send_quota(mid, HISTOGRAM_PUBACK_LATENCY)
         self._remove_message_from_query(mid)
 
     def _handle_pubcomp_packet(self, cmd, packet):
-        pass
+        (mid, ) = struct.unpack("!H", packet[:2])
+        self._logger.debug('[RECEIVED PUBCOMP FOR] %s', mid)
+        self._pubrel_mids.pop(mid, None)
+        self._id_generator.free_id(mid)
+        self._release_send_quota(mid, HISTOGRAM_PUBCOMP_LATENCY)
 
     def _handle_pubrec_packet(self, cmd, packet):
         (mid,) = struct.unpack("!H", packet[:2])
         self._logger.debug('[RECEIVED PUBREC FOR] %s', mid)
-        self._id_generator.free_id(mid)
+        self._resend_mids.discard(mid)
         self._remove_message_from_query(mid)
+        if len(packet) > 2 and packet[2] >= 0x80:
+            # QoS 2 flow is over, PUBREL must not be sent
+            self._id_generator.free_id(mid)
+            self._release_send_quota(mid)
+            return
+        # identifier is in use till PUBCOMP
+        self._pubrel_mids[mid] = None
         self._send_pubrel(mid, 0)
 
     def _handle_pubrel_packet(self, cmd, packet):
         (mid, ) = struct.unpack("!H", packet[:2])
         self._logger.debug('[RECEIVED PUBREL FOR] %s', mid)
         self._send_pubcomp(mid, 0)
-
-        self._id_generator.free_id(mid)
@@ -4,7 +4,14 @@ from typing import Tuple
 
 from .constants import MQTTCommands, MQTTv50
 from .property import Property
-from .utils import pack_variable_byte_integer, IdGenerator
+from .utils import pack_variable_byte_integer
+
+try:
+    from gmqtt import gmqttlib
+except:
+    _has_gmqttlib = False
+else:
+    _has_gmqttlib = True
 
 logger = logging.getLogger(__name__)
 
@@ -21,7 +28,6 @@ class Packet(object):
 
 
 class PackageFactory(object):
-    id_generator = IdGenerator()
 
     @classmethod
     async def parse_package(cls, cmd, package):
@@ -42,6 +48,10 @@ class PackageFactory(object):
     def _build_properties_data(cls, properties_dict, protocol_version):
         if protocol_version < MQTTv50:
             return bytearray()
+        if _has_gmqttlib:
+            result = gmqttlib.prop_dumps(properties_dict)
+            if result is not None:
+                return result
         data = bytearray()
         for property_name, property_value in properties_dict.items():
             property = Property.factory(name=property_name)
@@ -128,7 +138,7 @@ class UnsubscribePacket(PackageFactory):
         packet = bytearray()
         packet.append(command)
         packet.extend(pack_variable_byte_integer(remaining_length))
-        local_mid = cls.id_generator.next_id()
+        local_mid = protocol.id_generator.next_id()
         packet.extend(struct.pack("!H", local_mid))
         packet.extend(properties)
         for t in topics:
@@ -175,7 +185,7 @@ class SubscribePacket(PackageFactory):
         packet = bytearray()
         packet.append(command)
         packet.extend(pack_variable_byte_integer(remaining_length))
-        local_mid = cls.id_generator.next_id()
+        local_mid = protocol.id_generator.next_id()
         packet.extend(struct.pack("!H", local_mid))
         packet.extend(properties)
         for s in subscriptions:
@@ -199,36 +209,69 @@ class PublishPacket(PackageFactory):
     def build_package(cls, message, protocol) -> Tuple[int, bytes]:
         command = MQTTCommands.PUBLISH | ((message.dup & 0x1) << 3) | (message.qos << 1) | (message.retain & 0x1)
 
-        packet = bytearray()
-        packet.append(command)
-
-        remaining_length = 2 + len(message.topic) + message.payload_size
-        prop_bytes = cls._build_properties_data(message.properties, protocol_version=protocol.proto_ver)
-        remaining_length += len(prop_bytes)
-
         if message.payload_size == 0:
             logger.debug("Sending PUBLISH (q%d), '%s' (NULL payload)", message.qos, message.topic)
         else:
             logger.debug("Sending PUBLISH (q%d), '%s', ... (%d bytes)", message.qos, message.topic, message.payload_size)
 
-        if message.qos > 0:
+        topic, properties = cls._alias_topic(message, protocol)
+
+        # For message id
+        mid = protocol.id_generator.next_id() if message.qos > 0 else None
+        try:
+            packet = None
+            if _has_gmqttlib:
+                packet = gmqttlib.build_publish(command, topic, mid,
+                                                properties if protocol.proto_ver >= MQTTv50 else None,
+                                                message.payload)
+            if packet is None:
+                packet = cls._build_package(command, topic, properties, message, mid, protocol)
+        except Exception:
+            if mid is not None:
+                protocol.id_generator.free_id(mid)
+            topic_aliases = getattr(protocol, 'topic_aliases', None)
+            if topic_aliases is not None:
+                topic_aliases.rollback()
+            raise
+
+        return mid, packet
+
+    @classmethod
+    def _alias_topic(cls, message, protocol):
+        # only QoS 0 messages are aliased: stored QoS > 0 packages may be resent over the next connection,
+        # which has no aliases established
+        topic_aliases = getattr(protocol, 'topic_aliases', None)
+        if topic_aliases is None or not topic_aliases.maximum or message.qos > 0 \
+                or protocol.proto_ver < MQTTv50 or 'topic_alias' in message.properties:
+            return message.topic, message.properties
+
+        alias, established = topic_aliases.get(message.topic)
+        properties = dict(message.properties, topic_alias=alias)
+        return b'' if established else message.topic, properties
+
+    @classmethod
+    def _build_package(cls, command, topic, properties, message, mid, protocol):
+        packet = bytearray()
+        packet.append(command)
+
+        remaining_length = 2 + len(topic) + message.payload_size
+        prop_bytes = cls._build_properties_data(properties, protocol_version=protocol.proto_ver)
+        remaining_length += len(prop_bytes)
+
+        if mid is not None:
             # For message id
             remaining_length += 2
 
         packet.extend(pack_variable_byte_integer(remaining_length))
-        cls._pack_str16(packet, message.topic)
+        cls._pack_str16(packet, topic)
 
-        if message.qos > 0:
-            # For message id
-            mid = cls.id_generator.next_id()
+        if mid is not None:
             packet.extend(struct.pack("!H", mid))
-        else:
-            mid = None
         packet.extend(prop_bytes)
 
         packet.extend(message.payload)
 
-        return mid, packet
+        return packet
 
 
 class DisconnectPacket(PackageFactory):
@@ -21,7 +21,7 @@ class Property:
             value = (value1, value2)
         elif self.bytes_struct == 'b':
             str_len, = struct.unpack('!H', bytes_array[:2])
-            value = bytes_array[2:2 + str_len]
+            value = bytes(bytes_array[2:2 + str_len])
             left_str = bytes_array[2 + str_len:]
         elif self.bytes_struct == 'vbi':
             value, left_str = unpack_variable_byte_integer(bytes_array)
@@ -52,7 +52,8 @@ class Property:
             packet.extend(pack_utf8(data))
             return packet
         elif self.bytes_struct == 'u8x2':
-            if isinstance(data[0], str):
+            # single pair or list of pairs, empty list is no property at all as gmqttlib dumps it
+            if data and isinstance(data[0], str):
                 self._dump_user_property(data, packet)
             else:
                 for kv_pair in data:
@@ -3,9 +3,18 @@ import logging
 import time
 
 import sys
+from collections import deque
 
 from . import package
 from .constants import MQTTv50, MQTTCommands
+from .utils import IdGenerator, TopicAliases, Metrics, HISTOGRAM_FRAME_PARSE
+
+try:
+    from gmqtt import gmqttlib
+except:
+    _has_gmqttlib = False
+else:
+    _has_gmqttlib = True
 
 logger = logging.getLogger(__name__)
 
@@ -30,13 +39,37 @@ class _StreamReaderProtocolCompatibilityMixin:
 
 
 class BaseMQTTProtocol(_StreamReaderProtocolCompatibilityMixin, asyncio.StreamReaderProtocol):
-    def __init__(self, buffer_size=2**16, loop=None):
+    # pending coalesced writes are flushed at once when they grow over this size
+    write_buffer_limit = 2**16
+
+    def __init__(self, buffer_size=2**16, loop=None, write_delay=None, id_generator=None, metrics=None):
         if not loop:
             loop = asyncio.get_event_loop()
 
         self._connection = None
         self._transport = None
 
+        # packet identifiers are allocated per client, so they survive reconnects
+        self.id_generator = IdGenerator() if id_generator is None else id_generator
+        # counters are kept per client too, so they are not lost on reconnect
+        self.metrics = Metrics() if metrics is None else metrics
+        # outgoing topic aliases live as long as the connection, disabled till server topic_alias_maximum is set
+        self.topic_aliases = TopicAliases()
+
+        # if write_delay is not None packages are collected for write_delay seconds
+        # (till the end of the current loop iteration for 0) and written with one writelines call
+        self._write_delay = write_delay
+        self._write_buffer = []
+        self._write_buffer_size = 0
+        self._write_flush_handle = None
+
+        # set by transport when its buffer is over the high-water mark, drain() waits till it is below the low one
+        self._write_paused = False
+        self._write_waiters = []
+        # set while callbacks of received messages are behind and while payload stream is not read
+        self._reading_paused = False
+        self._stream_paused = False
+
         self._connected = asyncio.Event()
 
         reader = asyncio.StreamReader(limit=buffer_size, loop=loop)
@@ -65,15 +98,108 @@ class BaseMQTTProtocol(_StreamReaderProtocolCompatibilityMixin, asyncio.StreamRe
 
     def data_received(self, data):
         super(BaseMQTTProtocol, self).data_received(data)
+        if self._reading_paused or self._stream_paused:
+            # stream reader resumes transport once its buffer is read
+            self._transport.pause_reading()
 
     def write_data(self, data: bytes):
         self._connection._last_data_out = time.monotonic()
-        if self._transport and not self._transport.is_closing():
+        self.metrics.count_out(data)
+        if self._write_delay is not None:
+            self._buffer_write(data)
+            self._schedule_flush()
+        elif self._transport and not self._transport.is_closing():
             self._transport.write(data)
         else:
             logger.warning('[TRYING WRITE TO CLOSED SOCKET]')
 
+    def write_many(self, packages):
+        # packages are written with as few transport calls as possible, but not more than
+        # write_buffer_limit bytes per call
+        self._connection._last_data_out = time.monotonic()
+        self.metrics.count_out_many(packages)
+        for pkg in packages:
+            self._buffer_write(pkg)
+        if self._write_delay is not None:
+            self._schedule_flush()
+        else:
+            self.flush_writes()
+
+    def _buffer_write(self, data):
+        self._write_buffer.append(data)
+        self._write_buffer_size += len(data)
+        if self._write_buffer_size >= self.write_buffer_limit:
+            self.flush_writes()
+
+    def _schedule_flush(self):
+        if self._write_flush_handle is None and self._write_buffer:
+            if self._write_delay:
+                self._write_flush_handle = self._loop.call_later(self._write_delay, self.flush_writes)
+            else:
+                self._write_flush_handle = self._loop.call_soon(self.flush_writes)
+
+    def flush_writes(self):
+        if self._write_flush_handle is not None:
+            self._write_flush_handle.cancel()
+            self._write_flush_handle = None
+        if not self._write_buffer:
+            return
+
+        packages = self._write_buffer
+        self._write_buffer = []
+        self._write_buffer_size = 0
+        if self._transport and not self._transport.is_closing():
+            self._transport.writelines(packages)
+        else:
+            logger.warning('[TRYING WRITE TO CLOSED SOCKET]')
+
+    def pause_reading(self):
+        self._reading_paused = True
+        self._update_reading()
+
+    def resume_reading(self):
+        self._reading_paused = False
+        self._update_reading()
+
+    def _update_reading(self):
+        if self._transport and not self._transport.is_closing():
+            if self._reading_paused or self._stream_paused:
+                self._transport.pause_reading()
+            else:
+                self._transport.resume_reading()
+
+    def pause_writing(self):
+        super(BaseMQTTProtocol, self).pause_writing()
+        self._write_paused = True
+
+    def resume_writing(self):
+        super(BaseMQTTProtocol, self).resume_writing()
+        self._write_paused = False
+        self._wake_write_waiters()
+
+    def _wake_write_waiters(self):
+        waiters = self._write_waiters
+        self._write_waiters = []
+        for waiter in waiters:
+            if not waiter.done():
+                waiter.set_result(None)
+
+    async def drain(self):
+        # unlike StreamWriter.drain any number of callers may wait, lost connection just releases them:
+        # data which is not written is resent from the persistent storage
+        while self._write_paused:
+            waiter = self._loop.create_future()
+            self._write_waiters.append(waiter)
+            await waiter
+
     def connection_lost(self, exc):
+        if self._write_flush_handle is not None:
+            self._write_flush_handle.cancel()
+            self._write_flush_handle = None
+        self._write_buffer = []
+        self._write_buffer_size = 0
+        self._write_paused = False
+        self._wake_write_waiters()
         self._connected.clear()
         super(BaseMQTTProtocol, self).connection_lost(exc)
         if exc:
@@ -137,9 +263,27 @@ class MQTTProtocol(BaseMQTTProtocol):
     def send_publish(self, message):
         mid, pkg = package.PublishPacket.build_package(message, self)
         self.write_data(pkg)
+        self.topic_aliases.commit()
 
         return mid, pkg
 
+    def send_publish_many(self, messages):
+        packages = []
+        try:
+            for message in messages:
+                packages.append(package.PublishPacket.build_package(message, self))
+        except Exception:
+            # none of the batch is sent, ids of the messages built so far are not going to be acknowledged
+            # and aliases they established are rolled back by build_package
+            for mid, _ in packages:
+                if mid is not None:
+                    self.id_generator.free_id(mid)
+            raise
+        self.write_many([pkg for _, pkg in packages])
+        self.topic_aliases.commit()
+
+        return packages
+
     def send_disconnect(self, reason_code=0, **properties):
         pkg = package.DisconnectPacket.build_package(self, reason_code=reason_code, **properties)
 
@@ -153,6 +297,20 @@ class MQTTProtocol(BaseMQTTProtocol):
         self.write_data(pkg)
 
     def _read_packet(self, data):
+        started = time.perf_counter()
+        if _has_gmqttlib:
+            parsed_size, frames = gmqttlib.split_packets(data, self.metrics)
+        else:
+            parsed_size, frames = self._split_packets(data)
+        self.metrics.observe(HISTOGRAM_FRAME_PARSE, time.perf_counter() - started)
+
+        for command, start, payload_size in frames:
+            self._connection.put_package((command, data[start:start + payload_size]))
+        return parsed_size
+
+    def _split_packets(self, data):
+        # the same what gmqttlib.split_packets does
+        frames = []
         parsed_size = 0
         raw_size = len(data)
         data_size = raw_size
@@ -170,11 +328,11 @@ class MQTTProtocol(BaseMQTTProtocol):
             while True:
                 if parsed_size + header_size >= raw_size:
                     # not full header
-                    return parsed_size
+                    return parsed_size, frames
                 payload_byte = data[parsed_size + header_size]
                 payload_size += (payload_byte & 0x7F) * mult
                 if mult > 2097152:  # 128 * 128 * 128
-                    return -1
+                    return -1, frames
                 mult *= 128
                 header_size += 1
                 if header_size + payload_size > data_size:
@@ -191,15 +349,14 @@ class MQTTProtocol(BaseMQTTProtocol):
             # determine packet type
             command = data[parsed_size]
             start = parsed_size + header_size
-            end = start + payload_size
-            packet = data[start:end]
 
             data_size -= header_size + payload_size
             parsed_size += header_size + payload_size
 
-            self._connection.put_package((command, packet))
+            frames.append((command, start, payload_size))
+            self.metrics.count_in(command, header_size + payload_size)
 
-        return parsed_size
+        return parsed_size, frames
 
     async def _read_loop(self):
         await self._connected.wait()
@@ -229,3 +386,302 @@ class MQTTProtocol(BaseMQTTProtocol):
             self._read_loop_future = None
 
         self._queue = asyncio.Queue()
+
+
+class PayloadStream(object):
+    """Payload of a large PUBLISH packet, async iterator of chunks in the order they are received.
+
+    Chunks are copied out of the receive buffer, reading from the socket is paused while more than
+    max_buffered bytes are not consumed. `consumed` future is done when the whole payload is received
+    and read (or discarded), message is acknowledged after that; it is cancelled if connection is lost.
+    The rest of the payload is discarded if the stream is not being read when the callback it is given to returns.
+    """
+    max_buffered = 2**20
+
+    def __init__(self, size):
+        self.size = size
+        self._chunks = deque()
+        self._buffered = 0
+        self._received = 0
+        self._discarding = False
+        self._error = None
+        self._waiter = None
+        self._on_pause = None
+        self._on_resume = None
+        self._paused = False
+        # whole payload collected for callbacks which take bytes
+        self._copy = None
+        self._on_received = None
+        self.consumed = asyncio.get_event_loop().create_future()
+
+    def _attach(self, on_pause, on_resume):
+        self._on_pause = on_pause
+        self._on_resume = on_resume
+
+    def _tee(self, on_received):
+        self._copy = bytearray()
+        self._on_received = on_received
+
+    def _release(self):
+        # callback the stream is given to has returned, a task it has started gets a loop iteration to begin reading
+        asyncio.get_event_loop().call_soon(self._discard_unread)
+
+    def _discard_unread(self):
+        if not self.consumed.done() and not self._discarding and self._waiter is None:
+            asyncio.ensure_future(self.discard())
+
+    def __aiter__(self):
+        return self
+
+    async def __anext__(self):
+        while not self._chunks:
+            if self._error is not None:
+                raise self._error
+            if self._received == self.size:
+                self._set_consumed()
+                raise StopAsyncIteration
+            self._waiter = asyncio.get_event_loop().create_future()
+            try:
+                await self._waiter
+            finally:
+                self._waiter = None
+
+        chunk = self._chunks.popleft()
+        self._buffered -= len(chunk)
+        if self._paused and self._buffered < self.max_buffered:
+            self._paused = False
+            self._on_resume()
+        return chunk
+
+    async def read(self):
+        # whole payload at once, memory is not bounded then
+        return b''.join([chunk async for chunk in self])
+
+    async def discard(self):
+        # drops the rest of the payload, message is acknowledged when it is received
+        self._discarding = True
+        self._chunks.clear()
+        self._buffered = 0
+        if self._paused:
+            self._paused = False
+            self._on_resume()
+        if self._received == self.size:
+            self._set_consumed()
+        else:
+            await asyncio.wait([self.consumed])
+
+    def _set_consumed(self):
+        if not self.consumed.done():
+            self.consumed.set_result(None)
+
+    def _wake(self):
+        if self._waiter is not None and not self._waiter.done():
+            self._waiter.set_result(None)
+
+    def _feed(self, data):
+        self._received += len(data)
+        if self._copy is not None:
+            self._copy += data
+            if self._received == self.size:
+                payload, self._copy = bytes(self._copy), None
+                self._on_received(payload)
+        if self._discarding:
+            if self._received == self.size:
+                self._set_consumed()
+            return
+        self._chunks.append(bytes(data))
+        self._buffered += len(data)
+        if not self._paused and self._buffered >= self.max_buffered and self._on_pause is not None:
+            self._paused = True
+            self._on_pause()
+        self._wake()
+
+    def _abort(self, exc):
+        self._error = exc
+        self._wake()
+        if not self.consumed.done():
+            self.consumed.cancel()
+
+
+class MQTTBufferedProtocol(MQTTProtocol, asyncio.BufferedProtocol):
+    """Receives data straight into a reusable buffer through get_buffer/buffer_updated.
+
+    Frames are parsed in place and handed to the connection as memoryviews of that buffer,
+    so they are valid only until the handler returns. Unparsed bytes are moved to the buffer head
+    at most once per frame, and the buffer grows to the size of the expected frame at once.
+
+    PUBLISH frame larger than the buffer is offered to the connection as soon as its variable header
+    is received; if it is taken as a stream the payload goes to the PayloadStream as it is received,
+    and the buffer does not grow.
+    """
+
+    def __init__(self, *args, buffer_size=2**16, **kwargs):
+        super(MQTTBufferedProtocol, self).__init__(*args, buffer_size=buffer_size, **kwargs)
+        self._min_read_size = buffer_size
+        self._buffer = None
+        self._buffer_view = None
+        self._reset_buffer(buffer_size)
+        # unparsed data lives in self._buffer[self._data_start:self._data_end]
+        self._data_start = 0
+        self._data_end = 0
+        # end of the incomplete frame in the buffer, 0 if its header is not received yet
+        self._frame_end = 0
+        # payload stream being received and qty of its bytes left
+        self._stream = None
+        self._stream_left = 0
+
+    def connection_made(self, transport: asyncio.Transport):
+        # there is no read loop, data is parsed in buffer_updated
+        super(MQTTProtocol, self).connection_made(transport)
+
+    def _reset_buffer(self, size):
+        self._buffer = bytearray(size)
+        self._buffer_view = memoryview(self._buffer)
+
+    def get_buffer(self, sizehint):
+        if self._data_start == self._data_end:
+            self._data_start = self._data_end = 0
+            if len(self._buffer) > self._min_read_size:
+                # release memory allocated for the large frame
+                self._reset_buffer(self._min_read_size)
+
+        if len(self._buffer) - self._data_end < max(self._min_read_size, self._frame_end - self._data_end):
+            self._make_room()
+        return self._buffer_view[self._data_end:]
+
+    def _make_room(self):
+        data_size = self._data_end - self._data_start
+        frame_size = self._frame_end - self._data_start if self._frame_end else 0
+        required_size = max(data_size, frame_size) + self._min_read_size
+        if required_size <= len(self._buffer):
+            # move unparsed tail to the buffer head
+            self._buffer_view[:data_size] = self._buffer_view[self._data_start:self._data_end]
+        else:
+            old_view = self._buffer_view
+            self._reset_buffer(required_size)
+            self._buffer_view[:data_size] = old_view[self._data_start:self._data_end]
+        self._data_start = 0
+        self._data_end = data_size
+        self._frame_end = frame_size
+
+    def buffer_updated(self, nbytes):
+        self._data_end += nbytes
+        if self._stream is None and self._data_end < self._frame_end:
+            # large frame is not received yet
+            return
+
+        while True:
+            if self._stream is not None:
+                self._feed_stream()
+                if self._stream is not None:
+                    return
+            if not self._parse_buffer():
+                return
+
+    def _parse_buffer(self):
+        # returns True if payload stream is opened
+        data = self._buffer_view[self._data_start:self._data_end]
+        parsed_size = self._read_packet(data)
+        if parsed_size == -1:
+            logger.warning('[MALFORMED PACKET] Connection will be closed.')
+            self._transport.close()
+            return False
+
+        self._data_start += parsed_size
+        self._frame_end = 0
+        if self._data_start < self._data_end:
+            header = self._frame_header(data[parsed_size:])
+            if header:
+                if self._open_stream(data[parsed_size:], *header):
+                    return self._stream is not None
+                self._frame_end = self._data_start + sum(header)
+        return False
+
+    def _open_stream(self, data, header_size, remaining_length):
+        # returns False if the frame is to be buffered whole, True if it is streamed or its variable header
+        # is not received yet
+        command = data[0]
+        if remaining_length <= self._min_read_size or command & 0xF0 != MQTTCommands.PUBLISH or \
+                not self._connection.streams_enabled:
+            return False
+
+        variable_size = self._variable_header_size(command, data[header_size:])
+        if variable_size is None:
+            # waits for the rest of the header while it fits the buffer
+            return len(data) - header_size < self._min_read_size
+        if variable_size > remaining_length:
+            return False
+
+        stream = self._connection.open_stream(command, data[header_size:header_size + variable_size],
+                                              remaining_length - variable_size)
+        if stream is None:
+            return False
+        self.metrics.count_in(command, header_size + remaining_length)
+        stream._attach(self._pause_stream, self._resume_stream)
+        self._stream = stream
+        self._stream_left = remaining_length - variable_size
+        self._data_start += header_size + variable_size
+        return True
+
+    def _variable_header_size(self, command, data):
+        # topic, packet identifier and properties, None if they are not received yet
+        if len(data) < 2:
+            return None
+        size = 2 + (data[0] << 8 | data[1]) + (2 if command & 0x06 else 0)
+        if self.proto_ver >= MQTTv50:
+            properties = self._variable_integer(data[size:size + 4])
+            if properties is None:
+                return None
+            size += sum(properties)
+        return size if size <= len(data) else None
+
+    @staticmethod
+    def _variable_integer(data):
+        # returns (size of the integer, its value) or None if it is not received completely
+        value = 0
+        for i in range(min(len(data), 4)):
+            value += (data[i] & 0x7F) << (7 * i)
+            if not data[i] & 0x80:
+                return i + 1, value
+        return None
+
+    def _feed_stream(self):
+        size = min(self._data_end - self._data_start, self._stream_left)
+        if size:
+            self._connection._last_data_in = time.monotonic()
+            self._stream._feed(self._buffer_view[self._data_start:self._data_start + size])
+            self._data_start += size
+            self._stream_left -= size
+        if not self._stream_left:
+            self._stream = None
+            self._resume_stream()
+
+    def _pause_stream(self):
+        self._stream_paused = True
+        self._update_reading()
+
+    def _resume_stream(self):
+        if self._stream_paused:
+            self._stream_paused = False
+            self._update_reading()
+
+    @classmethod
+    def _frame_header(cls, data):
+        # returns (fixed header size, remaining length) if remaining length is received, None otherwise
+        if len(data) < 2:
+            return None
+        remaining_length = cls._variable_integer(data[1:5])
+        if remaining_length is None:
+            return None
+        return 1 + remaining_length[0], remaining_length[1]
+
+    def connection_lost(self, exc):
+        if self._stream is not None:
+            self._stream._abort(ConnectionError('connection is lost while payload is received'))
+            self._stream = None
+        super(MQTTBufferedProtocol, self).connection_lost(exc)
+
+    def eof_received(self):
+        # let the transport close itself, there is no reader to consume EOF
+        super(MQTTBufferedProtocol, self).eof_received()
+        return False
@@ -1,61 +1,488 @@
 import asyncio
+import math
 import struct
 import logging
+import time
+import weakref
 
+from collections import OrderedDict, deque
 from functools import partial
 
+try:
+    from gmqtt import gmqttlib
+except:
+    _has_gmqttlib = False
+else:
+    _has_gmqttlib = True
 
 logger = logging.getLogger(__name__)
 
 
-class Singleton(type):
-    _instances = {}
+class PyIdGenerator(object):
+    """Packet identifiers allocator, same as gmqttlib.IdGenerator.
 
-    def __call__(cls, *args, **kwargs):
-        if cls not in cls._instances:
-            cls._instances[cls] = super(Singleton, cls).__call__(*args, **kwargs)
-        return cls._instances[cls]
+    Used identifiers are bits of 64 bit words, full words are bits of one more int on top of them,
+    identifiers are allocated round-robin.
+    """
+    _word_mask = 2**64 - 1
 
-
-class IdGenerator(object, metaclass=Singleton):
-    def __init__(self, max=65536):
+    def __init__(self, max=65535):
+        if not 1 <= max <= 65535:
+            raise ValueError('max should be in range 1..65535')
         self._max = max
-        self._used_ids = set()
-        self._last_used_id = 0
+        self.reset()
 
-    def _mid_generate(self):
-        done = False
+    def reset(self):
+        self._words = [0] * 1024
+        self._full = 0
+        # zero identifier and identifiers above max are never allocated
+        for id in [0] + list(range(self._max + 1, 65536)):
+            self._set(id)
+        self._cursor = 1
+        self._in_flight = 0
 
-        while not done:
-            if len(self._used_ids) >= self._max - 1:
-                raise OverflowError("All ids has already used. May be your QoS query is full.")
+    def _set(self, id):
+        word = id >> 6
+        self._words[word] |= 1 << (id & 63)
+        if self._words[word] == self._word_mask:
+            self._full |= 1 << word
 
-            self._last_used_id += 1
+    @property
+    def in_flight(self):
+        return self._in_flight
 
-            if self._last_used_id in self._used_ids:
-                continue
+    @property
+    def max(self):
+        return self._max
 
-            if self._last_used_id == self._max:
-                self._last_used_id = 0
-                continue
+    def next_id(self):
+        if self._in_flight >= self._max:
+            raise OverflowError("All ids has already used. May be your QoS query is full.")
 
-            done = True
+        word = self._cursor >> 6
+        free = ~self._words[word] & (self._word_mask << (self._cursor & 63)) & self._word_mask
+        if not free:
+            # the first not full word after the current one, wraps around
+            free_words = ~self._full >> (word + 1) << (word + 1) & (2**1024 - 1)
+            if not free_words:
+                free_words = ~self._full & (2**1024 - 1)
+            word = (free_words & -free_words).bit_length() - 1
+            free = ~self._words[word] & self._word_mask
 
-        self._used_ids.add(self._last_used_id)
-        return self._last_used_id
+        id = (word << 6) + (free & -free).bit_length() - 1
+        self._set(id)
+        self._cursor = id
+        self._in_flight += 1
+        return id
 
     def free_id(self, id):
-        logger.debug('FREE MID: %s', id)
-        if id not in self._used_ids:
+        if id is None or not self.is_used(id):
             return
+        self._words[id >> 6] &= ~(1 << (id & 63))
+        self._full &= ~(1 << (id >> 6))
+        self._in_flight -= 1
 
-        self._used_ids.remove(id)
+    def use_id(self, id):
+        if not 1 <= id <= self._max:
+            raise ValueError('id should be in range 1..{}'.format(self._max))
+        if self.is_used(id):
+            return
+        self._set(id)
+        self._in_flight += 1
 
-    def next_id(self):
-        id = self._mid_generate()
+    def is_used(self, id):
+        return 1 <= id <= self._max and bool(self._words[id >> 6] >> (id & 63) & 1)
 
-        logger.debug("NEW ID: %s", id)
-        return id
+
+IdGenerator = gmqttlib.IdGenerator if _has_gmqttlib else PyIdGenerator
+
+
+class _TopicNode(object):
+    __slots__ = ['children', 'values']
+
+    def __init__(self):
+        self.children = {}
+        self.values = []
+
+
+class PyTopicMatcher(object):
+    """Subscriptions trie, same as gmqttlib.TopicMatcher.
+
+    Children of the node are kept in dictionary by topic level, "$share/{group}/" prefix of shared
+    subscriptions is dropped. Matched values of recent topics are cached, cache is dropped on any
+    change of filters or when it is full.
+    """
+
+    def __init__(self, cache_size=1024):
+        if cache_size < 0:
+            raise ValueError('cache_size should not be negative')
+        self._cache_size = cache_size
+        self.clear()
+
+    def clear(self):
+        self._root = _TopicNode()
+        self._cache = {}
+        self._size = 0
+
+    def __len__(self):
+        return self._size
+
+    @staticmethod
+    def _filter_levels(topic_filter):
+        if not isinstance(topic_filter, str):
+            raise TypeError('topic filter should be str')
+        if not topic_filter:
+            raise ValueError('topic filter should not be empty')
+        levels = topic_filter.split('/')
+        if levels[0] == '$share':
+            if len(levels) < 3 or not levels[1]:
+                raise ValueError('invalid shared subscription filter {!r}'.format(topic_filter))
+            levels = levels[2:]
+        for i, level in enumerate(levels):
+            if level in ('+', '#'):
+                if level == '#' and i != len(levels) - 1:
+                    break
+            elif '+' in level or '#' in level:
+                break
+        else:
+            return levels
+        raise ValueError('invalid wildcard in topic filter {!r}'.format(topic_filter))
+
+    def add(self, topic_filter, value):
+        node = self._root
+        for level in self._filter_levels(topic_filter):
+            child = node.children.get(level)
+            if child is None:
+                child = node.children[level] = _TopicNode()
+            node = child
+        node.values.append(value)
+        self._size += 1
+        self._cache.clear()
+
+    def remove(self, topic_filter, value):
+        levels = self._filter_levels(topic_filter)
+        path = [self._root]
+        for level in levels:
+            child = path[-1].children.get(level)
+            if child is None:
+                return False
+            path.append(child)
+
+        node = path[-1]
+        index = next((i for i, v in enumerate(node.values) if v is value), None)
+        if index is None:
+            return False
+        del node.values[index]
+        # drop empty nodes
+        for level, parent, child in zip(reversed(levels), reversed(path[:-1]), reversed(path[1:])):
+            if child.values or child.children:
+                break
+            del parent.children[level]
+        self._size -= 1
+        self._cache.clear()
+        return True
+
+    def match(self, topic):
+        if not isinstance(topic, str):
+            raise TypeError('topic should be str')
+        matched = self._cache.get(topic)
+        if matched is not None:
+            return matched
+
+        levels = topic.split('/')
+        result = []
+        self._match(self._root, levels, 0, result)
+        matched = tuple(result)
+        if self._cache_size:
+            if len(self._cache) >= self._cache_size:
+                self._cache.clear()
+            self._cache[topic] = matched
+        return matched
+
+    def _match(self, node, levels, index, result):
+        # topic names starting with "$" are not matched by filters starting with wildcard
+        wildcards = index != 0 or not levels[0].startswith('$')
+        children = node.children
+
+        if wildcards and '#' in children:
+            # "#" matches the parent level too
+            result.extend(children['#'].values)
+        if index == len(levels):
+            result.extend(node.values)
+            return
+        if not children:
+            return
+
+        if wildcards and '+' in children:
+            self._match(children['+'], levels, index + 1, result)
+        child = children.get(levels[index])
+        if child is not None:
+            self._match(child, levels, index + 1, result)
+
+
+TopicMatcher = gmqttlib.TopicMatcher if _has_gmqttlib else PyTopicMatcher
+
+
+# histograms of Metrics
+HISTOGRAM_PUBACK_LATENCY = 0
+HISTOGRAM_PUBCOMP_LATENCY = 1
+HISTOGRAM_FRAME_PARSE = 2
+HISTOGRAM_CALLBACK = 3
+HISTOGRAM_NAMES = ('puback_latency', 'pubcomp_latency', 'frame_parse', 'callback')
+
+
+class PyMetrics(object):
+    """Connection counters, same as gmqttlib.Metrics.
+
+    Packets and bytes are counted by packet type, histograms have log2 buckets of microseconds:
+    bucket 0 counts durations below 1us, bucket i counts durations in [2^(i-1), 2^i) us, the last one the rest.
+    """
+    packet_types = 16
+    buckets = 32
+
+    def __init__(self):
+        self.reset()
+
+    def reset(self):
+        self._packets_in = [0] * self.packet_types
+        self._bytes_in = [0] * self.packet_types
+        self._packets_out = [0] * self.packet_types
+        self._bytes_out = [0] * self.packet_types
+        self._buckets = [[0] * self.buckets for _ in HISTOGRAM_NAMES]
+        self._sums = [0.0] * len(HISTOGRAM_NAMES)
+
+    def count_in(self, command, size):
+        self._packets_in[command >> 4] += 1
+        self._bytes_in[command >> 4] += size
+
+    def count_out(self, package):
+        if package:
+            self._packets_out[package[0] >> 4] += 1
+            self._bytes_out[package[0] >> 4] += len(package)
+
+    def count_out_many(self, packages):
+        for package in packages:
+            self.count_out(package)
+
+    def observe(self, histogram, seconds):
+        if not 0 <= histogram < len(HISTOGRAM_NAMES):
+            raise ValueError('histogram should be in range 0..{}'.format(len(HISTOGRAM_NAMES) - 1))
+        seconds = max(seconds, 0)
+        bucket = min(int(seconds * 1e6).bit_length(), self.buckets - 1)
+        self._buckets[histogram][bucket] += 1
+        self._sums[histogram] += seconds
+
+    def snapshot(self):
+        return (list(self._packets_in), list(self._bytes_in), list(self._packets_out), list(self._bytes_out),
+                [(list(buckets), total) for buckets, total in zip(self._buckets, self._sums)])
+
+
+Metrics = gmqttlib.Metrics if _has_gmqttlib else PyMetrics
+
+
+class TopicAliases(object):
+    """Outgoing topic aliases of the connection, up to server topic_alias_maximum of them.
+
+    When all aliases are in use the least recently used one is reassigned to the new topic.
+    New aliases are pending until commit(): rollback() forgets them if packets carrying them are not sent.
+    """
+
+    def __init__(self, maximum=0):
+        self.reset(maximum)
+
+    def reset(self, maximum=0):
+        self._maximum = maximum
+        # alias by topic, the least recently used topic goes first
+        self._aliases = OrderedDict()
+        # aliases released by rollback, they are assigned before the new ones
+        self._free = []
+        # alias by topic assigned since the last commit
+        self._pending = {}
+
+    @property
+    def maximum(self):
+        return self._maximum
+
+    def __len__(self):
+        return len(self._aliases)
+
+    def get(self, topic):
+        """Returns (alias, established) for the topic, alias is None if aliases are disabled.
+
+        Topic must be sent along with the alias which is not established yet.
+        """
+        if not self._maximum:
+            return None, False
+        alias = self._aliases.get(topic)
+        if alias is not None:
+            self._aliases.move_to_end(topic)
+            return alias, True
+
+        if self._free:
+            alias = self._free.pop()
+        elif len(self._aliases) < self._maximum:
+            alias = len(self._aliases) + 1
+        else:
+            evicted, alias = self._aliases.popitem(last=False)
+            self._pending.pop(evicted, None)
+        self._aliases[topic] = alias
+        self._pending[topic] = alias
+        return alias, False
+
+    def commit(self):
+        # packets establishing pending aliases are sent
+        self._pending.clear()
+
+    def rollback(self):
+        # packets establishing pending aliases are dropped, broker never saw them
+        for topic, alias in self._pending.items():
+            del self._aliases[topic]
+            self._free.append(alias)
+        self._pending.clear()
+
+
+class _WheelTimer(object):
+    __slots__ = ['tick', 'callback', 'bucket']
+
+    def __init__(self, tick, callback):
+        self.tick = tick
+        self.callback = callback
+        # set of timers the timer is in, None when it is fired or cancelled
+        self.bucket = None
+
+
+class TimerWheel(object):
+    """Hierarchical timing wheel sharing one loop timer among many timers of the event loop.
+
+    Level 0 has `slots` buckets of one tick each, every next level has buckets `slots` times wider,
+    timers of the bucket are moved one level down when level below wraps around. Scheduling and
+    cancelling are O(1), the loop timer runs only while there are timers and only at ticks with
+    something to do: the next non-empty level 0 bucket or cascade of a non-empty bucket above.
+    """
+    _wheels = weakref.WeakKeyDictionary()
+
+    def __init__(self, loop=None, tick=0.1, slots=64, levels=4):
+        # wheel is the value of _wheels keyed by its loop, so it must not keep the loop alive
+        self._loop_ref = weakref.ref(loop or asyncio.get_event_loop())
+        self._tick = tick
+        self._slots = slots
+        self._levels = [[set() for _ in range(slots)] for _ in range(levels)]
+        self._size = 0
+        self._handle = None
+        # tick the loop timer is armed for, None while timers are expired
+        self._armed = None
+        # loop time of tick 0 and the next tick to expire
+        self._start = self._loop.time()
+        self._current = 0
+
+    @classmethod
+    def for_loop(cls, loop=None):
+        loop = loop or asyncio.get_event_loop()
+        wheel = cls._wheels.get(loop)
+        if wheel is None:
+            wheel = cls._wheels[loop] = cls(loop)
+        return wheel
+
+    @property
+    def _loop(self):
+        return self._loop_ref()
+
+    def __len__(self):
+        return self._size
+
+    def call_later(self, delay, callback):
+        """Calls callback not earlier than in delay seconds, within one tick after that"""
+        if not self._size and self._handle is None:
+            # nothing to catch up with after idle time
+            self._start = self._loop.time()
+            self._current = 0
+        tick = math.ceil((self._loop.time() + delay - self._start) / self._tick)
+        timer = _WheelTimer(max(tick, self._current), callback)
+        self._add(timer)
+        self._size += 1
+        # handle is kept while callbacks run, so timers they schedule do not arm the loop timer again
+        if self._handle is None or self._armed is not None and timer.tick < self._armed:
+            self._arm()
+        return timer
+
+    def cancel(self, timer):
+        if timer.bucket is None:
+            return
+        timer.bucket.discard(timer)
+        timer.bucket = None
+        self._size -= 1
+
+    def _add(self, timer):
+        delta = timer.tick - self._current
+        level = 0
+        while level < len(self._levels) - 1 and delta >= self._slots ** (level + 1):
+            level += 1
+        # timers beyond the last level wait in its farthest bucket and are cascaded again
+        tick = min(timer.tick, self._current + self._slots ** len(self._levels) - 1)
+        timer.bucket = self._levels[level][tick // self._slots ** level % self._slots]
+        timer.bucket.add(timer)
+
+    def _cascade(self, level):
+        index = self._current // self._slots ** level % self._slots
+        bucket = self._levels[level][index]
+        self._levels[level][index] = set()
+        for timer in bucket:
+            self._add(timer)
+
+    def _next_tick(self):
+        # the earliest tick from the current one with timers to expire or to cascade, ticks in between are empty
+        for tick in range(self._current, self._current + self._slots):
+            if self._levels[0][tick % self._slots]:
+                next_tick = tick
+                break
+        else:
+            next_tick = self._current + self._slots ** len(self._levels)
+        for level in range(1, len(self._levels)):
+            span = self._slots ** level
+            boundary = -(-self._current // span) * span
+            if boundary >= next_tick:
+                break
+            for tick in range(boundary, min(boundary + span * self._slots, next_tick), span):
+                if self._levels[level][tick // span % self._slots]:
+                    next_tick = tick
+                    break
+        return next_tick
+
+    def _arm(self):
+        if self._handle is not None:
+            self._handle.cancel()
+        self._armed = self._next_tick()
+        self._handle = self._loop.call_at(self._start + self._armed * self._tick, self._run)
+
+    def _run(self):
+        self._armed = None
+        self._expire(self._loop.time())
+        self._handle = None
+        if self._size:
+            self._arm()
+
+    def _expire(self, now):
+        while self._size:
+            tick = self._next_tick()
+            if self._start + tick * self._tick > now:
+                break
+            self._current = tick
+            level = 1
+            while level < len(self._levels) and self._current % self._slots ** level == 0:
+                self._cascade(level)
+                level += 1
+
+            index = self._current % self._slots
+            bucket = self._levels[0][index]
+            self._levels[0][index] = set()
+            self._current += 1
+            for timer in bucket:
+                timer.bucket = None
+                self._size -= 1
+                try:
+                    timer.callback()
+                except Exception as exc:
+                    logger.error('[TIMER WHEEL] callback failed', exc_info=exc)
 
 
 def pack_variable_byte_integer(value):
@@ -64,7 +491,7 @@ def pack_variable_byte_integer(value):
         value, b = divmod(value, 128)
         if value > 0:
             b |= 0x80
-        remaining_bytes.extend(struct.pack('!B', b))
+        remaining_bytes.append(b)
         if value <= 0:
             break
     return remaining_bytes
@@ -88,11 +515,22 @@ def unpack_variable_byte_integer(bts):
 
 def unpack_utf8(bytes_array):
     str_len, = struct.unpack('!H', bytes_array[:2])
-    value = bytes_array[2:2 + str_len].decode('utf-8')
+    value = str(bytes_array[2:2 + str_len], 'utf-8')
     left_str = bytes_array[2 + str_len:]
     return value, left_str
 
 
+def validate_utf8(data, allow_null=False):
+    """Checks data is well-formed UTF-8 (U+0000 is accepted only with allow_null, as MQTT strings forbid it)"""
+    if _has_gmqttlib:
+        return gmqttlib.validate_utf8(data, allow_null)
+    try:
+        str(data, 'utf-8')
+    except UnicodeDecodeError:
+        return False
+    return allow_null or b'\x00' not in bytes(data)
+
+
 def pack_utf8(data):
     packet = bytearray()
     if isinstance(data, str):
@@ -109,9 +547,112 @@ def iscoroutinefunction_or_partial(object):
 
 
 def run_coroutine_or_function(func, *args, callback=None, **kwargs):
+    # returns future of the coroutine function, None for plain function
     if iscoroutinefunction_or_partial(func):
         f = asyncio.ensure_future(func(*args, **kwargs))
         if callback is not None:
             f.add_done_callback(callback)
+        return f
     else:
         func(*args, **kwargs)
+
+
+class CallbackExecutor(object):
+    """Runs message callbacks in up to `workers` tasks instead of one task per message.
+
+    Callbacks of the same key (topic) run one after another in submit order if `ordered` is set.
+    When `max_pending` callbacks are submitted and not finished yet `on_pause` is called, `on_resume`
+    is called when half of them are done, so the caller may stop reading in between. Workers exit
+    when there is nothing to run.
+    """
+
+    def __init__(self, workers=16, max_pending=1024, ordered=False, on_pause=None, on_resume=None, observe=None):
+        if workers < 1 or max_pending < 1:
+            raise ValueError('workers and max_pending should be positive')
+        self._workers = workers
+        self._max_pending = max_pending
+        self._ordered = ordered
+        self._on_pause = on_pause
+        self._on_resume = on_resume
+        # called with callback duration in seconds
+        self._observe = observe
+
+        self._running_workers = 0
+        # keys with callbacks to run if ordered, else callbacks to run
+        self._ready = deque()
+        # callbacks to run by key, key is in _ready or being run while it is here
+        self._by_key = {}
+        self._pending = 0
+        self.paused = False
+
+    @property
+    def pending(self):
+        return self._pending
+
+    def submit(self, key, func, *args, callback=None):
+        item = (func, args, callback)
+        if not self._ordered:
+            self._ready.append(item)
+        elif key in self._by_key:
+            self._by_key[key].append(item)
+        else:
+            self._by_key[key] = deque([item])
+            self._ready.append(key)
+
+        if self._running_workers < self._workers and self._ready:
+            self._running_workers += 1
+            asyncio.ensure_future(self._work())
+
+        self._pending += 1
+        if not self.paused and self._pending >= self._max_pending:
+            self.paused = True
+            if self._on_pause is not None:
+                self._on_pause()
+
+    async def _work(self):
+        try:
+            while self._ready:
+                entry = self._ready.popleft()
+                items = self._by_key[entry] if self._ordered else None
+                # bookkeeping is done even if the worker is cancelled in the callback,
+                # otherwise the key is stuck and reading may stay paused
+                try:
+                    await self._run(*(entry if items is None else items.popleft()))
+                finally:
+                    if items is not None:
+                        if items:
+                            self._ready.append(entry)
+                        else:
+                            del self._by_key[entry]
+
+                    self._pending -= 1
+                    if self.paused and self._pending <= self._max_pending // 2:
+                        self.paused = False
+                        if self._on_resume is not None:
+                            self._on_resume()
+        finally:
+            self._running_workers -= 1
+
+    async def _run(self, func, args, callback):
+        started = time.monotonic()
+        result = asyncio.get_event_loop().create_future()
+        try:
+            value = func(*args)
+            if asyncio.iscoroutine(value):
+                result.set_result(await value)
+            else:
+                # as with run_coroutine_or_function, callback gets results of coroutines only
+                callback = None
+        except Exception as exc:
+            logger.error('[CALLBACK FAILED]', exc_info=exc)
+            result.set_exception(exc)
+        if self._observe is not None:
+            self._observe(time.monotonic() - started)
+        if callback is not None:
+            try:
+                callback(result)
+            except Exception as exc:
+                logger.error('[CALLBACK FAILED]', exc_info=exc)
+        elif result.done():
+            # exception is logged already
+            result.exception()
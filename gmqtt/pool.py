@@ -0,0 +1,474 @@
+import asyncio
+import logging
+import multiprocessing
+import os
+import struct
+import sys
+import threading
+import time
+import zlib
+from collections import deque
+from multiprocessing.reduction import ForkingPickler
+
+from .client import Client, Message
+from .mqtt.constants import MQTTv50
+
+logger = logging.getLogger(__name__)
+
+
+def _gil_enabled():
+    is_gil_enabled = getattr(sys, '_is_gil_enabled', None)
+    return is_gil_enabled is None or is_gil_enabled()
+
+
+def shard_topic(topic, workers):
+    # stable across processes and restarts, so messages of one topic always go through the same connection
+    if isinstance(topic, str):
+        topic = topic.encode('utf-8')
+    return zlib.crc32(topic) % workers
+
+
+def shared_topic(topic, group):
+    if group is None or topic.startswith('$share/'):
+        return topic
+    return '$share/{}/{}'.format(group, topic)
+
+
+class _Worker:
+    """Runs one client on its own event loop, driven by commands received through the pipe."""
+
+    def __init__(self, index, commands, events, client_id, client_kwargs, on_message, setup, stats_interval):
+        self._index = index
+        self._commands = commands
+        self._events = events
+        self._stats_interval = stats_interval
+        self._stopped = None
+        self._connecting = None
+        # publish batches received from the pool, written within the send quota of the client
+        self._publishes = deque()
+        self._publishing = None
+
+        self._client = Client(client_id, **client_kwargs)
+        if on_message is not None:
+            self._client.on_message = on_message
+        if setup is not None:
+            setup(self._client, index)
+
+        on_connect = self._client.on_connect
+        on_disconnect = self._client.on_disconnect
+
+        def report_connect(client, flags, rc, properties):
+            self._send('connect', flags, rc)
+            return on_connect(client, flags, rc, properties)
+
+        def report_disconnect(client, packet, *args, **kwargs):
+            self._send('disconnect')
+            return on_disconnect(client, packet, *args, **kwargs)
+
+        self._client.on_connect = report_connect
+        self._client.on_disconnect = report_disconnect
+
+    def _send(self, event, *args):
+        try:
+            self._events.send((event, self._index) + args)
+        except (OSError, EOFError):
+            # pool is gone, nobody listens
+            self._stopped.set()
+
+    async def run(self):
+        loop = asyncio.get_event_loop()
+        self._stopped = asyncio.Event()
+        loop.add_reader(self._commands.fileno(), self._receive_commands)
+        stats_task = asyncio.ensure_future(self._report_stats())
+        try:
+            await self._stopped.wait()
+        finally:
+            stats_task.cancel()
+            loop.remove_reader(self._commands.fileno())
+            self._send('stopped')
+            self._commands.close()
+            self._events.close()
+
+    async def _report_stats(self):
+        while True:
+            await asyncio.sleep(self._stats_interval)
+            self._send('stats', self._client.is_connected if self._client._connection else False,
+                       len(self._client._in_flight_mids))
+
+    def _receive_commands(self):
+        try:
+            while self._commands.poll():
+                command, *args = self._commands.recv()
+                getattr(self, '_command_' + command)(*args)
+        except (OSError, EOFError):
+            self._stopped.set()
+        except Exception as exc:
+            logger.error('[POOL WORKER %s] command failed', self._index, exc_info=exc)
+
+    def _command_connect(self, username, password, connect_kwargs):
+        if username is not None:
+            self._client.set_auth_credentials(username, password)
+        self._connecting = asyncio.ensure_future(self._client.connect(**connect_kwargs))
+        self._connecting.add_done_callback(self._connect_done)
+
+    def _connect_done(self, future):
+        if future.cancelled():
+            return
+        if future.exception() is not None:
+            self._send('error', repr(future.exception()))
+            self._stopped.set()
+        else:
+            self._send('ready')
+
+    def _command_subscribe(self, topic, qos, kwargs):
+        self._client.subscribe(topic, qos=qos, **kwargs)
+
+    def _command_unsubscribe(self, topic, kwargs):
+        self._client.unsubscribe(topic, **kwargs)
+
+    def _command_publish_many(self, messages):
+        self._publishes.append(messages)
+        if self._publishing is None:
+            self._publishing = asyncio.ensure_future(self._publish_pending())
+
+    async def _publish_pending(self):
+        client = self._client
+        try:
+            while self._publishes:
+                messages = [Message(topic, payload, qos=qos, retain=retain, **properties)
+                            for topic, payload, qos, retain, properties in self._publishes.popleft()]
+                start = 0
+                while start < len(messages):
+                    # QoS > 0 messages wait for acknowledgements of the ones in flight instead of
+                    # running out of packet identifiers, QoS 0 ones take no quota
+                    if messages[start].qos:
+                        await client._acquire_send_quota()
+                    free = client._send_quota - len(client._in_flight_mids)
+                    end = start
+                    while end < len(messages) and (free > 0 or not messages[end].qos):
+                        free -= messages[end].qos > 0
+                        end += 1
+                    client.publish_many(messages[start:end])
+                    start = end
+                    await client._connection.drain()
+        except Exception as exc:
+            logger.error('[POOL WORKER %s] %s publish batches are dropped', self._index, len(self._publishes) + 1,
+                         exc_info=exc)
+            self._publishes.clear()
+        finally:
+            self._publishing = None
+
+    def _command_disconnect(self, kwargs):
+        if self._connecting is not None and not self._connecting.done():
+            # pool gives up on connecting
+            self._connecting.cancel()
+        future = asyncio.ensure_future(self._disconnect(kwargs))
+        future.add_done_callback(lambda f: self._stopped.set())
+
+    async def _disconnect(self, kwargs):
+        if self._publishing is not None and self._client.is_connected:
+            # messages published before disconnect are written first
+            await asyncio.wait([self._publishing])
+        await self._client.disconnect(**kwargs)
+
+
+def _run_worker(index, commands, events, client_id, client_kwargs, on_message, setup, stats_interval):
+    try:
+        worker = _Worker(index, commands, events, client_id, client_kwargs, on_message, setup, stats_interval)
+    except Exception as exc:
+        logger.error('[POOL WORKER %s] failed to start', index, exc_info=exc)
+        events.send(('error', index, repr(exc)))
+        commands.close()
+        events.close()
+        return
+    loop = asyncio.new_event_loop()
+    try:
+        loop.run_until_complete(worker.run())
+    finally:
+        # tasks left by the client (reconnect, storage cleanup) are cancelled as asyncio.run does
+        tasks = asyncio.all_tasks(loop)
+        for task in tasks:
+            task.cancel()
+        if tasks:
+            loop.run_until_complete(asyncio.gather(*tasks, return_exceptions=True))
+        loop.close()
+
+
+class _CommandWriter:
+    """Sends commands to the worker pipe without blocking the event loop.
+
+    Commands are framed the same way as multiprocessing.Connection.send does, so the worker reads them with recv;
+    what does not fit into the pipe is written when it is writable again.
+    """
+
+    def __init__(self, conn, loop):
+        self._conn = conn
+        self._fd = conn.fileno()
+        self._loop = loop
+        self._buffer = bytearray()
+        os.set_blocking(self._fd, False)
+
+    @property
+    def buffered(self):
+        # bytes of commands not written to the pipe yet
+        return len(self._buffer)
+
+    def send(self, command):
+        data = ForkingPickler.dumps(command)
+        writing = bool(self._buffer)
+        if len(data) > 0x7fffffff:
+            self._buffer += struct.pack('!iQ', -1, len(data))
+        else:
+            self._buffer += struct.pack('!i', len(data))
+        self._buffer += data
+        if not writing:
+            self._write()
+
+    def _write(self):
+        try:
+            while self._buffer:
+                del self._buffer[:os.write(self._fd, self._buffer)]
+        except BlockingIOError:
+            self._loop.add_writer(self._fd, self._write)
+            return
+        except OSError as exc:
+            # worker is gone (or failed to start), it is reported by the event pipe
+            logger.debug('[POOL] %s bytes of commands are dropped: %r', len(self._buffer), exc)
+            self._buffer.clear()
+        self._loop.remove_writer(self._fd)
+
+    def close(self):
+        self._loop.remove_writer(self._fd)
+        self._conn.close()
+
+
+class WorkerState:
+    def __init__(self, index, client_id):
+        self.index = index
+        self.client_id = client_id
+        self.alive = False
+        self.connected = False
+        self.connects = 0
+        self.disconnects = 0
+        self.in_flight = 0
+        self.error = None
+        # monotonic time of the last event received from the worker
+        self.last_seen = None
+
+    def as_dict(self):
+        return dict(self.__dict__)
+
+
+class ClientPool:
+    """Runs `workers` clients, each one on its own event loop in a separate process (or thread on
+    free-threaded Python builds), so publishing and message callbacks are spread over CPU cores.
+
+    Publishes are sharded by topic hash, so order of messages of one topic is kept. Subscriptions are
+    made by every client as MQTT 5.0 shared subscriptions of `share_group`, so broker spreads messages
+    among the clients. `on_message` and `setup(client, index)` are called in workers, they must be
+    picklable (module level functions) unless threads are used.
+    """
+
+    def __init__(self, client_id, workers=None, on_message=None, setup=None, share_group=None,
+                 use_threads=None, stats_interval=1.0, **client_kwargs):
+        self._client_id = client_id
+        self._workers_count = workers or multiprocessing.cpu_count()
+        self._on_message = on_message
+        self._setup = setup
+        self._share_group = share_group if share_group is not None else client_id
+        self._use_threads = not _gil_enabled() if use_threads is None else use_threads
+        self._stats_interval = stats_interval
+        self._client_kwargs = client_kwargs
+
+        self._username = None
+        self._password = None
+
+        self._workers = []
+        # events are received from the workers and commands are sent to them through separate pipes
+        self._conns = []
+        self._writers = []
+        self._states = [WorkerState(i, self._client_id_of(i)) for i in range(self._workers_count)]
+
+        # publishes are sent to workers in batches once per event loop iteration
+        self._pending = [[] for _ in range(self._workers_count)]
+        self._flush_handle = None
+
+        self._ready_waiters = {}
+        self._stopped_waiters = {}
+
+        self.on_connect = None
+        self.on_disconnect = None
+
+    def _client_id_of(self, index):
+        return '{}-{}'.format(self._client_id, index)
+
+    @property
+    def workers(self):
+        return self._workers_count
+
+    def set_auth_credentials(self, username, password=None):
+        self._username = username
+        self._password = password
+
+    async def connect(self, host, port=1883, ssl=False, keepalive=60, version=MQTTv50, stop_timeout=10):
+        if self._workers:
+            raise RuntimeError('pool is connected already, disconnect it first')
+        loop = asyncio.get_event_loop()
+        connect_kwargs = dict(host=host, port=port, ssl=ssl, keepalive=keepalive, version=version)
+        context = multiprocessing.get_context('spawn')
+        self._ready_waiters = {}
+        self._stopped_waiters = {}
+
+        try:
+            for index in range(self._workers_count):
+                command_reader, command_writer = multiprocessing.Pipe(duplex=False)
+                event_reader, event_writer = multiprocessing.Pipe(duplex=False)
+                args = (index, command_reader, event_writer, self._client_id_of(index), self._client_kwargs,
+                        self._on_message, self._setup, self._stats_interval)
+                if self._use_threads:
+                    worker = threading.Thread(target=_run_worker, args=args, daemon=True)
+                else:
+                    worker = context.Process(target=_run_worker, args=args, daemon=True)
+                worker.start()
+                if not self._use_threads:
+                    command_reader.close()
+                    event_writer.close()
+
+                self._workers.append(worker)
+                self._conns.append(event_reader)
+                self._writers.append(_CommandWriter(command_writer, loop))
+                self._states[index].alive = True
+                self._states[index].error = None
+                self._ready_waiters[index] = loop.create_future()
+                self._stopped_waiters[index] = loop.create_future()
+                loop.add_reader(event_reader.fileno(), self._receive_events, index)
+                self._send(index, ('connect', self._username, self._password, connect_kwargs))
+
+            await asyncio.gather(*self._ready_waiters.values())
+        except BaseException:
+            # workers which are started or connected already are stopped, pool may be connected again
+            await self._stop_workers({}, timeout=stop_timeout)
+            raise
+
+    def _receive_events(self, index):
+        conn = self._conns[index]
+        try:
+            while conn.poll():
+                event, _, *args = conn.recv()
+                self._handle_event(index, event, args)
+        except (OSError, EOFError):
+            self._worker_stopped(index)
+
+    def _handle_event(self, index, event, args):
+        state = self._states[index]
+        state.last_seen = time.monotonic()
+        if event == 'connect':
+            state.connected = True
+            state.connects += 1
+            if self.on_connect is not None:
+                self.on_connect(self, index, *args)
+        elif event == 'disconnect':
+            state.connected = False
+            state.disconnects += 1
+            if self.on_disconnect is not None:
+                self.on_disconnect(self, index)
+        elif event == 'stats':
+            state.connected, state.in_flight = args
+        elif event == 'ready':
+            self._set_waiter(self._ready_waiters, index, None)
+        elif event == 'error':
+            state.error = args[0]
+            self._set_waiter(self._ready_waiters, index, ConnectionError(args[0]))
+        elif event == 'stopped':
+            self._worker_stopped(index)
+
+    @staticmethod
+    def _set_waiter(waiters, index, result):
+        waiter = waiters.get(index)
+        if waiter is None or waiter.done():
+            return
+        if isinstance(result, Exception):
+            waiter.set_exception(result)
+        else:
+            waiter.set_result(result)
+
+    def _worker_stopped(self, index):
+        state = self._states[index]
+        if not state.alive:
+            return
+        state.alive = False
+        state.connected = False
+        asyncio.get_event_loop().remove_reader(self._conns[index].fileno())
+        self._conns[index].close()
+        self._writers[index].close()
+        self._set_waiter(self._ready_waiters, index, ConnectionError('worker {} stopped'.format(index)))
+        self._set_waiter(self._stopped_waiters, index, None)
+
+    def _send(self, index, command):
+        if not self._states[index].alive:
+            logger.warning('[POOL] worker %s is stopped, command %s is dropped', index, command[0])
+            return
+        self._writers[index].send(command)
+
+    def _broadcast(self, command):
+        for index in range(self._workers_count):
+            self._send(index, command)
+
+    def subscribe(self, topic, qos=0, **kwargs):
+        # every client subscribes, broker delivers each message to one of them
+        self._broadcast(('subscribe', shared_topic(topic, self._share_group), qos, kwargs))
+
+    def unsubscribe(self, topic, **kwargs):
+        self._broadcast(('unsubscribe', shared_topic(topic, self._share_group), kwargs))
+
+    def publish(self, topic, payload=None, qos=0, retain=False, **kwargs):
+        index = shard_topic(topic, self._workers_count)
+        self._pending[index].append((topic, payload, qos, retain, kwargs))
+        if self._flush_handle is None:
+            self._flush_handle = asyncio.get_event_loop().call_soon(self.flush)
+
+    def publish_many(self, messages):
+        for message in messages:
+            self.publish(message.topic.decode('utf-8'), message.payload, message.qos, message.retain,
+                         **message.properties)
+
+    def flush(self):
+        if self._flush_handle is not None:
+            self._flush_handle.cancel()
+            self._flush_handle = None
+        for index, messages in enumerate(self._pending):
+            if messages:
+                self._pending[index] = []
+                self._send(index, ('publish_many', messages))
+
+    async def disconnect(self, **kwargs):
+        self.flush()
+        await self._stop_workers(kwargs)
+
+    async def _stop_workers(self, kwargs, timeout=None):
+        # workers stopped already or not started by a failed connect are skipped
+        for index in range(len(self._workers)):
+            if self._states[index].alive:
+                self._writers[index].send(('disconnect', kwargs))
+        if self._stopped_waiters:
+            await asyncio.wait(list(self._stopped_waiters.values()), timeout=timeout)
+        for index, worker in enumerate(self._workers):
+            if self._states[index].alive:
+                logger.warning('[POOL] worker %s does not stop', index)
+                if not self._use_threads:
+                    worker.terminate()
+                self._worker_stopped(index)
+            if worker.is_alive() and self._use_threads:
+                # daemon thread stuck in a callback can not be stopped
+                continue
+            worker.join()
+        self._workers = []
+        self._conns = []
+        self._writers = []
+
+    @property
+    def is_connected(self):
+        return all(state.connected for state in self._states)
+
+    def health(self):
+        return [state.as_dict() for state in self._states]
@@ -1,7 +1,13 @@
 import asyncio
-from typing import Callable, Tuple, Set
+import mmap
+import os
+import struct
+import time
+import zlib
+from typing import Callable, Tuple, Set, Sequence
 
 import heapq
+from collections import OrderedDict
 
 
 class BasePersistentStorage(object):
@@ -11,6 +17,13 @@ class BasePersistentStorage(object):
     def push_message_nowait(self, mid, raw_package) -> asyncio.Future:
         return asyncio.ensure_future(self.push_message(mid, raw_package))
 
+    async def push_messages(self, messages: Sequence[Tuple[int, bytes]]):
+        for mid, raw_package in messages:
+            await self.push_message(mid, raw_package)
+
+    def push_messages_nowait(self, messages: Sequence[Tuple[int, bytes]]) -> asyncio.Future:
+        return asyncio.ensure_future(self.push_messages(messages))
+
     async def pop_message(self) -> Tuple[int, bytes]:
         raise NotImplementedError
 
@@ -32,6 +45,11 @@ class BasePersistentStorage(object):
     async def get_all(self):
         raise NotImplementedError
 
+    def stored_mids(self) -> Sequence[int]:
+        # mids of the messages the storage has when client is created, e.g. recovered after restart;
+        # client reserves them before any new message takes an id
+        return ()
+
 
 class HeapPersistentStorage(BasePersistentStorage):
     def __init__(self):
@@ -50,6 +68,11 @@ class HeapPersistentStorage(BasePersistentStorage):
         tm = asyncio.get_event_loop().time()
         heapq.heappush(self._queue, (tm, mid, raw_package))
 
+    async def push_messages(self, messages):
+        tm = asyncio.get_event_loop().time()
+        for mid, raw_package in messages:
+            heapq.heappush(self._queue, (tm, mid, raw_package))
+
     async def pop_message(self):
         (tm, mid, raw_package) = heapq.heappop(self._queue)
 
@@ -78,4 +101,304 @@ class HeapPersistentStorage(BasePersistentStorage):
         self._notify_waiters(self._empty_waiters, lambda waiter: waiter.set_result(None))
 
     async def get_all(self):
-        return self._queue
\ No newline at end of file
+        return self._queue
+
+    def stored_mids(self):
+        return [mid for _, mid, _ in self._queue]
+
+
+class IndexedPersistentStorage(BasePersistentStorage):
+    """In-memory storage which keeps send order and finds messages by mid in O(1).
+
+    OrderedDict is a hash table on top of a doubly linked list, so push, pop of the oldest message
+    and removal on acknowledgement do not depend on the number of in-flight messages.
+    """
+
+    def __init__(self):
+        self._messages = OrderedDict()
+        self._empty_waiters: Set[asyncio.Future] = set()
+
+    def _notify_empty_waiters(self):
+        while self._empty_waiters:
+            waiter = self._empty_waiters.pop()
+            if not waiter.done():
+                waiter.set_result(None)
+
+    async def push_message(self, mid, raw_package):
+        tm = asyncio.get_event_loop().time()
+        # pushing the same mid again moves message to the end of the queue
+        self._messages.pop(mid, None)
+        self._messages[mid] = (tm, mid, raw_package)
+
+    async def push_messages(self, messages):
+        tm = asyncio.get_event_loop().time()
+        for mid, raw_package in messages:
+            self._messages.pop(mid, None)
+            self._messages[mid] = (tm, mid, raw_package)
+
+    async def pop_message(self):
+        _, (tm, mid, raw_package) = self._messages.popitem(last=False)
+
+        if not self._messages:
+            self._notify_empty_waiters()
+        return mid, raw_package
+
+    async def remove_message_by_mid(self, mid):
+        if self._messages.pop(mid, None) is not None and not self._messages:
+            self._notify_empty_waiters()
+
+    @property
+    async def is_empty(self):
+        return not self._messages
+
+    async def wait_empty(self) -> None:
+        if self._messages:
+            waiter = asyncio.get_running_loop().create_future()
+            self._empty_waiters.add(waiter)
+            await waiter
+
+    async def clear(self):
+        self._messages.clear()
+        self._notify_empty_waiters()
+
+    async def get_all(self):
+        # (tm, mid, raw_package) tuples in send order, view of the storage without copying
+        return self._messages.values()
+
+    def stored_mids(self):
+        return list(self._messages)
+
+
+class _Segment(object):
+    def __init__(self, number, path, size):
+        self.number = number
+        self.path = path
+        self.size = size
+        # write position for the current segment, end of valid records for recovered ones
+        self.offset = 0
+        # qty of bytes taken by push records of not acknowledged messages
+        self.live_bytes = 0
+        self.mmap = None
+
+    def open(self):
+        with open(self.path, 'w+b') as f:
+            f.truncate(self.size)
+            self.mmap = mmap.mmap(f.fileno(), self.size)
+
+    def close(self, sync=False):
+        if self.mmap is not None:
+            if sync:
+                self.mmap.flush()
+            self.mmap.close()
+            self.mmap = None
+
+
+class SegmentLogPersistentStorage(IndexedPersistentStorage):
+    """Durable storage, survives process restart.
+
+    Messages are kept in memory the same way as IndexedPersistentStorage does, every change is also appended
+    to memory-mapped segment files in the `path` directory. Record is a header (crc32, kind, mid, seq, size)
+    followed by raw package; acknowledgements are written as tombstones. On start storage scans segments
+    and restores not acknowledged messages in send order, scan stops on the first record with wrong
+    checksum, so partially written record is dropped.
+
+    When segment is full writes go to the next one, and while live messages take less than `compact_ratio`
+    of the full segments, the oldest ones are compacted in the background (recovered segments too): live
+    messages are copied to the current segment and the old file is removed. Data is written to the page
+    cache, so it survives process crash; pass `sync=True` to msync every record and survive power loss too.
+    """
+    _header = struct.Struct('<IBHQI')
+    _header_tail = struct.Struct('<BHQI')
+    _push, _ack = 1, 2
+    _suffix = '.seg'
+
+    def __init__(self, path, segment_size=16 * 2**20, compact_ratio=0.5, sync=False):
+        super(SegmentLogPersistentStorage, self).__init__()
+        self._path = path
+        self._segment_size = segment_size
+        self._compact_ratio = compact_ratio
+        self._sync = sync
+        self._segments = OrderedDict()
+        # mid -> (segment number, seq, record size) of live push records
+        self._records = {}
+        self._seq = 0
+        self._compact_handle = None
+        # compaction is asked for while there is no running loop to do it
+        self._compact_deferred = False
+
+        os.makedirs(path, exist_ok=True)
+        self._recover()
+        self._current = self._new_segment(self._segment_size)
+        # segments left sparse by the previous run are compacted as well
+        self._schedule_compaction()
+
+    def _segment_path(self, number):
+        return os.path.join(self._path, '{:020d}{}'.format(number, self._suffix))
+
+    def _new_segment(self, size):
+        number = next(reversed(self._segments), 0) + 1
+        segment = _Segment(number, self._segment_path(number), size)
+        segment.open()
+        self._segments[number] = segment
+        return segment
+
+    def _read_segment(self, segment, messages):
+        with open(segment.path, 'rb') as f:
+            if os.fstat(f.fileno()).st_size == 0:
+                return
+            with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as data:
+                segment.size = len(data)
+                offset = 0
+                while offset + self._header.size <= segment.size:
+                    crc, kind, mid, seq, size = self._header.unpack_from(data, offset)
+                    end = offset + self._header.size + size
+                    if end > segment.size:
+                        break
+                    package = data[offset + self._header.size:end]
+                    if crc != zlib.crc32(package, zlib.crc32(data[offset + 4:offset + self._header.size])):
+                        break
+
+                    if kind == self._push:
+                        messages[mid] = (seq, package, segment.number, end - offset)
+                    elif kind == self._ack:
+                        messages.pop(mid, None)
+                    else:
+                        break
+                    offset = end
+                segment.offset = offset
+
+    def _recover(self):
+        numbers = sorted(int(name[:-len(self._suffix)]) for name in os.listdir(self._path)
+                         if name.endswith(self._suffix) and name[:-len(self._suffix)].isdigit())
+        messages = {}
+        for number in numbers:
+            segment = _Segment(number, self._segment_path(number), 0)
+            self._segments[number] = segment
+            self._read_segment(segment, messages)
+
+        tm = time.monotonic()
+        for mid, (seq, package, number, size) in sorted(messages.items(), key=lambda item: item[1][0]):
+            self._messages[mid] = (tm, mid, package)
+            self._records[mid] = (number, seq, size)
+            self._segments[number].live_bytes += size
+            self._seq = seq + 1
+        self._drop_dead_segments(keep=0)
+
+    def _drop_dead_segments(self, keep=1):
+        # tombstones may refer to records in older segments, so only the oldest segments are removed
+        while len(self._segments) > keep:
+            segment = next(iter(self._segments.values()))
+            if segment.live_bytes:
+                break
+            self._remove_segment(segment)
+
+    def _remove_segment(self, segment):
+        segment.close(sync=False)
+        del self._segments[segment.number]
+        os.remove(segment.path)
+
+    def _append(self, kind, mid, seq, package=b''):
+        if self._compact_deferred:
+            self._schedule_compaction()
+        size = self._header.size + len(package)
+        segment = self._current
+        if segment.offset + size > segment.size:
+            segment.close(self._sync)
+            segment = self._current = self._new_segment(max(self._segment_size, size))
+            self._schedule_compaction()
+
+        offset = segment.offset
+        crc = zlib.crc32(package, zlib.crc32(self._header_tail.pack(kind, mid, seq, len(package))))
+        # header is written after the package, record is not valid until checksum is in place
+        segment.mmap[offset + self._header.size:offset + size] = package
+        self._header.pack_into(segment.mmap, offset, crc, kind, mid, seq, len(package))
+        segment.offset = offset + size
+        if self._sync:
+            page_offset = offset - offset % mmap.PAGESIZE
+            segment.mmap.flush(page_offset, segment.offset - page_offset)
+        return segment, size
+
+    def _forget(self, mid):
+        record = self._records.pop(mid, None)
+        if record is not None:
+            number, _, size = record
+            self._segments[number].live_bytes -= size
+
+    def _write_message(self, mid, raw_package, seq):
+        self._forget(mid)
+        segment, size = self._append(self._push, mid, seq, raw_package)
+        self._records[mid] = (segment.number, seq, size)
+        segment.live_bytes += size
+
+    def _write_ack(self, mid):
+        if mid in self._records:
+            self._append(self._ack, mid, 0)
+            self._forget(mid)
+
+    def _schedule_compaction(self):
+        if self._compact_handle is not None:
+            return
+        try:
+            loop = asyncio.get_running_loop()
+        except RuntimeError:
+            # storage is created before the loop is running, compaction starts with the first write
+            self._compact_deferred = True
+            return
+        self._compact_deferred = False
+        self._compact_handle = loop.call_soon(self._compact)
+
+    def _compact(self):
+        # compacts one segment per loop iteration to not block the loop for long
+        self._compact_handle = None
+        self._drop_dead_segments()
+        if len(self._segments) < 2:
+            return
+
+        # the oldest segment is rewritten even if it is dense itself, otherwise it blocks removal of the rest
+        closed = list(self._segments.values())[:-1]
+        if sum(segment.live_bytes for segment in closed) > sum(segment.size for segment in closed) * self._compact_ratio:
+            return
+
+        segment = closed[0]
+
+        for mid, (number, seq, _) in list(self._records.items()):
+            if number == segment.number:
+                # the copy keeps original seq, so recovery restores the same send order
+                self._write_message(mid, self._messages[mid][2], seq)
+        self._remove_segment(segment)
+        self._schedule_compaction()
+
+    async def push_message(self, mid, raw_package):
+        self._write_message(mid, raw_package, self._seq)
+        self._seq += 1
+        await super(SegmentLogPersistentStorage, self).push_message(mid, raw_package)
+
+    async def push_messages(self, messages):
+        messages = list(messages)
+        for mid, raw_package in messages:
+            self._write_message(mid, raw_package, self._seq)
+            self._seq += 1
+        await super(SegmentLogPersistentStorage, self).push_messages(messages)
+
+    async def pop_message(self):
+        mid, raw_package = await super(SegmentLogPersistentStorage, self).pop_message()
+        self._write_ack(mid)
+        return mid, raw_package
+
+    async def remove_message_by_mid(self, mid):
+        self._write_ack(mid)
+        await super(SegmentLogPersistentStorage, self).remove_message_by_mid(mid)
+
+    async def clear(self):
+        for segment in list(self._segments.values()):
+            self._remove_segment(segment)
+        self._records.clear()
+        self._current = self._new_segment(self._segment_size)
+        await super(SegmentLogPersistentStorage, self).clear()
+
+    def close(self):
+        if self._compact_handle is not None:
+            self._compact_handle.cancel()
+            self._compact_handle = None
+        for segment in self._segments.values():
+            segment.close(self._sync)
@@ -1,6 +1,9 @@
 #include <Python.h>
 #include <stdbool.h>
 #include <arpa/inet.h>
+#ifdef GMQTT_ZLIB
+#include <zlib.h>
+#endif
 
 
 /**
@@ -72,89 +75,314 @@ static const char *mqtt_property[] =
 };
 
 
-/// String validation on utf8 encoding
-static int32_t validate_utf8(const char *str, int32_t len)
+/// Validate one UTF-8 encoded character
+/// return its size or zero if it is invalid, U+0000 is invalid unless allow_null is set
+static inline int32_t utf8_char_size(const uint8_t *ustr, Py_ssize_t len, bool allow_null)
 {
-    int32_t i;
-    int32_t j;
     int32_t codelen;
     int32_t codepoint;
-    const unsigned char *ustr = (const unsigned char *)str;
-
-    if(!str)
-        return -1;
-    if(len < 0 || len > 65536)
-        return -1;
+    int32_t j;
 
-    for(i = 0; i < len; i++) {
-        if(ustr[i] == 0) {
-            return -1;
-        } else if (ustr[i] <= 0x7f) {
-            codelen = 1;
-            codepoint = ustr[i];
-        } else if((ustr[i] & 0xE0) == 0xC0) {
-            // 110xxxxx - 2 byte sequence
-            if(ustr[i] == 0xC0 || ustr[i] == 0xC1) {
-                // invalid bytes
-                return -1;
-            }
-            codelen = 2;
-            codepoint = (ustr[i] & 0x1F);
-        } else if((ustr[i] & 0xF0) == 0xE0) {
-            // 1110xxxx - 3 byte sequence
-            codelen = 3;
-            codepoint = (ustr[i] & 0x0F);
-        } else if((ustr[i] & 0xF8) == 0xF0) {
-            // 11110xxx - 4 byte sequence
-            if(ustr[i] > 0xF4) {
-                // invalid, this would produce values > 0x10FFFF
-                return -1;
-            }
-            codelen = 4;
-            codepoint = (ustr[i] & 0x07);
-        } else {
-            // unexpected continuation byte
-            return -1;
+    if (ustr[0] == 0) {
+        return allow_null ? 1 : 0;
+    } else if (ustr[0] <= 0x7f) {
+        return 1;
+    } else if ((ustr[0] & 0xE0) == 0xC0) {
+        // 110xxxxx - 2 byte sequence
+        if (ustr[0] == 0xC0 || ustr[0] == 0xC1) {
+            // overlong encoding
+            return 0;
+        }
+        codelen = 2;
+        codepoint = (ustr[0] & 0x1F);
+    } else if ((ustr[0] & 0xF0) == 0xE0) {
+        // 1110xxxx - 3 byte sequence
+        codelen = 3;
+        codepoint = (ustr[0] & 0x0F);
+    } else if ((ustr[0] & 0xF8) == 0xF0) {
+        // 11110xxx - 4 byte sequence
+        if (ustr[0] > 0xF4) {
+            // invalid, this would produce values > 0x10FFFF
+            return 0;
         }
+        codelen = 4;
+        codepoint = (ustr[0] & 0x07);
+    } else {
+        // unexpected continuation byte
+        return 0;
+    }
 
-        // ueconstruct full code point
-        if(i == len-codelen+1){
-            // not enough data
-            return -1;
+    if (len < codelen) {
+        // not enough data
+        return 0;
+    }
+    // reconstruct full code point
+    for (j = 1; j < codelen; j++) {
+        if ((ustr[j] & 0xC0) != 0x80) {
+            // not a continuation byte
+            return 0;
         }
-        for(j=0; j<codelen-1; j++) {
-            if((ustr[++i] & 0xC0) != 0x80) {
-                // not a continuation byte
-                return -1;
+        codepoint = (codepoint << 6) | (ustr[j] & 0x3F);
+    }
+
+    // check for UTF-16 high/low surrogates
+    if (codepoint >= 0xD800 && codepoint <= 0xDFFF)
+        return 0;
+    // check for overlong or out of range encodings
+    if (codelen == 3 && codepoint < 0x0800)
+        return 0;
+    if (codelen == 4 && (codepoint < 0x10000 || codepoint > 0x10FFFF))
+        return 0;
+
+    return codelen;
+}
+
+/// String validation on utf8 encoding, skips ASCII by 8 bytes words
+/// return zero for valid string
+static int32_t validate_utf8_scalar(const uint8_t *ustr, Py_ssize_t len, bool allow_null)
+{
+    Py_ssize_t i = 0;
+    int32_t codelen;
+    uint64_t word;
+
+    while (i < len) {
+        if (i + 8 <= len) {
+            memcpy(&word, ustr + i, 8);
+            // no high bits set and (if needed) no zero bytes
+            if (!(word & 0x8080808080808080ULL) &&
+                    (allow_null || !((word - 0x0101010101010101ULL) & ~word & 0x8080808080808080ULL))) {
+                i += 8;
+                continue;
             }
-            codepoint = (codepoint<<6) | (ustr[i] & 0x3F);
         }
-
-        // check for UTF-16 high/low surrogates
-        if(codepoint >= 0xD800 && codepoint <= 0xDFFF) {
+        codelen = utf8_char_size(ustr + i, len - i, allow_null);
+        if (!codelen)
             return -1;
-        }
+        i += codelen;
+    }
+    return 0;
+}
 
-        // check for overlong or out of range encodings
-        if(codelen == 3 && codepoint < 0x0800) {
-            return -1;
-        } else if(codelen == 4 && (codepoint < 0x10000 || codepoint > 0x10FFFF)) {
-            return -1;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define GMQTT_X86_SIMD 1
+
+// Vectorized validation classifies every pair of adjacent bytes with three 16 entries lookup tables
+// (high nibble of previous byte, low nibble of previous byte, high nibble of current byte), error bits
+// which survive AND of the three lookups mean invalid pair. See "Validating UTF-8 In Less Than One
+// Instruction Per Byte", J. Keiser, D. Lemire.
+#define UTF8_TOO_SHORT      (1 << 0)            // 11______ 0_______ or 11______ 11______
+#define UTF8_TOO_LONG       (1 << 1)            // 0_______ 10______
+#define UTF8_OVERLONG_3     (1 << 2)            // 11100000 100_____
+#define UTF8_TOO_LARGE      (1 << 3)            // 11110100 1001____ and above
+#define UTF8_SURROGATE      (1 << 4)            // 11101101 101_____
+#define UTF8_OVERLONG_2     (1 << 5)            // 1100000_ 10______
+#define UTF8_TOO_LARGE_1000 (1 << 6)            // 11110101 1000____ and above
+#define UTF8_OVERLONG_4     (1 << 6)            // 11110000 1000____
+#define UTF8_TWO_CONTS      (1 << 7)            // 10______ 10______
+#define UTF8_CARRY          (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+#define UTF8_BYTE_1_HIGH \
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, \
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, \
+    UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, \
+    UTF8_TOO_SHORT | UTF8_OVERLONG_2, \
+    UTF8_TOO_SHORT, \
+    UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE, \
+    UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+
+#define UTF8_BYTE_1_LOW \
+    UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4, \
+    UTF8_CARRY | UTF8_OVERLONG_2, \
+    UTF8_CARRY, \
+    UTF8_CARRY, \
+    UTF8_CARRY | UTF8_TOO_LARGE, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+
+#define UTF8_BYTE_2_HIGH \
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, \
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, \
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4, \
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE, \
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE, \
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE, \
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+
+// lead bytes above these values at the end of a block start an unfinished sequence
+static const uint8_t utf8_incomplete_max_16[16] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xF0 - 1, 0xE0 - 1, 0xC0 - 1
+};
+static const uint8_t utf8_incomplete_max_32[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xF0 - 1, 0xE0 - 1, 0xC0 - 1
+};
+
+/// Check 16 bytes block against previous one
+__attribute__((target("ssse3")))
+static inline __m128i utf8_check_block_ssse3(__m128i input, __m128i prev_input)
+{
+    const __m128i byte_1_high_table = _mm_setr_epi8(UTF8_BYTE_1_HIGH);
+    const __m128i byte_1_low_table = _mm_setr_epi8(UTF8_BYTE_1_LOW);
+    const __m128i byte_2_high_table = _mm_setr_epi8(UTF8_BYTE_2_HIGH);
+    const __m128i low_nibble = _mm_set1_epi8(0x0F);
+
+    __m128i prev1 = _mm_alignr_epi8(input, prev_input, 16 - 1);
+    __m128i prev2 = _mm_alignr_epi8(input, prev_input, 16 - 2);
+    __m128i prev3 = _mm_alignr_epi8(input, prev_input, 16 - 3);
+
+    __m128i byte_1_high = _mm_shuffle_epi8(byte_1_high_table, _mm_and_si128(_mm_srli_epi16(prev1, 4), low_nibble));
+    __m128i byte_1_low = _mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(prev1, low_nibble));
+    __m128i byte_2_high = _mm_shuffle_epi8(byte_2_high_table, _mm_and_si128(_mm_srli_epi16(input, 4), low_nibble));
+    __m128i special = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+    // third and fourth bytes of 3 and 4 bytes sequences must be continuations
+    __m128i is_third_byte = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80)));
+    __m128i is_fourth_byte = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80)));
+    __m128i must23_80 = _mm_and_si128(_mm_or_si128(is_third_byte, is_fourth_byte), _mm_set1_epi8((char)0x80));
+
+    return _mm_xor_si128(must23_80, special);
+}
+
+/// String validation on utf8 encoding, 16 bytes blocks
+__attribute__((target("ssse3")))
+static int32_t validate_utf8_ssse3(const uint8_t *ustr, Py_ssize_t len, bool allow_null)
+{
+    const __m128i incomplete_max_block = _mm_loadu_si128((const __m128i*)utf8_incomplete_max_16);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i error = zero;                       // accumulated error bits
+    __m128i prev_input = zero;                  // previous block
+    __m128i prev_incomplete = zero;             // previous block ends with unfinished sequence
+    __m128i input;                              // current block
+    uint8_t tail[16];                           // zero padded last block
+    Py_ssize_t i;
+
+    for (i = 0; i < len; i += 16) {
+        if (i + 16 <= len) {
+            input = _mm_loadu_si128((const __m128i*)(ustr + i));
+            if (!allow_null)
+                error = _mm_or_si128(error, _mm_cmpeq_epi8(input, zero));
+        } else {
+            // U+0000 is valid UTF-8 character, so padding does not change result
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, ustr + i, len - i);
+            input = _mm_loadu_si128((const __m128i*)tail);
+            if (!allow_null && memchr(ustr + i, 0, len - i))
+                return -1;
         }
 
-        // check for non-characters
-        if(codepoint >= 0xFDD0 && codepoint <= 0xFDEF) {
-            return -1;
+        if (!_mm_movemask_epi8(input)) {
+            // ASCII block, only unfinished sequence from previous block could be an error
+            error = _mm_or_si128(error, prev_incomplete);
+        } else {
+            error = _mm_or_si128(error, utf8_check_block_ssse3(input, prev_input));
+            prev_incomplete = _mm_subs_epu8(input, incomplete_max_block);
         }
-        if((codepoint & 0xFFFF) == 0xFFFE || (codepoint & 0xFFFF) == 0xFFFF) {
-            return -1;
+        prev_input = input;
+    }
+    error = _mm_or_si128(error, prev_incomplete);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, zero)) == 0xFFFF ? 0 : -1;
+}
+
+/// Check 32 bytes block against previous one
+__attribute__((target("avx2")))
+static inline __m256i utf8_check_block_avx2(__m256i input, __m256i prev_input)
+{
+    const __m256i byte_1_high_table = _mm256_setr_epi8(UTF8_BYTE_1_HIGH, UTF8_BYTE_1_HIGH);
+    const __m256i byte_1_low_table = _mm256_setr_epi8(UTF8_BYTE_1_LOW, UTF8_BYTE_1_LOW);
+    const __m256i byte_2_high_table = _mm256_setr_epi8(UTF8_BYTE_2_HIGH, UTF8_BYTE_2_HIGH);
+    const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+
+    // previous block high lane followed by current block low lane
+    __m256i shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(input, shifted, 16 - 1);
+    __m256i prev2 = _mm256_alignr_epi8(input, shifted, 16 - 2);
+    __m256i prev3 = _mm256_alignr_epi8(input, shifted, 16 - 3);
+
+    __m256i byte_1_high = _mm256_shuffle_epi8(byte_1_high_table,
+                                              _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble));
+    __m256i byte_1_low = _mm256_shuffle_epi8(byte_1_low_table, _mm256_and_si256(prev1, low_nibble));
+    __m256i byte_2_high = _mm256_shuffle_epi8(byte_2_high_table,
+                                              _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    // third and fourth bytes of 3 and 4 bytes sequences must be continuations
+    __m256i is_third_byte = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+    __m256i is_fourth_byte = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+    __m256i must23_80 = _mm256_and_si256(_mm256_or_si256(is_third_byte, is_fourth_byte),
+                                         _mm256_set1_epi8((char)0x80));
+
+    return _mm256_xor_si256(must23_80, special);
+}
+
+/// String validation on utf8 encoding, 32 bytes blocks
+__attribute__((target("avx2")))
+static int32_t validate_utf8_avx2(const uint8_t *ustr, Py_ssize_t len, bool allow_null)
+{
+    const __m256i incomplete_max_block = _mm256_loadu_si256((const __m256i*)utf8_incomplete_max_32);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i error = zero;                       // accumulated error bits
+    __m256i prev_input = zero;                  // previous block
+    __m256i prev_incomplete = zero;             // previous block ends with unfinished sequence
+    __m256i input;                              // current block
+    uint8_t tail[32];                           // zero padded last block
+    Py_ssize_t i;
+
+    for (i = 0; i < len; i += 32) {
+        if (i + 32 <= len) {
+            input = _mm256_loadu_si256((const __m256i*)(ustr + i));
+            if (!allow_null)
+                error = _mm256_or_si256(error, _mm256_cmpeq_epi8(input, zero));
+        } else {
+            // U+0000 is valid UTF-8 character, so padding does not change result
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, ustr + i, len - i);
+            input = _mm256_loadu_si256((const __m256i*)tail);
+            if (!allow_null && memchr(ustr + i, 0, len - i))
+                return -1;
         }
-        // check for control characters
-        if(codepoint <= 0x001F || (codepoint >= 0x007F && codepoint <= 0x009F)) {
-            return -1;
+
+        if (!_mm256_movemask_epi8(input)) {
+            // ASCII block, only unfinished sequence from previous block could be an error
+            error = _mm256_or_si256(error, prev_incomplete);
+        } else {
+            error = _mm256_or_si256(error, utf8_check_block_avx2(input, prev_input));
+            prev_incomplete = _mm256_subs_epu8(input, incomplete_max_block);
         }
+        prev_input = input;
     }
-    return -1;
+    error = _mm256_or_si256(error, prev_incomplete);
+
+    return _mm256_testz_si256(error, error) ? 0 : -1;
+}
+#endif
+
+/// UTF-8 validation kernel, selected on module init
+static int32_t (*validate_utf8_impl)(const uint8_t *, Py_ssize_t, bool) = validate_utf8_scalar;
+static const char *validate_utf8_impl_name = "scalar";
+
+/// String validation on utf8 encoding
+/// return zero for valid string
+static int32_t validate_utf8(const char *str, int32_t len)
+{
+    if (!str)
+        return -1;
+    if (len < 0 || len > 65536)
+        return -1;
+
+    return validate_utf8_impl((const uint8_t *)str, len, false);
 }
 
 /// Unpack varint
@@ -182,47 +410,6 @@ uint64_t fieldset_unpack_uint(const uint8_t *field_value, uint32_t field_size, u
     return value + ((((uint64_t)*ptr) & 0x7F) << bits);
 }
 
-/// Extract string from inside MQTT packet by updating its location in the packet and appending ending zero
-/// modifyies original contents of the packet
-/// checks all sizes and update packet payload and its size accordinally
-/// text: upon successfull return initialized with pointer
-/// str_length: used as output parameter for string length
-/// return zero on success with initialized header
-static int32_t mqtt_extract_string(uint8_t **payload, uint32_t *payload_size, char **text, int32_t max_length, int32_t *str_length)
-{
-    uint16_t length;                            // string length
-
-    if (*payload_size < 2)
-        // not enaugh size for header
-        return -1;
-
-    length = ntohs(*(uint16_t*)(*payload));
-    if (*payload_size < 2 + length || length > max_length)
-        // not enough size for string or incorrect size
-        return -1;
-    
-    *text = malloc(length + 1);
-    if (*text == NULL)
-        return -1;
-    
-    // copy string from payload
-    memcpy(*text, *payload + sizeof(uint16_t), length);
-    // add ending zero
-    ((uint8_t *)(*text))[length] = 0;
-    // validate UTF-8 string
-    if (!validate_utf8((char*)*text, length))
-        return -1;
-    
-    // and update pointers and remaining size
-    *payload = *payload + length + 2;
-    *payload_size -= length + 2;
-    // store string length for future use
-    if (str_length != NULL)
-        *str_length = length;
-
-    return 0;
-}
-
 /// Extract Variable Byte Integer into 4 bytes uint
 static int32_t mqtt_extract_uint(uint8_t **payload, uint32_t *payload_size, uint32_t *value)
 {
@@ -243,246 +430,249 @@ static int32_t mqtt_extract_uint(uint8_t **payload, uint32_t *payload_size, uint
     return 0;
 }
 
-/// Adding a property int to the result dictionary
-static int32_t write_property_int(PyObject *dictObj, uint32_t property_type, uint32_t value)
+/**
+* MetricsObject - connection counters, fixed-slot arrays updated without any allocation.
+* Packets and bytes are counted by packet type, histograms have log2 buckets of microseconds:
+* bucket 0 counts durations below 1us, bucket i counts durations in [2^(i-1), 2^i) us, the last one the rest.
+*/
+#define METRICS_PACKET_TYPES 16
+#define METRICS_HISTOGRAMS 4
+#define METRICS_BUCKETS 32
+
+typedef struct {
+    PyObject_HEAD
+    uint64_t packets_in[METRICS_PACKET_TYPES];
+    uint64_t bytes_in[METRICS_PACKET_TYPES];
+    uint64_t packets_out[METRICS_PACKET_TYPES];
+    uint64_t bytes_out[METRICS_PACKET_TYPES];
+    uint64_t buckets[METRICS_HISTOGRAMS][METRICS_BUCKETS];
+    double sums[METRICS_HISTOGRAMS];            // sum of observed durations in seconds
+} MetricsObject;
+
+static PyTypeObject MetricsType;
+
+static inline void metrics_count_in(MetricsObject *self, uint8_t command, Py_ssize_t size)
 {
-    if (!dictObj)
-        return -1;
-    
-    PyObject* key;                              // python dict key
-    PyObject* listObj;                          // python list object
-    PyObject* uint_val;                         // python unsigned int value
-    
-    // build dictionary key
-    key = PyUnicode_FromString(mqtt_property[property_type]);
-    if (!key)
-       return -1;
-    
-    // data format for unsigned int properties
-    // 'subscription_identifier': [54]
-    if (PyDict_Contains(dictObj, key) == 0) {
-        // new list
-        listObj = PyList_New(0);
-        if (!listObj) {
-            Py_DECREF(key);
-            return -1;
-        }
-        // adding list to dictionary
-        if (PyDict_SetItem(dictObj, key, listObj) != 0) {
-            Py_DECREF(key);
-            Py_DECREF(listObj);
-            return -1;
+    self->packets_in[command >> 4]++;
+    self->bytes_in[command >> 4] += size;
+}
+
+/// Split stream buffer into MQTT frames.
+/// returns tuple (consumed, [(command, offset, length), ...]) where offset points to the packet body,
+/// consumed is -1 in case of malformed remaining length (more than 4 bytes).
+/// Complete frames are counted by the optional Metrics object.
+static PyObject *split_packets(PyObject *self, PyObject *args)
+{
+    Py_buffer view;                             // incoming stream buffer
+    PyObject *metricsObj = Py_None;             // Metrics object or None
+    MetricsObject *metrics = NULL;              // metrics to count frames by
+    PyObject *framesObj;                        // python list of frames
+    PyObject *frameObj;                         // python frame tuple
+    PyObject *result;                           // python result tuple
+    const uint8_t *data;                        // stream data
+    Py_ssize_t data_size;                       // stream data size
+    Py_ssize_t parsed_size = 0;                 // size of complete frames
+    Py_ssize_t header_size;                     // fixed header size
+    Py_ssize_t payload_size;                    // remaining length
+    uint8_t payload_byte;                       // remaining length byte
+    int32_t bits;                               // remaining length shift
+
+    if (!PyArg_ParseTuple(args, "y*|O", &view, &metricsObj))
+        return NULL;
+    if (metricsObj != Py_None) {
+        if (!PyObject_TypeCheck(metricsObj, &MetricsType)) {
+            PyBuffer_Release(&view);
+            PyErr_SetString(PyExc_TypeError, "metrics should be gmqttlib.Metrics or None");
+            return NULL;
         }
-        Py_DECREF(key);
-        Py_DECREF(listObj);
-    } else {
-        listObj = PyDict_GetItem(dictObj, key);
-        Py_DECREF(key);
-        if (!listObj)
-            return -1;
+        metrics = (MetricsObject*)metricsObj;
     }
-    
-    // set value to list
-    uint_val = PyLong_FromLong(value);
-    if (!uint_val)
-        return -1;
-    if (PyList_Insert(listObj, 0, uint_val) != 0) {
-        Py_DECREF(uint_val);
-        return -1;
+
+    framesObj = PyList_New(0);
+    if (!framesObj) {
+        PyBuffer_Release(&view);
+        return NULL;
     }
-    Py_DECREF(uint_val);
-    
-    return 0;
+
+    data = (const uint8_t *)view.buf;
+    data_size = view.len;
+
+    // minimum expected packet size is 2
+    while (data_size - parsed_size >= 2) {
+        // extract remaining length
+        header_size = 1;
+        payload_size = 0;
+        bits = 0;
+        do {
+            if (parsed_size + header_size >= data_size)
+                // not full header
+                goto done;
+            if (header_size > 4) {
+                // remaining length can not be longer than 4 bytes
+                parsed_size = -1;
+                goto done;
+            }
+            payload_byte = data[parsed_size + header_size];
+            payload_size += (Py_ssize_t)(payload_byte & 0x7F) << bits;
+            bits += 7;
+            header_size++;
+        } while (payload_byte & 0x80);
+
+        if (header_size + payload_size > data_size - parsed_size)
+            // not enough data
+            break;
+
+        frameObj = Py_BuildValue("(Bnn)", data[parsed_size], parsed_size + header_size, payload_size);
+        if (!frameObj || PyList_Append(framesObj, frameObj) != 0) {
+            Py_XDECREF(frameObj);
+            Py_DECREF(framesObj);
+            PyBuffer_Release(&view);
+            return NULL;
+        }
+        Py_DECREF(frameObj);
+        if (metrics)
+            metrics_count_in(metrics, data[parsed_size], header_size + payload_size);
+
+        parsed_size += header_size + payload_size;
+    }
+
+done:
+    PyBuffer_Release(&view);
+    result = Py_BuildValue("(nN)", parsed_size, framesObj);
+    return result;
 }
 
-/// Adding a property string to the result dictionary
-static int32_t write_property_string(PyObject *dictObj, uint32_t property_type, const char *first_string, const char *second_string)
+/// Calculate size of the property value which starts at payload
+/// return -1 for unknown property or if there is not enough data
+static int32_t mqtt_property_value_size(uint8_t property_type, const uint8_t *payload, uint32_t payload_size)
 {
-    if (!dictObj || !first_string)
-        return -1;
-    
-    PyObject* key;                              // python dict key
-    PyObject* listObj;                          // python list object
-    PyObject* tupleObj;                         // python tuple object
-    PyObject* str_val;                          // python string value
-    
-    // build dictionary key
-    key = PyUnicode_FromString(mqtt_property[property_type]);
-    if (!key)
-       return -1;
-    
-    if (PyDict_Contains(dictObj, key) == 0) {
-        // new list
-        listObj = PyList_New(0);
-        if (!listObj) {
-            Py_DECREF(key);
-            return -1;
-        }
-        // adding list to dictionary
-        if (PyDict_SetItem(dictObj, key, listObj) != 0) {
-            Py_DECREF(key);
-            Py_DECREF(listObj);
-            return -1;
-        } 
-        Py_DECREF(key);
-        Py_DECREF(listObj);
-    } else {
-        listObj = PyDict_GetItem(dictObj, key);
-        Py_DECREF(key);
-        if (!listObj)
+    uint32_t bytes_read;                        // variable byte integer size
+    uint32_t value_size;                        // property value size
+
+    switch (property_type) {
+        // 1 byte value
+        case mqtt_property_type_pfi:
+        case mqtt_property_type_mqos:
+        case mqtt_property_type_ra:
+        case mqtt_property_type_wsa:
+        case mqtt_property_type_sia:
+        case mqtt_property_type_ssa:
+        case mqtt_property_type_rri:
+        case mqtt_property_type_rpi:
+            value_size = 1;
+        break;
+        // 2 bytes value
+        case mqtt_property_type_ska:
+        case mqtt_property_type_rm:
+        case mqtt_property_type_tam:
+        case mqtt_property_type_ta:
+            value_size = 2;
+        break;
+        // 4 bytes value
+        case mqtt_property_type_pei:
+        case mqtt_property_type_sei:
+        case mqtt_property_type_wdi:
+        case mqtt_property_type_mps:
+            value_size = 4;
+        break;
+        // variable byte integer
+        case mqtt_property_type_si:
+            if (payload_size < 1)
+                return -1;
+            fieldset_unpack_uint(payload, payload_size, &bytes_read);
+            if (bytes_read == 0 || bytes_read > 4)
+                return -1;
+            value_size = bytes_read;
+        break;
+        // utf-8 encoded string or binary data
+        case mqtt_property_type_ct:
+        case mqtt_property_type_rt:
+        case mqtt_property_type_aci:
+        case mqtt_property_type_am:
+        case mqtt_property_type_ri:
+        case mqtt_property_type_sr:
+        case mqtt_property_type_rs:
+        case mqtt_property_type_cd:
+        case mqtt_property_type_ad:
+            if (payload_size < 2)
+                return -1;
+            value_size = 2 + ntohs(*(uint16_t*)payload);
+        break;
+        // utf-8 string pair
+        case mqtt_property_type_up:
+            if (payload_size < 2)
+                return -1;
+            value_size = 2 + ntohs(*(uint16_t*)payload);
+            if (payload_size < value_size + 2)
+                return -1;
+            value_size += 2 + ntohs(*(uint16_t*)(payload + value_size));
+        break;
+        // unknown code
+        default:
             return -1;
     }
-    
-    // data format for string or user properties
-    // 'content_type': ['json']
-    // 'user_property': [('timestamp', '1582024312.256745'), ('cid', '212740'), ('token_id', '245729')]
-    if (property_type == mqtt_property_type_up) {
-        // adding strings to tuple
-        tupleObj = PyTuple_New(2);
-        if (!tupleObj)
-            return -1;
-        str_val = PyUnicode_FromString(first_string);
-        if (!str_val) {
-            Py_DECREF(tupleObj);
-            return -1;
-        }
-        if (PyTuple_SetItem(tupleObj, 0, str_val) != 0) {
-            Py_DECREF(str_val);
-            Py_DECREF(tupleObj);
-            return -1;
-        }
-        str_val = PyUnicode_FromString(second_string);
-        if (!str_val) {
-            Py_DECREF(tupleObj);
-            return -1;
-        }
-        if (PyTuple_SetItem(tupleObj, 1, str_val) != 0) {
-            Py_DECREF(str_val);
-            Py_DECREF(tupleObj);
-            return -1;
-        }
-        // append tuple to list
-        if (PyList_Append(listObj, tupleObj) != 0) {
-            Py_DECREF(tupleObj);
-            return -1;
-        }
-        Py_DECREF(tupleObj);
-    } else {
-        // set string to list
-        str_val = PyUnicode_FromString(first_string);
-        if (!str_val)
-            return -1;
-        if (PyList_Insert(listObj, 0, str_val) != 0) {
-            Py_DECREF(str_val);
+
+    if (value_size > payload_size)
+        return -1;
+    return (int32_t)value_size;
+}
+
+/// Find topic alias in the properties block
+/// return 1 if alias is found, 0 if it is absent and -1 for malformed properties
+static int32_t mqtt_find_topic_alias(const uint8_t *payload, uint32_t payload_size, uint32_t *topic_alias)
+{
+    uint8_t property_type;                      // property type
+    int32_t value_size;                         // property value size
+
+    while (payload_size > 0) {
+        property_type = *payload;
+        value_size = mqtt_property_value_size(property_type, payload + 1, payload_size - 1);
+        if (value_size < 0)
             return -1;
+        if (property_type == mqtt_property_type_ta) {
+            *topic_alias = ntohs(*(uint16_t*)(payload + 1));
+            return 1;
         }
-        Py_DECREF(str_val);
+        payload += 1 + value_size;
+        payload_size -= 1 + value_size;
     }
-    
     return 0;
 }
 
-/// Enumerate properties
-static PyObject *extract_properties(PyObject *bytesObj)
+/// Names of properties mapped to their types, filled on module init
+static PyObject *property_types = NULL;
+/// Interned names of properties, filled on module init
+static PyObject *property_names[mqtt_property_type_ssa + 1];
+
+/**
+* PropertiesObject - lazy MQTT (5 version) properties mapping.
+* Properties block is validated once on creation, values are decoded on the first access.
+*/
+typedef struct {
+    PyObject_HEAD
+    PyObject *raw;                              // properties block without its size
+    PyObject *values;                           // decoded and assigned values, NULL until first one
+    uint64_t pending;                           // types present in raw block and not decoded yet
+} PropertiesObject;
+
+static PyTypeObject PropertiesType;
+
+/// Validate properties block and collect types which are present in it
+/// return zero for valid block
+static int32_t mqtt_validate_properties(const uint8_t *payload, uint32_t payload_size, uint64_t *types)
 {
-    PyObject *dictObj = PyDict_New();
-    if (!dictObj)
-        Py_RETURN_NONE;
-    
-    mqtt_property_type_t property_type;         // property type
-    char *pair_string_value;                    // paired string value
-    char *string_value;                         // decoded string
-    uint32_t properties_size;                   // properties size
-    uint32_t uint_value = 0;                    // decoded uint
-    int32_t property_size;                      // property size
+    uint8_t property_type;                      // property type
+    int32_t value_size;                         // property value size
+    uint32_t first_size;                        // size of the first string of the pair
 
-    uint8_t *payload = (uint8_t*)PyBytes_AsString(bytesObj);
-    uint32_t payload_size = PyBytes_Size(bytesObj);
-    
-    // extract properties size
-    if (mqtt_extract_uint(&payload, &payload_size, &properties_size) == -1) {
-        Py_DECREF(dictObj);
-        Py_RETURN_NONE;
-    }
-    
-    // invalid format
-    if (properties_size > payload_size) {
-        Py_DECREF(dictObj);
-        Py_RETURN_NONE;
-    }
-    // update total payload size
-    payload_size -= properties_size;
-    
-    // parse properties
-    while (properties_size > 1) {
-        // [1b property_type][property data]
+    *types = 0;
+    while (payload_size > 0) {
         property_type = *payload;
-        // shift to property value
-        payload = payload + 1;
-        properties_size -= 1;
+        value_size = mqtt_property_value_size(property_type, payload + 1, payload_size - 1);
+        if (value_size < 0)
+            return -1;
+
         switch (property_type) {
-            // 1 byte value
-            case mqtt_property_type_pfi:
-            case mqtt_property_type_mqos:
-            case mqtt_property_type_ra:
-            case mqtt_property_type_wsa:
-            case mqtt_property_type_sia:
-            case mqtt_property_type_ssa:
-            case mqtt_property_type_rri:
-            case mqtt_property_type_rpi:
-                uint_value = *((uint8_t*)payload);
-                if (write_property_int(dictObj, property_type, uint_value) != 0) {
-                    Py_DECREF(dictObj);
-                    Py_RETURN_NONE;
-                }
-                payload = payload + 1;
-                properties_size -= 1;
-            break;
-            //  2 bytes value
-            case mqtt_property_type_ska:
-            case mqtt_property_type_rm:
-            case mqtt_property_type_tam:
-            case mqtt_property_type_ta:
-                if (properties_size < 2) {
-                    Py_DECREF(dictObj);
-                    Py_RETURN_NONE;
-                }
-                uint_value = ntohs(*((uint16_t*)payload));
-                if (write_property_int(dictObj, property_type, uint_value) != 0) {
-                    Py_DECREF(dictObj);
-                    Py_RETURN_NONE;
-                }
-                payload = payload + 2;
-                properties_size -= 2;
-            break;
-            // 4 bytes value
-            case mqtt_property_type_pei:
-            case mqtt_property_type_sei:
-            case mqtt_property_type_wdi:
-            case mqtt_property_type_mps:
-                if (properties_size < 4) {
-                    Py_DECREF(dictObj);
-                    Py_RETURN_NONE;
-                }
-                uint_value = ntohl(*((uint32_t*)payload));
-                if (write_property_int(dictObj, property_type, uint_value) != 0) {
-                    Py_DECREF(dictObj);
-                    Py_RETURN_NONE;
-                }
-                payload = payload + 4;
-                properties_size -= 4;
-            break;
-            // variable byte integer
-            case mqtt_property_type_si:
-                if (mqtt_extract_uint(&payload, &properties_size, &uint_value) != 0) {
-                    Py_DECREF(dictObj);
-                    Py_RETURN_NONE;
-                }
-                if (write_property_int(dictObj, property_type, uint_value) != 0) {
-                    Py_DECREF(dictObj);
-                    Py_RETURN_NONE;
-                }
-            break;
             // utf-8 encoded string
             case mqtt_property_type_ct:
             case mqtt_property_type_rt:
@@ -491,101 +681,2049 @@ static PyObject *extract_properties(PyObject *bytesObj)
             case mqtt_property_type_ri:
             case mqtt_property_type_sr:
             case mqtt_property_type_rs:
-                // extract string
-                if (mqtt_extract_string(&payload, &properties_size, &string_value, 65535, &property_size) != 0) {
-                    if (string_value)
-                        free(string_value);
-                    Py_DECREF(dictObj);
-                    Py_RETURN_NONE;
-                }
-                if (write_property_string(dictObj, property_type, string_value, NULL) != 0) {
-                    free(string_value);
-                    Py_DECREF(dictObj);
-                    Py_RETURN_NONE;
-                }
-                free(string_value);
+                if (validate_utf8((const char*)payload + 3, value_size - 2) != 0)
+                    return -1;
             break;
             // utf-8 string pair
             case mqtt_property_type_up:
-                // extract first string
-                if (mqtt_extract_string(&payload, &properties_size, &string_value, 65535, &property_size) != 0) {
-                    if (string_value)
-                        free(string_value);
-                    Py_DECREF(dictObj);
-                    Py_RETURN_NONE;
-                }
-                // extract second string
-                if (mqtt_extract_string(&payload, &properties_size, &pair_string_value, 65535, NULL) != 0) {
-                    if (pair_string_value)
-                        free(pair_string_value);
-                    free(string_value);
-                    Py_DECREF(dictObj);
-                    Py_RETURN_NONE;
-                }
-                if (write_property_string(dictObj, property_type, string_value, pair_string_value) != 0) {
-                    free(string_value);
-                    free(pair_string_value);
-                    Py_DECREF(dictObj);
-                    Py_RETURN_NONE;
-                }
-                free(string_value);
-                free(pair_string_value);
-            break;
-            // binary data
-            case mqtt_property_type_cd:
-            case mqtt_property_type_ad:
-                if (properties_size < 2) {
-                    Py_DECREF(dictObj);
-                    Py_RETURN_NONE;
-                }
-                property_size = ntohs(*(uint16_t*)payload);
-                if (property_size + 2 > properties_size) {
-                    Py_DECREF(dictObj);
-                    Py_RETURN_NONE;
-                }
-                properties_size -= 2 + property_size;
-                payload = payload + 2 + property_size;
+                first_size = ntohs(*(uint16_t*)(payload + 1));
+                if (validate_utf8((const char*)payload + 3, first_size) != 0 ||
+                        validate_utf8((const char*)payload + 5 + first_size, value_size - 4 - first_size) != 0)
+                    return -1;
             break;
-            // unknown code
-            default: {
-                Py_DECREF(dictObj);
-                Py_RETURN_NONE;
-            }
         }
+
+        *types |= (uint64_t)1 << property_type;
+        payload += 1 + value_size;
+        payload_size -= 1 + value_size;
     }
-    
-    return dictObj;
+    return 0;
 }
 
-/// Load MQTT (5 version) props.
-static PyObject *prop_loads(PyObject *self, PyObject *args)
+/// Decode property value which starts at payload
+static PyObject *mqtt_decode_property(uint8_t property_type, const uint8_t *payload, int32_t value_size)
 {
-    PyObject *bytesObj;
-    PyObject *dictObj;
+    uint32_t first_size;                        // size of the first string of the pair
 
-    if (!PyArg_ParseTuple(args, "S", &bytesObj))
-        return NULL;
+    switch (property_type) {
+        // utf-8 encoded string
+        case mqtt_property_type_ct:
+        case mqtt_property_type_rt:
+        case mqtt_property_type_aci:
+        case mqtt_property_type_am:
+        case mqtt_property_type_ri:
+        case mqtt_property_type_sr:
+        case mqtt_property_type_rs:
+            return PyUnicode_DecodeUTF8((const char*)payload + 2, value_size - 2, NULL);
+        // utf-8 string pair
+        case mqtt_property_type_up:
+            first_size = ntohs(*(uint16_t*)payload);
+            return Py_BuildValue("(NN)",
+                                 PyUnicode_DecodeUTF8((const char*)payload + 2, first_size, NULL),
+                                 PyUnicode_DecodeUTF8((const char*)payload + 4 + first_size,
+                                                      value_size - 4 - first_size, NULL));
+        // binary data
+        case mqtt_property_type_cd:
+        case mqtt_property_type_ad:
+            return PyBytes_FromStringAndSize((const char*)payload + 2, value_size - 2);
+        // variable byte integer
+        case mqtt_property_type_si:
+            return PyLong_FromUnsignedLong((uint32_t)fieldset_unpack_uint(payload, value_size, NULL));
+    }
 
-    dictObj = extract_properties(bytesObj);
-    
-    return dictObj;
+    // fixed size integers
+    switch (value_size) {
+        case 1:
+            return PyLong_FromLong(*payload);
+        case 2:
+            return PyLong_FromLong(ntohs(*(uint16_t*)payload));
+        default:
+            return PyLong_FromUnsignedLong(ntohl(*(uint32_t*)payload));
+    }
 }
 
-static PyMethodDef ModuleMethods[] = {
-    {"prop_loads", prop_loads, METH_VARARGS, "Load MQTT (5 version) props."},
-    {NULL, NULL, 0, NULL}
-};
+/// Decode all values of the property type into the values dictionary
+/// return zero on success
+static int32_t properties_decode(PropertiesObject *self, uint8_t property_type)
+{
+    const uint8_t *payload = (const uint8_t*)PyBytes_AS_STRING(self->raw);
+    uint32_t payload_size = (uint32_t)PyBytes_GET_SIZE(self->raw);
+    PyObject *listObj;                          // python list of values
+    PyObject *valueObj;                         // python property value
+    int32_t value_size;                         // property value size
 
-static struct PyModuleDef gmqttlibmodule = {
-    PyModuleDef_HEAD_INIT,
-    "gmqttlib",
-    NULL,
-    -1,
-    ModuleMethods
-};
+    if (!self->values) {
+        self->values = PyDict_New();
+        if (!self->values)
+            return -1;
+    }
+    listObj = PyList_New(0);
+    if (!listObj)
+        return -1;
 
-PyMODINIT_FUNC
-PyInit_gmqttlib(void)
+    // block is validated already
+    while (payload_size > 0) {
+        value_size = mqtt_property_value_size(*payload, payload + 1, payload_size - 1);
+        if (*payload == property_type) {
+            valueObj = mqtt_decode_property(property_type, payload + 1, value_size);
+            if (!valueObj || PyList_Append(listObj, valueObj) != 0) {
+                Py_XDECREF(valueObj);
+                Py_DECREF(listObj);
+                return -1;
+            }
+            Py_DECREF(valueObj);
+        }
+        payload += 1 + value_size;
+        payload_size -= 1 + value_size;
+    }
+
+    if (PyDict_SetItem(self->values, property_names[property_type], listObj) != 0) {
+        Py_DECREF(listObj);
+        return -1;
+    }
+    Py_DECREF(listObj);
+    self->pending &= ~((uint64_t)1 << property_type);
+    return 0;
+}
+
+/// Decode all pending properties in order of their appearance
+/// return zero on success
+static int32_t properties_decode_all(PropertiesObject *self)
 {
-    return PyModule_Create(&gmqttlibmodule);
+    const uint8_t *payload = (const uint8_t*)PyBytes_AS_STRING(self->raw);
+    uint32_t payload_size = (uint32_t)PyBytes_GET_SIZE(self->raw);
+    int32_t value_size;                         // property value size
+
+    if (!self->values) {
+        self->values = PyDict_New();
+        if (!self->values)
+            return -1;
+    }
+    while (self->pending && payload_size > 0) {
+        if (self->pending & ((uint64_t)1 << *payload)) {
+            if (properties_decode(self, *payload) != 0)
+                return -1;
+        }
+        value_size = mqtt_property_value_size(*payload, payload + 1, payload_size - 1);
+        payload += 1 + value_size;
+        payload_size -= 1 + value_size;
+    }
+    return 0;
+}
+
+/// Get property type by its name
+/// return -1 if key is not a name of the pending property
+static int32_t properties_pending_type(PropertiesObject *self, PyObject *key)
+{
+    PyObject *typeObj;                          // python property type
+    long property_type;                         // property type
+
+    if (!self->pending || !PyUnicode_Check(key))
+        return -1;
+    typeObj = PyDict_GetItemWithError(property_types, key);
+    if (!typeObj)
+        return -1;
+    property_type = PyLong_AsLong(typeObj);
+    if (!(self->pending & ((uint64_t)1 << property_type)))
+        return -1;
+    return (int32_t)property_type;
+}
+
+/// Find property value
+/// return borrowed reference or NULL, exception is not set for missing key
+static PyObject *properties_lookup(PropertiesObject *self, PyObject *key)
+{
+    PyObject *valueObj;                         // python property value
+    int32_t property_type;                      // property type
+
+    if (self->values) {
+        valueObj = PyDict_GetItemWithError(self->values, key);
+        if (valueObj || PyErr_Occurred())
+            return valueObj;
+    }
+    property_type = properties_pending_type(self, key);
+    if (property_type < 0 || properties_decode(self, property_type) != 0)
+        return NULL;
+    return PyDict_GetItem(self->values, key);
+}
+
+/// Create properties object from block with its size
+/// return None for malformed properties
+static PyObject *extract_properties(uint8_t *payload, uint32_t payload_size)
+{
+    PropertiesObject *self;                     // properties object
+    uint32_t properties_size;                   // properties size
+    uint64_t types;                             // types present in the block
+
+    // extract properties size
+    if (mqtt_extract_uint(&payload, &payload_size, &properties_size) == -1 || properties_size > payload_size)
+        Py_RETURN_NONE;
+    if (mqtt_validate_properties(payload, properties_size, &types) != 0)
+        Py_RETURN_NONE;
+
+    self = PyObject_GC_New(PropertiesObject, &PropertiesType);
+    if (!self)
+        return NULL;
+    self->values = NULL;
+    self->pending = types;
+    self->raw = PyBytes_FromStringAndSize((const char*)payload, properties_size);
+    if (!self->raw) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    PyObject_GC_Track(self);
+
+    return (PyObject*)self;
+}
+
+static int properties_traverse(PropertiesObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->values);
+    return 0;
+}
+
+static int properties_clear(PropertiesObject *self)
+{
+    Py_CLEAR(self->values);
+    return 0;
+}
+
+static void properties_dealloc(PropertiesObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    Py_XDECREF(self->raw);
+    Py_XDECREF(self->values);
+    PyObject_GC_Del(self);
+}
+
+static Py_ssize_t properties_length(PropertiesObject *self)
+{
+    return __builtin_popcountll(self->pending) + (self->values ? PyDict_GET_SIZE(self->values) : 0);
+}
+
+static PyObject *properties_subscript(PropertiesObject *self, PyObject *key)
+{
+    PyObject *valueObj = properties_lookup(self, key);
+
+    if (!valueObj) {
+        if (!PyErr_Occurred())
+            PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+    Py_INCREF(valueObj);
+    return valueObj;
+}
+
+static int properties_ass_subscript(PropertiesObject *self, PyObject *key, PyObject *valueObj)
+{
+    int32_t property_type = properties_pending_type(self, key);
+
+    if (PyErr_Occurred())
+        return -1;
+    // assigned value replaces raw one
+    if (property_type >= 0)
+        self->pending &= ~((uint64_t)1 << property_type);
+
+    if (valueObj) {
+        if (!self->values) {
+            self->values = PyDict_New();
+            if (!self->values)
+                return -1;
+        }
+        return PyDict_SetItem(self->values, key, valueObj);
+    }
+    if (self->values && PyDict_Contains(self->values, key) == 1)
+        return PyDict_DelItem(self->values, key);
+    if (property_type >= 0)
+        return 0;
+    if (!PyErr_Occurred())
+        PyErr_SetObject(PyExc_KeyError, key);
+    return -1;
+}
+
+static int properties_contains(PropertiesObject *self, PyObject *key)
+{
+    int result;
+
+    if (self->values) {
+        result = PyDict_Contains(self->values, key);
+        if (result != 0)
+            return result;
+    }
+    if (properties_pending_type(self, key) >= 0)
+        return 1;
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+static PyObject *properties_iter(PropertiesObject *self)
+{
+    if (properties_decode_all(self) != 0)
+        return NULL;
+    return PyObject_GetIter(self->values);
+}
+
+static PyObject *properties_richcompare(PropertiesObject *self, PyObject *other, int op)
+{
+    if (op != Py_EQ && op != Py_NE)
+        Py_RETURN_NOTIMPLEMENTED;
+    if (properties_decode_all(self) != 0)
+        return NULL;
+    if (PyObject_TypeCheck(other, &PropertiesType)) {
+        if (properties_decode_all((PropertiesObject*)other) != 0)
+            return NULL;
+        other = ((PropertiesObject*)other)->values;
+    }
+    return PyObject_RichCompare(self->values, other, op);
+}
+
+static PyObject *properties_repr(PropertiesObject *self)
+{
+    if (properties_decode_all(self) != 0)
+        return NULL;
+    return PyObject_Repr(self->values);
+}
+
+static PyObject *properties_get(PropertiesObject *self, PyObject *args)
+{
+    PyObject *key;                              // python property name
+    PyObject *defaultObj = Py_None;             // python default value
+    PyObject *valueObj;                         // python property value
+
+    if (!PyArg_ParseTuple(args, "O|O", &key, &defaultObj))
+        return NULL;
+    valueObj = properties_lookup(self, key);
+    if (!valueObj) {
+        if (PyErr_Occurred())
+            return NULL;
+        valueObj = defaultObj;
+    }
+    Py_INCREF(valueObj);
+    return valueObj;
+}
+
+static PyObject *properties_pop(PropertiesObject *self, PyObject *args)
+{
+    PyObject *key;                              // python property name
+    PyObject *defaultObj = NULL;                // python default value
+    PyObject *valueObj;                         // python property value
+
+    if (!PyArg_ParseTuple(args, "O|O", &key, &defaultObj))
+        return NULL;
+    valueObj = properties_lookup(self, key);
+    if (!valueObj) {
+        if (PyErr_Occurred())
+            return NULL;
+        if (!defaultObj) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            return NULL;
+        }
+        Py_INCREF(defaultObj);
+        return defaultObj;
+    }
+    Py_INCREF(valueObj);
+    if (PyDict_DelItem(self->values, key) != 0) {
+        Py_DECREF(valueObj);
+        return NULL;
+    }
+    return valueObj;
+}
+
+/// Plain dictionary with all properties decoded
+static PyObject *properties_copy(PropertiesObject *self, PyObject *Py_UNUSED(args))
+{
+    if (properties_decode_all(self) != 0)
+        return NULL;
+    return PyDict_Copy(self->values);
+}
+
+static PyObject *properties_keys(PropertiesObject *self, PyObject *Py_UNUSED(args))
+{
+    if (properties_decode_all(self) != 0)
+        return NULL;
+    return PyObject_CallMethod(self->values, "keys", NULL);
+}
+
+static PyObject *properties_values(PropertiesObject *self, PyObject *Py_UNUSED(args))
+{
+    if (properties_decode_all(self) != 0)
+        return NULL;
+    return PyObject_CallMethod(self->values, "values", NULL);
+}
+
+static PyObject *properties_items(PropertiesObject *self, PyObject *Py_UNUSED(args))
+{
+    if (properties_decode_all(self) != 0)
+        return NULL;
+    return PyObject_CallMethod(self->values, "items", NULL);
+}
+
+/// Pickled and deep copied as plain dictionary
+static PyObject *properties_reduce(PropertiesObject *self, PyObject *Py_UNUSED(args))
+{
+    if (properties_decode_all(self) != 0)
+        return NULL;
+    return Py_BuildValue("(O(O))", &PyDict_Type, self->values);
+}
+
+static PyMethodDef PropertiesMethods[] = {
+    {"get", (PyCFunction)properties_get, METH_VARARGS, "Get property values or default."},
+    {"pop", (PyCFunction)properties_pop, METH_VARARGS, "Remove property and return its values."},
+    {"copy", (PyCFunction)properties_copy, METH_NOARGS, "Decode all properties into dictionary."},
+    {"keys", (PyCFunction)properties_keys, METH_NOARGS, "Names of properties."},
+    {"values", (PyCFunction)properties_values, METH_NOARGS, "Values of properties."},
+    {"items", (PyCFunction)properties_items, METH_NOARGS, "Pairs of names and values of properties."},
+    {"__reduce__", (PyCFunction)properties_reduce, METH_NOARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMappingMethods PropertiesMapping = {
+    (lenfunc)properties_length,
+    (binaryfunc)properties_subscript,
+    (objobjargproc)properties_ass_subscript
+};
+
+static PySequenceMethods PropertiesSequence = {
+    .sq_contains = (objobjproc)properties_contains
+};
+
+static PyTypeObject PropertiesType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gmqttlib.Properties",
+    .tp_doc = "MQTT (5 version) properties decoded on access.",
+    .tp_basicsize = sizeof(PropertiesObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_dealloc = (destructor)properties_dealloc,
+    .tp_traverse = (traverseproc)properties_traverse,
+    .tp_clear = (inquiry)properties_clear,
+    .tp_repr = (reprfunc)properties_repr,
+    .tp_as_mapping = &PropertiesMapping,
+    .tp_as_sequence = &PropertiesSequence,
+    .tp_iter = (getiterfunc)properties_iter,
+    .tp_richcompare = (richcmpfunc)properties_richcompare,
+    .tp_methods = PropertiesMethods,
+    .tp_hash = PyObject_HashNotImplemented,
+};
+
+/// Load MQTT (5 version) props.
+static PyObject *prop_loads(PyObject *self, PyObject *args)
+{
+    Py_buffer view;
+    PyObject *propertiesObj;
+
+    if (!PyArg_ParseTuple(args, "y*", &view))
+        return NULL;
+
+    propertiesObj = extract_properties((uint8_t*)view.buf, (uint32_t)view.len);
+    PyBuffer_Release(&view);
+
+    return propertiesObj;
+}
+
+#ifdef GMQTT_ZLIB
+/// Raise ValueError with zlib stream message
+static PyObject *zlib_error(z_stream *stream, int rc, const char *what)
+{
+    PyErr_Format(PyExc_ValueError, "%s failed: %s (%d)", what, stream->msg ? stream->msg : "error", rc);
+    return NULL;
+}
+
+/// Compress payload into zlib stream, preset dictionary is used if given.
+/// GIL is released while payloads of at least nogil_threshold bytes are compressed
+static PyObject *deflate_payload(PyObject *self, PyObject *args)
+{
+    Py_buffer data;                             // payload buffer
+    Py_buffer dictionary = {NULL};              // preset dictionary buffer
+    int level = Z_DEFAULT_COMPRESSION;          // compression level
+    Py_ssize_t nogil_threshold = 65536;         // payload size to release GIL from
+    z_stream stream;                            // zlib stream
+    int rc;                                     // zlib result
+    PyObject *result = NULL;                    // python compressed payload
+
+    if (!PyArg_ParseTuple(args, "y*|iz*n", &data, &level, &dictionary, &nogil_threshold))
+        return NULL;
+
+    if (data.len > UINT32_MAX || dictionary.len > UINT32_MAX) {
+        PyErr_SetString(PyExc_ValueError, "payload is too large");
+        goto error;
+    }
+
+    memset(&stream, 0, sizeof(stream));
+    rc = deflateInit(&stream, level);
+    if (rc != Z_OK) {
+        zlib_error(&stream, rc, "deflateInit");
+        goto error;
+    }
+    if (dictionary.buf && dictionary.len) {
+        rc = deflateSetDictionary(&stream, (const Bytef*)dictionary.buf, (uInt)dictionary.len);
+        if (rc != Z_OK) {
+            zlib_error(&stream, rc, "deflateSetDictionary");
+            deflateEnd(&stream);
+            goto error;
+        }
+    }
+
+    result = PyBytes_FromStringAndSize(NULL, deflateBound(&stream, (uLong)data.len));
+    if (!result) {
+        deflateEnd(&stream);
+        goto error;
+    }
+    stream.next_in = (Bytef*)data.buf;
+    stream.avail_in = (uInt)data.len;
+    stream.next_out = (Bytef*)PyBytes_AS_STRING(result);
+    stream.avail_out = (uInt)PyBytes_GET_SIZE(result);
+
+    // output has deflateBound bytes, so the stream is finished in one call
+    if (data.len >= nogil_threshold) {
+        Py_BEGIN_ALLOW_THREADS
+        rc = deflate(&stream, Z_FINISH);
+        Py_END_ALLOW_THREADS
+    } else {
+        rc = deflate(&stream, Z_FINISH);
+    }
+    if (rc != Z_STREAM_END) {
+        zlib_error(&stream, rc, "deflate");
+        deflateEnd(&stream);
+        Py_CLEAR(result);
+        goto error;
+    }
+    deflateEnd(&stream);
+    _PyBytes_Resize(&result, (Py_ssize_t)stream.total_out);
+
+error:
+    PyBuffer_Release(&data);
+    if (dictionary.buf)
+        PyBuffer_Release(&dictionary);
+    return result;
+}
+
+/// Decompress zlib stream made by deflate_payload, raise ValueError for malformed stream,
+/// wrong dictionary or payload larger than max_size bytes.
+/// GIL is released while payloads of at least nogil_threshold bytes are decompressed
+static PyObject *inflate_payload(PyObject *self, PyObject *args)
+{
+    Py_buffer data;                             // compressed payload buffer
+    Py_buffer dictionary = {NULL};              // preset dictionary buffer
+    Py_ssize_t max_size = 268435455;            // the largest decompressed payload
+    Py_ssize_t nogil_threshold = 65536;         // compressed payload size to release GIL from
+    Py_ssize_t capacity;                        // size of output buffer
+    bool nogil;                                 // release GIL around inflate calls
+    z_stream stream;                            // zlib stream
+    int rc;                                     // zlib result
+    PyObject *result = NULL;                    // python decompressed payload
+
+    if (!PyArg_ParseTuple(args, "y*|z*nn", &data, &dictionary, &max_size, &nogil_threshold))
+        return NULL;
+
+    if (data.len > UINT32_MAX || max_size < 0 || max_size >= UINT32_MAX) {
+        PyErr_SetString(PyExc_ValueError, "payload or max_size is too large");
+        goto error;
+    }
+    nogil = data.len >= nogil_threshold;
+
+    memset(&stream, 0, sizeof(stream));
+    rc = inflateInit(&stream);
+    if (rc != Z_OK) {
+        zlib_error(&stream, rc, "inflateInit");
+        goto error;
+    }
+
+    // one byte over max_size tells payload is too large, the buffer is doubled when it is full
+    capacity = data.len > 256 ? data.len * 4 : 1024;
+    if (capacity > max_size + 1)
+        capacity = max_size + 1;
+    result = PyBytes_FromStringAndSize(NULL, capacity);
+    if (!result)
+        goto end;
+    stream.next_in = (Bytef*)data.buf;
+    stream.avail_in = (uInt)data.len;
+    stream.next_out = (Bytef*)PyBytes_AS_STRING(result);
+    stream.avail_out = (uInt)capacity;
+
+    while (1) {
+        if (nogil) {
+            Py_BEGIN_ALLOW_THREADS
+            rc = inflate(&stream, Z_NO_FLUSH);
+            Py_END_ALLOW_THREADS
+        } else {
+            rc = inflate(&stream, Z_NO_FLUSH);
+        }
+
+        if (rc == Z_NEED_DICT) {
+            if (!dictionary.buf || !dictionary.len) {
+                PyErr_SetString(PyExc_ValueError, "payload is compressed with dictionary");
+                goto fail;
+            }
+            rc = inflateSetDictionary(&stream, (const Bytef*)dictionary.buf, (uInt)dictionary.len);
+            if (rc != Z_OK) {
+                PyErr_SetString(PyExc_ValueError, "payload is compressed with another dictionary");
+                goto fail;
+            }
+            continue;
+        }
+        if (rc == Z_STREAM_END)
+            break;
+        if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            zlib_error(&stream, rc, "inflate");
+            goto fail;
+        }
+        if (stream.avail_out) {
+            // all input is consumed and there is room for output, but the stream is not finished
+            PyErr_SetString(PyExc_ValueError, "compressed payload is truncated");
+            goto fail;
+        }
+        if (capacity > max_size) {
+            PyErr_Format(PyExc_ValueError, "decompressed payload is larger than %zd bytes", max_size);
+            goto fail;
+        }
+
+        capacity = capacity > (max_size + 1) / 2 ? max_size + 1 : capacity * 2;
+        if (_PyBytes_Resize(&result, capacity) < 0)
+            goto end;
+        stream.next_out = (Bytef*)PyBytes_AS_STRING(result) + stream.total_out;
+        stream.avail_out = (uInt)(capacity - (Py_ssize_t)stream.total_out);
+    }
+
+    if (stream.avail_in) {
+        PyErr_SetString(PyExc_ValueError, "compressed payload has trailing data");
+        goto fail;
+    }
+    if ((Py_ssize_t)stream.total_out > max_size) {
+        PyErr_Format(PyExc_ValueError, "decompressed payload is larger than %zd bytes", max_size);
+        goto fail;
+    }
+    _PyBytes_Resize(&result, (Py_ssize_t)stream.total_out);
+    goto end;
+
+fail:
+    Py_CLEAR(result);
+end:
+    inflateEnd(&stream);
+error:
+    PyBuffer_Release(&data);
+    if (dictionary.buf)
+        PyBuffer_Release(&dictionary);
+    return result;
+}
+#endif
+
+/// Slice python object into memoryview without copying
+static PyObject *memoryview_slice(PyObject *obj, Py_ssize_t start, Py_ssize_t end)
+{
+    PyObject *viewObj;                          // python memoryview of the whole object
+    PyObject *startObj;                         // python slice start
+    PyObject *endObj;                           // python slice end
+    PyObject *sliceObj;                         // python slice
+    PyObject *result;                           // python memoryview of the slice
+
+    startObj = PyLong_FromSsize_t(start);
+    endObj = PyLong_FromSsize_t(end);
+    sliceObj = (startObj && endObj) ? PySlice_New(startObj, endObj, NULL) : NULL;
+    Py_XDECREF(startObj);
+    Py_XDECREF(endObj);
+    if (!sliceObj)
+        return NULL;
+
+    viewObj = PyMemoryView_FromObject(obj);
+    if (!viewObj) {
+        Py_DECREF(sliceObj);
+        return NULL;
+    }
+    result = PyObject_GetItem(viewObj, sliceObj);
+    Py_DECREF(sliceObj);
+    Py_DECREF(viewObj);
+    return result;
+}
+
+/// Decode PUBLISH packet in one pass.
+/// returns tuple (topic, mid, properties, payload) or None for malformed packet:
+/// topic is resolved through topic aliases dictionary and is None for unknown alias,
+/// properties is dictionary if extract_properties is true or memoryview of the properties block otherwise,
+/// payload is memoryview of the packet
+static PyObject *publish_loads(PyObject *self, PyObject *args)
+{
+    PyObject *packetObj;                        // python packet object
+    PyObject *aliasesObj;                       // python topic aliases dictionary
+    PyObject *topicObj = NULL;                  // python topic
+    PyObject *midObj = NULL;                    // python message id
+    PyObject *propertiesObj = NULL;             // python properties
+    PyObject *payloadObj = NULL;                // python payload view
+    PyObject *aliasObj;                         // python topic alias
+    PyObject *result = NULL;                    // python result tuple
+    Py_buffer view;                             // packet buffer
+    int qos;                                    // message QoS
+    int protocol_version;                       // MQTT protocol version
+    int extract_properties_flag;                // build properties dictionary
+    uint8_t *payload;                           // current packet position
+    uint32_t payload_size;                      // remaining packet size
+    uint32_t topic_size;                        // topic size
+    uint32_t properties_size = 0;               // properties block size
+    uint8_t *properties = NULL;                 // properties block with its size
+    uint32_t properties_header_size = 0;        // properties size field length
+    uint32_t topic_alias;                       // topic alias
+    int32_t alias_found = 0;                    // topic alias presence
+
+    if (!PyArg_ParseTuple(args, "OiipO!", &packetObj, &qos, &protocol_version, &extract_properties_flag,
+                          &PyDict_Type, &aliasesObj))
+        return NULL;
+    if (PyObject_GetBuffer(packetObj, &view, PyBUF_SIMPLE) != 0)
+        return NULL;
+
+    payload = (uint8_t*)view.buf;
+    payload_size = (uint32_t)view.len;
+
+    // topic
+    if (payload_size < 2)
+        goto malformed;
+    topic_size = ntohs(*(uint16_t*)payload);
+    if (payload_size < 2 + topic_size)
+        goto malformed;
+    topicObj = PyBytes_FromStringAndSize((const char*)payload + 2, topic_size);
+    if (!topicObj)
+        goto error;
+    payload += 2 + topic_size;
+    payload_size -= 2 + topic_size;
+
+    // message id
+    if (qos > 0) {
+        if (payload_size < 2)
+            goto malformed;
+        midObj = PyLong_FromLong(ntohs(*(uint16_t*)payload));
+        payload += 2;
+        payload_size -= 2;
+    } else {
+        Py_INCREF(Py_None);
+        midObj = Py_None;
+    }
+    if (!midObj)
+        goto error;
+
+    // properties
+    if (protocol_version >= 5) {
+        properties = payload;
+        if (mqtt_extract_uint(&payload, &payload_size, &properties_size) != 0 || properties_size > payload_size)
+            goto malformed;
+        properties_header_size = payload - properties;
+        alias_found = mqtt_find_topic_alias(payload, properties_size, &topic_alias);
+        if (alias_found < 0)
+            goto malformed;
+
+        if (extract_properties_flag) {
+            propertiesObj = extract_properties(properties, properties_header_size + properties_size);
+            if (propertiesObj == Py_None)
+                goto malformed;
+        } else {
+            propertiesObj = memoryview_slice(packetObj, payload - (uint8_t*)view.buf,
+                                             payload - (uint8_t*)view.buf + properties_size);
+        }
+        payload += properties_size;
+        payload_size -= properties_size;
+    } else {
+        propertiesObj = PyDict_New();
+    }
+    if (!propertiesObj)
+        goto error;
+
+    // resolve topic alias
+    if (alias_found) {
+        aliasObj = PyLong_FromLong(topic_alias);
+        if (!aliasObj)
+            goto error;
+        if (PyBytes_GET_SIZE(topicObj) > 0) {
+            if (PyDict_SetItem(aliasesObj, aliasObj, topicObj) != 0) {
+                Py_DECREF(aliasObj);
+                goto error;
+            }
+        } else {
+            Py_DECREF(topicObj);
+            topicObj = PyDict_GetItem(aliasesObj, aliasObj);
+            if (!topicObj)
+                topicObj = Py_None;
+            Py_INCREF(topicObj);
+        }
+        Py_DECREF(aliasObj);
+    }
+
+    payloadObj = memoryview_slice(packetObj, payload - (uint8_t*)view.buf, view.len);
+    if (!payloadObj)
+        goto error;
+
+    PyBuffer_Release(&view);
+    return Py_BuildValue("(NNNN)", topicObj, midObj, propertiesObj, payloadObj);
+
+malformed:
+    Py_INCREF(Py_None);
+    result = Py_None;
+error:
+    Py_XDECREF(topicObj);
+    Py_XDECREF(midObj);
+    Py_XDECREF(propertiesObj);
+    PyBuffer_Release(&view);
+    return result;
+}
+
+/// Size of the Variable Byte Integer
+static uint32_t mqtt_uint_size(uint32_t value)
+{
+    if (value < 128)
+        return 1;
+    if (value < 16384)
+        return 2;
+    if (value < 2097152)
+        return 3;
+    return 4;
+}
+
+/// Pack Variable Byte Integer, return qty of bytes written
+static uint32_t mqtt_pack_uint(uint8_t *out, uint32_t value)
+{
+    uint32_t size = 0;                          // bytes written
+
+    do {
+        out[size] = value & 0x7F;
+        value >>= 7;
+        if (value > 0)
+            out[size] |= 0x80;
+        size++;
+    } while (value > 0);
+
+    return size;
+}
+
+/// Get UTF-8 data of str or data of bytes object
+/// return zero on success
+static int32_t mqtt_string_data(PyObject *obj, bool allow_str, const char **data, Py_ssize_t *size)
+{
+    if (allow_str && PyUnicode_Check(obj)) {
+        *data = PyUnicode_AsUTF8AndSize(obj, size);
+        if (*data == NULL) {
+            PyErr_Clear();
+            return -1;
+        }
+    } else if (PyBytes_Check(obj)) {
+        *data = PyBytes_AS_STRING(obj);
+        *size = PyBytes_GET_SIZE(obj);
+    } else if (PyByteArray_Check(obj)) {
+        *data = PyByteArray_AS_STRING(obj);
+        *size = PyByteArray_GET_SIZE(obj);
+    } else {
+        return -1;
+    }
+    return *size > 65535 ? -1 : 0;
+}
+
+/// Dump string with two bytes length, writes nothing if out is NULL
+/// return size of the dumped string or -1
+static Py_ssize_t mqtt_dump_string(PyObject *obj, bool allow_str, uint8_t *out)
+{
+    const char *data;                           // string data
+    Py_ssize_t size;                            // string size
+
+    if (mqtt_string_data(obj, allow_str, &data, &size) != 0)
+        return -1;
+    if (out) {
+        *(uint16_t*)out = htons((uint16_t)size);
+        memcpy(out + 2, data, size);
+    }
+    return 2 + size;
+}
+
+/// Dump user property pair, writes nothing if out is NULL
+/// return size of the dumped property or -1
+static Py_ssize_t mqtt_dump_user_property(PyObject *pairObj, uint8_t *out)
+{
+    Py_ssize_t key_size;                        // dumped key size
+    Py_ssize_t value_size;                      // dumped value size
+
+    if (!PyTuple_Check(pairObj) || PyTuple_GET_SIZE(pairObj) != 2)
+        return -1;
+    if (out)
+        *out = mqtt_property_type_up;
+    key_size = mqtt_dump_string(PyTuple_GET_ITEM(pairObj, 0), true, out ? out + 1 : NULL);
+    if (key_size < 0)
+        return -1;
+    value_size = mqtt_dump_string(PyTuple_GET_ITEM(pairObj, 1), true, out ? out + 1 + key_size : NULL);
+    if (value_size < 0)
+        return -1;
+    return 1 + key_size + value_size;
+}
+
+/// Dump unsigned int value of the given size, writes nothing if out is NULL
+/// return zero on success
+static int32_t mqtt_dump_uint(PyObject *obj, uint32_t size, uint8_t *out)
+{
+    unsigned long value;                        // property value
+
+    if (!PyLong_Check(obj))
+        return -1;
+    value = PyLong_AsUnsignedLong(obj);
+    if (PyErr_Occurred()) {
+        PyErr_Clear();
+        return -1;
+    }
+    if (size < 4 && value >> (size * 8))
+        return -1;
+    if (size == 4 && value > 0xFFFFFFFFUL)
+        return -1;
+    if (out) {
+        if (size == 1)
+            *out = (uint8_t)value;
+        else if (size == 2)
+            *(uint16_t*)out = htons((uint16_t)value);
+        else
+            *(uint32_t*)out = htonl((uint32_t)value);
+    }
+    return 0;
+}
+
+/// Dump property, writes nothing if out is NULL
+/// return size of the dumped property or -1 if value can not be dumped natively
+static Py_ssize_t mqtt_dump_property(uint8_t property_type, PyObject *valueObj, uint8_t *out)
+{
+    PyObject *pairsObj;                         // python user properties sequence
+    Py_ssize_t size;                            // dumped size
+    Py_ssize_t pair_size;                       // dumped user property size
+    Py_ssize_t i;                               // user property index
+    unsigned long value;                        // variable byte integer value
+
+    if (out)
+        *out = property_type;
+
+    switch (property_type) {
+        // 1 byte value
+        case mqtt_property_type_pfi:
+        case mqtt_property_type_mqos:
+        case mqtt_property_type_ra:
+        case mqtt_property_type_wsa:
+        case mqtt_property_type_sia:
+        case mqtt_property_type_ssa:
+        case mqtt_property_type_rri:
+        case mqtt_property_type_rpi:
+            return mqtt_dump_uint(valueObj, 1, out ? out + 1 : NULL) == 0 ? 2 : -1;
+        // 2 bytes value
+        case mqtt_property_type_ska:
+        case mqtt_property_type_rm:
+        case mqtt_property_type_tam:
+        case mqtt_property_type_ta:
+            return mqtt_dump_uint(valueObj, 2, out ? out + 1 : NULL) == 0 ? 3 : -1;
+        // 4 bytes value
+        case mqtt_property_type_pei:
+        case mqtt_property_type_sei:
+        case mqtt_property_type_wdi:
+        case mqtt_property_type_mps:
+            return mqtt_dump_uint(valueObj, 4, out ? out + 1 : NULL) == 0 ? 5 : -1;
+        // variable byte integer
+        case mqtt_property_type_si:
+            if (!PyLong_Check(valueObj))
+                return -1;
+            value = PyLong_AsUnsignedLong(valueObj);
+            if (PyErr_Occurred()) {
+                PyErr_Clear();
+                return -1;
+            }
+            if (value > 268435455)
+                return -1;
+            if (out)
+                return 1 + mqtt_pack_uint(out + 1, (uint32_t)value);
+            return 1 + mqtt_uint_size((uint32_t)value);
+        // utf-8 encoded string
+        case mqtt_property_type_ct:
+        case mqtt_property_type_rt:
+        case mqtt_property_type_aci:
+        case mqtt_property_type_am:
+        case mqtt_property_type_ri:
+        case mqtt_property_type_sr:
+        case mqtt_property_type_rs:
+            size = mqtt_dump_string(valueObj, true, out ? out + 1 : NULL);
+            return size < 0 ? -1 : 1 + size;
+        // binary data
+        case mqtt_property_type_cd:
+        case mqtt_property_type_ad:
+            size = mqtt_dump_string(valueObj, false, out ? out + 1 : NULL);
+            return size < 0 ? -1 : 1 + size;
+        // utf-8 string pair or sequence of pairs
+        case mqtt_property_type_up:
+            if (!PyTuple_Check(valueObj) && !PyList_Check(valueObj))
+                return -1;
+            if (PySequence_Fast_GET_SIZE(valueObj) > 0 && PyUnicode_Check(PySequence_Fast_GET_ITEM(valueObj, 0)))
+                return mqtt_dump_user_property(valueObj, out);
+            pairsObj = valueObj;
+            size = 0;
+            for (i = 0; i < PySequence_Fast_GET_SIZE(pairsObj); i++) {
+                pair_size = mqtt_dump_user_property(PySequence_Fast_GET_ITEM(pairsObj, i), out ? out + size : NULL);
+                if (pair_size < 0)
+                    return -1;
+                size += pair_size;
+            }
+            return size;
+        default:
+            return -1;
+    }
+}
+
+/// Dump properties dictionary without its size, writes nothing if out is NULL
+/// return size of the dumped properties or -1 if they can not be dumped natively
+static Py_ssize_t mqtt_dump_properties(PyObject *dictObj, uint8_t *out)
+{
+    PyObject *key;                              // python property name
+    PyObject *value;                            // python property value
+    PyObject *typeObj;                          // python property type
+    Py_ssize_t pos = 0;                         // dictionary position
+    Py_ssize_t size = 0;                        // dumped size
+    Py_ssize_t property_size;                   // dumped property size
+
+    while (PyDict_Next(dictObj, &pos, &key, &value)) {
+        typeObj = PyDict_GetItem(property_types, key);
+        if (!typeObj)
+            // unknown property, let python code handle it
+            return -1;
+        property_size = mqtt_dump_property((uint8_t)PyLong_AsLong(typeObj), value, out ? out + size : NULL);
+        if (property_size < 0)
+            return -1;
+        size += property_size;
+    }
+    return size > 268435455 ? -1 : size;
+}
+
+/// Dump MQTT (5 version) props with their size.
+/// returns bytearray or None if properties can not be dumped natively
+static PyObject *prop_dumps(PyObject *self, PyObject *args)
+{
+    PyObject *dictObj;                          // python properties dictionary
+    PyObject *result;                           // python bytearray
+    Py_ssize_t properties_size;                 // properties size
+    uint32_t header_size;                       // properties size length
+    uint8_t *out;                               // output buffer
+
+    if (!PyArg_ParseTuple(args, "O!", &PyDict_Type, &dictObj))
+        return NULL;
+
+    properties_size = mqtt_dump_properties(dictObj, NULL);
+    if (properties_size < 0)
+        Py_RETURN_NONE;
+    header_size = mqtt_uint_size((uint32_t)properties_size);
+
+    result = PyByteArray_FromStringAndSize(NULL, header_size + properties_size);
+    if (!result)
+        return NULL;
+    out = (uint8_t*)PyByteArray_AS_STRING(result);
+    mqtt_pack_uint(out, (uint32_t)properties_size);
+    mqtt_dump_properties(dictObj, out + header_size);
+
+    return result;
+}
+
+/// Build PUBLISH packet into one preallocated buffer.
+/// properties is None for MQTT versions without properties
+/// returns bytearray or None if packet can not be built natively
+static PyObject *build_publish(PyObject *self, PyObject *args)
+{
+    PyObject *topicObj;                         // python topic
+    PyObject *midObj;                           // python message id or None
+    PyObject *propertiesObj;                    // python properties dictionary or None
+    PyObject *result;                           // python bytearray
+    Py_buffer payload;                          // payload buffer
+    int command;                                // command with flags
+    const char *topic;                          // topic data
+    Py_ssize_t topic_size;                      // topic size
+    Py_ssize_t properties_size = 0;             // properties size
+    Py_ssize_t remaining_length;                // packet remaining length
+    unsigned long mid = 0;                      // message id
+    uint8_t *out;                               // output buffer
+
+    if (!PyArg_ParseTuple(args, "iOOOy*", &command, &topicObj, &midObj, &propertiesObj, &payload))
+        return NULL;
+
+    if (mqtt_string_data(topicObj, true, &topic, &topic_size) != 0)
+        goto fallback;
+    remaining_length = 2 + topic_size + payload.len;
+
+    if (midObj != Py_None) {
+        if (mqtt_dump_uint(midObj, 2, NULL) != 0)
+            goto fallback;
+        mid = PyLong_AsUnsignedLong(midObj);
+        remaining_length += 2;
+    }
+    if (propertiesObj != Py_None) {
+        if (!PyDict_Check(propertiesObj))
+            goto fallback;
+        properties_size = mqtt_dump_properties(propertiesObj, NULL);
+        if (properties_size < 0)
+            goto fallback;
+        remaining_length += mqtt_uint_size((uint32_t)properties_size) + properties_size;
+    }
+    if (remaining_length > 268435455)
+        goto fallback;
+
+    result = PyByteArray_FromStringAndSize(NULL, 1 + mqtt_uint_size((uint32_t)remaining_length) + remaining_length);
+    if (!result) {
+        PyBuffer_Release(&payload);
+        return NULL;
+    }
+    out = (uint8_t*)PyByteArray_AS_STRING(result);
+
+    // fixed header
+    *out++ = (uint8_t)command;
+    out += mqtt_pack_uint(out, (uint32_t)remaining_length);
+    // topic
+    *(uint16_t*)out = htons((uint16_t)topic_size);
+    memcpy(out + 2, topic, topic_size);
+    out += 2 + topic_size;
+    // message id
+    if (midObj != Py_None) {
+        *(uint16_t*)out = htons((uint16_t)mid);
+        out += 2;
+    }
+    // properties
+    if (propertiesObj != Py_None) {
+        out += mqtt_pack_uint(out, (uint32_t)properties_size);
+        mqtt_dump_properties(propertiesObj, out);
+        out += properties_size;
+    }
+    // payload
+    memcpy(out, payload.buf, payload.len);
+
+    PyBuffer_Release(&payload);
+    return result;
+
+fallback:
+    PyBuffer_Release(&payload);
+    Py_RETURN_NONE;
+}
+
+/// Validate buffer is well-formed UTF-8, U+0000 is rejected unless allow_null is set
+static PyObject *check_utf8(PyObject *self, PyObject *args)
+{
+    Py_buffer data;                             // input buffer
+    int allow_null = 0;                         // allow U+0000 characters
+    int32_t result;                             // validation result
+
+    if (!PyArg_ParseTuple(args, "y*|p", &data, &allow_null))
+        return NULL;
+
+    result = validate_utf8_impl((const uint8_t*)data.buf, data.len, allow_null);
+    PyBuffer_Release(&data);
+
+    return PyBool_FromLong(result == 0);
+}
+
+/// Same as check_utf8 but uses given kernel, return None if CPU does not support it
+static PyObject *check_utf8_kernel(PyObject *self, PyObject *args)
+{
+    Py_buffer data;                             // input buffer
+    int allow_null = 0;                         // allow U+0000 characters
+    const char *kernel;                         // kernel name
+    int32_t (*impl)(const uint8_t *, Py_ssize_t, bool) = NULL;
+    int32_t result;                             // validation result
+
+    if (!PyArg_ParseTuple(args, "y*ps", &data, &allow_null, &kernel))
+        return NULL;
+
+    if (strcmp(kernel, "scalar") == 0)
+        impl = validate_utf8_scalar;
+#ifdef GMQTT_X86_SIMD
+    else if (strcmp(kernel, "ssse3") == 0 && __builtin_cpu_supports("ssse3"))
+        impl = validate_utf8_ssse3;
+    else if (strcmp(kernel, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+        impl = validate_utf8_avx2;
+#endif
+    if (!impl) {
+        PyBuffer_Release(&data);
+        Py_RETURN_NONE;
+    }
+
+    result = impl((const uint8_t*)data.buf, data.len, allow_null);
+    PyBuffer_Release(&data);
+
+    return PyBool_FromLong(result == 0);
+}
+
+/**
+* IdGeneratorObject - packet identifiers allocator.
+* Bitmap of used identifiers with a bitmap of full words on top of it, so both allocation
+* and release take constant time. Identifiers are allocated round-robin to not reuse just freed ones.
+*/
+#define MQTT_MAX_PACKET_ID 65535
+#define ID_WORDS ((MQTT_MAX_PACKET_ID + 1) / 64)
+
+typedef struct {
+    PyObject_HEAD
+    uint64_t used[ID_WORDS];                    // bit per identifier, zero identifier is always used
+    uint64_t full[ID_WORDS / 64];               // bit per full word of used bitmap
+    uint32_t max_id;                            // the largest identifier
+    uint32_t cursor;                            // identifier to start search from
+    uint32_t in_flight;                         // qty of used identifiers
+} IdGeneratorObject;
+
+static inline void id_generator_set(IdGeneratorObject *self, uint32_t id)
+{
+    self->used[id / 64] |= (uint64_t)1 << (id % 64);
+    if (self->used[id / 64] == UINT64_MAX)
+        self->full[id / 4096] |= (uint64_t)1 << (id / 64 % 64);
+}
+
+static inline void id_generator_clear(IdGeneratorObject *self, uint32_t id)
+{
+    self->used[id / 64] &= ~((uint64_t)1 << (id % 64));
+    self->full[id / 4096] &= ~((uint64_t)1 << (id / 64 % 64));
+}
+
+/// Mark all identifiers as free except zero one and ones above max_id
+static void id_generator_reset(IdGeneratorObject *self)
+{
+    uint32_t id;
+
+    memset(self->used, 0, sizeof(self->used));
+    memset(self->full, 0, sizeof(self->full));
+    id_generator_set(self, 0);
+    for (id = self->max_id + 1; id <= MQTT_MAX_PACKET_ID; id++)
+        id_generator_set(self, id);
+    self->cursor = 1;
+    self->in_flight = 0;
+}
+
+/// Find the first not full word starting from the given one, wraps around
+static int32_t id_generator_find_word(IdGeneratorObject *self, uint32_t word)
+{
+    uint32_t i;
+    uint32_t summary_index;
+    uint64_t free_words;
+
+    for (i = 0; i <= ID_WORDS / 64; i++) {
+        summary_index = (word / 64 + i) % (ID_WORDS / 64);
+        free_words = ~self->full[summary_index];
+        if (i == 0)
+            free_words &= UINT64_MAX << (word % 64);
+        if (free_words)
+            return summary_index * 64 + __builtin_ctzll(free_words);
+    }
+    return -1;
+}
+
+static PyObject *id_generator_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"max", NULL};
+    IdGeneratorObject *self;
+    unsigned int max_id = MQTT_MAX_PACKET_ID;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|I", kwlist, &max_id))
+        return NULL;
+    if (max_id < 1 || max_id > MQTT_MAX_PACKET_ID) {
+        PyErr_Format(PyExc_ValueError, "max should be in range 1..%d", MQTT_MAX_PACKET_ID);
+        return NULL;
+    }
+
+    self = (IdGeneratorObject*)type->tp_alloc(type, 0);
+    if (!self)
+        return NULL;
+    self->max_id = max_id;
+    id_generator_reset(self);
+
+    return (PyObject*)self;
+}
+
+static PyObject *id_generator_next_id(IdGeneratorObject *self, PyObject *Py_UNUSED(args))
+{
+    uint64_t free_bits;                         // free identifiers of the word
+    int32_t word;                               // word index
+
+    if (self->in_flight >= self->max_id) {
+        PyErr_SetString(PyExc_OverflowError, "All ids has already used. May be your QoS query is full.");
+        return NULL;
+    }
+
+    word = self->cursor / 64;
+    free_bits = ~self->used[word] & (UINT64_MAX << (self->cursor % 64));
+    if (!free_bits) {
+        word = id_generator_find_word(self, (word + 1) % ID_WORDS);
+        free_bits = ~self->used[word];
+    }
+    self->cursor = word * 64 + __builtin_ctzll(free_bits);
+
+    id_generator_set(self, self->cursor);
+    self->in_flight++;
+    return PyLong_FromUnsignedLong(self->cursor);
+}
+
+static PyObject *id_generator_free_id(IdGeneratorObject *self, PyObject *idObj)
+{
+    unsigned long id;
+
+    if (idObj == Py_None)
+        Py_RETURN_NONE;
+    id = PyLong_AsUnsignedLong(idObj);
+    if (PyErr_Occurred())
+        return NULL;
+    if (id < 1 || id > self->max_id || !(self->used[id / 64] & ((uint64_t)1 << (id % 64))))
+        Py_RETURN_NONE;
+
+    id_generator_clear(self, id);
+    self->in_flight--;
+    Py_RETURN_NONE;
+}
+
+static PyObject *id_generator_use_id(IdGeneratorObject *self, PyObject *idObj)
+{
+    unsigned long id = PyLong_AsUnsignedLong(idObj);
+
+    if (PyErr_Occurred())
+        return NULL;
+    if (id < 1 || id > self->max_id) {
+        PyErr_Format(PyExc_ValueError, "id should be in range 1..%u", self->max_id);
+        return NULL;
+    }
+    if (self->used[id / 64] & ((uint64_t)1 << (id % 64)))
+        Py_RETURN_NONE;
+
+    id_generator_set(self, id);
+    self->in_flight++;
+    Py_RETURN_NONE;
+}
+
+static PyObject *id_generator_is_used(IdGeneratorObject *self, PyObject *idObj)
+{
+    unsigned long id = PyLong_AsUnsignedLong(idObj);
+
+    if (PyErr_Occurred())
+        return NULL;
+    if (id < 1 || id > self->max_id)
+        Py_RETURN_FALSE;
+    return PyBool_FromLong((self->used[id / 64] >> (id % 64)) & 1);
+}
+
+static PyObject *id_generator_reset_method(IdGeneratorObject *self, PyObject *Py_UNUSED(args))
+{
+    id_generator_reset(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *id_generator_get_in_flight(IdGeneratorObject *self, void *closure)
+{
+    return PyLong_FromUnsignedLong(self->in_flight);
+}
+
+static PyObject *id_generator_get_max(IdGeneratorObject *self, void *closure)
+{
+    return PyLong_FromUnsignedLong(self->max_id);
+}
+
+static PyMethodDef IdGeneratorMethods[] = {
+    {"next_id", (PyCFunction)id_generator_next_id, METH_NOARGS, "Allocate packet identifier."},
+    {"free_id", (PyCFunction)id_generator_free_id, METH_O, "Release packet identifier."},
+    {"use_id", (PyCFunction)id_generator_use_id, METH_O, "Mark packet identifier as allocated."},
+    {"is_used", (PyCFunction)id_generator_is_used, METH_O, "Check packet identifier is allocated."},
+    {"reset", (PyCFunction)id_generator_reset_method, METH_NOARGS, "Release all packet identifiers."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef IdGeneratorGetSet[] = {
+    {"in_flight", (getter)id_generator_get_in_flight, NULL, "Qty of allocated packet identifiers.", NULL},
+    {"max", (getter)id_generator_get_max, NULL, "The largest packet identifier.", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject IdGeneratorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gmqttlib.IdGenerator",
+    .tp_doc = "Packet identifiers allocator.",
+    .tp_basicsize = sizeof(IdGeneratorObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = id_generator_new,
+    .tp_methods = IdGeneratorMethods,
+    .tp_getset = IdGeneratorGetSet,
+};
+
+/**
+* TopicMatcherObject - subscriptions trie, matches topic names against topic filters.
+* Node children are kept in dictionaries keyed by topic level, so matching costs a few dictionary
+* lookups per level whatever the number of filters is. Matched values of recent topics are cached,
+* cache is dropped on any change of filters or when it is full.
+*/
+typedef struct {
+    PyObject_HEAD
+    PyObject *children;                         // dictionary of child nodes by topic level
+    PyObject *values;                           // list of values of filters ending at this node
+} TopicNodeObject;
+
+typedef struct {
+    PyObject_HEAD
+    TopicNodeObject *root;                      // node of the empty filter
+    PyObject *cache;                            // dictionary of matched values tuples by topic
+    Py_ssize_t cache_size;                      // max qty of cached topics
+    Py_ssize_t size;                            // qty of added values
+} TopicMatcherObject;
+
+static PyTypeObject TopicNodeType;
+static PyObject *topic_separator = NULL;        // "/"
+static PyObject *topic_single_wildcard = NULL;  // "+"
+static PyObject *topic_multi_wildcard = NULL;   // "#"
+
+static TopicNodeObject *topic_node_new(void)
+{
+    TopicNodeObject *node = PyObject_GC_New(TopicNodeObject, &TopicNodeType);
+
+    if (!node)
+        return NULL;
+    node->children = PyDict_New();
+    node->values = PyList_New(0);
+    if (!node->children || !node->values) {
+        Py_CLEAR(node->children);
+        Py_CLEAR(node->values);
+        Py_DECREF(node);
+        return NULL;
+    }
+    PyObject_GC_Track(node);
+    return node;
+}
+
+static int topic_node_traverse(TopicNodeObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->children);
+    Py_VISIT(self->values);
+    return 0;
+}
+
+static int topic_node_clear(TopicNodeObject *self)
+{
+    Py_CLEAR(self->children);
+    Py_CLEAR(self->values);
+    return 0;
+}
+
+static void topic_node_dealloc(TopicNodeObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    topic_node_clear(self);
+    PyObject_GC_Del(self);
+}
+
+static PyTypeObject TopicNodeType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gmqttlib._TopicNode",
+    .tp_basicsize = sizeof(TopicNodeObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_dealloc = (destructor)topic_node_dealloc,
+    .tp_traverse = (traverseproc)topic_node_traverse,
+    .tp_clear = (inquiry)topic_node_clear,
+};
+
+/// Split topic filter into levels, "$share/{group}/" prefix of shared subscription is dropped
+static PyObject *topic_filter_levels(PyObject *filterObj)
+{
+    PyObject *levelsObj;                        // list of filter levels
+    PyObject *levelObj;                         // filter level
+    PyObject *sharedObj;                        // filter levels without shared subscription prefix
+    Py_ssize_t count;                           // qty of levels
+    Py_ssize_t i;
+
+    if (!PyUnicode_Check(filterObj)) {
+        PyErr_SetString(PyExc_TypeError, "topic filter should be str");
+        return NULL;
+    }
+    if (PyUnicode_GET_LENGTH(filterObj) == 0) {
+        PyErr_SetString(PyExc_ValueError, "topic filter should not be empty");
+        return NULL;
+    }
+    levelsObj = PyUnicode_Split(filterObj, topic_separator, -1);
+    if (!levelsObj)
+        return NULL;
+
+    count = PyList_GET_SIZE(levelsObj);
+    if (PyUnicode_CompareWithASCIIString(PyList_GET_ITEM(levelsObj, 0), "$share") == 0) {
+        if (count < 3 || PyUnicode_GET_LENGTH(PyList_GET_ITEM(levelsObj, 1)) == 0) {
+            PyErr_Format(PyExc_ValueError, "invalid shared subscription filter %R", filterObj);
+            goto error;
+        }
+        sharedObj = PyList_GetSlice(levelsObj, 2, count);
+        Py_DECREF(levelsObj);
+        if (!sharedObj)
+            return NULL;
+        levelsObj = sharedObj;
+        count -= 2;
+    }
+
+    for (i = 0; i < count; i++) {
+        levelObj = PyList_GET_ITEM(levelsObj, i);
+        if (PyUnicode_GET_LENGTH(levelObj) == 1 &&
+            (PyUnicode_READ_CHAR(levelObj, 0) == '+' || PyUnicode_READ_CHAR(levelObj, 0) == '#')) {
+            if (PyUnicode_READ_CHAR(levelObj, 0) == '#' && i != count - 1)
+                break;
+            continue;
+        }
+        if (PyUnicode_FindChar(levelObj, '+', 0, PyUnicode_GET_LENGTH(levelObj), 1) != -1 ||
+            PyUnicode_FindChar(levelObj, '#', 0, PyUnicode_GET_LENGTH(levelObj), 1) != -1)
+            break;
+    }
+    if (i != count) {
+        PyErr_Format(PyExc_ValueError, "invalid wildcard in topic filter %R", filterObj);
+        goto error;
+    }
+    return levelsObj;
+
+error:
+    Py_DECREF(levelsObj);
+    return NULL;
+}
+
+static PyObject *topic_matcher_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"cache_size", NULL};
+    TopicMatcherObject *self;
+    Py_ssize_t cache_size = 1024;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|n", kwlist, &cache_size))
+        return NULL;
+    if (cache_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "cache_size should not be negative");
+        return NULL;
+    }
+
+    self = (TopicMatcherObject*)type->tp_alloc(type, 0);
+    if (!self)
+        return NULL;
+    self->cache_size = cache_size;
+    self->root = topic_node_new();
+    self->cache = PyDict_New();
+    if (!self->root || !self->cache) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject*)self;
+}
+
+static int topic_matcher_traverse(TopicMatcherObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->root);
+    Py_VISIT(self->cache);
+    return 0;
+}
+
+static int topic_matcher_clear(TopicMatcherObject *self)
+{
+    Py_CLEAR(self->root);
+    Py_CLEAR(self->cache);
+    return 0;
+}
+
+static void topic_matcher_dealloc(TopicMatcherObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    topic_matcher_clear(self);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject *topic_matcher_add(TopicMatcherObject *self, PyObject *args)
+{
+    PyObject *filterObj;                        // topic filter
+    PyObject *valueObj;                         // value returned for matched topics
+    PyObject *levelsObj;                        // list of filter levels
+    PyObject *childObj;                         // child node
+    TopicNodeObject *node;                      // current node, borrowed
+    Py_ssize_t i;
+
+    if (!PyArg_ParseTuple(args, "OO", &filterObj, &valueObj))
+        return NULL;
+    levelsObj = topic_filter_levels(filterObj);
+    if (!levelsObj)
+        return NULL;
+
+    node = self->root;
+    for (i = 0; i < PyList_GET_SIZE(levelsObj); i++) {
+        childObj = PyDict_GetItemWithError(node->children, PyList_GET_ITEM(levelsObj, i));
+        if (!childObj) {
+            if (PyErr_Occurred())
+                goto error;
+            childObj = (PyObject*)topic_node_new();
+            if (!childObj)
+                goto error;
+            if (PyDict_SetItem(node->children, PyList_GET_ITEM(levelsObj, i), childObj) != 0) {
+                Py_DECREF(childObj);
+                goto error;
+            }
+            Py_DECREF(childObj);
+        }
+        node = (TopicNodeObject*)childObj;
+    }
+    Py_DECREF(levelsObj);
+
+    if (PyList_Append(node->values, valueObj) != 0)
+        return NULL;
+    self->size++;
+    PyDict_Clear(self->cache);
+    Py_RETURN_NONE;
+
+error:
+    Py_DECREF(levelsObj);
+    return NULL;
+}
+
+/// Remove value from the node of filter levels[index:], empty nodes are dropped. Returns 1 if value is found.
+static int32_t topic_node_remove(TopicNodeObject *node, PyObject *levelsObj, Py_ssize_t index, PyObject *valueObj)
+{
+    PyObject *levelObj;                         // filter level, borrowed
+    PyObject *childObj;                         // child node, borrowed
+    TopicNodeObject *child;                     // child node, borrowed
+    int32_t result;
+    Py_ssize_t i;
+
+    if (index == PyList_GET_SIZE(levelsObj)) {
+        for (i = 0; i < PyList_GET_SIZE(node->values); i++) {
+            if (PyList_GET_ITEM(node->values, i) == valueObj)
+                return PySequence_DelItem(node->values, i) == 0 ? 1 : -1;
+        }
+        return 0;
+    }
+
+    levelObj = PyList_GET_ITEM(levelsObj, index);
+    childObj = PyDict_GetItemWithError(node->children, levelObj);
+    if (!childObj)
+        return PyErr_Occurred() ? -1 : 0;
+    child = (TopicNodeObject*)childObj;
+
+    result = topic_node_remove(child, levelsObj, index + 1, valueObj);
+    if (result == 1 && PyList_GET_SIZE(child->values) == 0 && PyDict_GET_SIZE(child->children) == 0) {
+        if (PyDict_DelItem(node->children, levelObj) != 0)
+            return -1;
+    }
+    return result;
+}
+
+static PyObject *topic_matcher_remove(TopicMatcherObject *self, PyObject *args)
+{
+    PyObject *filterObj;                        // topic filter
+    PyObject *valueObj;                         // value added with the filter
+    PyObject *levelsObj;                        // list of filter levels
+    int32_t result;
+
+    if (!PyArg_ParseTuple(args, "OO", &filterObj, &valueObj))
+        return NULL;
+    levelsObj = topic_filter_levels(filterObj);
+    if (!levelsObj)
+        return NULL;
+
+    result = topic_node_remove(self->root, levelsObj, 0, valueObj);
+    Py_DECREF(levelsObj);
+    if (result < 0)
+        return NULL;
+    if (result) {
+        self->size--;
+        PyDict_Clear(self->cache);
+    }
+    return PyBool_FromLong(result);
+}
+
+static int32_t topic_node_extend(PyObject *resultObj, TopicNodeObject *node)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < PyList_GET_SIZE(node->values); i++) {
+        if (PyList_Append(resultObj, PyList_GET_ITEM(node->values, i)) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/// Collect values of filters under the node matching topic levels[index:]
+static int32_t topic_node_match(TopicNodeObject *node, PyObject *levelsObj, Py_ssize_t index, PyObject *resultObj)
+{
+    PyObject *childObj;                         // child node, borrowed
+    bool wildcards;                             // wildcards match the level
+
+    // topic names starting with "$" are not matched by filters starting with wildcard
+    wildcards = index != 0 || PyUnicode_GET_LENGTH(PyList_GET_ITEM(levelsObj, 0)) == 0
+        || PyUnicode_READ_CHAR(PyList_GET_ITEM(levelsObj, 0), 0) != '$';
+
+    if (wildcards && PyDict_GET_SIZE(node->children) != 0) {
+        // "#" matches the parent level too
+        childObj = PyDict_GetItemWithError(node->children, topic_multi_wildcard);
+        if (childObj && topic_node_extend(resultObj, (TopicNodeObject*)childObj) != 0)
+            return -1;
+    }
+    if (index == PyList_GET_SIZE(levelsObj))
+        return topic_node_extend(resultObj, node);
+    if (PyDict_GET_SIZE(node->children) == 0)
+        return 0;
+
+    if (wildcards) {
+        childObj = PyDict_GetItemWithError(node->children, topic_single_wildcard);
+        if (childObj && topic_node_match((TopicNodeObject*)childObj, levelsObj, index + 1, resultObj) != 0)
+            return -1;
+    }
+    childObj = PyDict_GetItemWithError(node->children, PyList_GET_ITEM(levelsObj, index));
+    if (childObj && topic_node_match((TopicNodeObject*)childObj, levelsObj, index + 1, resultObj) != 0)
+        return -1;
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+static PyObject *topic_matcher_match(TopicMatcherObject *self, PyObject *topicObj)
+{
+    PyObject *matchedObj;                       // tuple of matched values
+    PyObject *resultObj;                        // list of matched values
+    PyObject *levelsObj;                        // list of topic levels
+
+    if (!PyUnicode_Check(topicObj)) {
+        PyErr_SetString(PyExc_TypeError, "topic should be str");
+        return NULL;
+    }
+    matchedObj = PyDict_GetItemWithError(self->cache, topicObj);
+    if (matchedObj) {
+        Py_INCREF(matchedObj);
+        return matchedObj;
+    }
+    if (PyErr_Occurred())
+        return NULL;
+
+    levelsObj = PyUnicode_Split(topicObj, topic_separator, -1);
+    if (!levelsObj)
+        return NULL;
+    resultObj = PyList_New(0);
+    if (!resultObj) {
+        Py_DECREF(levelsObj);
+        return NULL;
+    }
+    if (topic_node_match(self->root, levelsObj, 0, resultObj) != 0) {
+        Py_DECREF(levelsObj);
+        Py_DECREF(resultObj);
+        return NULL;
+    }
+    Py_DECREF(levelsObj);
+    matchedObj = PyList_AsTuple(resultObj);
+    Py_DECREF(resultObj);
+    if (!matchedObj || self->cache_size == 0)
+        return matchedObj;
+
+    if (PyDict_GET_SIZE(self->cache) >= self->cache_size)
+        PyDict_Clear(self->cache);
+    if (PyDict_SetItem(self->cache, topicObj, matchedObj) != 0) {
+        Py_DECREF(matchedObj);
+        return NULL;
+    }
+    return matchedObj;
+}
+
+static PyObject *topic_matcher_clear_method(TopicMatcherObject *self, PyObject *Py_UNUSED(args))
+{
+    TopicNodeObject *root = topic_node_new();
+
+    if (!root)
+        return NULL;
+    Py_SETREF(self->root, root);
+    PyDict_Clear(self->cache);
+    self->size = 0;
+    Py_RETURN_NONE;
+}
+
+static Py_ssize_t topic_matcher_length(TopicMatcherObject *self)
+{
+    return self->size;
+}
+
+static PyMethodDef TopicMatcherMethods[] = {
+    {"add", (PyCFunction)topic_matcher_add, METH_VARARGS, "Add value matched by topic filter."},
+    {"remove", (PyCFunction)topic_matcher_remove, METH_VARARGS, "Remove value added with topic filter."},
+    {"match", (PyCFunction)topic_matcher_match, METH_O, "Return tuple of values of filters matching topic."},
+    {"clear", (PyCFunction)topic_matcher_clear_method, METH_NOARGS, "Remove all values."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PySequenceMethods TopicMatcherSequence = {
+    .sq_length = (lenfunc)topic_matcher_length,
+};
+
+static PyTypeObject TopicMatcherType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gmqttlib.TopicMatcher",
+    .tp_doc = "Topic filters trie.",
+    .tp_basicsize = sizeof(TopicMatcherObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_new = topic_matcher_new,
+    .tp_dealloc = (destructor)topic_matcher_dealloc,
+    .tp_traverse = (traverseproc)topic_matcher_traverse,
+    .tp_clear = (inquiry)topic_matcher_clear,
+    .tp_methods = TopicMatcherMethods,
+    .tp_as_sequence = &TopicMatcherSequence,
+};
+
+static PyObject *metrics_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "", kwlist))
+        return NULL;
+    // memory is zeroed by tp_alloc
+    return type->tp_alloc(type, 0);
+}
+
+static PyObject *metrics_count_in_method(MetricsObject *self, PyObject *args)
+{
+    unsigned char command;
+    Py_ssize_t size;
+
+    if (!PyArg_ParseTuple(args, "bn", &command, &size))
+        return NULL;
+    metrics_count_in(self, command, size);
+    Py_RETURN_NONE;
+}
+
+static int32_t metrics_count_out_package(MetricsObject *self, PyObject *packageObj)
+{
+    Py_buffer view;                             // package buffer
+
+    if (PyBytes_Check(packageObj) && PyBytes_GET_SIZE(packageObj) > 0) {
+        self->packets_out[(uint8_t)PyBytes_AS_STRING(packageObj)[0] >> 4]++;
+        self->bytes_out[(uint8_t)PyBytes_AS_STRING(packageObj)[0] >> 4] += PyBytes_GET_SIZE(packageObj);
+        return 0;
+    }
+    if (PyByteArray_Check(packageObj) && PyByteArray_GET_SIZE(packageObj) > 0) {
+        self->packets_out[(uint8_t)PyByteArray_AS_STRING(packageObj)[0] >> 4]++;
+        self->bytes_out[(uint8_t)PyByteArray_AS_STRING(packageObj)[0] >> 4] += PyByteArray_GET_SIZE(packageObj);
+        return 0;
+    }
+    if (PyObject_GetBuffer(packageObj, &view, PyBUF_SIMPLE) != 0)
+        return -1;
+    if (view.len > 0) {
+        self->packets_out[((uint8_t*)view.buf)[0] >> 4]++;
+        self->bytes_out[((uint8_t*)view.buf)[0] >> 4] += view.len;
+    }
+    PyBuffer_Release(&view);
+    return 0;
+}
+
+static PyObject *metrics_count_out(MetricsObject *self, PyObject *packageObj)
+{
+    if (metrics_count_out_package(self, packageObj) != 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *metrics_count_out_many(MetricsObject *self, PyObject *packagesObj)
+{
+    PyObject *seqObj;                           // packages sequence
+    Py_ssize_t i;
+
+    seqObj = PySequence_Fast(packagesObj, "packages should be iterable");
+    if (!seqObj)
+        return NULL;
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seqObj); i++) {
+        if (metrics_count_out_package(self, PySequence_Fast_GET_ITEM(seqObj, i)) != 0) {
+            Py_DECREF(seqObj);
+            return NULL;
+        }
+    }
+    Py_DECREF(seqObj);
+    Py_RETURN_NONE;
+}
+
+static PyObject *metrics_observe(MetricsObject *self, PyObject *args)
+{
+    int histogram;
+    double seconds;
+    uint64_t us;                                // duration in microseconds
+    int32_t bucket;
+
+    if (!PyArg_ParseTuple(args, "id", &histogram, &seconds))
+        return NULL;
+    if (histogram < 0 || histogram >= METRICS_HISTOGRAMS) {
+        PyErr_Format(PyExc_ValueError, "histogram should be in range 0..%d", METRICS_HISTOGRAMS - 1);
+        return NULL;
+    }
+    if (seconds < 0)
+        seconds = 0;
+
+    us = seconds * 1e6 < (double)UINT64_MAX ? (uint64_t)(seconds * 1e6) : UINT64_MAX;
+    bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= METRICS_BUCKETS)
+        bucket = METRICS_BUCKETS - 1;
+    self->buckets[histogram][bucket]++;
+    self->sums[histogram] += seconds;
+    Py_RETURN_NONE;
+}
+
+static PyObject *metrics_list(const uint64_t *values, Py_ssize_t count)
+{
+    PyObject *listObj = PyList_New(count);
+    PyObject *valueObj;
+    Py_ssize_t i;
+
+    if (!listObj)
+        return NULL;
+    for (i = 0; i < count; i++) {
+        valueObj = PyLong_FromUnsignedLongLong(values[i]);
+        if (!valueObj) {
+            Py_DECREF(listObj);
+            return NULL;
+        }
+        PyList_SET_ITEM(listObj, i, valueObj);
+    }
+    return listObj;
+}
+
+/// returns tuple (packets_in, bytes_in, packets_out, bytes_out, [(buckets, sum), ...]) of lists by packet type
+static PyObject *metrics_snapshot(MetricsObject *self, PyObject *Py_UNUSED(args))
+{
+    PyObject *histogramsObj;                    // list of histograms
+    PyObject *histogramObj;                     // (buckets, sum) tuple
+    int32_t i;
+
+    histogramsObj = PyList_New(METRICS_HISTOGRAMS);
+    if (!histogramsObj)
+        return NULL;
+    for (i = 0; i < METRICS_HISTOGRAMS; i++) {
+        histogramObj = Py_BuildValue("(Nd)", metrics_list(self->buckets[i], METRICS_BUCKETS), self->sums[i]);
+        if (!histogramObj) {
+            Py_DECREF(histogramsObj);
+            return NULL;
+        }
+        PyList_SET_ITEM(histogramsObj, i, histogramObj);
+    }
+
+    return Py_BuildValue("(NNNNN)",
+                         metrics_list(self->packets_in, METRICS_PACKET_TYPES),
+                         metrics_list(self->bytes_in, METRICS_PACKET_TYPES),
+                         metrics_list(self->packets_out, METRICS_PACKET_TYPES),
+                         metrics_list(self->bytes_out, METRICS_PACKET_TYPES),
+                         histogramsObj);
+}
+
+static PyObject *metrics_reset(MetricsObject *self, PyObject *Py_UNUSED(args))
+{
+    memset(self->packets_in, 0, sizeof(MetricsObject) - offsetof(MetricsObject, packets_in));
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef MetricsMethods[] = {
+    {"count_in", (PyCFunction)metrics_count_in_method, METH_VARARGS, "Count received packet of given command and size."},
+    {"count_out", (PyCFunction)metrics_count_out, METH_O, "Count sent package."},
+    {"count_out_many", (PyCFunction)metrics_count_out_many, METH_O, "Count sent packages."},
+    {"observe", (PyCFunction)metrics_observe, METH_VARARGS, "Add duration in seconds to histogram."},
+    {"snapshot", (PyCFunction)metrics_snapshot, METH_NOARGS, "Return counters and histograms."},
+    {"reset", (PyCFunction)metrics_reset, METH_NOARGS, "Zero counters and histograms."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject MetricsType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gmqttlib.Metrics",
+    .tp_doc = "Connection counters and histograms.",
+    .tp_basicsize = sizeof(MetricsObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = metrics_new,
+    .tp_methods = MetricsMethods,
+};
+
+static PyMethodDef ModuleMethods[] = {
+    {"prop_loads", prop_loads, METH_VARARGS, "Load MQTT (5 version) props."},
+    {"split_packets", split_packets, METH_VARARGS, "Split stream buffer into (command, offset, length) MQTT frames."},
+    {"publish_loads", publish_loads, METH_VARARGS, "Decode PUBLISH packet into (topic, mid, properties, payload)."},
+    {"prop_dumps", prop_dumps, METH_VARARGS, "Dump MQTT (5 version) props."},
+    {"build_publish", build_publish, METH_VARARGS, "Build PUBLISH packet."},
+    {"validate_utf8", check_utf8, METH_VARARGS, "Check buffer is well-formed UTF-8."},
+    {"_validate_utf8_kernel", check_utf8_kernel, METH_VARARGS, "Check buffer is well-formed UTF-8 with given kernel."},
+#ifdef GMQTT_ZLIB
+    {"deflate_payload", deflate_payload, METH_VARARGS, "Compress payload into zlib stream."},
+    {"inflate_payload", inflate_payload, METH_VARARGS, "Decompress zlib stream into payload."},
+#endif
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef gmqttlibmodule = {
+    PyModuleDef_HEAD_INIT,
+    "gmqttlib",
+    NULL,
+    -1,
+    ModuleMethods
+};
+
+PyMODINIT_FUNC
+PyInit_gmqttlib(void)
+{
+    PyObject *typeObj;                          // python property type
+    uint32_t property_type;                     // property type
+    PyObject *module;                           // module object
+    PyObject *abcObj;                           // python collections.abc module
+    PyObject *mappingObj;                       // python Mapping class
+    PyObject *registeredObj;                    // result of Mapping.register
+
+#ifdef GMQTT_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        validate_utf8_impl = validate_utf8_avx2;
+        validate_utf8_impl_name = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+        validate_utf8_impl = validate_utf8_ssse3;
+        validate_utf8_impl_name = "ssse3";
+    }
+#endif
+
+    property_types = PyDict_New();
+    if (!property_types)
+        return NULL;
+    for (property_type = 0; property_type < sizeof(mqtt_property) / sizeof(mqtt_property[0]); property_type++) {
+        if (!mqtt_property[property_type])
+            continue;
+        property_names[property_type] = PyUnicode_InternFromString(mqtt_property[property_type]);
+        if (!property_names[property_type])
+            return NULL;
+        typeObj = PyLong_FromLong(property_type);
+        if (!typeObj || PyDict_SetItem(property_types, property_names[property_type], typeObj) != 0) {
+            Py_XDECREF(typeObj);
+            Py_CLEAR(property_types);
+            return NULL;
+        }
+        Py_DECREF(typeObj);
+    }
+
+    topic_separator = PyUnicode_InternFromString("/");
+    topic_single_wildcard = PyUnicode_InternFromString("+");
+    topic_multi_wildcard = PyUnicode_InternFromString("#");
+    if (!topic_separator || !topic_single_wildcard || !topic_multi_wildcard)
+        return NULL;
+
+    if (PyType_Ready(&PropertiesType) != 0 || PyType_Ready(&IdGeneratorType) != 0 ||
+        PyType_Ready(&TopicNodeType) != 0 || PyType_Ready(&TopicMatcherType) != 0 ||
+        PyType_Ready(&MetricsType) != 0)
+        return NULL;
+
+    module = PyModule_Create(&gmqttlibmodule);
+    if (!module)
+        return NULL;
+    if (PyModule_AddStringConstant(module, "UTF8_IMPL", validate_utf8_impl_name) != 0)
+        goto error;
+    Py_INCREF(&PropertiesType);
+    if (PyModule_AddObject(module, "Properties", (PyObject*)&PropertiesType) != 0) {
+        Py_DECREF(&PropertiesType);
+        goto error;
+    }
+    Py_INCREF(&IdGeneratorType);
+    if (PyModule_AddObject(module, "IdGenerator", (PyObject*)&IdGeneratorType) != 0) {
+        Py_DECREF(&IdGeneratorType);
+        goto error;
+    }
+    Py_INCREF(&TopicMatcherType);
+    if (PyModule_AddObject(module, "TopicMatcher", (PyObject*)&TopicMatcherType) != 0) {
+        Py_DECREF(&TopicMatcherType);
+        goto error;
+    }
+    Py_INCREF(&MetricsType);
+    if (PyModule_AddObject(module, "Metrics", (PyObject*)&MetricsType) != 0) {
+        Py_DECREF(&MetricsType);
+        goto error;
+    }
+    // isinstance(properties, collections.abc.Mapping) holds as for dictionary
+    abcObj = PyImport_ImportModule("collections.abc");
+    if (!abcObj)
+        goto error;
+    mappingObj = PyObject_GetAttrString(abcObj, "Mapping");
+    Py_DECREF(abcObj);
+    if (!mappingObj)
+        goto error;
+    registeredObj = PyObject_CallMethod(mappingObj, "register", "O", (PyObject*)&PropertiesType);
+    Py_DECREF(mappingObj);
+    if (!registeredObj)
+        goto error;
+    Py_DECREF(registeredObj);
+    return module;
+
+error:
+    Py_DECREF(module);
+    return NULL;
 }
@@ -45,6 +45,12 @@ TESTS_REQUIRE = [
 # Allow you to run pip install .[test] to get test dependencies included
 EXTRAS_REQUIRE = {"test": TESTS_REQUIRE}
 
+# payload compression links zlib, which comes with every Python build except Windows ones
+if sys.platform == "win32":
+    GMQTTLIB = Extension('gmqtt.gmqttlib', ['lib/gmqttlib.c'])
+else:
+    GMQTTLIB = Extension('gmqtt.gmqttlib', ['lib/gmqttlib.c'], libraries=['z'], define_macros=[('GMQTT_ZLIB', '1')])
+
 setup(
     name="gmqtt",
     version=gmqtt.__version__,
@@ -55,7 +61,7 @@ setup(
     author_email=gmqtt.__email__,
     license='MIT',
     url="https://github.com/wialon/gmqtt",
-    packages=find_packages(exclude=['examples', 'tests', 'lib']),
+    packages=find_packages(exclude=['examples', 'tests', 'lib', 'benchmarks']),
     download_url="https://github.com/wialon/gmqtt",
     classifiers=CLASSIFIERS,
     keywords=KEYWORDS,
@@ -64,6 +70,6 @@ setup(
     install_requires=[],
     tests_require=TESTS_REQUIRE,
     extras_require=EXTRAS_REQUIRE,
-    ext_modules=[Extension('gmqtt.gmqttlib', ['lib/gmqttlib.c'])],
+    ext_modules=[GMQTTLIB],
     python_requires='>=3.5',
 )
@@ -0,0 +1,209 @@
+import asyncio
+import multiprocessing
+import sys
+import uuid
+from types import SimpleNamespace
+
+import pytest
+
+import gmqtt
+from gmqtt.mqtt.package import PublishPacket
+from gmqtt.mqtt.utils import IdGenerator, pack_variable_byte_integer
+
+if not sys.platform.startswith('linux'):
+    pytest.skip('fanout needs Linux shared memory and abstract sockets', allow_module_level=True)
+
+from gmqtt.fanout import FanoutHub, FanoutSubscriber, SharedRing
+
+
+def ring_test_name():
+    return 'gmqtt-test-' + uuid.uuid4().hex[:12]
+
+
+def test_shared_ring_wraps():
+    ring = SharedRing.create(ring_test_name(), 4096)
+    reader = SharedRing.attach(ring.name)
+    try:
+        position = reader.write_position
+        received = []
+        for i in range(100):
+            record = bytes([i]) * (1 + i * 7 % 900)
+            assert ring.write(record[:3], record[3:])
+            records, position = reader.read(position)
+            received.extend(records)
+        assert received == [bytes([i]) * (1 + i * 7 % 900) for i in range(100)]
+        assert position == ring.write_position > ring.capacity
+
+        with pytest.raises(ValueError):
+            ring.write(b'x' * ring.max_record)
+    finally:
+        reader.close()
+        ring.close()
+
+
+def test_shared_ring_reader_overtaken():
+    ring = SharedRing.create(ring_test_name(), 4096)
+    try:
+        position = ring.write_position
+        for i in range(3):
+            ring.write(b'x' * 500)
+        records, position = ring.read(position)
+        assert len(records) == 3
+        # writer gets more than half of the ring ahead of the reader
+        for i in range(5):
+            ring.write(bytes([i]) * 500)
+        records, position = ring.read(position)
+        assert records is None and position == ring.write_position
+        ring.write(b'next')
+        assert ring.read(position) == ([b'next'], ring.write_position)
+    finally:
+        ring.close()
+
+
+def test_bounded_ring_full():
+    ring = SharedRing.create(ring_test_name(), 4096, bounded=True)
+    reader = SharedRing.attach(ring.name, bounded=True)
+    try:
+        written = 0
+        while ring.write(b'x' * 1000):
+            written += 1
+        assert written == 4
+        records, position = reader.read(reader.read_position, limit=2)
+        assert len(records) == 2
+        reader.read_position = position
+        assert ring.write(b'y' * 1000) and ring.write(b'z' * 1000)
+        assert not ring.write(b'w')
+        records, position = reader.read(reader.read_position)
+        assert records == [b'x' * 1000] * 2 + [b'y' * 1000, b'z' * 1000]
+    finally:
+        reader.close()
+        ring.close()
+
+
+def make_owner():
+    client = gmqtt.Client('owner')
+    client._connection = SimpleNamespace(_protocol=SimpleNamespace(proto_ver=5))
+    calls = []
+    client._connection.subscribe = lambda subscriptions, **kwargs: calls.append(
+        ('subscribe', [(sub.topic, sub.qos) for sub in subscriptions]))
+    client._connection.unsubscribe = lambda topic, **kwargs: calls.append(('unsubscribe', topic))
+    client._connection.send_command_with_mid = lambda *args, **kwargs: None
+    client._connection.publish_many = lambda messages: calls.extend(
+        ('publish', message.topic, message.payload, message.qos, message.retain, message.properties)
+        for message in messages) or [(None, None) for _ in messages]
+    return client, calls
+
+
+def receive_publish(client, topic, payload, qos=0, **properties):
+    protocol = SimpleNamespace(proto_ver=5, id_generator=IdGenerator())
+    message = gmqtt.Message(topic, payload, qos=qos, **properties)
+    mid, pkg = PublishPacket.build_package(message, protocol)
+    client._handle_publish_packet(pkg[0], memoryview(bytes(pkg))[len(pack_variable_byte_integer(len(pkg) - 2)) + 1:])
+
+
+async def wait_for(condition):
+    for _ in range(200):
+        if condition():
+            return
+        await asyncio.sleep(0.005)
+    raise AssertionError('condition is not met')
+
+
+@pytest.mark.asyncio
+async def test_fanout_hub_and_subscribers():
+    name = ring_test_name()
+    client, calls = make_owner()
+    hub = await FanoutHub(client, name).start()
+    subscribers = [FanoutSubscriber(name), FanoutSubscriber(name)]
+    received = [[], []]
+    try:
+        for subscriber, messages in zip(subscribers, received):
+            await subscriber.connect()
+            subscriber.on_message = lambda sub, topic, payload, qos, properties, messages=messages: messages.append(
+                (topic, payload, qos, properties.get('user_property')))
+        subscribers[0].subscribe('a/#', qos=1)
+        subscribers[1].subscribe('a/b', qos=0)
+        subscribers[1].subscribe('c', qos=2)
+        await wait_for(lambda: len(calls) == 3)
+        assert calls == [('subscribe', [('a/#', 1)]), ('subscribe', [('a/b', 0)]), ('subscribe', [('c', 2)])]
+
+        receive_publish(client, 'a/b', b'1', qos=1, user_property=('k', 'v'))
+        receive_publish(client, 'a/x', b'2', qos=1)
+        receive_publish(client, 'c', b'3' * 100000, qos=2)
+        await wait_for(lambda: len(received[0]) == 2 and len(received[1]) == 2)
+        assert received[0] == [('a/b', b'1', 1, [('k', 'v')]), ('a/x', b'2', 1, None)]
+        assert received[1] == [('a/b', b'1', 0, [('k', 'v')]), ('c', b'3' * 100000, 2, None)]
+
+        subscribers[1].publish('out', b'x', qos=1, retain=True, content_type='text/plain')
+        await subscribers[1].publish_async('out', b'y')
+        await wait_for(lambda: len(calls) == 5)
+        assert calls[3:] == [('publish', b'out', b'x', 1, True, {'content_type': 'text/plain'}),
+                             ('publish', b'out', b'y', 0, False, {})]
+
+        # filters nobody needs any more are unsubscribed
+        subscribers[1].unsubscribe('c')
+        await subscribers[0].disconnect()
+        await wait_for(lambda: len(calls) == 7)
+        assert sorted(calls[5:]) == [('unsubscribe', 'a/#'), ('unsubscribe', 'c')]
+        assert [sub.topic for sub in client.subscriptions] == ['a/b']
+    finally:
+        for subscriber in subscribers:
+            if subscriber.is_connected:
+                await subscriber.disconnect()
+        await hub.stop()
+
+
+def run_subscriber(name, count, results):
+    async def main():
+        subscriber = FanoutSubscriber(name)
+        await subscriber.connect()
+        received = []
+        done = asyncio.get_event_loop().create_future()
+
+        def on_message(client, topic, payload, qos, properties):
+            received.append(payload)
+            if len(received) == count:
+                done.set_result(None)
+
+        subscriber.on_message = on_message
+        subscriber.subscribe('fanout/#', qos=1)
+        results.put('ready')
+        await done
+        await subscriber.publish_async('replies', b'%d' % len(received))
+        await asyncio.sleep(0.05)
+        await subscriber.disconnect()
+        results.put(received == [b'%d' % i for i in range(count)])
+
+    asyncio.run(main())
+
+
+@pytest.mark.asyncio
+async def test_fanout_to_other_processes():
+    name = ring_test_name()
+    client, calls = make_owner()
+    hub = await FanoutHub(client, name).start()
+    context = multiprocessing.get_context('spawn')
+    results = context.Queue()
+    processes = [context.Process(target=run_subscriber, args=(name, 1000, results)) for _ in range(2)]
+    try:
+        for process in processes:
+            process.start()
+        loop = asyncio.get_event_loop()
+        for _ in processes:
+            assert await loop.run_in_executor(None, results.get, True, 30) == 'ready'
+        await wait_for(lambda: len(client.subscriptions) == 1)
+
+        for i in range(1000):
+            receive_publish(client, 'fanout/{}'.format(i % 10), b'%d' % i, qos=1)
+            if i % 100 == 99:
+                await asyncio.sleep(0)
+        for _ in processes:
+            assert await loop.run_in_executor(None, results.get, True, 30) is True
+        await wait_for(lambda: len([call for call in calls if call[0] == 'publish']) == 2)
+        assert [call[1:3] for call in calls if call[0] == 'publish'] == [(b'replies', b'1000')] * 2
+    finally:
+        for process in processes:
+            process.join(10)
+            if process.is_alive():
+                process.terminate()
+        await hub.stop()
@@ -0,0 +1,598 @@
+import json
+import pickle
+import random
+import struct
+from collections.abc import Mapping
+from copy import deepcopy
+from types import SimpleNamespace
+
+import pytest
+
+import gmqtt
+from gmqtt import compression
+from gmqtt.mqtt import package, protocol
+from gmqtt.mqtt.constants import MQTTCommands, PubAckReasonCode, PubRecReasonCode
+from gmqtt.mqtt.package import PackageFactory, PublishPacket
+from gmqtt.mqtt.protocol import MQTTProtocol
+from gmqtt.mqtt.utils import PyIdGenerator, PyTopicMatcher, PyMetrics, HISTOGRAM_FRAME_PARSE, unpack_variable_byte_integer
+
+from .utils import PackagesCollector, build_frame, build_publish, make_client
+
+gmqttlib = pytest.importorskip('gmqtt.gmqttlib')
+
+
+def read_stream(stream, chunk_sizes, use_gmqttlib, monkeypatch):
+    monkeypatch.setattr(protocol, '_has_gmqttlib', use_gmqttlib)
+    proto = MQTTProtocol()
+    collector = PackagesCollector()
+    proto.set_connection(collector)
+
+    buf = b''
+    pos = 0
+    for size in chunk_sizes:
+        buf += stream[pos:pos + size]
+        pos += size
+        parsed_size = proto._read_packet(buf)
+        if parsed_size == -1:
+            return collector.packages, -1
+        buf = buf[parsed_size:]
+    return collector.packages, len(buf)
+
+
+@pytest.mark.asyncio
+async def test_split_packets_matches_python(monkeypatch):
+    rnd = random.Random(42)
+    frames = [(0x30 | rnd.randrange(16), bytes(rnd.randrange(256) for _ in range(rnd.choice((0, 1, 5, 130, 20000)))))
+              for _ in range(200)]
+    stream = b''.join(build_frame(cmd, body) for cmd, body in frames)
+
+    chunk_sizes = []
+    left = len(stream)
+    while left > 0:
+        chunk_sizes.append(min(left, rnd.choice((1, 2, 3, 64, 4096))))
+        left -= chunk_sizes[-1]
+
+    c_packages, c_left = read_stream(stream, chunk_sizes, True, monkeypatch)
+    py_packages, py_left = read_stream(stream, chunk_sizes, False, monkeypatch)
+
+    assert c_packages == py_packages == frames
+    assert c_left == py_left == 0
+
+
+def test_split_packets_offsets():
+    stream = build_frame(0x30, b'abc') + build_frame(0xd0, b'') + b'\x30\x05ab'
+    parsed_size, frames = gmqttlib.split_packets(stream)
+    assert frames == [(0x30, 2, 3), (0xd0, 7, 0)]
+    assert parsed_size == 7
+
+    parsed_size, frames = gmqttlib.split_packets(memoryview(bytearray(stream))[5:])
+    assert frames == [(0xd0, 2, 0)]
+    assert parsed_size == 2
+
+
+@pytest.mark.asyncio
+@pytest.mark.parametrize('use_gmqttlib', [True, False])
+async def test_split_packets_malformed_length(use_gmqttlib, monkeypatch):
+    stream = build_frame(0x30, b'ok') + b'\x30\x80\x80\x80\x80\x01'
+    packages, left = read_stream(stream, [len(stream)], use_gmqttlib, monkeypatch)
+    assert packages == [(0x30, b'ok')]
+    assert left == -1
+
+    # incomplete remaining length is not an error
+    packages, left = read_stream(b'\x30\xff\xff', [3], use_gmqttlib, monkeypatch)
+    assert packages == []
+    assert left == 3
+
+
+PUBLISH_CASES = [
+    dict(topic='a/b', payload=b'hello'),
+    dict(topic='a/b', payload=b'', qos=1),
+    dict(topic='a/b', payload=b'x' * 1000, qos=2, content_type='json', user_property=[('k', 'v'), ('k2', 'v2')],
+         message_expiry_interval=60, subscription_identifier=300, correlation_data=b'\x00\x01'),
+    dict(topic='a/b', payload=b'3.1.1', qos=1, proto_ver=4),
+]
+
+
+@pytest.mark.asyncio
+@pytest.mark.parametrize('case', PUBLISH_CASES)
+@pytest.mark.parametrize('extract_c_properties', [True, False])
+async def test_publish_loads_matches_python(case, extract_c_properties):
+    case = dict(case)
+    proto_ver = case.get('proto_ver', 5)
+    cmd, packet = build_publish(**case)
+    qos = (cmd & 0x06) >> 1
+
+    client = make_client(proto_ver, extract_c_properties)
+    py_topic, py_mid, py_properties, py_payload = client._decode_publish_packet(qos, packet)
+    c_topic, c_mid, c_properties, c_payload = client._decode_publish_packet_c(qos, packet)
+
+    assert isinstance(c_payload, memoryview)
+    assert (c_topic, c_mid, c_properties, bytes(c_payload)) == (py_topic, py_mid, py_properties, bytes(py_payload))
+    assert c_topic == case['topic'].encode()
+    assert bytes(c_payload) == case['payload']
+
+
+@pytest.mark.asyncio
+async def test_publish_loads_topic_aliases():
+    aliases = {}
+    cmd, packet = build_publish('a/b', b'1', topic_alias=3)
+    assert gmqttlib.publish_loads(packet, 0, 5, False, aliases)[0] == b'a/b'
+    assert aliases == {3: b'a/b'}
+
+    cmd, packet = build_publish('', b'2', topic_alias=3)
+    topic, mid, properties, payload = gmqttlib.publish_loads(packet, 0, 5, True, aliases)
+    assert (topic, bytes(payload), properties['topic_alias']) == (b'a/b', b'2', [3])
+
+    cmd, packet = build_publish('', b'3', topic_alias=4)
+    assert gmqttlib.publish_loads(packet, 0, 5, False, aliases)[0] is None
+
+
+def test_publish_loads_malformed():
+    assert gmqttlib.publish_loads(b'\x00', 0, 5, False, {}) is None
+    assert gmqttlib.publish_loads(b'\x00\x05abc', 0, 5, False, {}) is None
+    # no message id
+    assert gmqttlib.publish_loads(b'\x00\x01a\x00', 1, 5, False, {}) is None
+    # properties size is out of packet
+    assert gmqttlib.publish_loads(b'\x00\x01a\x05\x01', 0, 5, False, {}) is None
+    # unknown property
+    assert gmqttlib.publish_loads(b'\x00\x01a\x02\x7f\x00', 0, 5, False, {}) is None
+
+
+NATIVE_PROPERTIES_CASES = [
+    {},
+    {'payload_format_id': 1, 'message_expiry_interval': 60, 'content_type': 'json', 'response_topic': 'a/б',
+     'correlation_data': b'\x00\x01', 'subscription_identifier': 268435455, 'topic_alias': 10},
+    {'user_property': ('key', 'value')},
+    {'user_property': [('k1', 'v1'), ('k2', 'v2')]},
+    {'session_expiry_interval': 0xFFFFFFFF, 'receive_maximum': 24000, 'maximum_packet_size': 1024,
+     'request_problem_info': 1, 'request_response_info': 0, 'will_delay_interval': 5, 'auth_method': 'm'},
+    {'user_property': []},
+]
+PROPERTIES_CASES = NATIVE_PROPERTIES_CASES + [
+    # not supported natively, dumped by Python code
+    {'user_property': [['k1', 'v1']]},
+    {'unknown_property': 1, 'content_type': 'json'},
+]
+
+
+@pytest.mark.parametrize('properties', PROPERTIES_CASES)
+def test_prop_dumps_matches_python(properties, monkeypatch):
+    c_result = PackageFactory._build_properties_data(properties, 5)
+    monkeypatch.setattr(package, '_has_gmqttlib', False)
+    py_result = PackageFactory._build_properties_data(properties, 5)
+    assert c_result == py_result
+
+
+@pytest.mark.parametrize('properties', PROPERTIES_CASES)
+@pytest.mark.parametrize('qos', [0, 1])
+@pytest.mark.parametrize('proto_ver', [4, 5])
+def test_build_publish_matches_python(properties, qos, proto_ver, monkeypatch):
+    protocol = SimpleNamespace(proto_ver=proto_ver)
+    message = gmqtt.Message('a/b', b'x' * 200, qos=qos, retain=True, **properties)
+    command = 0x30 | qos << 1 | 1
+    mid = 10 if qos else None
+
+    c_packet = gmqttlib.build_publish(command, message.topic, mid, message.properties if proto_ver == 5 else None,
+                                      message.payload)
+    monkeypatch.setattr(package, '_has_gmqttlib', False)
+    py_packet = PublishPacket._build_package(command, message.topic, message.properties, message, mid, protocol)
+    if proto_ver == 5 and properties not in NATIVE_PROPERTIES_CASES:
+        # falls back to Python code
+        assert c_packet is None
+    else:
+        assert isinstance(c_packet, bytearray)
+        assert c_packet == py_packet
+
+
+@pytest.mark.parametrize('properties', PROPERTIES_CASES[:5])
+def test_prop_loads_matches_python(properties):
+    block = PackageFactory._build_properties_data(properties, 5)
+    c_properties = gmqttlib.prop_loads(block)
+    _, block_body = unpack_variable_byte_integer(block)
+    py_properties = make_client()._load_properties(block_body)
+
+    assert isinstance(c_properties, gmqttlib.Properties)
+    assert c_properties == py_properties
+    assert py_properties == c_properties
+    assert len(c_properties) == len(py_properties)
+    assert dict(c_properties) == py_properties
+
+
+def test_prop_loads_lazy_mapping():
+    properties = gmqttlib.prop_loads(PackageFactory._build_properties_data(
+        {'content_type': 'json', 'subscription_identifier': 1, 'correlation_data': b'\x01'}, 5))
+    properties['subscription_identifier'] = properties['subscription_identifier'] + [2]
+
+    assert len(properties) == 3
+    assert 'content_type' in properties and 'topic_alias' not in properties
+    assert properties.get('topic_alias') is None
+    assert properties.get('correlation_data') == [b'\x01']
+    assert properties['subscription_identifier'] == [1, 2]
+    with pytest.raises(KeyError):
+        properties['topic_alias']
+
+    properties['dup'] = 0
+    del properties['content_type']
+    assert sorted(properties) == ['correlation_data', 'dup', 'subscription_identifier']
+    assert properties.pop('dup') == 0
+    assert 'content_type' not in properties
+    with pytest.raises(KeyError):
+        del properties['content_type']
+
+    assert isinstance(properties, Mapping)
+    assert pickle.loads(pickle.dumps(properties)) == properties
+    assert deepcopy(properties) == {'correlation_data': [b'\x01'], 'subscription_identifier': [1, 2]}
+
+
+def test_prop_loads_binary_data():
+    block = PackageFactory._build_properties_data({'auth_data': b'\x00\xff', 'reason_string': 'r'}, 5)
+    assert gmqttlib.prop_loads(block) == {'auth_data': [b'\x00\xff'], 'reason_string': ['r']}
+
+
+def test_prop_loads_keeps_order():
+    block = b'\x06' + b'\x0b\x01' + b'\x0b\x02' + b'\x0b\x03'
+    assert gmqttlib.prop_loads(block)['subscription_identifier'] == [1, 2, 3]
+    # trailing property type without value
+    assert gmqttlib.prop_loads(b'\x03\x0b\x01\x01') is None
+
+
+def test_build_publish_invalid_values():
+    assert gmqttlib.prop_dumps({'payload_format_id': 256}) is None
+    assert gmqttlib.prop_dumps({'content_type': 1}) is None
+    assert gmqttlib.build_publish(0x32, b'a', 65536, None, b'') is None
+    assert gmqttlib.build_publish(0x30, b'a' * 65536, None, None, b'') is None
+
+
+UTF8_KERNELS = [kernel for kernel in ('scalar', 'ssse3', 'avx2')
+                if gmqttlib._validate_utf8_kernel(b'', False, kernel) is not None]
+
+
+def python_validate_utf8(data, allow_null):
+    try:
+        str(data, 'utf-8')
+    except UnicodeDecodeError:
+        return False
+    return allow_null or b'\x00' not in data
+
+
+def random_utf8_samples(rnd, count):
+    alphabet = ['a', '/', '\x00', '\x7f', 'é', 'Ж', 'ࠀ', '€', '￿', '😀', '\U0010ffff']
+    junk = [b'\x80', b'\xbf', b'\xc0\x80', b'\xc1\xbf', b'\xe0\x80\x80', b'\xed\xa0\x80', b'\xf0\x80\x80\x80',
+            b'\xf4\x90\x80\x80', b'\xf5\x80\x80\x80', b'\xff', b'\xe2\x82', b'\xf0\x9f\x98']
+    for _ in range(count):
+        data = ''.join(rnd.choice(alphabet) if rnd.random() < 0.3 else 'x'
+                       for _ in range(rnd.randrange(0, 130))).encode()
+        if data and rnd.random() < 0.5:
+            pos = rnd.randrange(len(data))
+            data = data[:pos] + rnd.choice(junk) + data[pos:]
+        if data and rnd.random() < 0.2:
+            # cut multibyte character at the end
+            data = data[:-1]
+        yield data
+
+
+@pytest.mark.parametrize('kernel', UTF8_KERNELS)
+@pytest.mark.parametrize('allow_null', [True, False])
+def test_validate_utf8_matches_python(kernel, allow_null):
+    rnd = random.Random(5)
+    for data in random_utf8_samples(rnd, 5000):
+        assert gmqttlib._validate_utf8_kernel(data, allow_null, kernel) == python_validate_utf8(data, allow_null), data
+
+
+@pytest.mark.parametrize('kernel', UTF8_KERNELS)
+@pytest.mark.parametrize('data, valid', [
+    (b'', True),
+    (b'a/b', True),
+    ('Grüße, привет, 你好, 😀'.encode(), True),
+    (b'a\x00b', False),
+    # overlong encodings
+    (b'\xc0\xaf', False),
+    (b'\xe0\x80\xaf', False),
+    (b'\xf0\x80\x80\xaf', False),
+    # UTF-16 surrogates
+    (b'\xed\xa0\x80', False),
+    (b'\xed\xbf\xbf', False),
+    # above U+10FFFF
+    (b'\xf4\x90\x80\x80', False),
+    # unexpected continuation, truncated sequence
+    (b'\x80', False),
+    (b'\xe2\x82', False),
+])
+@pytest.mark.parametrize('prefix', [b'', b'x' * 31, b'x' * 63])
+def test_validate_utf8_cases(kernel, data, valid, prefix):
+    assert gmqttlib._validate_utf8_kernel(prefix + data, False, kernel) is valid
+    assert gmqttlib._validate_utf8_kernel(prefix + data + b'y' * 40, False, kernel) is valid
+
+
+def test_validate_utf8_allow_null():
+    assert gmqttlib.validate_utf8(memoryview(b'a\x00b'), True)
+    assert not gmqttlib.validate_utf8(b'a\x00b')
+
+
+def test_prop_loads_rejects_invalid_strings():
+    assert gmqttlib.prop_loads(b'\x04\x03\x00\x01a') == {'content_type': ['a']}
+    assert gmqttlib.prop_loads(b'\x06\x03\x00\x03\xed\xa0\x80') is None
+    assert gmqttlib.prop_loads(b'\x04\x03\x00\x01\x00') is None
+
+
+@pytest.mark.asyncio
+@pytest.mark.parametrize('qos', [0, 1, 2])
+async def test_publish_payload_format_validation(qos):
+    client = make_client()
+    client._validate_payload_format = True
+    sent = []
+    received = []
+    client._send_command_with_mid = lambda cmd, mid, dup, reason_code=0: sent.append((cmd, reason_code))
+    client.on_message = lambda *args: received.append(args[2])
+
+    cmd, packet = build_publish('a/b', b'\xff', qos=qos, payload_format_id=1)
+    client._handle_publish_packet(cmd, packet)
+    cmd, packet = build_publish('a/b', 'ok'.encode(), qos=qos, payload_format_id=1)
+    client._handle_publish_packet(cmd, packet)
+
+    assert received == [b'ok']
+    if qos == 1:
+        assert sent[0] == (MQTTCommands.PUBACK, PubAckReasonCode.PAYLOAD_FORMAT_INVALID)
+    elif qos == 2:
+        assert sent[0] == (MQTTCommands.PUBREC, PubRecReasonCode.PAYLOAD_FORMAT_INVALID)
+
+
+@pytest.mark.parametrize('max_id', [65535, 100, 64, 1])
+def test_id_generator_matches_python(max_id):
+    rnd = random.Random(3)
+    c_generator, py_generator = gmqttlib.IdGenerator(max=max_id), PyIdGenerator(max=max_id)
+    used = set()
+    for _ in range(20000):
+        if used and (rnd.random() < 0.45 or len(used) == max_id):
+            mid = rnd.choice(sorted(used)) if rnd.random() < 0.9 else rnd.randrange(max_id + 2)
+            used.discard(mid)
+            c_generator.free_id(mid)
+            py_generator.free_id(mid)
+        else:
+            mid = c_generator.next_id()
+            assert mid == py_generator.next_id()
+            assert mid not in used and 1 <= mid <= max_id
+            used.add(mid)
+        assert c_generator.in_flight == py_generator.in_flight == len(used)
+
+    for generator in (c_generator, py_generator):
+        assert all(generator.is_used(mid) for mid in used)
+        generator.reset()
+        assert generator.in_flight == 0
+        assert generator.next_id() == 1
+
+
+@pytest.mark.parametrize('generator_class', [gmqttlib.IdGenerator, PyIdGenerator])
+def test_id_generator_overflow(generator_class):
+    generator = generator_class(max=65535)
+    assert [generator.next_id() for _ in range(65535)] == list(range(1, 65536))
+    with pytest.raises(OverflowError):
+        generator.next_id()
+
+    # round-robin, just freed identifier is not reused while there are others
+    generator.free_id(10)
+    generator.free_id(20)
+    assert generator.next_id() == 10
+    generator.free_id(5)
+    assert generator.next_id() == 20
+    assert generator.next_id() == 5
+
+
+@pytest.mark.parametrize('generator_class', [gmqttlib.IdGenerator, PyIdGenerator])
+def test_id_generator_use_id(generator_class):
+    generator = generator_class(max=100)
+    generator.use_id(1)
+    generator.use_id(3)
+    generator.use_id(3)
+    assert generator.in_flight == 2
+    assert [generator.next_id() for _ in range(2)] == [2, 4]
+    with pytest.raises(ValueError):
+        generator.use_id(101)
+
+
+def test_id_generator_per_client():
+    busy_client, client = make_client(), make_client()
+    for _ in range(65535):
+        busy_client._id_generator.next_id()
+    assert client._id_generator.next_id() == 1
+
+
+@pytest.mark.asyncio
+async def test_ids_are_freed_on_acknowledgement():
+    client = make_client()
+    client._send_command_with_mid = lambda cmd, mid, dup, reason_code=0: None
+    client._remove_message_from_query = lambda mid: None
+    generator = client._id_generator
+    mid = generator.next_id()
+
+    # incoming message has identifier from the server identifiers space
+    client.on_message = lambda *args: 0
+    cmd, packet = build_publish('a/b', b'', qos=1)
+    client._handle_publish_packet(cmd, packet)
+    assert generator.is_used(mid)
+
+    # QoS 2 message identifier is in use till PUBCOMP
+    client._handle_pubrec_packet(MQTTCommands.PUBREC, struct.pack('!H', mid))
+    assert generator.is_used(mid)
+    client._handle_pubcomp_packet(MQTTCommands.PUBCOMP, struct.pack('!H', mid))
+    assert not generator.is_used(mid)
+
+    # unless PUBREC has failure reason code
+    mid = generator.next_id()
+    client._handle_pubrec_packet(MQTTCommands.PUBREC, struct.pack('!HB', mid, 0x80))
+    assert not generator.is_used(mid)
+
+    mid = generator.next_id()
+    client._handle_puback_packet(MQTTCommands.PUBACK, struct.pack('!H', mid))
+    assert generator.in_flight == 0
+
+
+MATCHER_FILTERS = ['a/b', 'a/+', 'a/#', '#', '+/+', '+', 'a/+/c', 'a/b/c/#', '$SYS/#', '$SYS/+/x', '+/b',
+                   '$share/group/a/b', '$share/g2/+/+/c', '/', '/+', '+/', 'a//b']
+MATCHER_TOPICS = ['a', 'a/b', 'a/b/c', 'a/b/c/d', 'b', 'b/b', '$SYS/x', '$SYS/a/x', '$SYS', '/', '/a', 'a/',
+                  'a//b', '', 'x/y/c']
+
+
+@pytest.mark.parametrize('matcher_class', [gmqttlib.TopicMatcher, PyTopicMatcher])
+def test_topic_matcher(matcher_class):
+    matcher = matcher_class()
+    for topic_filter in MATCHER_FILTERS:
+        matcher.add(topic_filter, topic_filter)
+    assert len(matcher) == len(MATCHER_FILTERS)
+
+    assert set(matcher.match('a/b')) == {'a/b', 'a/+', 'a/#', '#', '+/+', '+/b', '$share/group/a/b'}
+    assert set(matcher.match('a')) == {'a/#', '#', '+'}
+    assert set(matcher.match('$SYS/a/x')) == {'$SYS/#', '$SYS/+/x'}
+    assert set(matcher.match('x/y/c')) == {'#', '$share/g2/+/+/c'}
+    # cached result is dropped when filters are changed
+    assert matcher.remove('#', '#')
+    assert not matcher.remove('#', '#')
+    assert not matcher.remove('a/b/c', 'a/b/c')
+    assert set(matcher.match('x/y/c')) == {'$share/g2/+/+/c'}
+
+    matcher.clear()
+    assert len(matcher) == 0
+    assert matcher.match('a/b') == ()
+
+
+def test_topic_matcher_matches_python():
+    rnd = random.Random(5)
+    c_matcher, py_matcher = gmqttlib.TopicMatcher(cache_size=8), PyTopicMatcher(cache_size=8)
+    added = []
+    for _ in range(3000):
+        if added and rnd.random() < 0.3:
+            topic_filter, value = added.pop(rnd.randrange(len(added)))
+            assert c_matcher.remove(topic_filter, value) and py_matcher.remove(topic_filter, value)
+        elif rnd.random() < 0.3:
+            topic_filter = rnd.choice(MATCHER_FILTERS)
+            value = object()
+            c_matcher.add(topic_filter, value)
+            py_matcher.add(topic_filter, value)
+            added.append((topic_filter, value))
+        else:
+            topic = rnd.choice(MATCHER_TOPICS)
+            assert sorted(map(id, c_matcher.match(topic))) == sorted(map(id, py_matcher.match(topic)))
+        assert len(c_matcher) == len(py_matcher) == len(added)
+
+
+@pytest.mark.parametrize('matcher_class', [gmqttlib.TopicMatcher, PyTopicMatcher])
+@pytest.mark.parametrize('topic_filter', ['', 'a/#/b', 'a+', 'a/b#', '$share/g', '$share//a', b'a/b'])
+def test_topic_matcher_invalid_filters(matcher_class, topic_filter):
+    with pytest.raises((TypeError, ValueError)):
+        matcher_class().add(topic_filter, None)
+
+
+def test_metrics_matches_python():
+    rnd = random.Random(11)
+    c_metrics, py_metrics = gmqttlib.Metrics(), PyMetrics()
+    for _ in range(2000):
+        command = rnd.randrange(256)
+        package = bytes([command]) + b'x' * rnd.randrange(100)
+        for metrics in (c_metrics, py_metrics):
+            metrics.count_in(command, len(package))
+            metrics.count_out(package)
+            metrics.count_out_many([bytearray(package), memoryview(package)])
+        seconds = rnd.choice([0, 1e-7, 1e-3, 0.5, 10 ** 7, -1])
+        histogram = rnd.randrange(4)
+        c_metrics.observe(histogram, seconds)
+        py_metrics.observe(histogram, seconds)
+
+    c_snapshot, py_snapshot = c_metrics.snapshot(), py_metrics.snapshot()
+    assert c_snapshot[:4] == py_snapshot[:4]
+    for (c_buckets, c_sum), (py_buckets, py_sum) in zip(c_snapshot[4], py_snapshot[4]):
+        assert c_buckets == py_buckets
+        assert c_sum == pytest.approx(py_sum)
+
+    c_metrics.reset()
+    assert not any(sum(values) for values in c_metrics.snapshot()[:4])
+    with pytest.raises(ValueError):
+        c_metrics.observe(4, 1)
+
+
+@pytest.mark.asyncio
+@pytest.mark.parametrize('use_gmqttlib', [True, False])
+async def test_split_packets_counts_frames(use_gmqttlib, monkeypatch):
+    publish = build_frame(0x30, b'\x00\x01a' + b'x' * 300)
+    stream = publish + build_frame(0xd0, b'') + b'\x30\x05'
+    monkeypatch.setattr(protocol, '_has_gmqttlib', use_gmqttlib)
+    proto = MQTTProtocol()
+    proto.set_connection(PackagesCollector())
+    assert proto._read_packet(stream) == len(stream) - 2
+
+    packets_in, bytes_in, _, _, histograms = proto.metrics.snapshot()
+    assert packets_in[3] == packets_in[13] == 1
+    assert bytes_in[3] == len(publish) and bytes_in[13] == 2
+    assert sum(histograms[HISTOGRAM_FRAME_PARSE][0]) == 1
+
+
+TELEMETRY = json.dumps([{'device': 'sensor-{}'.format(i), 'temperature': 20 + i % 7, 'humidity': 40 + i % 11}
+                        for i in range(100)]).encode()
+TELEMETRY_DICTIONARY = b'{"device": "sensor-", "temperature": , "humidity": }'
+
+
+@pytest.mark.parametrize('dictionary', [None, TELEMETRY_DICTIONARY])
+@pytest.mark.parametrize('nogil_threshold', [0, 2**20])
+def test_compression_matches_python(dictionary, nogil_threshold):
+    for payload in (b'', b'x', TELEMETRY, bytes(range(256)) * 300):
+        c_payload = gmqttlib.deflate_payload(payload, 6, dictionary, nogil_threshold)
+        assert c_payload == compression._py_deflate_payload(payload, 6, dictionary, nogil_threshold)
+        assert gmqttlib.inflate_payload(c_payload, dictionary, len(payload), nogil_threshold) == payload
+        assert compression._py_inflate_payload(c_payload, dictionary, len(payload), nogil_threshold) == payload
+
+
+@pytest.mark.parametrize('inflate_payload', [gmqttlib.inflate_payload, compression._py_inflate_payload])
+def test_decompression_errors(inflate_payload):
+    compressed = gmqttlib.deflate_payload(TELEMETRY, 6, TELEMETRY_DICTIONARY)
+    limit = len(TELEMETRY)
+    for data, dictionary, max_size in [
+        (compressed, None, limit),
+        (compressed, b'another dictionary', limit),
+        (compressed[:-3], TELEMETRY_DICTIONARY, limit),
+        (compressed + b'x', TELEMETRY_DICTIONARY, limit),
+        (compressed, TELEMETRY_DICTIONARY, limit - 1),
+        (b'not compressed', None, limit),
+    ]:
+        with pytest.raises(ValueError):
+            inflate_payload(data, dictionary, max_size, 0)
+
+
+@pytest.mark.asyncio
+@pytest.mark.parametrize('extract_c_properties', [True, False])
+async def test_compressed_publish(extract_c_properties):
+    compressor = compression.PayloadCompressor(dictionary=TELEMETRY_DICTIONARY, min_size=64)
+    publisher = gmqtt.Client('publisher', compression=compressor)
+    publisher._connection = SimpleNamespace(_protocol=SimpleNamespace(proto_ver=5))
+    published = []
+    publisher._connection.publish = lambda message: published.append(message) or (None, None)
+    publisher._connection.publish_many = lambda messages: [(None, None) for _ in messages]
+
+    publisher.publish('t', TELEMETRY, user_property=('k', 'v'))
+    publisher.publish('t', b'short')
+    message = gmqtt.Message('t', TELEMETRY)
+    publisher.publish_many([message])
+    # message published twice is compressed once
+    publisher.publish(message)
+    published.append(message)
+
+    assert len(published[0].payload) < len(TELEMETRY) // 4
+    assert published[0].properties['user_property'] == [('k', 'v'), ('content-encoding', 'deflate')]
+    assert published[1].payload == b'short' and 'user_property' not in published[1].properties
+    assert published[2] is published[3] and published[2].properties['user_property'] == [('content-encoding', 'deflate')]
+
+    subscriber = make_client(extract_c_properties=extract_c_properties)
+    subscriber._payload_compressor = compressor
+    subscriber._send_puback = lambda mid, reason_code=0: received.append(('ack', reason_code))
+    received = []
+    subscriber.on_message = lambda client, topic, payload, qos, properties: received.append(
+        (payload, properties.get('user_property'))) or 0
+
+    for message in published:
+        cmd, packet = build_publish('t', message.payload, qos=1, **message.properties)
+        subscriber._handle_publish_packet(cmd, packet)
+    # mangled payload is not delivered
+    cmd, packet = build_publish('t', published[0].payload[:-1], qos=1, **published[0].properties)
+    subscriber._handle_publish_packet(cmd, packet)
+
+    delivered = [event for event in received if event != ('ack', 0)]
+    assert delivered == [(TELEMETRY, [('k', 'v')]), (b'short', None), (TELEMETRY, None), (TELEMETRY, None),
+                         ('ack', PubAckReasonCode.PAYLOAD_FORMAT_INVALID)]
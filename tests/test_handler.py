@@ -0,0 +1,135 @@
+import asyncio
+import json
+import time
+from concurrent.futures import ThreadPoolExecutor
+from types import SimpleNamespace
+
+import pytest
+
+import gmqtt
+from gmqtt import compression
+from gmqtt.decoder import PayloadDecoder
+from gmqtt.mqtt.constants import PubAckReasonCode, PubRecReasonCode
+
+from .utils import build_publish, make_client
+
+TELEMETRY = json.dumps([{'device': 'sensor-{}'.format(i), 'temperature': 20 + i % 5} for i in range(50)]).encode()
+
+
+@pytest.mark.asyncio
+async def test_subscription_callbacks():
+    client = make_client()
+    mids = iter(range(1, 10))
+    client._connection.subscribe = lambda subscriptions, **kwargs: next(mids)
+    client._connection.unsubscribe = lambda topic, **kwargs: next(mids)
+    received = []
+    client.on_message = lambda client, topic, payload, qos, properties: received.append(('on_message', topic))
+
+    def callback(name):
+        return lambda client, topic, payload, qos, properties: received.append((name, topic))
+
+    client.subscribe(gmqtt.Subscription('a/+', callback=callback('a'), subscription_identifier=5))
+    client.subscribe(gmqtt.Subscription('$share/group/a/b', callback=callback('shared')))
+    client.subscribe('c/#')
+
+    for topic in ('a/b', 'a/c', 'c/d'):
+        cmd, packet = build_publish(topic, b'')
+        client._handle_publish_packet(cmd, packet)
+    assert received == [('a', 'a/b'), ('shared', 'a/b'), ('a', 'a/c'), ('on_message', 'c/d')]
+    assert client.get_subscription_by_identifier(5).topic == 'a/+'
+    assert [sub.topic for sub in client.get_subscriptions_by_mid(3)] == ['c/#']
+
+    client.unsubscribe(['a/+', '$share/group/a/b'])
+    assert client.get_subscription_by_identifier(5) is None
+    received.clear()
+    cmd, packet = build_publish('a/b', b'')
+    client._handle_publish_packet(cmd, packet)
+    assert received == [('on_message', 'a/b')]
+
+
+@pytest.mark.asyncio
+async def test_payload_decoder():
+    def slow_json(payload):
+        time.sleep(0.05)
+        return json.loads(payload)
+
+    decoder = PayloadDecoder({'application/x-slow; v=1': slow_json}, executor=ThreadPoolExecutor(2),
+                             inline_threshold=16)
+    client = gmqtt.Client('test-client', payload_decoder=decoder, optimistic_acknowledgement=False)
+    client._connection = SimpleNamespace(_protocol=SimpleNamespace(proto_ver=5))
+    client.subscribe = lambda *args, **kwargs: None
+    client._index_subscription(gmqtt.Subscription('c/#', codec=bytes.upper))
+    events = []
+    client._send_puback = lambda mid, reason_code=0: events.append(('ack', reason_code))
+
+    async def on_message(client, topic, payload, qos, properties):
+        events.append((topic, payload))
+        return 0
+
+    client.on_message = on_message
+    messages = [
+        ('a', b'{"n": "' + b'x' * 32 + b'"}', dict(content_type='application/x-slow')),
+        ('a', b'[1]', dict(content_type='application/json; charset=utf-8')),
+        ('a', b'raw', {}),
+        ('b', b'text', dict(payload_format_id=1)),
+        ('c/d', b'sub', dict(content_type='application/json')),
+        ('a', b'not json' * 4, dict(content_type='application/x-slow')),
+        ('a', b'"last"', dict(content_type='application/json')),
+    ]
+    for topic, payload, properties in messages:
+        cmd, packet = build_publish(topic, payload, qos=1, **properties)
+        client._handle_publish_packet(cmd, packet)
+    for _ in range(100):
+        if len(events) == 12:
+            break
+        await asyncio.sleep(0.01)
+
+    delivered = [event for event in events if event[0] != 'ack']
+    # topics which do not wait for executor go right away, order of each topic is kept
+    assert delivered[:2] == [('b', 'text'), ('c/d', b'SUB')]
+    assert delivered[2:] == [('a', {'n': 'x' * 32}), ('a', [1]), ('a', b'raw'), ('a', 'last')]
+    # every acknowledgement follows delivery, undecodable payload is acknowledged as invalid
+    assert events.count(('ack', PubRecReasonCode.PAYLOAD_FORMAT_INVALID)) == 1
+    not_acknowledged = 0
+    for event in events:
+        if event[0] != 'ack':
+            not_acknowledged += 1
+        elif event[1] == 0:
+            not_acknowledged -= 1
+            assert not_acknowledged >= 0
+    assert not client._decode_queues
+
+
+@pytest.mark.asyncio
+async def test_large_compressed_payload_inflated_in_executor():
+    compressor = compression.PayloadCompressor(nogil_threshold=64)
+    compressed = compressor.compress(TELEMETRY)
+    marker = ('content-encoding', 'deflate')
+    subscriber = make_client()
+    subscriber._payload_compressor = compressor
+    received = []
+    subscriber._send_puback = lambda mid, reason_code=0: received.append(('ack', reason_code))
+    subscriber.on_message = lambda client, topic, payload, qos, properties: received.append(payload) or 0
+
+    for payload, properties in ((compressed, {'user_property': marker}), (b'plain', {}),
+                                (compressed[:-1], {'user_property': marker})):
+        subscriber._handle_publish_packet(*build_publish('t', payload, qos=1, **properties))
+    # compressed messages are acknowledged once inflated, next message of the topic waits for them to be delivered
+    assert received == [('ack', 0)]
+
+    for _ in range(100):
+        if len(received) == 5:
+            break
+        await asyncio.sleep(0.01)
+    assert received == [('ack', 0), ('ack', 0), TELEMETRY, b'plain', ('ack', PubAckReasonCode.PAYLOAD_FORMAT_INVALID)]
+    assert not subscriber._decode_queues
+
+
+@pytest.mark.asyncio
+async def test_compressed_payload_is_not_streamed():
+    client = make_client()
+    client._index_subscription(gmqtt.Subscription('fw/#', stream_threshold=1000))
+    cmd, header = build_publish('fw/1', b'', qos=1, user_property=('content-encoding', 'deflate'))
+    assert client._open_publish_stream(cmd, header, 10000) is None
+    cmd, header = build_publish('fw/1', b'', qos=1)
+    assert client._open_publish_stream(cmd, header, 10000) is not None
@@ -0,0 +1,222 @@
+import asyncio
+import multiprocessing
+import threading
+from collections import Counter
+
+import pytest
+
+import gmqtt
+from gmqtt.pool import ClientPool, _CommandWriter, _Worker, shard_topic, shared_topic
+
+from benchmarks.broker import FakeBroker
+
+
+class FakeConn:
+    def __init__(self):
+        self.sent = []
+
+    def send(self, command):
+        self.sent.append(command)
+
+
+def make_pool(workers):
+    pool = ClientPool('pool', workers=workers, share_group='group')
+    pool._writers = [FakeConn() for _ in range(workers)]
+    for state in pool._states:
+        state.alive = True
+    return pool
+
+
+def test_shard_topic():
+    topics = ['devices/{}/telemetry'.format(i) for i in range(10000)]
+    shards = Counter(shard_topic(topic, 4) for topic in topics)
+    assert set(shards) == {0, 1, 2, 3}
+    assert min(shards.values()) > 2000
+    assert shard_topic('a/b', 4) == shard_topic(b'a/b', 4)
+
+
+def test_shared_topic():
+    assert shared_topic('a/#', 'group') == '$share/group/a/#'
+    assert shared_topic('$share/other/a/#', 'group') == '$share/other/a/#'
+    assert shared_topic('a/#', None) == 'a/#'
+
+
+@pytest.mark.asyncio
+async def test_pool_publish_is_sharded_and_batched():
+    pool = make_pool(3)
+    for i in range(30):
+        pool.publish('devices/{}'.format(i % 5), str(i), qos=1)
+    pool.publish_many([gmqtt.Message('devices/0', 'last')])
+    assert all(conn.sent == [] for conn in pool._writers)
+
+    await asyncio.sleep(0)
+    published = {}
+    for index, conn in enumerate(pool._writers):
+        for command, messages in conn.sent:
+            assert command == 'publish_many'
+            for topic, payload, qos, retain, properties in messages:
+                assert shard_topic(topic, 3) == index
+                published.setdefault(topic, []).append(payload)
+    # order of messages of one topic is kept
+    assert published['devices/0'] == ['0', '5', '10', '15', '20', '25', b'last']
+
+
+def test_pool_subscribe_broadcast():
+    pool = make_pool(2)
+    pool.subscribe('a/+', qos=1)
+    assert [conn.sent for conn in pool._writers] == [[('subscribe', '$share/group/a/+', 1, {})]] * 2
+
+    pool._states[1].alive = False
+    pool.unsubscribe('a/+')
+    assert pool._writers[1].sent[-1][0] == 'subscribe'
+    assert not pool.is_connected
+    assert pool.health()[1]['alive'] is False
+
+
+@pytest.mark.asyncio
+async def test_command_writer_does_not_block():
+    reader, writer = multiprocessing.Pipe(duplex=False)
+    commands = _CommandWriter(writer, asyncio.get_event_loop())
+    batch = [('t', b'%04d' % i * 250, 1, False, {}) for i in range(1000)]
+    # worker does not read, the rest of the batch waits till the pipe is writable
+    commands.send(('publish_many', batch))
+    commands.send(('disconnect', {}))
+    assert commands.buffered > 0
+
+    loop = asyncio.get_event_loop()
+    assert await loop.run_in_executor(None, reader.recv) == ('publish_many', batch)
+    assert await loop.run_in_executor(None, reader.recv) == ('disconnect', {})
+    assert commands.buffered == 0
+    commands.close()
+    reader.close()
+
+
+class QuotaConnection:
+    def __init__(self, client):
+        self.client = client
+        self.published = []
+
+    def publish_many(self, messages):
+        packages = []
+        for message in messages:
+            mid = self.client._id_generator.next_id() if message.qos else None
+            self.published.append((message.topic, mid))
+            packages.append((mid, b''))
+        return packages
+
+    async def drain(self):
+        pass
+
+
+@pytest.mark.asyncio
+async def test_worker_publishes_within_send_quota():
+    worker = _Worker(0, None, None, 'worker', {}, None, None, 1)
+    client = worker._client
+    client._send_quota = 2
+    client._connection = QuotaConnection(client)
+    worker._command_publish_many([('a', b'1', 1, False, {}), ('b', b'2', 0, False, {}), ('a', b'3', 1, False, {}),
+                                  ('a', b'4', 1, False, {}), ('b', b'5', 0, False, {})])
+    worker._command_publish_many([('b', b'6', 0, False, {})])
+    await asyncio.sleep(0)
+    assert client._connection.published == [(b'a', 1), (b'b', None), (b'a', 2)]
+
+    client._release_send_quota(1)
+    for _ in range(5):
+        await asyncio.sleep(0)
+    assert client._connection.published[3:] == [(b'a', 3), (b'b', None), (b'b', None)]
+    assert worker._publishing is None
+
+
+@pytest.mark.asyncio
+async def test_pool_threads_with_broker():
+    broker = await FakeBroker().start()
+    received = []
+    lock = threading.Lock()
+
+    def on_message(client, topic, payload, qos, properties):
+        with lock:
+            received.append((client._client_id, topic, payload))
+        return 0
+
+    pool = ClientPool('pool', workers=2, on_message=on_message, use_threads=True, stats_interval=0.05)
+    try:
+        await pool.connect('127.0.0.1', broker.port)
+        assert len(broker._connections) == 2
+        pool.subscribe('in/#', qos=1)
+        while sum(len(subscriptions) for subscriptions in broker._connections.values()) < 2:
+            await asyncio.sleep(0.01)
+
+        for i in range(2000):
+            pool.publish('out/{}'.format(i % 10), b'x' * 1000, qos=1)
+        pool.flush()
+        await asyncio.wait_for(broker.wait_received(2000), 10)
+
+        publisher = gmqtt.Client('publisher')
+        await publisher.connect('127.0.0.1', broker.port)
+        publisher.publish('in/1', b'hello', qos=1)
+        for _ in range(200):
+            if len(received) == 2:
+                break
+            await asyncio.sleep(0.01)
+        await publisher.disconnect()
+        # FakeBroker delivers shared subscription messages to every member of the group
+        assert sorted(received) == [('pool-0', 'in/1', b'hello'), ('pool-1', 'in/1', b'hello')]
+        await asyncio.sleep(0.1)
+        assert pool.is_connected and all(state['in_flight'] == 0 for state in pool.health())
+    finally:
+        await pool.disconnect()
+        await broker.stop()
+    assert not any(state['alive'] for state in pool.health())
+
+
+def fail_second_worker(client, index):
+    if index == 1:
+        raise RuntimeError('setup failed')
+
+
+@pytest.mark.asyncio
+async def test_pool_connect_failure_stops_started_workers(caplog):
+    broker = await FakeBroker().start()
+    pool = ClientPool('pool', workers=3, setup=fail_second_worker, use_threads=True)
+    try:
+        with pytest.raises(ConnectionError):
+            await pool.connect('127.0.0.1', broker.port)
+        for _ in range(100):
+            if not broker._connections:
+                break
+            await asyncio.sleep(0.01)
+        assert not broker._connections
+        assert not any(state['alive'] for state in pool.health())
+        assert 'setup failed' in pool.health()[1]['error']
+        assert pool._workers == [] and pool._writers == []
+        # the worker after the failed one may not be started, it is not told to stop
+        assert 'dropped' not in caplog.text
+    finally:
+        await broker.stop()
+
+
+@pytest.mark.asyncio
+async def test_pool_processes_with_broker(caplog):
+    broker = await FakeBroker().start()
+    pool = ClientPool('pool', workers=2, use_threads=False, stats_interval=0.05)
+    try:
+        await pool.connect('127.0.0.1', broker.port)
+        assert len(broker._connections) == 2
+        with pytest.raises(RuntimeError):
+            await pool.connect('127.0.0.1', broker.port)
+        assert len(pool._workers) == len(pool._writers) == 2
+
+        pool.subscribe('in/#', qos=1)
+        for i in range(2000):
+            pool.publish('out/{}'.format(i % 10), b'%d' % i * 100, qos=1)
+        pool.flush()
+        await asyncio.wait_for(broker.wait_received(2000), 20)
+        while sum(len(subscriptions) for subscriptions in broker._connections.values()) < 2:
+            await asyncio.sleep(0.01)
+        await asyncio.sleep(0.2)
+        assert pool.is_connected and all(state['in_flight'] == 0 for state in pool.health())
+    finally:
+        await pool.disconnect()
+        await broker.stop()
+    assert not any(state['alive'] for state in pool.health())
+    assert 'dropped' not in caplog.text and 'does not stop' not in caplog.text
@@ -0,0 +1,609 @@
+import asyncio
+import gc
+import random
+import weakref
+from types import SimpleNamespace
+
+import pytest
+
+import gmqtt
+from gmqtt.mqtt.connection import MQTTConnection
+from gmqtt.mqtt.protocol import MQTTProtocol, MQTTBufferedProtocol, PayloadStream
+from gmqtt.mqtt.utils import CallbackExecutor, TimerWheel
+
+from .utils import PackagesCollector, build_frame
+
+
+class FakeTransport:
+    def __init__(self):
+        self.closed = False
+        self.paused = False
+        self.written = []
+
+    def get_extra_info(self, name, default=None):
+        return default
+
+    def is_closing(self):
+        return self.closed
+
+    def write(self, data):
+        self.written.append(bytes(data))
+
+    def writelines(self, list_of_data):
+        self.written.append(b''.join(list_of_data))
+
+    def close(self):
+        self.closed = True
+
+    def pause_reading(self):
+        self.paused = True
+
+    def resume_reading(self):
+        self.paused = False
+
+
+def feed(proto, data):
+    # mimics transport reading socket into the protocol buffer
+    while data:
+        buf = proto.get_buffer(-1)
+        size = min(len(buf), len(data))
+        buf[:size] = data[:size]
+        data = data[size:]
+        proto.buffer_updated(size)
+
+
+@pytest.mark.asyncio
+async def test_buffered_protocol_chunks():
+    rnd = random.Random(7)
+    frames = [(0x30, bytes(rnd.randrange(256) for _ in range(rnd.choice((0, 3, 200, 70000, 300000)))))
+              for _ in range(60)]
+    stream = b''.join(build_frame(cmd, body) for cmd, body in frames)
+
+    proto = MQTTBufferedProtocol(buffer_size=1024)
+    collector = PackagesCollector()
+    proto.set_connection(collector)
+    proto.connection_made(FakeTransport())
+
+    pos = 0
+    while pos < len(stream):
+        size = rnd.choice((1, 5, 1000, 50000))
+        feed(proto, stream[pos:pos + size])
+        pos += size
+
+    assert collector.packages == frames
+    # large frames buffer is released when it is not needed anymore
+    proto.get_buffer(-1)
+    assert len(proto._buffer) == 1024
+
+
+@pytest.mark.asyncio
+async def test_buffered_protocol_grows_once_for_large_frame():
+    proto = MQTTBufferedProtocol(buffer_size=1024)
+    collector = PackagesCollector()
+    proto.set_connection(collector)
+    proto.connection_made(FakeTransport())
+
+    frame = build_frame(0x30, b'x' * 100000)
+    feed(proto, frame[:10])
+    buffers = set()
+    for i in range(10, len(frame), 1000):
+        feed(proto, frame[i:i + 1000])
+        buffers.add(id(proto._buffer))
+
+    assert len(buffers) == 1
+    assert collector.packages == [(0x30, b'x' * 100000)]
+
+
+@pytest.mark.asyncio
+async def test_buffered_protocol_malformed_packet():
+    proto = MQTTBufferedProtocol()
+    transport = FakeTransport()
+    proto.set_connection(PackagesCollector())
+    proto.connection_made(transport)
+
+    feed(proto, b'\x30\x80\x80\x80\x80\x01')
+    assert transport.closed
+
+
+def make_writer(write_delay=None):
+    proto = MQTTProtocol(write_delay=write_delay)
+    proto.set_connection(SimpleNamespace(_last_data_out=0))
+    transport = FakeTransport()
+    proto._transport = transport
+    return proto, transport
+
+
+@pytest.mark.asyncio
+async def test_coalesced_writes():
+    proto, transport = make_writer(write_delay=0)
+    for i in range(3):
+        proto.write_data(bytes([i]))
+    proto.write_many([b'\x03', b'\x04'])
+    assert transport.written == []
+
+    await asyncio.sleep(0)
+    assert transport.written == [b'\x00\x01\x02\x03\x04']
+
+    # flushed at once when buffer is over the limit
+    proto.write_data(b'x' * proto.write_buffer_limit)
+    assert len(transport.written) == 2
+
+
+@pytest.mark.asyncio
+async def test_coalesced_writes_delay():
+    proto, transport = make_writer(write_delay=0.01)
+    proto.write_data(b'a')
+    await asyncio.sleep(0)
+    assert transport.written == []
+    await asyncio.sleep(0.02)
+    assert transport.written == [b'a']
+
+    proto.write_data(b'b')
+    proto.flush_writes()
+    assert transport.written == [b'a', b'b']
+
+
+@pytest.mark.asyncio
+async def test_publish_many():
+    proto, transport = make_writer()
+    client = gmqtt.Client('test-client')
+    client._connection = SimpleNamespace(publish_many=proto.send_publish_many)
+
+    messages = [gmqtt.Message('a/b', str(i), qos=i % 2) for i in range(10)]
+    client.publish_many(messages)
+    await asyncio.sleep(0)
+
+    expected = [proto.send_publish(message)[1] for message in messages]
+    assert len(transport.written) == 11
+    assert len(transport.written[0]) == sum(len(pkg) for pkg in expected)
+    stored = await client._persistent_storage.get_all()
+    assert len(stored) == 5
+    assert all(pkg[0] & 0x06 == 0x02 for _, _, pkg in stored)
+
+
+@pytest.mark.asyncio
+async def test_publish_many_frees_ids_on_failure():
+    proto, transport = make_writer()
+    messages = [gmqtt.Message('a/b', str(i), qos=1) for i in range(3)]
+    messages.append(gmqtt.Message('a/b', 'bad', qos=1, message_expiry_interval='x'))
+
+    with pytest.raises(Exception):
+        proto.send_publish_many(messages)
+    assert not any(proto.id_generator.is_used(mid) for mid in range(1, 5))
+    assert transport.written == []
+
+
+@pytest.mark.asyncio
+async def test_drain_waits_for_resume_writing():
+    proto, transport = make_writer()
+    await proto.drain()
+
+    proto.pause_writing()
+    drain = asyncio.ensure_future(proto.drain())
+    await asyncio.sleep(0)
+    assert not drain.done()
+
+    proto.resume_writing()
+    await asyncio.sleep(0)
+    assert drain.done()
+
+
+@pytest.mark.asyncio
+async def test_publish_async_send_quota():
+    proto, transport = make_writer()
+    client = gmqtt.Client('test-client')
+    client._connection = SimpleNamespace(publish=proto.send_publish, drain=proto.drain,
+                                         keepalive=60, send_command_with_mid=lambda *args, **kwargs: None)
+    client._connack_properties = {'receive_maximum': [2]}
+    client._update_send_quota()
+
+    mids = [await client.publish_async('a/b', 'x', qos=1) for _ in range(2)]
+    third = asyncio.ensure_future(client.publish_async('a/b', 'x', qos=1))
+    await asyncio.sleep(0)
+    assert not third.done()
+    assert len(transport.written) == 2
+
+    # QoS 0 messages are not limited
+    assert await client.publish_async('a/b', 'x') is None
+
+    client._handle_puback_packet(0x40, mids[0].to_bytes(2, 'big'))
+    assert await third is not None
+    assert len(transport.written) == 4
+
+
+@pytest.mark.asyncio
+async def test_auto_topic_alias():
+    proto, transport = make_writer()
+    client = gmqtt.Client('test-client', auto_topic_alias=True)
+    client._connection = SimpleNamespace(publish=proto.send_publish, _protocol=proto,
+                                         set_topic_alias_maximum=proto.topic_aliases.reset)
+    client._connack_properties = {'topic_alias_maximum': [2]}
+    client._update_topic_alias_maximum()
+
+    for topic in ('a/1', 'a/2', 'a/1', 'a/3', 'a/2', 'a/1'):
+        client.publish(topic, b'x')
+    # QoS > 0 messages are sent with topic as they may be resent over another connection
+    client.publish('a/1', b'x', qos=1)
+
+    decoded = []
+    for pkg in transport.written:
+        topic, mid, properties, payload = client._decode_publish_packet((pkg[0] & 0x06) >> 1, pkg[2:])
+        decoded.append((topic, properties.get('topic_alias', [None])[0]))
+    # a/2 is the least recently used topic when a/3 comes, a/1 loses its alias after that
+    assert decoded == [(b'a/1', 1), (b'a/2', 2), (b'a/1', 1), (b'a/3', 2), (b'a/2', 1), (b'a/1', 2),
+                       (b'a/1', None)]
+    # established alias is sent with empty topic
+    assert len(transport.written[2]) == len(transport.written[0]) - len('a/1')
+
+
+@pytest.mark.asyncio
+async def test_topic_alias_rolled_back_when_not_sent():
+    proto, transport = make_writer()
+    proto.topic_aliases.reset(2)
+    proto.send_publish(gmqtt.Message('a/1', b'x'))
+
+    with pytest.raises(Exception):
+        proto.send_publish(gmqtt.Message('a/2', b'x', message_expiry_interval='x'))
+    with pytest.raises(Exception):
+        proto.send_publish_many([gmqtt.Message('a/3', b'x'), gmqtt.Message('a/4', b'x', message_expiry_interval='x')])
+    proto.send_publish_many([gmqtt.Message('a/2', b'x'), gmqtt.Message('a/3', b'x')])
+    proto.flush_writes()
+
+    decoded = []
+    for pkg in transport.written[1:]:
+        while pkg:
+            length = pkg[1] + 2
+            topic_length = int.from_bytes(pkg[2:4], 'big')
+            decoded.append((bytes(pkg[4:4 + topic_length]), pkg[4 + topic_length + 3]))
+            pkg = pkg[length:]
+    # aliases of the packets never sent are released and established again along with the topic,
+    # a/1 was evicted by the dropped batch
+    assert decoded == [(b'a/2', 1), (b'a/3', 2)]
+
+
+@pytest.mark.asyncio
+async def test_client_metrics():
+    proto, transport = make_writer()
+    client = gmqtt.Client('test-client')
+    client._metrics = proto.metrics
+    client._connection = SimpleNamespace(publish=proto.send_publish, _protocol=proto, is_closing=lambda: False,
+                                         send_command_with_mid=lambda *args, **kwargs: None)
+    proto.set_connection(SimpleNamespace(_last_data_out=0, put_package=lambda pkg: client(*pkg)))
+    received = []
+    client.on_message = lambda *args: received.append(args)
+
+    client.publish('a/b', b'x' * 10)
+    client.publish('a/b', b'x', qos=1)
+    assert client.get_metrics()['in_flight'] == 1
+    assert client.get_metrics()['oldest_in_flight_age'] >= 0
+
+    mid = next(iter(client._in_flight_mids))
+    proto._read_packet(build_frame(0x40, mid.to_bytes(2, 'big')) + build_frame(0x30, b'\x00\x01a\x00payload'))
+    metrics = client.get_metrics()
+    assert received and metrics['in_flight'] == 0 and metrics['oldest_in_flight_age'] is None
+    assert metrics['packets_out'] == {'PUBLISH': 2}
+    assert metrics['bytes_out']['PUBLISH'] == sum(len(pkg) for pkg in transport.written)
+    assert metrics['packets_in'] == {'PUBLISH': 1, 'PUBACK': 1}
+    for name in ('puback_latency', 'frame_parse', 'callback'):
+        assert metrics['histograms'][name]['count'] == 1
+    assert metrics['histograms']['pubcomp_latency']['count'] == 0
+
+
+class ManualLoop:
+    def __init__(self):
+        self.now = 0.0
+        self.handles = []
+
+    def time(self):
+        return self.now
+
+    def call_at(self, when, callback):
+        self.handles.append((when, callback))
+        self.handles.sort(key=lambda handle: handle[0])
+        return SimpleNamespace(cancel=lambda: self.handles.remove((when, callback)))
+
+
+def test_timer_wheel():
+    loop = ManualLoop()
+    wheel = TimerWheel(loop, tick=1, slots=4, levels=3)
+    fired = []
+    delays = [0, 1, 3, 4, 5, 15, 16, 17, 40, 63, 64, 100, 1000]
+    timers = {delay: wheel.call_later(delay, lambda delay=delay: fired.append((delay, loop.now))) for delay in delays}
+    wheel.cancel(timers.pop(17))
+    wheel.cancel(timers[16])
+    wheel.cancel(timers.pop(16))
+    assert len(wheel) == len(timers)
+    # one loop timer for all of them
+    assert len(loop.handles) == 1
+
+    while loop.handles:
+        loop.now, run = loop.handles.pop(0)
+        run()
+    assert fired == [(delay, delay) for delay in sorted(timers)]
+    assert not len(wheel)
+
+
+def test_timer_wheel_reschedules_from_callback():
+    loop = ManualLoop()
+    wheel = TimerWheel(loop, tick=1, slots=4, levels=2)
+    fired = []
+
+    def callback():
+        fired.append(loop.now)
+        if len(fired) < 3:
+            wheel.call_later(10, callback)
+
+    wheel.call_later(2, callback)
+    # late loop timer catches up with missed ticks at once
+    loop.handles.clear()
+    loop.now = 5
+    wheel._run()
+    while loop.handles:
+        assert len(loop.handles) == 1
+        loop.now, run = loop.handles.pop(0)
+        run()
+    assert fired == [5, 15, 25]
+
+
+def test_timer_wheel_skips_empty_ticks():
+    loop = ManualLoop()
+    wheel = TimerWheel(loop, tick=0.1, slots=64, levels=4)
+    fired = []
+    wheel.call_later(60, lambda: fired.append(loop.now))
+    wakeups = 0
+    while loop.handles:
+        loop.now, run = loop.handles.pop(0)
+        wakeups += 1
+        run()
+    # cascade of the level 1 bucket and the expiry itself
+    assert wakeups == 2 and fired == [pytest.approx(60)]
+
+    # earlier timer arms the loop timer again
+    wheel.call_later(30, lambda: fired.append(loop.now))
+    wheel.call_later(1, lambda: fired.append(loop.now))
+    assert len(loop.handles) == 1
+    while loop.handles:
+        loop.now, run = loop.handles.pop(0)
+        run()
+    assert fired[1:] == [pytest.approx(61), pytest.approx(90)]
+
+
+@pytest.mark.asyncio
+async def test_keepalive_shares_timer_wheel():
+    proto, transport = make_writer()
+    connections = [MQTTConnection(transport, proto, True, 60) for _ in range(3)]
+    wheel = TimerWheel.for_loop()
+    assert len(wheel) >= 3
+
+    connection = connections[0]
+    timer = connection._keep_connection_callback
+    assert (timer.tick - wheel._current) * wheel._tick > 40
+
+    # incoming data only moves timestamp
+    connection.set_handler(lambda *args: None)
+    connection.put_package((0xd0, b''))
+    assert connection._keep_connection_callback is timer
+
+    # idle connection pings once per half of keepalive
+    connection._last_data_in -= 50
+    connection._keep_connection()
+    assert transport.written == [b'\xc0\x00']
+    connection._keep_connection()
+    assert transport.written == [b'\xc0\x00']
+
+    # server keepalive is applied at once
+    connection.keepalive = 5
+    assert connection._keep_connection_callback.tick <= wheel._current + 1
+    connection._keep_connection()
+    assert connection._keep_connection_callback is None
+    await asyncio.sleep(0)
+    assert transport.closed
+
+    for connection in connections[1:]:
+        connection.keepalive = 0
+        assert connection._keep_connection_callback is None
+
+
+def test_timer_wheel_does_not_keep_loop_alive():
+    async def schedule():
+        wheel = TimerWheel.for_loop()
+        wheel.cancel(wheel.call_later(0.05, lambda: None))
+        wheel.call_later(0, lambda: None)
+        await asyncio.sleep(0.2)
+        return wheel
+
+    loops = []
+    for _ in range(3):
+        loop = asyncio.new_event_loop()
+        assert len(loop.run_until_complete(schedule())) == 0
+        loop.close()
+        loops.append(weakref.ref(loop))
+    del loop
+    gc.collect()
+    assert all(loop() is None for loop in loops)
+    assert not any(wheel._loop is None for wheel in TimerWheel._wheels.values())
+
+
+@pytest.mark.asyncio
+async def test_callback_executor_ordered():
+    events = []
+    running = [0, 0]
+    executor = CallbackExecutor(workers=3, max_pending=6, ordered=True, on_pause=lambda: events.append('pause'),
+                                on_resume=lambda: events.append('resume'))
+
+    async def callback(topic, i):
+        running[0] += 1
+        running[1] = max(running)
+        await asyncio.sleep(0.001 * (3 - i % 3))
+        running[0] -= 1
+        events.append((topic, i))
+        return i
+
+    acks = []
+    for i in range(12):
+        executor.submit('t%d' % (i % 4), callback, 't%d' % (i % 4), i, callback=lambda f: acks.append(f.result()))
+    # plain functions are called too, they are not acknowledged
+    executor.submit('t0', lambda: events.append('sync'))
+    assert events == ['pause'] and executor.pending == 13
+
+    while executor.pending:
+        await asyncio.sleep(0.001)
+    assert running[1] == 3
+    assert events.count('pause') == events.count('resume') == 1
+    for topic in ('t0', 't1', 't2', 't3'):
+        assert [event[1] for event in events if event[0] == topic] == list(range(int(topic[1]), 12, 4))
+    assert sorted(acks) == list(range(12)) and 'sync' in events
+
+
+@pytest.mark.asyncio
+async def test_callback_executor_worker_cancelled():
+    events = []
+    done = []
+    executor = CallbackExecutor(workers=1, max_pending=2, ordered=True, on_pause=lambda: events.append('pause'),
+                                on_resume=lambda: events.append('resume'))
+    executor.submit('a', asyncio.sleep, 10)
+    executor.submit('a', done.append, 1)
+    assert executor.paused
+    await asyncio.sleep(0)
+
+    worker = next(task for task in asyncio.all_tasks() if task.get_coro().__qualname__ == 'CallbackExecutor._work')
+    worker.cancel()
+    await asyncio.sleep(0)
+    assert events == ['pause', 'resume'] and executor.pending == 1
+
+    # the rest of the key is run by the next worker
+    executor.submit('a', done.append, 2)
+    await asyncio.sleep(0)
+    assert done == [1, 2] and executor.pending == 0
+
+
+@pytest.mark.asyncio
+async def test_client_pauses_reading_while_callbacks_are_behind():
+    client = gmqtt.Client('test-client', callback_workers=2, max_pending_callbacks=4)
+    reading = []
+    client._connection = SimpleNamespace(_protocol=SimpleNamespace(proto_ver=5),
+                                         pause_reading=lambda: reading.append(False),
+                                         resume_reading=lambda: reading.append(True))
+    received = []
+    release = asyncio.Event()
+
+    async def on_message(client, topic, payload, qos, properties):
+        await release.wait()
+        received.append(payload)
+
+    client.on_message = on_message
+    for i in range(6):
+        body = b'\x00\x01a\x00' + bytes([i])
+        client._handle_publish_packet(0x30, body)
+    await asyncio.sleep(0.01)
+    assert reading == [False] and not received
+
+    release.set()
+    while client._callback_executor.pending:
+        await asyncio.sleep(0.001)
+    assert reading == [False, True]
+    assert sorted(received) == [bytes([i]) for i in range(6)]
+    assert client.get_metrics()['histograms']['callback']['count'] == 6
+
+
+@pytest.mark.asyncio
+async def test_streamed_payload(monkeypatch):
+    monkeypatch.setattr(PayloadStream, 'max_buffered', 8192)
+    proto = MQTTBufferedProtocol(buffer_size=4096)
+    transport = FakeTransport()
+    connection = MQTTConnection(transport, proto, True, 0)
+    proto.connection_made(transport)
+    client = gmqtt.Client('test-client')
+    client._connection = connection
+    connection.set_handler(client)
+    client._index_subscription(gmqtt.Subscription('fw/#', stream_threshold=100000))
+
+    delivered = []
+    received = {}
+    buffered = []
+
+    async def on_message(client, topic, payload, qos, properties):
+        delivered.append(topic)
+        if isinstance(payload, PayloadStream):
+            chunks = []
+            async for chunk in payload:
+                buffered.append(payload._buffered + len(chunk))
+                chunks.append(chunk)
+                await asyncio.sleep(0)
+            payload = b''.join(chunks)
+            # acknowledged after the stream is read
+            assert not transport.written
+        received[topic] = payload
+        return 0
+
+    client.on_message = on_message
+    rnd = random.Random(5)
+    firmware = bytes(rnd.randrange(256) for _ in range(300000))
+    data = build_frame(0x32, b'\x00\x0bfw/device-1\x00\x07\x03\x03\x00\x00' + firmware) + \
+        build_frame(0x30, b'\x00\x0bother/topic\x00' + firmware[:200000]) + build_frame(0x30, b'\x00\x01a\x00end')
+    buffers = set()
+    while data:
+        if transport.paused:
+            await asyncio.sleep(0)
+            continue
+        feed(proto, data[:1500])
+        data = data[1500:]
+        buffers.add(len(proto._buffer))
+    for _ in range(10):
+        await asyncio.sleep(0)
+
+    # stream is delivered as soon as its header is received
+    assert delivered == ['fw/device-1', 'other/topic', 'a']
+    assert received == {'fw/device-1': firmware, 'other/topic': firmware[:200000], 'a': b'end'}
+    # streamed payload is not buffered, the other large one is
+    assert max(buffered) <= 8192 + 1500
+    assert max(buffers) > 200000 and 4096 in buffers
+    assert transport.written == [b'\x40\x04\x00\x07\x00\x00']
+    assert proto.metrics.snapshot()[0][3] == 3
+
+
+@pytest.mark.asyncio
+async def test_stream_goes_to_streaming_subscription_only(monkeypatch):
+    monkeypatch.setattr(PayloadStream, 'max_buffered', 8192)
+    proto = MQTTBufferedProtocol(buffer_size=4096)
+    transport = FakeTransport()
+    connection = MQTTConnection(transport, proto, True, 0)
+    proto.connection_made(transport)
+    client = gmqtt.Client('test-client')
+    client._connection = connection
+    connection.set_handler(client)
+
+    streamed = []
+    received = []
+    ignored = []
+
+    async def on_firmware(client, topic, payload, qos, properties):
+        streamed.append((topic, await payload.read()))
+        return 0
+
+    def on_logs(client, topic, payload, qos, properties):
+        # stream is not read, so it is discarded
+        ignored.append((topic, payload.size))
+        return 0
+
+    client._index_subscription(gmqtt.Subscription('fw/#', stream_threshold=100000, callback=on_firmware))
+    client._index_subscription(gmqtt.Subscription('logs/#', stream_threshold=100000, callback=on_logs))
+    client._index_subscription(gmqtt.Subscription('#', callback=lambda *args: received.append(args[1:3]) or 0))
+
+    firmware = bytes(range(256)) * 1200
+    data = build_frame(0x32, b'\x00\x04fw/1\x00\x07\x00' + firmware) + \
+        build_frame(0x32, b'\x00\x06logs/1\x00\x08\x00' + firmware)
+    while data:
+        if transport.paused:
+            await asyncio.sleep(0)
+            continue
+        feed(proto, data[:1500])
+        data = data[1500:]
+    for _ in range(10):
+        await asyncio.sleep(0)
+
+    assert streamed == [('fw/1', firmware)]
+    assert ignored == [('logs/1', len(firmware))]
+    # overlapping subscription without streaming gets bytes
+    assert received == [('fw/1', firmware), ('logs/1', firmware)]
+    assert transport.written == [b'\x40\x04\x00\x07\x00\x00', b'\x40\x04\x00\x08\x00\x00']
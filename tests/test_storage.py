@@ -0,0 +1,367 @@
+import asyncio
+import os
+import struct
+from types import SimpleNamespace
+
+import pytest
+
+import gmqtt
+from gmqtt.mqtt.package import PublishPacket
+from gmqtt.storage import HeapPersistentStorage, IndexedPersistentStorage, SegmentLogPersistentStorage
+
+
+@pytest.fixture(params=['heap', 'indexed', 'segment_log'])
+def storage_class(request, tmp_path):
+    if request.param == 'heap':
+        return HeapPersistentStorage
+    elif request.param == 'indexed':
+        return IndexedPersistentStorage
+    return lambda: SegmentLogPersistentStorage(str(tmp_path / 'storage'))
+
+
+@pytest.mark.asyncio
+async def test_storage_keeps_send_order(storage_class):
+    storage = storage_class()
+    for mid in (5, 3, 9):
+        await storage.push_message(mid, b'pkg %d' % mid)
+    await storage.push_messages([(1, b'pkg 1'), (2, b'pkg 2')])
+
+    await storage.remove_message_by_mid(9)
+    # unknown mid is ignored
+    await storage.remove_message_by_mid(100)
+
+    assert [mid for _, mid, _ in await storage.get_all()][:2] == [5, 3]
+    assert sorted(mid for _, mid, _ in await storage.get_all()) == [1, 2, 3, 5]
+    assert await storage.pop_message() == (5, b'pkg 5')
+    assert await storage.pop_message() == (3, b'pkg 3')
+    assert not await storage.is_empty
+
+
+@pytest.mark.asyncio
+async def test_storage_wait_empty(storage_class):
+    storage = storage_class()
+    await storage.push_messages([(1, b'1'), (2, b'2')])
+
+    waiter = asyncio.ensure_future(storage.wait_empty())
+    await asyncio.sleep(0)
+    await storage.remove_message_by_mid(1)
+    await asyncio.sleep(0)
+    assert not waiter.done()
+
+    await storage.remove_message_by_mid(2)
+    await asyncio.wait_for(waiter, 1)
+    assert await storage.is_empty
+    # does not block on empty storage
+    await asyncio.wait_for(storage.wait_empty(), 1)
+
+
+@pytest.mark.asyncio
+async def test_indexed_storage():
+    storage = IndexedPersistentStorage()
+    await storage.push_messages([(mid, b'%d' % mid) for mid in range(1, 6)])
+    # message pushed again goes to the end of the queue
+    await storage.push_message(2, b'2 again')
+
+    messages = await storage.get_all()
+    assert [mid for _, mid, _ in messages] == [1, 3, 4, 5, 2]
+    # get_all returns view of the storage
+    await storage.remove_message_by_mid(4)
+    assert [mid for _, mid, _ in messages] == [1, 3, 5, 2]
+
+    await storage.clear()
+    assert await storage.is_empty
+    assert list(messages) == []
+
+
+def segment_files(path):
+    return sorted(name for name in os.listdir(path) if name.endswith('.seg'))
+
+
+async def stored(storage):
+    return [(mid, bytes(package)) for _, mid, package in await storage.get_all()]
+
+
+@pytest.mark.asyncio
+async def test_segment_log_recovery(tmp_path):
+    path = str(tmp_path)
+    storage = SegmentLogPersistentStorage(path)
+    await storage.push_messages([(mid, b'pkg %d' % mid) for mid in range(1, 6)])
+    await storage.remove_message_by_mid(2)
+    await storage.pop_message()
+    await storage.push_message(3, b'pkg 3 again')
+    await storage.push_message(7, bytearray(b'pkg 7'))
+    expected = await stored(storage)
+    assert expected == [(4, b'pkg 4'), (5, b'pkg 5'), (3, b'pkg 3 again'), (7, b'pkg 7')]
+
+    # process is killed, storage is not closed
+    recovered = SegmentLogPersistentStorage(path)
+    assert await stored(recovered) == expected
+
+    # and keeps working after recovery
+    await recovered.remove_message_by_mid(5)
+    await recovered.push_message(1, b'pkg 1')
+    recovered.close()
+    assert await stored(SegmentLogPersistentStorage(path)) == [(4, b'pkg 4'), (3, b'pkg 3 again'), (7, b'pkg 7'),
+                                                                (1, b'pkg 1')]
+
+
+@pytest.mark.asyncio
+async def test_segment_log_torn_write(tmp_path):
+    path = str(tmp_path)
+    storage = SegmentLogPersistentStorage(path)
+    await storage.push_messages([(1, b'a' * 100), (2, b'b' * 100)])
+    await storage.push_message(3, b'c' * 100)
+    storage.close()
+
+    # crash in the middle of the last record
+    name = os.path.join(path, segment_files(path)[0])
+    with open(name, 'r+b') as f:
+        data = bytearray(f.read())
+        pos = data.rindex(b'c' * 100)
+        data[pos + 50:pos + 100] = b'\x00' * 50
+        f.seek(0)
+        f.write(data)
+
+    recovered = SegmentLogPersistentStorage(path)
+    assert await stored(recovered) == [(1, b'a' * 100), (2, b'b' * 100)]
+    await recovered.push_message(3, b'c')
+    recovered.close()
+    assert await stored(SegmentLogPersistentStorage(path)) == [(1, b'a' * 100), (2, b'b' * 100), (3, b'c')]
+
+
+@pytest.mark.asyncio
+async def test_segment_log_compaction(tmp_path):
+    path = str(tmp_path)
+    storage = SegmentLogPersistentStorage(path, segment_size=4096)
+    for mid in range(1, 1001):
+        await storage.push_message(mid, b'%d' % mid * 10)
+        # every tenth message is waiting for acknowledgement for a long time
+        if mid % 10:
+            await storage.remove_message_by_mid(mid)
+        await asyncio.sleep(0)
+    expected = await stored(storage)
+    assert [mid for mid, _ in expected] == list(range(10, 1001, 10))
+
+    # live messages of the old segments were moved, so less segments left than written
+    assert len(segment_files(path)) < 10
+    recovered = SegmentLogPersistentStorage(path)
+    assert await stored(recovered) == expected
+    recovered.close()
+
+    # large message does not fit segment
+    await storage.push_message(1, b'x' * 10000)
+    await storage.clear()
+    assert len(segment_files(path)) == 1
+    storage.close()
+    assert await stored(SegmentLogPersistentStorage(path)) == []
+
+
+@pytest.mark.asyncio
+async def test_segment_log_compaction_after_recovery(tmp_path):
+    path = str(tmp_path)
+    storage = SegmentLogPersistentStorage(path, segment_size=4096)
+    for mid in range(1, 201):
+        await storage.push_message(mid, b'%d' % mid * 10)
+    # the oldest message keeps the segments after it from being dropped
+    for mid in range(2, 201):
+        await storage.remove_message_by_mid(mid)
+    storage.close()
+    assert len(segment_files(path)) > 3
+
+    recovered = SegmentLogPersistentStorage(path, segment_size=4096)
+    for _ in range(10):
+        await asyncio.sleep(0)
+    assert len(segment_files(path)) == 1
+    assert await stored(recovered) == [(1, b'1' * 10)]
+    recovered.close()
+    assert await stored(SegmentLogPersistentStorage(path)) == [(1, b'1' * 10)]
+
+
+class ResendConnection:
+    def __init__(self, client):
+        self.client = client
+        self.batches = []
+
+    def is_closing(self):
+        return False
+
+    async def drain(self):
+        pass
+
+    def send_packages(self, packages):
+        self.batches.append(list(packages))
+        # broker acknowledges every batch by the next loop iteration
+        for pkg in packages:
+            mid, = struct.unpack_from('!H', pkg, 4 + pkg[2] * 256 + pkg[3])
+            asyncio.get_event_loop().call_soon(self.client._handle_puback_packet, 0x40, struct.pack('!H', mid))
+
+
+def stored_publish(topic, mid):
+    # PUBLISH QoS 1 package of MQTT 3.1.1
+    body = struct.pack('!H', len(topic)) + topic + struct.pack('!H', mid) + b'payload'
+    return bytes([0x32, len(body)]) + body
+
+
+@pytest.mark.asyncio
+async def test_client_resends_recovered_messages(tmp_path):
+    path = str(tmp_path)
+    storage = SegmentLogPersistentStorage(path)
+    await storage.push_messages([(1, stored_publish(b'a', 1)), (2, stored_publish(b'b', 2))])
+
+    # client is restarted
+    client = gmqtt.Client('test-client', persistent_storage=SegmentLogPersistentStorage(path))
+    client._connection = ResendConnection(client)
+    client._connected.set()
+    await client._resend_qos_messages()
+
+    # resent with DUP flag
+    assert client._connection.batches == [[b'\x3a' + stored_publish(b'a', 1)[1:], b'\x3a' + stored_publish(b'b', 2)[1:]]]
+    # new messages do not take ids of the resent ones
+    assert client._id_generator.next_id() == 3
+
+
+@pytest.mark.asyncio
+async def test_client_publishes_from_on_connect_over_recovered_messages(tmp_path):
+    path = str(tmp_path)
+    storage = SegmentLogPersistentStorage(path)
+    await storage.push_messages([(1, stored_publish(b'a', 1)), (2, stored_publish(b'b', 2))])
+
+    client = gmqtt.Client('test-client', persistent_storage=SegmentLogPersistentStorage(path))
+    client._connection = ResendConnection(client)
+    protocol = SimpleNamespace(proto_ver=gmqtt.constants.MQTTv311, id_generator=client._id_generator)
+    client._connection.publish = lambda message: PublishPacket.build_package(message, protocol)
+    published = []
+    client.on_connect = lambda client, flags, rc, properties: published.append(
+        client._publish_message(gmqtt.Message('c', b'new', qos=1)))
+
+    client._handle_connack_packet(0x20, b'\x01\x00')
+    assert published == [3]
+    await asyncio.sleep(0.01)
+
+    # recovered messages are resent as they are, the new one is not overwriting any of them
+    assert client._connection.batches == [[b'\x3a' + stored_publish(b'a', 1)[1:], b'\x3a' + stored_publish(b'b', 2)[1:]]]
+    assert [mid for _, mid, _ in await client._persistent_storage.get_all()] == [3]
+
+
+@pytest.mark.asyncio
+async def test_client_resends_pubrel_on_session_resume():
+    client = gmqtt.Client('test-client')
+    client._connection = ResendConnection(client)
+    protocol = SimpleNamespace(proto_ver=gmqtt.constants.MQTTv311, id_generator=client._id_generator)
+    client._connection.publish = lambda message: PublishPacket.build_package(message, protocol)
+    commands = []
+    client._connection.send_command_with_mid = lambda cmd, mid, dup, **kwargs: commands.append((cmd, mid, dup))
+    client._handle_connack_packet(0x20, b'\x00\x00')
+
+    mid = client._publish_message(gmqtt.Message('a', b'x', qos=2))
+    client._handle_pubrec_packet(0x50, struct.pack('!H', mid))
+    await asyncio.sleep(0)
+    assert await client._persistent_storage.is_empty
+
+    # connection is lost before PUBCOMP
+    client._handle_connack_packet(0x20, b'\x01\x00')
+    await asyncio.sleep(0)
+    assert commands == [(0x62, mid, 0), (0x62, mid, 0)]
+    assert client._connection.batches == []
+
+    client._handle_pubcomp_packet(0x70, struct.pack('!H', mid))
+    assert not client._id_generator.is_used(mid) and not client._in_flight_mids
+    client._handle_connack_packet(0x20, b'\x01\x00')
+    assert len(commands) == 2
+
+    # there is nothing to release in the new session
+    mid = client._publish_message(gmqtt.Message('a', b'x', qos=2))
+    client._handle_pubrec_packet(0x50, struct.pack('!H', mid))
+    client._handle_connack_packet(0x20, b'\x00\x00')
+    client._handle_connack_packet(0x20, b'\x01\x00')
+    assert len(commands) == 3
+
+
+@pytest.mark.asyncio
+async def test_client_resends_backlog_within_send_quota():
+    client = gmqtt.Client('test-client')
+    client.resend_batch_size = 8
+    client._send_quota = 20
+    client._connection = ResendConnection(client)
+    client._connected.set()
+    packages = {}
+    for mid in range(1, 101):
+        packages[mid] = bytearray(stored_publish(b'topic', mid))
+        client._id_generator.use_id(mid)
+        client._in_flight_mids[mid] = 0
+    await client._persistent_storage.push_messages(packages.items())
+    # acknowledged before resume
+    client._handle_puback_packet(0x40, struct.pack('!H', 50))
+
+    resend = asyncio.ensure_future(client._resend_qos_messages())
+    await asyncio.sleep(0)
+    # new messages are published while backlog is resent
+    client._connection.publish = lambda message: (None, b'')
+    client.publish('new', b'', qos=0)
+    await resend
+
+    batches = client._connection.batches
+    sent = [pkg for batch in batches for pkg in batch]
+    assert len(sent) == 99 and all(len(batch) <= 8 for batch in batches)
+    # DUP flag is set in stored packages, nothing is copied
+    assert all(any(pkg is stored for stored in packages.values()) and pkg[0] == 0x3a for pkg in sent)
+    await asyncio.sleep(0)
+    assert await client._persistent_storage.is_empty
+    assert not client._in_flight_mids
+
+
+@pytest.mark.asyncio
+async def test_client_does_not_resend_acknowledged_id_taken_again():
+    client = gmqtt.Client('test-client')
+    client.resend_batch_size = 1
+    client._connection = ResendConnection(client)
+    client._connected.set()
+    for mid in range(1, 4):
+        client._id_generator.use_id(mid)
+    await client._persistent_storage.push_messages([(mid, bytearray(stored_publish(b'topic', mid)))
+                                                    for mid in range(1, 4)])
+
+    resend = asyncio.ensure_future(client._resend_qos_messages())
+    while not client._connection.batches:
+        await asyncio.sleep(0)
+    # message 2 is acknowledged and its id goes to a new message before the resend gets to it
+    client._handle_puback_packet(0x40, struct.pack('!H', 2))
+    client._id_generator.use_id(2)
+    await resend
+
+    sent = [struct.unpack_from('!H', pkg, 4 + len(b'topic'))[0] for batch in client._connection.batches for pkg in batch]
+    assert sent == [1, 3]
+
+
+@pytest.mark.asyncio
+async def test_connect_returns_while_resumed_backlog_is_not_acknowledged():
+    received = []
+
+    async def broker(reader, writer):
+        await reader.read(1024)
+        # CONNACK with session present, nothing is ever acknowledged
+        writer.write(b'\x20\x02\x01\x00')
+        while True:
+            data = await reader.read(1024)
+            if not data:
+                break
+            received.append(data)
+        writer.close()
+
+    server = await asyncio.start_server(broker, '127.0.0.1', 0)
+    port = server.sockets[0].getsockname()[1]
+    storage = IndexedPersistentStorage()
+    await storage.push_messages([(mid, stored_publish(b'topic', mid)) for mid in range(1, 4)])
+    client = gmqtt.Client('test-client', clean_session=False, persistent_storage=storage)
+    try:
+        await asyncio.wait_for(client.connect('127.0.0.1', port, version=gmqtt.constants.MQTTv311), 2)
+        for _ in range(100):
+            if len(b''.join(received)) >= 3 * len(stored_publish(b'topic', 1)):
+                break
+            await asyncio.sleep(0.01)
+        assert b''.join(received) == b''.join(b'\x3a' + stored_publish(b'topic', mid)[1:] for mid in range(1, 4))
+        assert not await storage.is_empty
+    finally:
+        await client.disconnect()
+        server.close()
+        await server.wait_closed()
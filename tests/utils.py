@@ -1,9 +1,12 @@
 import time
+from types import SimpleNamespace
 
 import asyncio
 
 import gmqtt
 import logging
+from gmqtt.mqtt.package import PublishPacket
+from gmqtt.mqtt.utils import IdGenerator, pack_variable_byte_integer
 
 
 class Callbacks:
@@ -81,3 +84,33 @@ async def cleanup(host, port=1883, username=None, password=None, client_ids=None
     # clean retained messages
     await clean_retained(host, port, username, password=password, prefix=prefix)
     print("clean up finished")
+
+
+class PackagesCollector:
+    """Connection stand-in which keeps packages parsed by the protocol"""
+    streams_enabled = False
+
+    def __init__(self):
+        self.packages = []
+
+    def put_package(self, pkg):
+        cmd, packet = pkg
+        self.packages.append((cmd, bytes(packet)))
+
+
+def build_frame(cmd, body):
+    return bytes([cmd]) + bytes(pack_variable_byte_integer(len(body))) + body
+
+
+def make_client(proto_ver=5, extract_c_properties=False):
+    client = gmqtt.Client('test-client', extract_c_properties=extract_c_properties)
+    client._connection = SimpleNamespace(_protocol=SimpleNamespace(proto_ver=proto_ver))
+    return client
+
+
+def build_publish(topic, payload, qos=0, proto_ver=5, **properties):
+    # (command, packet without fixed header) as the protocol passes them to the handler
+    protocol = SimpleNamespace(proto_ver=proto_ver, id_generator=IdGenerator())
+    message = gmqtt.Message(topic, payload, qos=qos, **properties)
+    mid, pkg = PublishPacket.build_package(message, protocol)
+    return pkg[0], memoryview(bytes(pkg))[len(pack_variable_byte_integer(len(pkg) - 2)) + 1:]